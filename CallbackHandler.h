@@ -3,11 +3,20 @@
 #include <thread>
 #include <chrono>
 #include <functional>
+#include "executor.h"
 
-// Function to create a custom callback
+// Runs the callback on one of the executor's worker threads, the arguments are copied
 template <typename Callback, typename... Args>
 void CallbackThread(Callback callback, Args... args) {
 
-	callback(args...);
+	executor_submit([callback, args...]() { callback(args...); });
+
+}
+
+// Runs the callback on the UI thread, for everything which touches windows
+template <typename Callback, typename... Args>
+void CallbackUiThread(Callback callback, Args... args) {
+
+	executor_post_ui([callback, args...]() { callback(args...); });
 
 }
@@ -1,31 +1,164 @@
 #pragma once
 
+#include <algorithm>
 #include <string>
-#include <vector>
-#include <regex>
+#include <string_view>
 #include <optional>
-#include <sstream>
-#include <iostream>
 #include <format>
 #include "StringEx.h"
+#include "log.h"
+
+// The pieces of a HID device path, e.g.
+//   \\?\HID#VID_35EE&PID_1308&MI_01#7&1A2B3C4D&0&0000#{4D1E55B2-F16F-11CF-88CB-001111000030}
+// The path is split at '#': VID_, PID_ and &MI_ are searched in every segment
+// (case insensitive, the last segment which has one wins), the third segment is
+// the port. A second segment with a service UUID is a BLE device:
+//   \\?\HID#{00001812-0000-1000-8000-00805F9B34FB}_DEV_VID&02046D_PID&B013_REV&0007_...
+// its VID& carries the vendor id source in front of the id. No regex and no
+// allocation, port points into the path.
+typedef struct _DevicePath {
+    std::optional<uint16_t> vid; // not set for BLE devices, see bleVid
+    std::optional<uint16_t> pid;
+    char mi[7];                  // "&MI_01" in upper case, empty without
+    std::optional<std::string_view> port;
+    bool ble;
+    uint16_t bleVid;
+    uint16_t blePid;
+} DevicePath;
+
+inline bool devicePathHex(char c, uint8_t& value) {
+    if (c >= '0' && c <= '9') value = static_cast<uint8_t>(c - '0');
+    else if (c >= 'a' && c <= 'f') value = static_cast<uint8_t>(c - 'a' + 10);
+    else if (c >= 'A' && c <= 'F') value = static_cast<uint8_t>(c - 'A' + 10);
+    else return false;
+    return true;
+}
+
+// digits hex digits at text[at], false if one isn't
+inline bool devicePathHexValue(std::string_view text, size_t at, size_t digits, uint16_t& value) {
+    if (at + digits > text.size())
+        return false;
+    value = 0;
+    for (size_t i = 0; i < digits; i++) {
+        uint8_t digit;
+        if (!devicePathHex(text[at + i], digit))
+            return false;
+        value = static_cast<uint16_t>((value << 4) | digit);
+    }
+    return true;
+}
+
+inline bool devicePathIs(std::string_view text, size_t at, std::string_view token) {
+    if (at + token.size() > text.size())
+        return false;
+    for (size_t i = 0; i < token.size(); i++) {
+        char c = text[at + i];
+        if (c >= 'a' && c <= 'z')
+            c = static_cast<char>(c - 'a' + 'A');
+        if (c != token[i])
+            return false;
+    }
+    return true;
+}
+
+// the first token (upper case) followed by digits hex digits in the segment
+inline bool devicePathFind(std::string_view segment, std::string_view token, size_t digits, uint16_t& value, size_t* where = nullptr) {
+    for (size_t at = 0; at + token.size() + digits <= segment.size(); at++) {
+        if (devicePathIs(segment, at, token) && devicePathHexValue(segment, at + token.size(), digits, value)) {
+            if (where)
+                *where = at + token.size();
+            return true;
+        }
+    }
+    return false;
+}
+
+// {xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx} anywhere in the segment
+inline bool devicePathHasUuid(std::string_view segment) {
+    static constexpr std::string_view uuid = "{XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX}";
+    for (size_t at = segment.find('{'); at != std::string_view::npos && at + uuid.size() <= segment.size();
+        at = segment.find('{', at + 1)) {
+        size_t i = 1;
+        for (uint8_t digit; i < uuid.size(); i++) {
+            char c = segment[at + i];
+            if (uuid[i] == 'X' ? !devicePathHex(c, digit) : c != uuid[i])
+                break;
+        }
+        if (i == uuid.size())
+            return true;
+    }
+    return false;
+}
+
+// false for a BLE device or a path without VID and PID
+inline bool parseDevicePath(std::string_view path, DevicePath& parsed) {
+    parsed = {};
+    size_t index = 0;
+    for (size_t start = 0; start < path.size(); index++) {
+        size_t end = path.find('#', start);
+        if (end == std::string_view::npos)
+            end = path.size();
+        std::string_view segment = path.substr(start, end - start);
+        start = end + 1;
+
+        if (index == 1 && devicePathHasUuid(segment)) {
+            // VID&02046D (BLE) or VID&0002046D (Bluetooth): the vendor id source, then vendor 046D
+            uint16_t value;
+            size_t at;
+            parsed = {}; // nothing of a BLE path counts as a USB id
+            parsed.ble = true;
+            if (devicePathFind(segment, "VID&", 2, value, &at)) {
+                size_t digits = 0;
+                for (uint8_t digit; digits < 8 && at + digits < segment.size() && devicePathHex(segment[at + digits], digit);)
+                    digits++;
+                if (digits >= 6)
+                    devicePathHexValue(segment, at + digits - 4, 4, parsed.bleVid);
+            }
+            if (devicePathFind(segment, "PID&", 4, value))
+                parsed.blePid = value;
+            return false;
+        }
+        uint16_t value;
+        if (devicePathFind(segment, "VID_", 4, value))
+            parsed.vid = value;
+        if (devicePathFind(segment, "PID_", 4, value))
+            parsed.pid = value;
+        size_t at;
+        if (devicePathFind(segment, "&MI_", 2, value, &at)) {
+            static constexpr char hex[] = "0123456789ABCDEF";
+            std::copy_n("&MI_", 4, parsed.mi);
+            parsed.mi[4] = hex[value >> 4];
+            parsed.mi[5] = hex[value & 0xF];
+            parsed.mi[6] = '\0';
+        }
+        if (index == 2)
+            parsed.port = segment;
+    }
+    return parsed.vid.has_value() && parsed.pid.has_value();
+}
 
 class DeviceNameParser {
 public:
-    DeviceNameParser(const std::string& deviceName) {
-        parseDeviceName(deviceName);
+    DeviceNameParser(std::string_view deviceName) {
+        parseDevicePath(deviceName, path);
+        if (path.mi[0])
+            mi = path.mi;
+        if (path.port)
+            port = stringex::toUpper(std::string(*path.port));
+        path.port.reset(); // the view dies with deviceName
     }
 
-    std::optional<uint16_t> getVID() const { return vid; }
-    std::optional<uint16_t> getPID() const { return pid; }
+    std::optional<uint16_t> getVID() const { return path.vid; }
+    std::optional<uint16_t> getPID() const { return path.pid; }
     std::optional<std::string> getMI() const { return mi; }
     std::optional<std::string> getPort() const { return port; }
-    std::string getDevName() const { return devname; }
+    bool isBle() const { return path.ble; }
 
     void log() const {
-        if (vid.has_value()) _log("VID: {:04X}\n", vid.value());
-        if (pid.has_value()) _log("PID: {:04X}\n", pid.value());
-        if (mi.has_value()) _log("MI: {}\n", mi.value());
-        if (port.has_value()) _log("Port: {}\n", port.value());
+        if (path.vid.has_value()) QLOG_DEBUG("DEV", "VID: {:04X}\n", path.vid.value());
+        if (path.pid.has_value()) QLOG_DEBUG("DEV", "PID: {:04X}\n", path.pid.value());
+        if (mi.has_value()) QLOG_DEBUG("DEV", "MI: {}\n", mi.value());
+        if (port.has_value()) QLOG_DEBUG("DEV", "Port: {}\n", port.value());
     }
 	bool isHidInterface(const std::string& iface) const {
 		std::string c_mi = mi.value();
@@ -38,89 +171,31 @@ public:
     //devname = "\\\\?\\HID#{00001812-0000-1000-8000-00805F9B34FB}_DEV_VID&02046D_PID&B013_REV&0007_C4C4C279C660&COL03#B&2C603A6D&0&0002#{4D1E55B2-F16F-11CF-88CB-001111000030}"
 	bool isRegularHidDevice() {
 		// the minimal requirement
-		if (vid.has_value() && pid.has_value()) {
+		if (path.vid.has_value() && path.pid.has_value()) {
 			return true;
 		}
 		return false;
 	}
-	bool isValidPort(const std::string& port) const {
-		std::regex portRegex(R"(([0-9A-Fa-f]+)&([0-9A-Fa-f]+)&([0-9A-Fa-f]+)&([0-9A-Fa-f]+))");
-		return std::regex_match(port, portRegex);
+	// four groups of hex digits separated by '&', e.g. 7&1A2B3C4D&0&0000
+	bool isValidPort(std::string_view port) const {
+		size_t groups = 0, digits = 0;
+		for (char c : port) {
+			uint8_t digit;
+			if (c == '&' && digits) {
+				groups++;
+				digits = 0;
+			}
+			else if (devicePathHex(c, digit)) {
+				digits++;
+			}
+			else {
+				return false;
+			}
+		}
+		return digits && groups == 3;
 	}
 private:
-    std::optional<uint16_t> vid;
-    std::optional<uint16_t> pid;
+    DevicePath path;
     std::optional<std::string> mi;
     std::optional<std::string> port;
-    std::string devname;
-
-
-    void _log(const std::string& format_str, auto&&... args) const {
-        std::string formatted_str = std::vformat(format_str, std::make_format_args(args...));
-        OutputDebugString(formatted_str.c_str());
-    }
-
-    bool parseDeviceName(const std::string& deviceName) {
-        this->devname =  stringex::toUpper(deviceName);
-		std::vector<std::string> pieces = splitDeviceName(this->devname);
-
-		std::smatch match;
-		std::regex uuidRegex(R"(\{[0-9a-fA-F]{8}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{12}\})");
-
-		// if device name start with a UUID we stop parsing -> BLE device
-        if (pieces.size() > 1 && std::regex_search(pieces[1], match, uuidRegex)) {
-			uint16_t vid = 0, pid = 0;
-			const auto& part = pieces[1];
-
-			std::regex vidRegex(R"(VID&([0-9a-fA-F]{4}))");
-			if (std::regex_search(part, match, vidRegex)) {
-				vid = std::stoi(match.str(1), nullptr, 16);
-			}
-
-			std::regex pidRegex(R"(PID&([0-9a-fA-F]{4}))");
-			if (std::regex_search(part, match, pidRegex)) {
-				pid = std::stoi(match.str(1), nullptr, 16);
-			}
-			// we don't support BLE device
-            return false;
-		}
-
-        for (size_t i = 0; i < pieces.size(); ++i) {
-            const auto& part = pieces[i];
-			std::smatch match;
-
-			std::regex vidRegex(R"(VID_([0-9a-fA-F]{4}))");
-			if (std::regex_search(part, match, vidRegex)) {
-                vid = std::stoi(match.str(1), nullptr, 16);
-            }
-			std::regex pidRegex(R"(PID_([0-9a-fA-F]{4}))");
-			if (std::regex_search(part, match, pidRegex)) {
-				pid = std::stoi(match.str(1), nullptr, 16);
-			}
-
-			std::regex miRegex(R"(&MI_([0-9a-fA-F]{2}))");
-			if (std::regex_search(part, match, miRegex)) {
-                mi = "&MI_" + match.str(1);
-			}
-            if (i == 2) {
-                auto val = isValidPort(part);
-                port = part;
-            }
-        }
-        if (isRegularHidDevice()) {
-            return true;
-        }
-        return false;
-    }
-    std::vector<std::string> splitDeviceName(const std::string& deviceName) {
-        std::vector<std::string> pieces;
-        std::stringstream ss(deviceName);
-        std::string item;
-
-        while (std::getline(ss, item, '#')) {
-            pieces.push_back(item);
-        }
-        return pieces;
-    }
-
 };
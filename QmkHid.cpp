@@ -16,11 +16,23 @@
 #include <functional>
 #include <shlobj.h>
 #include <iostream>
+#include <array>
 
 #include "hidex.h"
 #include "sqlite/sqlite3.h"
 #include "json.hpp"
 #include "msgpack.h"
+#include "qmkcommand.h"
+#include "qmkframe.h"
+#include "qmkkeymap.h"
+#include "qmklatency.h"
+#include "hidregistry.h"
+#include "qmkevent.h"
+#include "streamdeck.h"
+#include "qmkaction.h"
+#include "log.h"
+#include "hidcapture.h"
+#include "hidsim.h"
 
 #include "CallbackHandler.h"
 
@@ -36,9 +48,13 @@ using json = nlohmann::json;
 using namespace std::chrono;
 
 #define WM_TRAYICON (WM_USER + 1)
+#define WM_COMMAND_FAILED (WM_USER + 2) // wParam: QMKCommandStatus
+#define WM_UI_TASKS (WM_USER + 3) // executor_post_ui has tasks, posted once per batch
+#define WM_DEVICE_EVENTS (WM_USER + 5) // uiEvents has events, posted once per batch
 #define ID_TRAY_APP_ICON 1001
 #define ID_TRAY_EXIT 1002
 #define ID_TRAY_WRITE 10031
+#define ID_TRAY_LATENCY 10032
 
 #define IDT_HIDE_WINDOW 1015
 
@@ -57,16 +73,26 @@ QMKHIDPREFERENCE _qmkPreference = {
 	.showLayerSwitch = 1, // Default to show layer switch in the client window
 	.windowPos = "0,0,100,100", // Default window position (example values)
 #ifdef _DEBUG
-	.traydev = "a&55b843f&0&" // port which shows his state e.g. "a&55b843f&0&"
+	.traydev = "a&55b843f&0&", // port which shows his state e.g. "a&55b843f&0&"
 #else
-	.traydev = "" // port which shows his state e.g. "a&55b843f&0&"
+	.traydev = "", // port which shows his state e.g. "a&55b843f&0&"
 #endif
+	.profile = 0,
 };
 
 std::vector<QMKHIDPREFERENCE> qmkPreferences;
 
+// stored into an empty ActionRules table, inactive until edited in the database
+static const std::vector<QMKActionRule> _exampleRules = {
+    // seqnr, active, profile, device, layer, trigger, code, edge, action, argument
+    {0, false, 0, QMK_ACTION_ANY_DEVICE, QMK_ACTION_ANY_LAYER, QMK_TRIGGER_BUTTON, 0, QMK_EDGE_PRESS, QMK_ACTION_LAUNCH, "notepad.exe"},
+    {0, false, 0, QMK_ACTION_ANY_DEVICE, QMK_ACTION_ANY_LAYER, QMK_TRIGGER_LAYER, 1, QMK_EDGE_PRESS, QMK_ACTION_KEYS, "layer 1"},
+    {0, false, 0, QMK_ACTION_ANY_DEVICE, QMK_ACTION_ANY_LAYER, QMK_TRIGGER_BUTTON, 14, QMK_EDGE_LONG_PRESS, QMK_ACTION_PROFILE, "1"},
+    {0, false, 1, QMK_ACTION_ANY_DEVICE, QMK_ACTION_ANY_LAYER, QMK_TRIGGER_BUTTON, 14, QMK_EDGE_LONG_PRESS, QMK_ACTION_PROFILE, "0"},
+};
+
 typedef struct _QMKHID {
-    std::vector<HIDData> hidData;
+    HIDRegistry<HIDData> devices; // the open devices, looked up by id on the read threads
     std::vector<DeviceSupport> usbSuppDevs;// devices which are allowed
     std::vector<DeviceSupport> dbSuppDevs; // active/inactive devices on the usb bus
     std::shared_ptr<sqlite3> sqLite;
@@ -75,9 +101,7 @@ typedef struct _QMKHID {
     QMKHIDPREFERENCE pref;
 }QMKHID;
 
-
 QMKHID qmkData = {
-	.hidData = {},
     .usbSuppDevs = {
         // the active shows the state in the taskbar
         {0, true, "QMK", QMK, QMK_VID, QMK_PID, 0, "&MI_01"}, // DeviceSupport instances
@@ -88,12 +112,36 @@ QMKHID qmkData = {
     .iTrayIcon = nullptr,
 };
 
+// build with /DQMK_POLL_LOOP for the loop before the message wait: look for
+// messages, Sleep(QMK_POLL_MS) if there are none. Compare the loopStats line
+// and "Log latency" of both builds.
+#ifdef QMK_POLL_LOOP
+#define QMK_POLL_MS 10
+#define QMK_LOOP_NAME "poll"
+#else
+#define QMK_LOOP_NAME "wait"
+#endif
+
+// counters of the WinMain message loop, logged on exit
+typedef struct _QMKLOOPSTATS {
+    uint64_t wakeups;  // returns from MsgWaitForMultipleObjectsEx, or Sleeps with QMK_POLL_LOOP
+    uint64_t messages; // messages taken from the queue
+    steady_clock::time_point start;
+} QMKLOOPSTATS;
+
+QMKLOOPSTATS loopStats = {};
+
+std::jthread replayThread; // runs a --replay file
+
+QMKEventQueue uiEvents; // decoded reports from the read threads, applied by TrayWindowProc
+QMKActions qmkActions;  // the ActionRules of the active profile, dispatched on the read threads
 
 NOTIFYICONDATA nid;
+HICON layerIcon; // the numbered tray icon shown now, destroyed when replaced
 HWND hTrayWnd;
 HWND hChildWnd;
 
-void readCallback(HID& hid, const std::vector<uint8_t>& data, void* userData);
+void readCallback(HID& hid, HIDReport& report, void* userData);
 std::optional<HIDData*> findMatchingPortDevice(QMKHID& qmkData, const std::string& deviceName);
 static bool OpenHidDevices(QMKHID& qmkData, std::vector<DeviceSupport>& devsupport);
 
@@ -104,11 +152,6 @@ bool caseInsensitiveCompare(const std::string& str1, const std::string& str2) {
         });
 }
 
-void qmk_log(const std::string& format_str, auto&&... args) {
-    std::string formatted_str = std::vformat(format_str, std::make_format_args(args...));
-    OutputDebugString(formatted_str.c_str());
-}
-
 bool IsDarkTheme() {
     DWORD value = 0;
     DWORD valueSize = sizeof(value);
@@ -167,11 +210,22 @@ HICON CreateIconWithNumber(int number, bool darkTheme) {
     return hIcon;
 }
 
-void UpdateTrayIcon() {
+// the tray icon for a layer, the shell keeps its own copy of the one it shows
+static HICON LayerIcon(int layer) {
+    HICON icon = CreateIconWithNumber(layer, IsDarkTheme());
+    if (layerIcon)
+        DestroyIcon(layerIcon);
+    layerIcon = icon;
+    return icon;
+}
+
+// received: completion time of the report which changed the layer, if any
+void UpdateTrayIcon(steady_clock::time_point received = {}) {
     nid.uFlags = NIF_ICON; // Set the flag to update only the icon
-    nid.hIcon = qmkData.hidData.size()?
-        CreateIconWithNumber(qmkData.pref.curLayer, IsDarkTheme()) : qmkData.iTrayIcon;
+    nid.hIcon = qmkData.devices.count.load(std::memory_order_relaxed) ?
+        LayerIcon(qmkData.pref.curLayer) : qmkData.iTrayIcon;
     Shell_NotifyIcon(NIM_MODIFY, &nid);
+    qmk_latency_record(QMK_LATENCY_TRAY_ICON, received);
 }
 
 void InitNotifyIconData() {
@@ -186,6 +240,7 @@ void InitNotifyIconData() {
     nid.hIcon = qmkData.iTrayIcon;
 }
 
+// UI thread only, the read threads push a QMK_EVENT_DECODE_ERROR instead
 void ShowNotification(const HIDData& hidData,const char* title, const char* message) {
     nid.uFlags = NIF_INFO | NIF_ICON;
     strcpy_s(nid.szInfoTitle, title);
@@ -194,21 +249,20 @@ void ShowNotification(const HIDData& hidData,const char* title, const char* mess
 
     // Check if hidData is uninitialized
     if (hidData.hid == nullptr || hidData.hid->handle == INVALID_HANDLE_VALUE) {
-        qmkData.iTrayIcon = LoadIcon(GetModuleHandle(NULL), MAKEINTRESOURCE(IDI_QMKHID));
+        nid.hIcon = qmkData.iTrayIcon; // the standard application icon
     }
     else {
-        // Load the standard application icon
-        qmkData.iTrayIcon = CreateIconWithNumber(qmkData.pref.curLayer, IsDarkTheme());
+        nid.hIcon = LayerIcon(qmk_state_read(hidData.state).layer);
     }
     Shell_NotifyIcon(NIM_MODIFY, &nid);
 }
 
-// Thread callback to show the layer switch window and start to hide it
-// This function is started inside readCallback
-void LayerWindowSwitchCallback(std::string devname, uint8_t curlayer,  uint8_t msg) {
+// Shows the layer switch window and starts the timer to hide it
+// UI thread, called for a layer event from ApplyDeviceEvents
+void LayerWindowSwitchCallback(std::string devname, uint8_t curlayer,  uint8_t msg, steady_clock::time_point received) {
 	// Check if the child window is already visible
 	if (IsWindowVisible(hChildWnd)) {
-		qmk_log("Child window is already visible\n");
+		QLOG_INFO("QMK", "Child window is already visible\n");
 	}
 	// Kill running timer
 	KillTimer(hChildWnd, IDT_HIDE_WINDOW);
@@ -219,8 +273,9 @@ void LayerWindowSwitchCallback(std::string devname, uint8_t curlayer,  uint8_t m
         InvalidateRect(hChildWnd, NULL, TRUE);
        // Set a timer to hide the window
         SetTimer(hTrayWnd, IDT_HIDE_WINDOW, qmkData.pref.showTime, NULL);
+        qmk_latency_record(QMK_LATENCY_LAYER_WINDOW, received);
     }
-    UpdateTrayIcon();
+    UpdateTrayIcon(received);
 }
 
 void RegisterDeviceNotification(HWND hwnd) {
@@ -237,13 +292,23 @@ void RegisterDeviceNotification(HWND hwnd) {
 }
 
 // this function is called from Arrival with the WM_DEVICECHANGE message
-// - if the device is removed, the hidData is removed from the qmkData.hidData vector
+// - if the device is removed, the hidData is removed from the qmkData.devices registry
 //   but the device exists further in the dbSuppDevs vector
 // - if the device arrived, we must check if the device is in the dbSuppDevs vector
 //   and if it is active, we must open the device otherwise we ignore it
 // - if the device is not in the dbSuppDevs but in the usbSuppDevs we ...
 
 bool OpenArrivedHidDevice(QMKHID& qmkData, const std::string& dev) {
+    if (dev.starts_with(HID_SIM_PREFIX)) {
+        // simulated devices are never stored in the database
+        std::vector<DeviceSupport> system;
+        hid_open_list(system, qmkData.usbSuppDevs);
+        std::erase_if(system, [&dev](const DeviceSupport& devsupport) { return devsupport.dev != dev; });
+        for (auto& devsupport : system) {
+            devsupport.active = true;
+        }
+        return !system.empty() && OpenHidDevices(qmkData, system);
+    }
     auto it = std::ranges::find_if(qmkData.dbSuppDevs, [&dev](const DeviceSupport& devsupport) {
         return devsupport.dev == dev;
         });
@@ -255,11 +320,12 @@ bool OpenArrivedHidDevice(QMKHID& qmkData, const std::string& dev) {
         return OpenHidDevices(qmkData, devsupport);
     }
     else {
-		qmk_log("Device not found in dbSuppDevs: {}\n", dev);       
+		QLOG_INFO("QMK", "Device not found in dbSuppDevs: {}\n", dev);       
 		// be careful with the device name, it can be a bluetooth device
-		auto cdevParser = DeviceNameParser(dev);
-		auto it = std::ranges::find_if(qmkData.usbSuppDevs, [&cdevParser](const DeviceSupport& device) {
-			return cdevParser.isRegularHidDevice() && cdevParser.getVID().value() == device.vid && device.pid == cdevParser.getPID().value();
+		DevicePath path;
+		bool regular = parseDevicePath(dev, path);
+		auto it = std::ranges::find_if(qmkData.usbSuppDevs, [regular, &path](const DeviceSupport& device) {
+			return regular && path.vid.value() == device.vid && device.pid == path.pid.value();
 			});
         if (it != qmkData.usbSuppDevs.end()) {
 			std::vector<DeviceSupport> devsupport;
@@ -288,6 +354,50 @@ bool OpenArrivedHidDevice(QMKHID& qmkData, const std::string& dev) {
     return false;
 }
 
+// identifies the device and its firmware when a keymap download finished
+typedef struct _KEYMAPREADY {
+    std::string port;
+    std::string serial_number;
+    uint16_t sernbr;
+} KEYMAPREADY;
+
+// UI thread, the download of LoadKeymap finished
+static void KeymapReady(KEYMAPREADY ready, bool ok) {
+    auto hidData = findMatchingPortDevice(qmkData, ready.port);
+    if (!hidData.has_value())
+        return; // unplugged meanwhile
+    HIDData& hidDataRef = *(*hidData);
+    auto download = hidDataRef.keymapDownload.exchange(nullptr);
+    if (!download)
+        return;
+    if (ok) {
+        auto keymap = std::make_shared<QMKKeymap>(download->keymap);
+        hidDataRef.keymap.store(keymap);
+        if (qmkData.sqLite)
+            sqlite_store_keymap(qmkData.sqLite.get(), ready.serial_number, ready.sernbr, *keymap);
+        uint8_t layer = qmk_state_read(hidDataRef.state).layer;
+        QLOG_INFO("QMK", "Layer {}:\n{}", layer, qmk_keymap_layer_text(*keymap, layer));
+    }
+}
+
+// takes the keymap from the database, or downloads it once for this firmware version
+static void LoadKeymap(QMKHID& qmkData, HIDData& hidData, const DeviceSupport& device) {
+    // the version of the open device, the stored DeviceSupport row keeps the one of its first listing
+    uint16_t sernbr = hidData.hid->info.sernr;
+    QMKKeymap keymap;
+    if (qmkData.sqLite && sqlite_get_keymap(qmkData.sqLite.get(), device.serial_number, sernbr, keymap)) {
+        hidData.keymap.store(std::make_shared<QMKKeymap>(std::move(keymap)));
+        return;
+    }
+    KEYMAPREADY ready = { hidData.hid->port.value_or(device.dev), device.serial_number, sernbr };
+    auto download = qmk_keymap_download_create(hidData.commander, [ready](bool ok) {
+        CallbackUiThread(KeymapReady, ready, ok);
+        });
+    // published before the first request, the chunks are fed to it by the read callback
+    hidData.keymapDownload.store(download);
+    qmk_keymap_download_begin(*download);
+}
+
 bool OpenHidDevices(QMKHID& qmkData, std::vector<DeviceSupport>& devsupport) {
     bool anyDeviceOpened = false;
     std::string manufactor, product;
@@ -295,9 +405,8 @@ bool OpenHidDevices(QMKHID& qmkData, std::vector<DeviceSupport>& devsupport) {
     // Search through supported devices and open if found
     for (const auto& device : devsupport) {
         if (device.active) {
-            qmkData.hidData.push_back({});
-            HIDData& adHidData = qmkData.hidData.back();
-            adHidData.hid = std::make_shared<HID>(HID{
+            auto entry = std::make_unique<HIDData>();
+            entry->hid = std::make_shared<HID>(HID{
                 INVALID_HANDLE_VALUE,
                 0,
                 0,
@@ -306,14 +415,35 @@ bool OpenHidDevices(QMKHID& qmkData, std::vector<DeviceSupport>& devsupport) {
                 nullptr,
                 nullptr,
                 });
-            if (!hid_connect(*adHidData.hid, device.dev, readCallback)) {
-                qmkData.hidData.pop_back();
+            // opened without the callback, readCallback only sees a complete entry
+            std::shared_ptr<HID> hid = entry->hid;
+            if (!hid_connect(*hid, device.dev, nullptr))
+                continue;
+            entry->writeData.resize(hid->outEplength);
+            entry->type = device.type;
+            entry->seqnr = device.seqnr;
+            qmk_state_update(entry->state, [](QMKDeviceState& state) { state.connection = QMK_CONNECTION_OPEN; });
+            if (device.type == QMK) {
+                entry->commander = qmk_command_create(hid);
+                entry->framer = std::make_shared<QMKFramer>();
+                entry->commander->framer = entry->framer; // requests larger than one report
+            }
+            HIDData& adHidData = *entry;
+            uint32_t id = hid_registry_add(qmkData.devices, std::move(entry));
+            if (id == HID_REGISTRY_INVALID) {
+                QLOG_ERROR("QMK", "Too many devices, {} not opened\n", device.dev);
+                hid_close(*hid);
+            }
+            else if (!hid_attach(*hid, readCallback, hid_registry_userdata(id))) {
+                hid_close(*hid);
+                hid_registry_remove(qmkData.devices, id);
             }
             else {
-                // Set the hid_read() function to be non-blocking.
-                adHidData.readData.resize(adHidData.hid->inEplength);
-                adHidData.writeData.resize(adHidData.hid->outEplength);
-                adHidData.type = device.type;
+                // requests go out once the replies can come back
+                if (adHidData.commander) {
+                    qmk_command_handshake(*adHidData.commander);
+                    LoadKeymap(qmkData, adHidData, device);
+                }
                 anyDeviceOpened = true;
                 manufactor = device.manufactor;
                 product = device.product;
@@ -322,8 +452,7 @@ bool OpenHidDevices(QMKHID& qmkData, std::vector<DeviceSupport>& devsupport) {
 
     }
     if (anyDeviceOpened) {
-		auto hidData = qmkData.hidData[0];
-        ShowNotification(hidData, "Device Status:",
+        ShowNotification(*hid_registry_first(qmkData.devices), "Device Status:",
             (manufactor + " / " + product + " ready").c_str());
     }
     else {
@@ -333,7 +462,6 @@ bool OpenHidDevices(QMKHID& qmkData, std::vector<DeviceSupport>& devsupport) {
     return anyDeviceOpened;
 }
 
-
 LRESULT CALLBACK ChildWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
     switch (uMsg) {
     case WM_PAINT: {
@@ -445,18 +573,88 @@ void CreateChildWindow() {
 std::optional<HIDData*> findMatchingPortDevice(QMKHID& qmkData, const std::string& deviceName) {
     std::string upperDevName = stringex::toUpper(deviceName);;
 
-    for (auto& hidData : qmkData.hidData) {
-        if (hidData.hid->port.has_value()) {
-            std::string upperPort = stringex::toUpper(*hidData.hid->port); ;
+    for (uint32_t id : qmkData.devices.order) {
+        HIDData* hidData = hid_registry_get(qmkData.devices, id);
+        if (hidData && hidData->hid->port.has_value()) {
+            std::string upperPort = stringex::toUpper(*hidData->hid->port); ;
             std::transform(upperPort.begin(), upperPort.end(), upperPort.begin(), [](unsigned char c) { return std::toupper(c); });
-            qmk_log("Hid port: {} == {}\n", upperPort, upperDevName);
+            QLOG_TRACE("QMK", "Hid port: {} == {}\n", upperPort, upperDevName);
             if (upperDevName.find(upperPort) != std::string::npos)
-                return &hidData;
+                return hidData;
         }
     }
     return std::nullopt;
 }
 
+// WM_DEVICECHANGE removal, or a simulated device unplugged
+static void CloseRemovedHidDevice(QMKHID& qmkData, const std::string& devname) {
+    auto hidData = findMatchingPortDevice(qmkData, devname);
+    if (hidData.has_value()) {
+        QLOG_INFO("QMK", "Device removed: {}\n", devname);
+        // Remove comes more than one, because of the multiple interfaces
+        HIDData& hidDataRef = *(*hidData);
+        if (hidDataRef.hid->handle != INVALID_HANDLE_VALUE) {
+            if (hidDataRef.commander) {
+                qmk_command_log_stats(*hidDataRef.commander);
+                qmk_command_close(*hidDataRef.commander);
+            }
+            if (hidDataRef.framer)
+                qmk_frame_log_stats(*hidDataRef.framer, devname);
+            hid_close(*hidDataRef.hid);
+            if (hidDataRef.type == StreamDeck)
+                streamdeck_log_stats(hidDataRef.buttons, devname); // the read thread is done
+            qmk_state_update(hidDataRef.state, [](QMKDeviceState& state) {
+                state.connection = QMK_CONNECTION_CLOSED;
+                state.layer = 0;
+                });
+            qmk_state_log(hidDataRef.state, devname);
+            ShowNotification(hidDataRef, "FootSwitch Device Status:", "Device unplugged");
+        }
+        // freed once the read threads are done with it
+        hid_registry_remove(qmkData.devices, hidDataRef.id);
+    }
+}
+
+static void WakeUiThread(void* context) {
+    PostMessage(hTrayWnd, static_cast<UINT>(reinterpret_cast<uintptr_t>(context)), 0, 0);
+}
+
+// the UI side of readCallback, one batch per WM_DEVICE_EVENTS
+static void ApplyDeviceEvents(QMKHID& qmkData) {
+    static std::vector<QMKEvent> events;
+    qmk_event_drain(uiEvents, events);
+    for (const QMKEvent& event : events) {
+        HIDData* hidData = hid_registry_get(qmkData.devices, event.device);
+        if (!hidData)
+            continue; // removed meanwhile
+        switch (event.type) {
+        case QMK_EVENT_LAYER:
+            qmkData.pref.curLayer = static_cast<uint8_t>(event.value);
+            // todo check the preference for showing the layer switch
+            LayerWindowSwitchCallback(hidData->hid->port.value_or(""), qmkData.pref.curLayer, event.detail, event.received);
+            break;
+        case QMK_EVENT_KEYCODE:
+            QLOG_TRACE("QMK", "Key {:04x}\n", event.value); // the device state has it
+            break;
+        case QMK_EVENT_LEDSTATE:
+            QLOG_TRACE("QMK", "LEDs {:02x}\n", event.value);
+            break;
+        case QMK_EVENT_BUTTON:
+            QLOG_DEBUG("QMK", "Button {} {}\n", event.value, event.detail ? "pressed" : "released");
+            break;
+        case QMK_EVENT_LONG_PRESS:
+            QLOG_DEBUG("QMK", "Button {} long press\n", event.value);
+            break;
+        case QMK_EVENT_MULTI_PRESS:
+            QLOG_DEBUG("QMK", "Button {} pressed {} times\n", event.value, event.detail);
+            break;
+        case QMK_EVENT_DECODE_ERROR:
+            ShowNotification(*hidData, "Device Status", "Wrong data from the USB Device");
+            break;
+        }
+    }
+}
+
 LRESULT CALLBACK TrayWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
     switch (uMsg) {
 
@@ -469,23 +667,7 @@ LRESULT CALLBACK TrayWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
             if (pHdr->dbch_devicetype == DBT_DEVTYP_DEVICEINTERFACE) {
                 PDEV_BROADCAST_DEVICEINTERFACE pDevInf = (PDEV_BROADCAST_DEVICEINTERFACE)pHdr;
 
-                auto hidData = findMatchingPortDevice(qmkData, pDevInf->dbcc_name);
-                if (hidData.has_value()) {
-                    qmk_log("Device removed: {}\n", pDevInf->dbcc_name);
-                    // Remove comes more than one, because of the multiple interfaces
-                    HIDData& hidDataRef = *(*hidData);
-                    if (hidDataRef.hid->handle != INVALID_HANDLE_VALUE) {
-                        hid_close(*hidDataRef.hid);
-                        hidDataRef.curLayer = 0;
-                        ShowNotification(hidDataRef, "FootSwitch Device Status:", "Device unplugged");
-                    }
-                    // remove the hidData from qmkData.hidData
-                    qmkData.hidData.erase(std::remove_if(qmkData.hidData.begin(), qmkData.hidData.end(),
-                        [&hidDataRef](const HIDData& data) {
-                            return data.hid->handle == hidDataRef.hid->handle;
-                        }), qmkData.hidData.end());
-
-                }
+                CloseRemovedHidDevice(qmkData, pDevInf->dbcc_name);
             }
         }
         else if (wParam == DBT_DEVICEARRIVAL) {
@@ -504,6 +686,7 @@ LRESULT CALLBACK TrayWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
 
             HMENU hMenu = CreatePopupMenu();
             InsertMenu(hMenu, -1, MF_BYPOSITION, ID_TRAY_WRITE, "Write to HID");
+            InsertMenu(hMenu, -1, MF_BYPOSITION, ID_TRAY_LATENCY, "Log latency");
             InsertMenu(hMenu, -1, MF_BYPOSITION, ID_TRAY_EXIT, "Exit");
 
             TrackPopupMenu(hMenu, TPM_BOTTOMALIGN | TPM_LEFTALIGN, curPoint.x, curPoint.y, 0, hwnd, NULL);
@@ -513,20 +696,21 @@ LRESULT CALLBACK TrayWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
     case WM_COMMAND:
         switch (LOWORD(wParam)) {
             case ID_TRAY_WRITE: {
-                msgpack_t msgpack = {0};
-                init_msgpack(&msgpack);
-                // wen want the current layer back from the keyboard
-                add_msgpack_add(&msgpack, MSGPACK_CURRENT_LAYER, 0);
-				make_msgpack(&msgpack, qmkData.hidData[0].writeData);
-                //read_msgpack(&msgpack, qmkData.hidData[0].writeData);
-                if (hid_write(*qmkData.hidData[0].hid, qmkData.hidData[0].writeData)) {
-                   // ShowNotification(qmkData.hidData[0], "HID Write", "Data written successfully");
-                }
-                else {
-                    ShowNotification(qmkData.hidData[0], "HID Write", "Failed to write data");
-                }
+                HIDData* first = hid_registry_first(qmkData.devices);
+                if (!first || !first->commander)
+                    break;
+                // wen want the current layer back from the keyboard, readCallback shows it
+                QMKCommandOptions options;
+                options.done = [hwnd](const QMKCommandResult& result) {
+                    if (result.status != QMK_COMMAND_OK)
+                        PostMessage(hwnd, WM_COMMAND_FAILED, result.status, 0);
+                    };
+                qmk_command_batch(*first->commander, MSGPACK_CURRENT_LAYER, 0, options);
                 break;
             }
+            case ID_TRAY_LATENCY:
+                qmk_latency_log();
+                break;
             case ID_TRAY_EXIT:
                 Shell_NotifyIcon(NIM_DELETE, &nid);
 				DestroyWindow(hwnd);
@@ -534,6 +718,18 @@ LRESULT CALLBACK TrayWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
                 break;
         }
         break;
+    case WM_UI_TASKS:
+        executor_run_ui();
+        break;
+    case WM_DEVICE_EVENTS:
+        ApplyDeviceEvents(qmkData);
+        break;
+    case WM_COMMAND_FAILED:
+        if (HIDData* first = hid_registry_first(qmkData.devices)) {
+            const char* reason = (wParam == QMK_COMMAND_TIMEOUT) ? "No answer from the keyboard" : "Failed to write data";
+            ShowNotification(*first, "HID Write", reason);
+        }
+        break;
     case WM_TIMER:
         if (wParam == IDT_HIDE_WINDOW) {
             KillTimer(hwnd, 1); 
@@ -546,9 +742,7 @@ LRESULT CALLBACK TrayWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
     case WM_ENDSESSION:
         if (wParam) {
             // System is shutting down or logging off
-            for (auto& hidData : qmkData.hidData) {
-                hid_close(*hidData.hid);
-            }
+            hid_registry_for_each(qmkData.devices, [](HIDData& hidData) { hid_close(*hidData.hid); });
             Shell_NotifyIcon(NIM_DELETE, &nid);
             PostQuitMessage(0);
         }
@@ -557,10 +751,8 @@ LRESULT CALLBACK TrayWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
 		ShowWindow(hwnd, SW_HIDE);
 		break;
     case WM_DESTROY:
-        qmk_log("WM_DESTROY: Window is being destroyed\n");
-        for (auto& hidData : qmkData.hidData) {
-            hid_close(*hidData.hid);
-        }
+        QLOG_INFO("QMK", "WM_DESTROY: Window is being destroyed\n");
+        hid_registry_for_each(qmkData.devices, [](HIDData& hidData) { hid_close(*hidData.hid); });
         Shell_NotifyIcon(NIM_DELETE, &nid);
         PostQuitMessage(0);
         break;
@@ -570,59 +762,176 @@ LRESULT CALLBACK TrayWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
     return 0;
 }
 
-void readCallback(HID& hid, const std::vector<uint8_t>& data, void* userData) {
-	// Get the HIDData object associated with the HID device
-	auto it = std::ranges::find_if(qmkData.hidData, [&hid](const HIDData& data) {
-		return data.hid->handle == hid.handle;
-		});
-	if (it == qmkData.hidData.end()) {
+// UI thread, the preferences are stored on exit and the profile is selected again at the next start
+static void StoreProfile(uint8_t profile) {
+    qmkData.pref.profile = profile;
+}
+
+// executor thread, a copy of the matched rule
+static void RunAction(QMKActionRule rule) {
+    switch (rule.action) {
+    case QMK_ACTION_LAUNCH: {
+        STARTUPINFOA startup = { sizeof(startup) };
+        PROCESS_INFORMATION process = {};
+        std::string commandLine = rule.argument; // CreateProcessA may modify it
+        if (!CreateProcessA(nullptr, commandLine.data(), nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &process)) {
+            QLOG_ERROR("ACTION", "Rule {}: failed to launch {}, error {}\n", rule.seqnr, rule.argument, GetLastError());
+            break;
+        }
+        CloseHandle(process.hThread);
+        CloseHandle(process.hProcess);
+        break;
+    }
+    case QMK_ACTION_KEYS: {
+        int length = MultiByteToWideChar(CP_UTF8, 0, rule.argument.c_str(), static_cast<int>(rule.argument.size()), nullptr, 0);
+        std::wstring text(length, L'\0');
+        MultiByteToWideChar(CP_UTF8, 0, rule.argument.c_str(), static_cast<int>(rule.argument.size()), text.data(), length);
+        std::vector<INPUT> inputs;
+        for (wchar_t c : text) {
+            INPUT input = {};
+            input.type = INPUT_KEYBOARD;
+            input.ki.wScan = c;
+            input.ki.dwFlags = KEYEVENTF_UNICODE;
+            inputs.push_back(input);
+            input.ki.dwFlags |= KEYEVENTF_KEYUP;
+            inputs.push_back(input);
+        }
+        if (SendInput(static_cast<UINT>(inputs.size()), inputs.data(), sizeof(INPUT)) != inputs.size())
+            QLOG_ERROR("ACTION", "Rule {}: keys blocked, error {}\n", rule.seqnr, GetLastError());
+        break;
+    }
+    case QMK_ACTION_PROFILE: {
+        uint8_t profile = static_cast<uint8_t>(strtoul(rule.argument.c_str(), nullptr, 10));
+        if (qmk_action_select(qmkActions, profile))
+            CallbackUiThread(StoreProfile, profile);
+        break;
+    }
+    default:
+        QLOG_WARN("ACTION", "Rule {}: unknown action {}\n", rule.seqnr, rule.action);
+        break;
+    }
+}
+
+// read thread inside the epoch guard of readCallback, the action itself runs on the executor
+static void DispatchAction(const HIDData& hidData, uint8_t trigger, uint16_t code, uint8_t edge) {
+    uint8_t layer = qmk_state_read(hidData.state).layer;
+    const QMKActionRule* rule = qmk_action_dispatch(qmkActions, hidData.seqnr, layer, trigger, code, edge);
+    if (!rule)
+        return;
+    QLOG_DEBUG("ACTION", "Rule {} for trigger {} code {} edge {}\n", rule->seqnr, trigger, code, edge);
+    // a replayed capture must not launch programs or type on the host
+    if (!hidData.replayed)
+        CallbackThread(RunAction, *rule);
+}
+
+void readCallback(HID& hid, HIDReport& report, void* userData) {
+	// Get the HIDData object associated with the HID device, the guard keeps it
+	// alive until we return even if the device is removed meanwhile
+	HIDEpochGuard epoch;
+	HIDData* entry = hid_registry_get(qmkData.devices, hid_registry_id(userData));
+	if (!entry) {
 		return;
 	}
 
-	HIDData& hidData  = *it;
-	// remove the first report id byte from data
-	hidData.readData = std::vector<uint8_t>(data.begin(), data.end());
+	HIDData& hidData  = *entry;
+	// the report is on loan from the device's buffer pool, it is only valid during the callback
+	std::span<const uint8_t> data = report.data;
 
 	// Try to read from the device.
 	if (data.size() == hidData.hid->inEplength) {
 
 		// Check the USB device
 		if (hidData.type == StreamDeck) { // repid for btn pressed is data[0] == 1
-			// Set to the StreamDeck HID input
-			auto report = reinterpret_cast<StreamDeckHIDIn*>(&hidData.readData[0]);
-
-			// Display all bits set in the buttonStates array
-			std::string bitString;
-			for (int i = 0; i < sizeof(report->buttonStates); ++i) {
-				bitString += (report->buttonStates[i] == 1) ? '1' : '0';
-				bitString += ' ';
+			std::array<StreamDeckEdge, STREAMDECK_MAX_EDGES> edges;
+			size_t count = streamdeck_decode(hidData.buttons, data, report.timestamp, edges);
+			QLOG_TRACE("QMK", "StreamDeck buttons {:08x}, {} edges\n", hidData.buttons.state, count);
+			qmk_state_update(hidData.state, [&](QMKDeviceState& state) {
+				state.reports++;
+				state.lastReport = report.timestamp.time_since_epoch().count();
+				state.buttons = hidData.buttons.state;
+				state.presses = hidData.buttons.stats.presses;
+				});
+			for (size_t i = 0; i < count; ++i) {
+				const StreamDeckEdge& edge = edges[i];
+				switch (edge.type) {
+				case STREAMDECK_PRESSED:
+				case STREAMDECK_RELEASED:
+					qmk_event_push(uiEvents, { hidData.id, edge.button, QMK_EVENT_BUTTON, edge.type == STREAMDECK_PRESSED, edge.time });
+					DispatchAction(hidData, QMK_TRIGGER_BUTTON, edge.button, edge.type == STREAMDECK_PRESSED ? QMK_EDGE_PRESS : QMK_EDGE_RELEASE);
+					break;
+				case STREAMDECK_LONG_PRESS:
+					qmk_event_push(uiEvents, { hidData.id, edge.button, QMK_EVENT_LONG_PRESS, 0, edge.time });
+					DispatchAction(hidData, QMK_TRIGGER_BUTTON, edge.button, QMK_EDGE_LONG_PRESS);
+					break;
+				case STREAMDECK_MULTI_PRESS:
+					qmk_event_push(uiEvents, { hidData.id, edge.button, QMK_EVENT_MULTI_PRESS, edge.presses, edge.time });
+					if (edge.presses == 2)
+						DispatchAction(hidData, QMK_TRIGGER_BUTTON, edge.button, QMK_EDGE_DOUBLE_PRESS);
+					break;
+				}
+			}
+		}
+		else if (hidData.type == QMK && hidData.framer && qmk_frame_is_fragment(data)) {
+			// part of a payload larger than one report
+			std::vector<uint8_t> message;
+			qmk_state_update(hidData.state, [&](QMKDeviceState& state) {
+				state.reports++;
+				state.lastReport = report.timestamp.time_since_epoch().count();
+				});
+			if (qmk_frame_feed(*hidData.framer, data, report.timestamp, message) == QMK_FRAME_COMPLETE) {
+				auto download = hidData.keymapDownload.load();
+				if (!download || !qmk_keymap_feed(*download, message))
+					QLOG_INFO("QMK", "Message of {} bytes from {}\n", message.size(), hid.port.value_or(""));
 			}
-			bitString += '\n';
-			OutputDebugString(bitString.c_str());
-
 		}
 		else if (hidData.type == QMK) {
 			msgpack_t km;
-			if (read_msgpack(&km, hidData.readData)) {
+			if (read_msgpack(&km, data)) {
+				qmk_latency_record(QMK_LATENCY_CALLBACK, report.timestamp);
 				msgpack_log(&km);
+				// answers a pending query, the layer is shown below either way
+				if (hidData.commander)
+					qmk_command_dispatch(*hidData.commander, km);
+
+				bool changed = msgpack_has<MSGPACK_CHANGED_LAYER>(km);
+				std::optional<uint16_t> layer;
+				if (changed || msgpack_has<MSGPACK_CURRENT_LAYER>(km))
+					layer = changed ? msgpack_value<MSGPACK_CHANGED_LAYER>(km) : msgpack_value<MSGPACK_CURRENT_LAYER>(km);
+				auto keycode = msgpack_get<MSGPACK_CURRENT_KEYCODE>(km);
+				auto leds = msgpack_get<MSGPACK_CURRENT_LEDSTATE>(km);
+				// one update per report, readers see its layer and key together
+				qmk_state_update(hidData.state, [&](QMKDeviceState& state) {
+					state.reports++;
+					state.lastReport = report.timestamp.time_since_epoch().count();
+					if (layer) {
+						state.layer = static_cast<uint8_t>(*layer);
+						state.layerChanges += changed;
+					}
+					if (keycode) {
+						state.keycode = static_cast<uint16_t>(*keycode);
+						state.keycodes++;
+					}
+					if (leds)
+						state.ledState = static_cast<uint8_t>(*leds);
+					});
 
-                // show the 
-				if (msgpack_haskey(&km, MSGPACK_CHANGED_LAYER) || msgpack_haskey(&km, MSGPACK_CURRENT_LAYER)) {
-                    
-					uint8_t msg = msgpack_haskey(&km, MSGPACK_CHANGED_LAYER)? 
-                                MSGPACK_CHANGED_LAYER : MSGPACK_CURRENT_LAYER;
-                    auto curLayer = msgpack_getValue(&km, msg);
-
-                    hidData.curLayer = qmkData.pref.curLayer = (uint8_t)curLayer.value();
-                    
-					// todo check the preference for showing the layer switch
-					std::jthread timerThread2(CallbackThread<decltype(LayerWindowSwitchCallback),
-                        std::string, uint8_t, uint8_t>, LayerWindowSwitchCallback, hidData.hid->port.value(), hidData.curLayer, msg);
+				// the UI thread shows it, see ApplyDeviceEvents
+				if (layer) {
+					uint8_t msg = changed ? MSGPACK_CHANGED_LAYER : MSGPACK_CURRENT_LAYER;
+					qmk_event_push(uiEvents, { hidData.id, *layer, QMK_EVENT_LAYER, msg, report.timestamp });
+					if (changed)
+						DispatchAction(hidData, QMK_TRIGGER_LAYER, *layer, QMK_EDGE_PRESS);
 				}
+				if (keycode) {
+					qmk_event_push(uiEvents, { hidData.id, static_cast<uint16_t>(*keycode), QMK_EVENT_KEYCODE, 0, report.timestamp });
+					DispatchAction(hidData, QMK_TRIGGER_KEYCODE, static_cast<uint16_t>(*keycode), QMK_EDGE_PRESS);
+				}
+				if (leds)
+					qmk_event_push(uiEvents, { hidData.id, static_cast<uint16_t>(*leds), QMK_EVENT_LEDSTATE, 0, report.timestamp });
 			}
 			else {
-				qmk_log("Wrong data from the USB Device\n");
-				ShowNotification(hidData, "Device Status", "Wrong data from the USB Device");
+				QLOG_ERROR("QMK", "Wrong data from the USB Device\n");
+				qmk_event_push(uiEvents, { hidData.id, static_cast<uint16_t>(data.size()), QMK_EVENT_DECODE_ERROR, 0, report.timestamp });
 			}
 		}
 	}
@@ -630,17 +939,88 @@ void readCallback(HID& hid, const std::vector<uint8_t>& data, void* userData) {
 		; // No data received
 	}
 	else if (data.size() == -1) {
-		InvalidateRect(hChildWnd, NULL, TRUE);
 		std::string msgerr = hid_error(hid);
-		ShowNotification(hidData, "Foot Switch", msgerr.c_str());
+		qmk_state_update(hidData.state, [](QMKDeviceState& state) { state.connection = QMK_CONNECTION_ERROR; });
+		CallbackUiThread([](uint32_t id, const std::string& msgerr) {
+			InvalidateRect(hChildWnd, NULL, TRUE);
+			if (HIDData* hidData = hid_registry_get(qmkData.devices, id))
+				ShowNotification(*hidData, "Foot Switch", msgerr.c_str());
+			}, hidData.id, msgerr);
 		hid_close(hid);
 		hid.handle = nullptr;
 	}
 }
 
+// Feeds a capture file through readCallback as if the devices in it were plugged in,
+// with --fast as quick as possible instead of in the captured timing
+static bool ReplayCapture(QMKHID& qmkData, const std::string& path, bool realtime) {
+    static HIDReplay replay;
+    if (!hid_replay_open(replay, path))
+        return false;
+    for (auto& hid : replay.devices) {
+        if (!hid)
+            continue;
+        auto it = std::ranges::find_if(qmkData.usbSuppDevs, [&hid](const DeviceSupport& device) {
+            return device.vid == hid->info.vid && device.pid == hid->info.pid;
+            });
+        auto entry = std::make_unique<HIDData>();
+        entry->hid = hid;
+        entry->type = (it != qmkData.usbSuppDevs.end()) ? it->type : NoBoard;
+        entry->replayed = true;
+        entry->writeData.resize(hid->outEplength);
+        if (entry->type == QMK)
+            entry->framer = std::make_shared<QMKFramer>();
+        qmk_state_update(entry->state, [](QMKDeviceState& state) { state.connection = QMK_CONNECTION_OPEN; });
+        uint32_t id = hid_registry_add(qmkData.devices, std::move(entry));
+        if (id == HID_REGISTRY_INVALID)
+            continue;
+        replay.userData.resize(replay.devices.size());
+        replay.userData[&hid - replay.devices.data()] = hid_registry_userdata(id);
+    }
+    replayThread = std::jthread([realtime](std::stop_token stop) {
+        auto stats = hid_replay_run(replay, readCallback, nullptr, realtime, stop);
+        QLOG_INFO("QMK", "Replay: {} reports, {} bytes in {} us ({} writes skipped)\n",
+            stats.reports, stats.bytes, stats.elapsed.count(), stats.written);
+        qmk_latency_log();
+        });
+    return true;
+}
+
 int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow) {
     (void)hPrevInstance;
-    (void)lpCmdLine;
+    // --capture <file>: record all reports, --replay <file> [--fast]: play a recording back
+    std::string capturePath, replayPath;
+    bool replayRealtime = true;
+    uint32_t simRate = 0; // --sim <reports/s>: a simulated QMK board and StreamDeck instead of the hardware
+    LogSink logSink = QLOG_SINK_DEBUGGER;
+    std::string logPath;
+    std::istringstream cmdLine(lpCmdLine ? lpCmdLine : "");
+    for (std::string arg; cmdLine >> arg;) {
+        if (arg == "--capture")
+            cmdLine >> capturePath;
+        else if (arg == "--replay")
+            cmdLine >> replayPath;
+        else if (arg == "--fast")
+            replayRealtime = false;
+        else if (arg == "--sim")
+            cmdLine >> simRate;
+        else if (arg == "--log") { // --log trace|debug|info|warn|error|off
+            std::string level;
+            cmdLine >> level;
+            if (!log_set_level(level))
+                QLOG_WARN("QMK", "Unknown log level {}\n", level);
+        }
+        else if (arg == "--log-file") { // binary, read it with qmklogdump
+            cmdLine >> logPath;
+            logSink = QLOG_SINK_FILE;
+        }
+        else if (arg == "--log-stderr")
+            logSink = QLOG_SINK_STDERR;
+    }
+    if (!log_start(logSink, logPath))
+        log_start(QLOG_SINK_DEBUGGER);
+    if (!capturePath.empty())
+        hid_capture_start(capturePath);
     (void)nCmdShow;
 
     SetProcessDpiAwarenessContext(DPI_AWARENESS_CONTEXT_PER_MONITOR_AWARE_V2);
@@ -649,6 +1029,8 @@ int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
     WNDCLASSEX wc = { sizeof(WNDCLASSEX), CS_CLASSDC, TrayWindowProc, 0L, 0L, hInstance, NULL, NULL, NULL, NULL, "QMkTrayIconWnd", NULL };
     RegisterClassEx(&wc);
     hTrayWnd = CreateWindow(wc.lpszClassName, "OMRS31H Foot Switch", WS_OVERLAPPEDWINDOW, 100, 100, 300, 300, NULL, NULL, wc.hInstance, NULL);
+    qmk_event_init(uiEvents, WakeUiThread, reinterpret_cast<void*>(WM_DEVICE_EVENTS));
+    executor_start(0, WakeUiThread, reinterpret_cast<void*>(WM_UI_TASKS));
 
     // Initialize the NOTIFYICONDATA structure
     InitNotifyIconData();
@@ -668,20 +1050,59 @@ int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
         devCount = sqlite_tableCount(qmkData.sqLite.get(), "DeviceSupport");
     }
     else {
-        qmk_log("Failed to get database connection");
+        QLOG_ERROR("QMK", "Failed to get database connection");
         qmkData.sqLite = nullptr;
     }
-	if (devCount > 0) {
+    auto tabCount = sqlite_tableCount(qmkData.sqLite.get(), "Preferences");
+    if (tabCount <= 0) {
+        qmkPreferences.push_back(_qmkPreference);
+        sqlite_add_update_preferences(qmkData.sqLite.get(), qmkPreferences);
+    }
+    else {
+        sqlite_get_preferences(qmkData.sqLite.get(), qmkPreferences);
+    }
+	qmkData.pref = qmkPreferences[0];
+
+    // the rules are in place before the first device reports
+    if (qmkData.sqLite) {
+        std::vector<QMKActionRule> rules;
+        if (sqlite_tableCount(qmkData.sqLite.get(), "ActionRules") <= 0) {
+            rules = _exampleRules;
+            sqlite_add_update_actionrules(qmkData.sqLite.get(), rules);
+        }
+        else {
+            sqlite_get_actionrules(qmkData.sqLite.get(), rules);
+        }
+        qmk_action_load(qmkActions, std::move(rules), qmkData.pref.profile);
+    }
+
+    if (simRate) {
+        hid_sim_add({ "qmk", HID_SIM_QMK, QMK_VID, QMK_PID, "&MI_01", simRate, 4, 0, true });
+        hid_sim_add({ "streamdeck", HID_SIM_STREAMDECK, STMDECK_VID, STMDECK_PID, "", simRate, 0, 15 });
+        hid_sim_set_hotplug([](const std::string& devname, bool arrived) {
+            CallbackUiThread([](const std::string& devname, bool arrived) {
+                if (arrived)
+                    OpenArrivedHidDevice(qmkData, devname);
+                else
+                    CloseRemovedHidDevice(qmkData, devname);
+                }, devname, arrived);
+            });
+        std::vector<DeviceSupport> simDevices;
+        hid_open_list(simDevices, qmkData.usbSuppDevs);
+        std::erase_if(simDevices, [](const DeviceSupport& devsupport) { return !devsupport.dev.starts_with(HID_SIM_PREFIX); });
+        for (auto& devsupport : simDevices) {
+            devsupport.active = true;
+        }
+        OpenHidDevices(qmkData, simDevices);
+    }
+	else if (devCount > 0) {
 		sqlite_get_devicesupport(qmkData.sqLite.get(), qmkData.dbSuppDevs);
         opened = OpenHidDevices(qmkData, qmkData.dbSuppDevs);
-        if (opened) {
-			msgpack_t msgpack = { 0 };
-			init_msgpack(&msgpack);
-			// wen want the current layer back from the keyboard
-			add_msgpack_add(&msgpack, MSGPACK_CURRENT_LAYER, 0);
-			make_msgpack(&msgpack, qmkData.hidData[0].writeData);
-			//read_msgpack(&msgpack, qmkData.hidData[0].writeData);
-            hid_write(*qmkData.hidData[0].hid, qmkData.hidData[0].writeData);
+        HIDData* first = hid_registry_first(qmkData.devices);
+        if (opened && first && first->commander) {
+            // wen want the current layer and the leds back from the keyboard, both queries share one report
+            qmk_command_batch(*first->commander, MSGPACK_CURRENT_LAYER, 0);
+            qmk_command_batch(*first->commander, MSGPACK_CURRENT_LEDSTATE, 0);
         }
     }
 	else {
@@ -692,30 +1113,42 @@ int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
         sqlite_add_update_devicesupport(qmkData.sqLite.get(), sysDeviceSupp);
     }
 
-    auto tabCount = sqlite_tableCount(qmkData.sqLite.get(), "Preferences");
-    if (tabCount <= 0) {
-        qmkPreferences.push_back(_qmkPreference);
-        sqlite_add_update_preferences(qmkData.sqLite.get(), qmkPreferences);
-    }
-    else {
-        sqlite_get_preferences(qmkData.sqLite.get(), qmkPreferences);
-    }
-	qmkData.pref = qmkPreferences[0];
+    if (!replayPath.empty() && !ReplayCapture(qmkData, replayPath, replayRealtime))
+        ShowNotification({0}, "Replay", "The capture file could not be read");
 
-    // Message loop
+    // Message loop, sleeps until a message arrives (QMK_POLL_LOOP: polls). Reports are waited for by the
+    // reactor thread, no other thread touches a window: device events, decode errors
+    // included, and executor tasks post one WM_DEVICE_EVENTS / WM_UI_TASKS per batch
+    // and are applied here.
     MSG msg;
     bool running = true;
+    loopStats.start = steady_clock::now();
     while (running) {
+#ifndef QMK_POLL_LOOP
+        DWORD waitResult = MsgWaitForMultipleObjectsEx(0, NULL, INFINITE, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+        if (waitResult == WAIT_FAILED) {
+            QLOG_ERROR("QMK", "MsgWaitForMultipleObjectsEx failed: {}\n", GetLastError());
+            break;
+        }
+#endif
+        loopStats.wakeups++;
         while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
-            TranslateMessage(&msg);
-            DispatchMessage(&msg);
+            loopStats.messages++;
             if (msg.message == WM_QUIT) {
                 running = false;
                 break;
             }
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
         }
-        Sleep(10); // Sleep for 100 ms
+#ifdef QMK_POLL_LOOP
+        if (running)
+            Sleep(QMK_POLL_MS);
+#endif
     }
+    auto seconds = duration_cast<duration<double>>(steady_clock::now() - loopStats.start).count();
+    QLOG_INFO("QMK", "Message loop (" QMK_LOOP_NAME "): {} wakeups, {} messages in {:.0f} s ({:.2f} wakeups/s)\n",
+        loopStats.wakeups, loopStats.messages, seconds, seconds > 0 ? loopStats.wakeups / seconds : 0.0);
 
 	// update preferences
     // timestamp format is ""
@@ -724,10 +1157,20 @@ int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
 
 	sqlite_add_update_preferences(qmkData.sqLite.get(), qmkPreferences);
 
-
     Shell_NotifyIcon(NIM_DELETE, &nid);
-    for (auto& hidData : qmkData.hidData) {
-        hid_close(*hidData.hid);
+    if (replayThread.joinable()) {
+        replayThread.request_stop();
+        replayThread.join();
     }
+    hid_registry_for_each(qmkData.devices, [](HIDData& hidData) { hid_close(*hidData.hid); });
+    qmk_event_log_stats(uiEvents);
+    executor_stop();
+    executor_log_stats();
+    qmk_action_log_stats(qmkActions);
+    qmk_action_close(qmkActions);
+    hid_registry_clear(qmkData.devices);
+    hid_epoch_reclaim();
+    hid_capture_stop();
+    log_stop();
     return 0;
-}
\ No newline at end of file
+}
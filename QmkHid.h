@@ -1,10 +1,12 @@
 #pragma once
 
 #include "resource.h"
+#include "streamdeck.h"
+#include "qmkstate.h"
 
 typedef struct _StreamDeckHIDIn {
 	uint8_t reportID[4]; // Report ID to identify the report type
-	uint8_t buttonStates[15]; // Button states (adjust size as needed)
+	uint8_t buttonStates[15]; // Button states, 32 on the XL, see streamdeck.h
 } StreamDeckHIDIn;
 
 enum ProductType {
@@ -20,16 +22,22 @@ typedef struct _QMKHIDPREFERENCE {
 	uint8_t showLayerSwitch; // show layer switch in the client window
 	std::string windowPos; // serialized RECT, status window position
 	std::string traydev; // USB device which shows its state in the tray
+	uint8_t profile;     // action profile selected last, see qmkaction.h
 	std::string timestamp;
 }QMKHIDPREFERENCE;
 
 
 typedef struct _HIDData {
-	uint32_t seqnr;
+	uint32_t seqnr; // DeviceSupport.seqnr, 0 if the device isn't stored
+	uint32_t id; // in qmkData.devices, the read callback's userData
 	uint8_t type;
+	bool replayed; // fed by --replay, its events run no host actions
 	std::shared_ptr<HID> hid;
-	std::vector<uint8_t> readData;
 	std::vector<uint8_t> writeData;
-	uint8_t curLayer;// current layer if qmk sends it
-	uint16_t curKey;   // last key pressed
+	QMKStateBlock state; // layer, last key, LEDs, counters; written by the read thread, read anywhere
+	StreamDeckButtons buttons; // StreamDeck edge detection, read thread
+	std::shared_ptr<QMKCommander> commander; // request/response layer, QMK boards only
+	std::shared_ptr<QMKFramer> framer;       // reassembles payloads larger than one report, QMK boards only
+	std::atomic<std::shared_ptr<QMKKeymap>> keymap; // from the database or downloaded, QMK boards only
+	std::atomic<std::shared_ptr<QMKKeymapDownload>> keymapDownload; // while the keymap is transferred, read by the read callback
 }HIDData;
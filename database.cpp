@@ -3,6 +3,7 @@
 #include <thread>
 #include <vector>
 #include <string>
+#include <cstring>
 #include <mutex>
 #include <locale>
 #include <codecvt>
@@ -23,16 +24,10 @@
 #include "stringex.h"
 #include "qmkhid.h"
 #include "database.h"
+#include "log.h"
 
 static sqlite3* _db = nullptr;
 
-
-void sqlite_log(const std::string& format_str, auto&&... args) {
-    std::string fmtstr = std::vformat(format_str, std::make_format_args(args...));
-    OutputDebugString(("HID: " + fmtstr).c_str());
-}
-
-
 std::optional<std::string> GetLocalAppDataFolder() {
 #ifdef _WIN32
 	char path[MAX_PATH];
@@ -57,25 +52,23 @@ std::optional<std::string> GetLocalAppDataFolder() {
 #endif
 }
 
-
 bool executeSQL(sqlite3* db, const char* sql) {
     char* errMsg = nullptr;
     int rc = sqlite3_exec(db, sql, nullptr, nullptr, &errMsg);
     if (rc != SQLITE_OK) {
-        sqlite_log("SQL error: {}", errMsg);
+        QLOG_ERROR("DB", "SQL error: {}", errMsg);
         sqlite3_free(errMsg);
         return false;
     }
     return true;
 }
 
-
 int sqlite_tableCount(sqlite3* db, const std::string& tableName) {
     std::string sql = "SELECT COUNT(*) FROM " + tableName + ";";
     sqlite3_stmt* stmt;
     int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        sqlite_log("Failed to prepare statement: {}", sqlite3_errmsg(db));
+        QLOG_ERROR("DB", "Failed to prepare statement: {}", sqlite3_errmsg(db));
         return -1;
     }
     rc = sqlite3_step(stmt);
@@ -84,7 +77,7 @@ int sqlite_tableCount(sqlite3* db, const std::string& tableName) {
         count = sqlite3_column_int(stmt, 0);
     }
     else {
-        sqlite_log("Failed to get row count: {}", sqlite3_errmsg(db));
+        QLOG_ERROR("DB", "Failed to get row count: {}", sqlite3_errmsg(db));
     }
     sqlite3_finalize(stmt);
     return count;
@@ -95,7 +88,21 @@ bool sqlite_tableExists(sqlite3* db, const std::string& tableName) {
     sqlite3_stmt* stmt;
     int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        sqlite_log("Failed to prepare statement: {}", sqlite3_errmsg(db));
+        QLOG_ERROR("DB", "Failed to prepare statement: {}", sqlite3_errmsg(db));
+        return false;
+    }
+    rc = sqlite3_step(stmt);
+    bool exists = (rc == SQLITE_ROW);
+    sqlite3_finalize(stmt);
+    return exists;
+}
+
+bool sqlite_columnExists(sqlite3* db, const std::string& tableName, const std::string& columnName) {
+    std::string sql = "SELECT name FROM pragma_table_info('" + tableName + "') WHERE name='" + columnName + "';";
+    sqlite3_stmt* stmt;
+    int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
+    if (rc != SQLITE_OK) {
+        QLOG_ERROR("DB", "Failed to prepare statement: {}", sqlite3_errmsg(db));
         return false;
     }
     rc = sqlite3_step(stmt);
@@ -112,7 +119,7 @@ bool sqlite_delete_devicesupport(sqlite3* db, const std::vector<DeviceSupport>&
     sqlite3_stmt* stmt;
     int rc = sqlite3_prepare_v2(db, deleteSQL, -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        sqlite_log("Failed to prepare delete statement: {}", sqlite3_errmsg(db));
+        QLOG_ERROR("DB", "Failed to prepare delete statement: {}", sqlite3_errmsg(db));
         return false;
     }
 
@@ -123,7 +130,7 @@ bool sqlite_delete_devicesupport(sqlite3* db, const std::vector<DeviceSupport>&
 
             rc = sqlite3_step(stmt);
             if (rc != SQLITE_DONE) {
-                sqlite_log("Failed to delete data: {}", sqlite3_errmsg(db));
+                QLOG_ERROR("DB", "Failed to delete data: {}", sqlite3_errmsg(db));
                 sqlite3_finalize(stmt);
                 return false;
             }
@@ -152,13 +159,13 @@ bool sqlite_add_update_devicesupport(sqlite3* db, const std::vector<DeviceSuppor
     sqlite3_stmt* updateStmt;
     int rc = sqlite3_prepare_v2(db, insertSQL, -1, &insertStmt, nullptr);
     if (rc != SQLITE_OK) {
-        sqlite_log("Failed to prepare insert statement: {}", sqlite3_errmsg(db));
+        QLOG_ERROR("DB", "Failed to prepare insert statement: {}", sqlite3_errmsg(db));
         return false;
     }
 
     rc = sqlite3_prepare_v2(db, updateSQL, -1, &updateStmt, nullptr);
     if (rc != SQLITE_OK) {
-        sqlite_log("Failed to prepare update statement: {}", sqlite3_errmsg(db));
+        QLOG_ERROR("DB", "Failed to prepare update statement: {}", sqlite3_errmsg(db));
         sqlite3_finalize(insertStmt);
         return false;
     }
@@ -166,7 +173,7 @@ bool sqlite_add_update_devicesupport(sqlite3* db, const std::vector<DeviceSuppor
     // Begin transaction
     rc = sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr);
     if (rc != SQLITE_OK) {
-        sqlite_log("Failed to begin transaction: {}", sqlite3_errmsg(db));
+        QLOG_ERROR("DB", "Failed to begin transaction: {}", sqlite3_errmsg(db));
         sqlite3_finalize(insertStmt);
         sqlite3_finalize(updateStmt);
         return false;
@@ -189,7 +196,7 @@ bool sqlite_add_update_devicesupport(sqlite3* db, const std::vector<DeviceSuppor
 
             rc = sqlite3_step(insertStmt);
             if (rc != SQLITE_DONE) {
-                sqlite_log("Failed to insert data: {}", sqlite3_errmsg(db));
+                QLOG_ERROR("DB", "Failed to insert data: {}", sqlite3_errmsg(db));
                 sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
                 sqlite3_finalize(insertStmt);
                 sqlite3_finalize(updateStmt);
@@ -216,7 +223,7 @@ bool sqlite_add_update_devicesupport(sqlite3* db, const std::vector<DeviceSuppor
 
             rc = sqlite3_step(updateStmt);
             if (rc != SQLITE_DONE) {
-                sqlite_log("Failed to update data: {}", sqlite3_errmsg(db));
+                QLOG_ERROR("DB", "Failed to update data: {}", sqlite3_errmsg(db));
                 sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
                 sqlite3_finalize(insertStmt);
                 sqlite3_finalize(updateStmt);
@@ -230,7 +237,7 @@ bool sqlite_add_update_devicesupport(sqlite3* db, const std::vector<DeviceSuppor
     // Commit transaction
     rc = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
     if (rc != SQLITE_OK) {
-        sqlite_log("Failed to commit transaction: {}", sqlite3_errmsg(db));
+        QLOG_ERROR("DB", "Failed to commit transaction: {}", sqlite3_errmsg(db));
         sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
         sqlite3_finalize(insertStmt);
         sqlite3_finalize(updateStmt);
@@ -252,7 +259,7 @@ bool sqlite_update_devicesupport(sqlite3* db, const std::vector<DeviceSupport>&
     sqlite3_stmt* stmt;
     int rc = sqlite3_prepare_v2(db, updateSQL, -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        sqlite_log("Failed to prepare statement: {}", sqlite3_errmsg(db));
+        QLOG_ERROR("DB", "Failed to prepare statement: {}", sqlite3_errmsg(db));
         return false;
     }
 
@@ -273,7 +280,7 @@ bool sqlite_update_devicesupport(sqlite3* db, const std::vector<DeviceSupport>&
 
         rc = sqlite3_step(stmt);
         if (rc != SQLITE_DONE) {
-            sqlite_log("Failed to update data: {}", sqlite3_errmsg(db));
+            QLOG_ERROR("DB", "Failed to update data: {}", sqlite3_errmsg(db));
             sqlite3_finalize(stmt);
             return false;
         }
@@ -293,7 +300,7 @@ bool sqlite_get_devicesupport(sqlite3* db, std::vector<DeviceSupport>& devices)
     sqlite3_stmt* stmt;
     int rc = sqlite3_prepare_v2(db, selectSQL, -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        sqlite_log("Failed to prepare statement: {}", sqlite3_errmsg(db));
+        QLOG_ERROR("DB", "Failed to prepare statement: {}", sqlite3_errmsg(db));
         return false;
     }
     devices.clear();
@@ -317,7 +324,7 @@ bool sqlite_get_devicesupport(sqlite3* db, std::vector<DeviceSupport>& devices)
     }
 
     if (rc != SQLITE_DONE) {
-        sqlite_log("Failed to retrieve data: {}", sqlite3_errmsg(db));
+        QLOG_ERROR("DB", "Failed to retrieve data: {}", sqlite3_errmsg(db));
         sqlite3_finalize(stmt);
         return false;
     }
@@ -335,7 +342,7 @@ bool sqlite_store_devicesupport(sqlite3* db, const std::vector<DeviceSupport>& d
     sqlite3_stmt* stmt;
     int rc = sqlite3_prepare_v2(db, insertSQL, -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        sqlite_log("Failed to prepare statement: {}", sqlite3_errmsg(db));
+        QLOG_ERROR("DB", "Failed to prepare statement: {}", sqlite3_errmsg(db));
         return false;
     }
 
@@ -354,7 +361,7 @@ bool sqlite_store_devicesupport(sqlite3* db, const std::vector<DeviceSupport>& d
 
         rc = sqlite3_step(stmt);
         if (rc != SQLITE_DONE) {
-            sqlite_log("Failed to insert data: {}", sqlite3_errmsg(db));
+            QLOG_ERROR("DB", "Failed to insert data: {}", sqlite3_errmsg(db));
             sqlite3_finalize(stmt);
             return false;
         }
@@ -369,7 +376,7 @@ bool sqlite_store_devicesupport(sqlite3* db, const std::vector<DeviceSupport>& d
 // Function to create the DeviceSupport table
 bool sqlite_create_devicesupport(sqlite3* db) {
     if (sqlite_tableExists(db, "DeviceSupport")) {
-        sqlite_log("Table already exists");
+        QLOG_DEBUG("DB", "Table already exists");
         return true;
     }
     const char* createTableSQL = R"(
@@ -394,7 +401,7 @@ bool sqlite_create_devicesupport(sqlite3* db) {
     int rc = sqlite3_exec(db, createTableSQL, nullptr, nullptr, &errMsg);
     if (rc != SQLITE_OK) {
         std::string errorMessage = "SQL error: " + std::string(errMsg);
-        sqlite_log(errorMessage);
+        QLOG_ERROR("DB", "{}", errorMessage);
         sqlite3_free(errMsg);
         return false;
     }
@@ -403,13 +410,13 @@ bool sqlite_create_devicesupport(sqlite3* db) {
 
 bool sqlite_add_update_preferences(sqlite3* db, std::vector<QMKHIDPREFERENCE>& preferences) {
 	const char* insertSQL = R"(
-        INSERT INTO Preferences (curLayer, showTime, showLayerSwitch, windowPos, traydev)
-        VALUES (?, ?, ?, ?, ?);
+        INSERT INTO Preferences (curLayer, showTime, showLayerSwitch, windowPos, traydev, profile)
+        VALUES (?, ?, ?, ?, ?, ?);
     )";
 
 	const char* updateSQL = R"(
         UPDATE Preferences
-        SET curLayer = ?, showTime = ?, showLayerSwitch = ?, windowPos = ?, traydev = ?, timestamp = ? 
+        SET curLayer = ?, showTime = ?, showLayerSwitch = ?, windowPos = ?, traydev = ?, timestamp = ?, profile = ?
         WHERE seqnr = ?;
     )";
 
@@ -422,20 +429,20 @@ bool sqlite_add_update_preferences(sqlite3* db, std::vector<QMKHIDPREFERENCE>& p
 	sqlite3_stmt* selectTimestampStmt;
 	int rc = sqlite3_prepare_v2(db, insertSQL, -1, &insertStmt, nullptr);
 	if (rc != SQLITE_OK) {
-		sqlite_log("Failed to prepare insert statement: {}", sqlite3_errmsg(db));
+		QLOG_ERROR("DB", "Failed to prepare insert statement: {}", sqlite3_errmsg(db));
 		return false;
 	}
 
 	rc = sqlite3_prepare_v2(db, updateSQL, -1, &updateStmt, nullptr);
 	if (rc != SQLITE_OK) {
-		sqlite_log("Failed to prepare update statement: {}", sqlite3_errmsg(db));
+		QLOG_ERROR("DB", "Failed to prepare update statement: {}", sqlite3_errmsg(db));
 		sqlite3_finalize(insertStmt);
 		return false;
 	}
 
 	rc = sqlite3_prepare_v2(db, selectTimestampSQL, -1, &selectTimestampStmt, nullptr);
 	if (rc != SQLITE_OK) {
-		sqlite_log("Failed to prepare select timestamp statement: {}", sqlite3_errmsg(db));
+		QLOG_ERROR("DB", "Failed to prepare select timestamp statement: {}", sqlite3_errmsg(db));
 		sqlite3_finalize(insertStmt);
 		sqlite3_finalize(updateStmt);
 		return false;
@@ -444,7 +451,7 @@ bool sqlite_add_update_preferences(sqlite3* db, std::vector<QMKHIDPREFERENCE>& p
 	// Begin transaction
 	rc = sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr);
 	if (rc != SQLITE_OK) {
-		sqlite_log("Failed to begin transaction: {}", sqlite3_errmsg(db));
+		QLOG_ERROR("DB", "Failed to begin transaction: {}", sqlite3_errmsg(db));
 		sqlite3_finalize(insertStmt);
 		sqlite3_finalize(updateStmt);
 		sqlite3_finalize(selectTimestampStmt);
@@ -459,10 +466,11 @@ bool sqlite_add_update_preferences(sqlite3* db, std::vector<QMKHIDPREFERENCE>& p
 			sqlite3_bind_int(insertStmt, 3, pref.showLayerSwitch);
 			sqlite3_bind_text(insertStmt, 4, pref.windowPos.c_str(), -1, SQLITE_STATIC);
 			sqlite3_bind_text(insertStmt, 5, pref.traydev.c_str(), -1, SQLITE_STATIC);
+			sqlite3_bind_int(insertStmt, 6, pref.profile);
 
 			rc = sqlite3_step(insertStmt);
 			if (rc != SQLITE_DONE) {
-				sqlite_log("Failed to insert data: {}", sqlite3_errmsg(db));
+				QLOG_ERROR("DB", "Failed to insert data: {}", sqlite3_errmsg(db));
 				sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
 				sqlite3_finalize(insertStmt);
 				sqlite3_finalize(updateStmt);
@@ -480,7 +488,7 @@ bool sqlite_add_update_preferences(sqlite3* db, std::vector<QMKHIDPREFERENCE>& p
 				pref.timestamp = reinterpret_cast<const char*>(sqlite3_column_text(selectTimestampStmt, 0));
 			}
 			else {
-				sqlite_log("Failed to retrieve timestamp: {}", sqlite3_errmsg(db));
+				QLOG_ERROR("DB", "Failed to retrieve timestamp: {}", sqlite3_errmsg(db));
 				sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
 				sqlite3_finalize(insertStmt);
 				sqlite3_finalize(updateStmt);
@@ -505,12 +513,13 @@ bool sqlite_add_update_preferences(sqlite3* db, std::vector<QMKHIDPREFERENCE>& p
 					sqlite3_bind_text(updateStmt, 4, pref.windowPos.c_str(), -1, SQLITE_STATIC);
 					sqlite3_bind_text(updateStmt, 5, pref.traydev.c_str(), -1, SQLITE_STATIC);
 					sqlite3_bind_text(updateStmt, 6, pref.timestamp.c_str(), -1, SQLITE_STATIC);
+					sqlite3_bind_int(updateStmt, 7, pref.profile);
 				    // where clause	
-                    sqlite3_bind_int(updateStmt, 7, pref.seqnr);
+                    sqlite3_bind_int(updateStmt, 8, pref.seqnr);
 
 					rc = sqlite3_step(updateStmt);
 					if (rc != SQLITE_DONE) {
-						sqlite_log("Failed to update data: {}", sqlite3_errmsg(db));
+						QLOG_ERROR("DB", "Failed to update data: {}", sqlite3_errmsg(db));
 						sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
 						sqlite3_finalize(insertStmt);
 						sqlite3_finalize(updateStmt);
@@ -531,7 +540,7 @@ bool sqlite_add_update_preferences(sqlite3* db, std::vector<QMKHIDPREFERENCE>& p
 	// Commit transaction
 	rc = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
 	if (rc != SQLITE_OK) {
-		sqlite_log("Failed to commit transaction: {}", sqlite3_errmsg(db));
+		QLOG_ERROR("DB", "Failed to commit transaction: {}", sqlite3_errmsg(db));
 		sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
 		sqlite3_finalize(insertStmt);
 		sqlite3_finalize(updateStmt);
@@ -554,6 +563,7 @@ bool sqlite_create_preferences(sqlite3* db) {
             showLayerSwitch INTEGER NOT NULL,
             windowPos TEXT,
             traydev TEXT,
+            profile INTEGER NOT NULL DEFAULT 0,
             timestamp DATETIME DEFAULT CURRENT_TIMESTAMP
         );
     )";
@@ -562,7 +572,7 @@ bool sqlite_create_preferences(sqlite3* db) {
 	int rc = sqlite3_exec(db, createTableSQL, nullptr, nullptr, &errMsg);
 	if (rc != SQLITE_OK) {
 		std::string errorMessage = "SQL error: " + std::string(errMsg);
-		sqlite_log(errorMessage);
+		QLOG_ERROR("DB", "{}", errorMessage);
 		sqlite3_free(errMsg);
 		return false;
 	}
@@ -571,14 +581,14 @@ bool sqlite_create_preferences(sqlite3* db) {
 
 bool sqlite_get_preferences(sqlite3* db, std::vector<QMKHIDPREFERENCE>& preferences) {
 	const char* selectSQL = R"(
-        SELECT seqnr, curLayer, showTime, showLayerSwitch, windowPos, traydev, timestamp
+        SELECT seqnr, curLayer, showTime, showLayerSwitch, windowPos, traydev, timestamp, profile
         FROM Preferences;
     )";
 
 	sqlite3_stmt* stmt;
 	int rc = sqlite3_prepare_v2(db, selectSQL, -1, &stmt, nullptr);
 	if (rc != SQLITE_OK) {
-		sqlite_log("Failed to prepare statement: {}", sqlite3_errmsg(db));
+		QLOG_ERROR("DB", "Failed to prepare statement: {}", sqlite3_errmsg(db));
 		return false;
 	}
 
@@ -592,12 +602,13 @@ bool sqlite_get_preferences(sqlite3* db, std::vector<QMKHIDPREFERENCE>& preferen
 		pref.windowPos = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 4));
 		pref.traydev = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 5));
 	    pref.timestamp = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 6)); 
+		pref.profile = static_cast<uint8_t>(sqlite3_column_int(stmt, 7));
 
 		preferences.push_back(pref);
 	}
 
 	if (rc != SQLITE_DONE) {
-		sqlite_log("Failed to retrieve data: {}", sqlite3_errmsg(db));
+		QLOG_ERROR("DB", "Failed to retrieve data: {}", sqlite3_errmsg(db));
 		sqlite3_finalize(stmt);
 		return false;
 	}
@@ -606,12 +617,224 @@ bool sqlite_get_preferences(sqlite3* db, std::vector<QMKHIDPREFERENCE>& preferen
 	return true;
 }
 
+bool sqlite_create_keymap(sqlite3* db) {
+    const char* createTableSQL = R"(
+        CREATE TABLE IF NOT EXISTS Keymap (
+            serial_number TEXT NOT NULL,
+            sernbr INTEGER NOT NULL,
+            layers INTEGER NOT NULL,
+            rows INTEGER NOT NULL,
+            cols INTEGER NOT NULL,
+            keycodes BLOB NOT NULL,
+            timestamp DATETIME DEFAULT CURRENT_TIMESTAMP,
+            PRIMARY KEY (serial_number, sernbr)
+        );
+    )";
+
+    char* errMsg = nullptr;
+    int rc = sqlite3_exec(db, createTableSQL, nullptr, nullptr, &errMsg);
+    if (rc != SQLITE_OK) {
+        std::string errorMessage = "SQL error: " + std::string(errMsg);
+        QLOG_ERROR("DB", "{}", errorMessage);
+        sqlite3_free(errMsg);
+        return false;
+    }
+    return true;
+}
+
+// false if there is no keymap for this firmware version, or it doesn't fit its dimensions
+bool sqlite_get_keymap(sqlite3* db, const std::string& serial_number, uint16_t sernbr, QMKKeymap& keymap) {
+    const char* selectSQL = R"(
+        SELECT layers, rows, cols, keycodes FROM Keymap WHERE serial_number = ? AND sernbr = ?;
+    )";
+
+    sqlite3_stmt* stmt;
+    int rc = sqlite3_prepare_v2(db, selectSQL, -1, &stmt, nullptr);
+    if (rc != SQLITE_OK) {
+        QLOG_ERROR("DB", "Failed to prepare statement: {}", sqlite3_errmsg(db));
+        return false;
+    }
+    sqlite3_bind_text(stmt, 1, serial_number.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, sernbr);
+
+    bool found = false;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        keymap.layers = static_cast<uint8_t>(sqlite3_column_int(stmt, 0));
+        keymap.rows = static_cast<uint8_t>(sqlite3_column_int(stmt, 1));
+        keymap.cols = static_cast<uint8_t>(sqlite3_column_int(stmt, 2));
+        // keycodes in the byte order of the host which stored them
+        const void* blob = sqlite3_column_blob(stmt, 3);
+        size_t bytes = static_cast<size_t>(sqlite3_column_bytes(stmt, 3));
+        size_t keys = static_cast<size_t>(keymap.layers) * keymap.rows * keymap.cols;
+        if (keys && bytes == keys * sizeof(uint16_t)) {
+            keymap.keycodes.resize(keys);
+            memcpy(keymap.keycodes.data(), blob, bytes);
+            found = true;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+bool sqlite_store_keymap(sqlite3* db, const std::string& serial_number, uint16_t sernbr, const QMKKeymap& keymap) {
+    const char* insertSQL = R"(
+        INSERT OR REPLACE INTO Keymap (serial_number, sernbr, layers, rows, cols, keycodes)
+        VALUES (?, ?, ?, ?, ?, ?);
+    )";
+
+    sqlite3_stmt* stmt;
+    int rc = sqlite3_prepare_v2(db, insertSQL, -1, &stmt, nullptr);
+    if (rc != SQLITE_OK) {
+        QLOG_ERROR("DB", "Failed to prepare statement: {}", sqlite3_errmsg(db));
+        return false;
+    }
+    sqlite3_bind_text(stmt, 1, serial_number.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, sernbr);
+    sqlite3_bind_int(stmt, 3, keymap.layers);
+    sqlite3_bind_int(stmt, 4, keymap.rows);
+    sqlite3_bind_int(stmt, 5, keymap.cols);
+    sqlite3_bind_blob(stmt, 6, keymap.keycodes.data(), static_cast<int>(keymap.keycodes.size() * sizeof(uint16_t)), SQLITE_STATIC);
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        QLOG_ERROR("DB", "Failed to insert data: {}", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return false;
+    }
+    sqlite3_finalize(stmt);
+    return true;
+}
+
+bool sqlite_create_actionrules(sqlite3* db) {
+    const char* createTableSQL = R"(
+        CREATE TABLE IF NOT EXISTS ActionRules (
+            seqnr INTEGER PRIMARY KEY AUTOINCREMENT,
+            active INTEGER NOT NULL,
+            profile INTEGER NOT NULL DEFAULT 0,
+            device INTEGER NOT NULL DEFAULT 0,
+            layer INTEGER NOT NULL DEFAULT 255,
+            trigger INTEGER NOT NULL,
+            code INTEGER NOT NULL,
+            edge INTEGER NOT NULL DEFAULT 0,
+            action INTEGER NOT NULL,
+            argument TEXT,
+            timestamp DATETIME DEFAULT CURRENT_TIMESTAMP
+        );
+    )";
+
+    char* errMsg = nullptr;
+    int rc = sqlite3_exec(db, createTableSQL, nullptr, nullptr, &errMsg);
+    if (rc != SQLITE_OK) {
+        std::string errorMessage = "SQL error: " + std::string(errMsg);
+        QLOG_ERROR("DB", "{}", errorMessage);
+        sqlite3_free(errMsg);
+        return false;
+    }
+    return true;
+}
+
+bool sqlite_get_actionrules(sqlite3* db, std::vector<QMKActionRule>& rules) {
+    const char* selectSQL = R"(
+        SELECT seqnr, active, profile, device, layer, trigger, code, edge, action, argument, timestamp
+        FROM ActionRules ORDER BY seqnr;
+    )";
+
+    sqlite3_stmt* stmt;
+    int rc = sqlite3_prepare_v2(db, selectSQL, -1, &stmt, nullptr);
+    if (rc != SQLITE_OK) {
+        QLOG_ERROR("DB", "Failed to prepare statement: {}", sqlite3_errmsg(db));
+        return false;
+    }
+    rules.clear();
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        QMKActionRule rule;
+        rule.seqnr = sqlite3_column_int(stmt, 0);
+        rule.active = sqlite3_column_int(stmt, 1) != 0;
+        rule.profile = static_cast<uint8_t>(sqlite3_column_int(stmt, 2));
+        rule.device = static_cast<uint32_t>(sqlite3_column_int(stmt, 3));
+        rule.layer = static_cast<uint8_t>(sqlite3_column_int(stmt, 4));
+        rule.trigger = static_cast<uint8_t>(sqlite3_column_int(stmt, 5));
+        rule.code = static_cast<uint16_t>(sqlite3_column_int(stmt, 6));
+        rule.edge = static_cast<uint8_t>(sqlite3_column_int(stmt, 7));
+        rule.action = static_cast<uint8_t>(sqlite3_column_int(stmt, 8));
+        const unsigned char* argument = sqlite3_column_text(stmt, 9);
+        rule.argument = argument ? reinterpret_cast<const char*>(argument) : "";
+        rule.timestamp = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 10));
+
+        rules.push_back(rule);
+    }
+
+    if (rc != SQLITE_DONE) {
+        QLOG_ERROR("DB", "Failed to retrieve data: {}", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return false;
+    }
+
+    sqlite3_finalize(stmt);
+    return true;
+}
+
+// rules with seqnr 0 are inserted and get their seqnr, the others are updated
+bool sqlite_add_update_actionrules(sqlite3* db, std::vector<QMKActionRule>& rules) {
+    const char* insertSQL = R"(
+        INSERT INTO ActionRules (active, profile, device, layer, trigger, code, edge, action, argument)
+        VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);
+    )";
+    const char* updateSQL = R"(
+        UPDATE ActionRules
+        SET active = ?, profile = ?, device = ?, layer = ?, trigger = ?, code = ?, edge = ?, action = ?, argument = ?,
+            timestamp = CURRENT_TIMESTAMP
+        WHERE seqnr = ?;
+    )";
+
+    sqlite3_stmt* insertStmt;
+    sqlite3_stmt* updateStmt;
+    if (sqlite3_prepare_v2(db, insertSQL, -1, &insertStmt, nullptr) != SQLITE_OK) {
+        QLOG_ERROR("DB", "Failed to prepare statement: {}", sqlite3_errmsg(db));
+        return false;
+    }
+    if (sqlite3_prepare_v2(db, updateSQL, -1, &updateStmt, nullptr) != SQLITE_OK) {
+        QLOG_ERROR("DB", "Failed to prepare statement: {}", sqlite3_errmsg(db));
+        sqlite3_finalize(insertStmt);
+        return false;
+    }
+
+    bool ok = true;
+    for (auto& rule : rules) {
+        sqlite3_stmt* stmt = rule.seqnr ? updateStmt : insertStmt;
+        sqlite3_bind_int(stmt, 1, rule.active ? 1 : 0);
+        sqlite3_bind_int(stmt, 2, rule.profile);
+        sqlite3_bind_int(stmt, 3, static_cast<int>(rule.device));
+        sqlite3_bind_int(stmt, 4, rule.layer);
+        sqlite3_bind_int(stmt, 5, rule.trigger);
+        sqlite3_bind_int(stmt, 6, rule.code);
+        sqlite3_bind_int(stmt, 7, rule.edge);
+        sqlite3_bind_int(stmt, 8, rule.action);
+        sqlite3_bind_text(stmt, 9, rule.argument.c_str(), -1, SQLITE_STATIC);
+        if (rule.seqnr)
+            sqlite3_bind_int(stmt, 10, static_cast<int>(rule.seqnr));
+
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            QLOG_ERROR("DB", "Failed to store action rule: {}", sqlite3_errmsg(db));
+            ok = false;
+            break;
+        }
+        if (!rule.seqnr)
+            rule.seqnr = static_cast<uint32_t>(sqlite3_last_insert_rowid(db));
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_finalize(insertStmt);
+    sqlite3_finalize(updateStmt);
+    return ok;
+}
+
 // Function to open the database and ensure the DeviceSupport table exists
 bool sqlite_database_open(std::shared_ptr<sqlite3>& db) {
 	if (_db == nullptr) {
 		auto localAppDataOpt = GetLocalAppDataFolder();
 		if (!localAppDataOpt) {
-			sqlite_log("Failed to get local app data folder");
+			QLOG_ERROR("DB", "Failed to get local app data folder");
 			return false;
 		}
         std::string dbPath = *localAppDataOpt + "/QMK/HIDTray/";
@@ -621,7 +844,7 @@ bool sqlite_database_open(std::shared_ptr<sqlite3>& db) {
 
 		int rc = sqlite3_open(dbPath.c_str(), &_db);
 		if (rc != SQLITE_OK) {
-			sqlite_log("Failed to open database: {}", sqlite3_errmsg(_db));
+			QLOG_ERROR("DB", "Failed to open database: {}", sqlite3_errmsg(_db));
 			return false;
 		}
 	}
@@ -632,15 +855,33 @@ bool sqlite_database_open(std::shared_ptr<sqlite3>& db) {
 
 	if (!sqlite_tableExists(db.get(), "Preferences")) {
 		if (!sqlite_create_preferences(db.get())) {
-			sqlite_log("Failed to create Preferences table");
+			QLOG_ERROR("DB", "Failed to create Preferences table");
 			return false;
 		}
 	}
+	// came with the action rules, databases from before get it here
+	if (!sqlite_columnExists(db.get(), "Preferences", "profile")
+		&& !executeSQL(db.get(), "ALTER TABLE Preferences ADD COLUMN profile INTEGER NOT NULL DEFAULT 0;")) {
+		QLOG_ERROR("DB", "Failed to add the profile to the Preferences table");
+		return false;
+	}
 	if (!sqlite_tableExists(db.get(), "DeviceSupport")) {
 		if (!sqlite_create_devicesupport(db.get())) {
-			sqlite_log("Failed to create DeviceSupport table");
+			QLOG_ERROR("DB", "Failed to create DeviceSupport table");
+			return false;
+		}
+	}
+	if (!sqlite_tableExists(db.get(), "Keymap")) {
+		if (!sqlite_create_keymap(db.get())) {
+			QLOG_ERROR("DB", "Failed to create Keymap table");
+			return false;
+		}
+	}
+	if (!sqlite_tableExists(db.get(), "ActionRules")) {
+		if (!sqlite_create_actionrules(db.get())) {
+			QLOG_ERROR("DB", "Failed to create ActionRules table");
 			return false;
 		}
 	}
     return true;
-}
\ No newline at end of file
+}
@@ -6,6 +6,8 @@
 #include <format> // For std::
 #include <string>
 #include "hidex.h"
+#include "qmkkeymap.h"
+#include "qmkaction.h"
 #include "sqlite/sqlite3.h"
 
 
@@ -15,10 +17,10 @@ struct CreateTableResult {
 };
 
 // Function declarations
-void sqlite_log(const std::string& format_str, auto&&... args);
 bool sqlite_database_open(std::shared_ptr<sqlite3>& db);
 bool executeSQL(sqlite3* db, const char* sql);
 bool sqlite_tableExists(sqlite3* db, const std::string& tableName);
+bool sqlite_columnExists(sqlite3* db, const std::string& tableName, const std::string& columnName);
 bool sqlite_create_devicesupport(sqlite3* db);
 
 bool sqlite_create_preferences(sqlite3* db);
@@ -30,4 +32,14 @@ int sqlite_tableCount(sqlite3* db, const std::string& tableName);
 bool sqlite_store_devicesupport(sqlite3* db, const std::vector<DeviceSupport>& devices);
 bool sqlite_get_devicesupport(sqlite3* db, std::vector<DeviceSupport>& devices);
 bool sqlite_update_devicesupport(sqlite3* db, const std::vector<DeviceSupport>& devices);
-bool sqlite_add_update_devicesupport(sqlite3* db, const std::vector<DeviceSupport>& devices);
\ No newline at end of file
+bool sqlite_add_update_devicesupport(sqlite3* db, const std::vector<DeviceSupport>& devices);
+
+// keymaps by serial_number and firmware version (DeviceSupport.sernbr)
+bool sqlite_create_keymap(sqlite3* db);
+bool sqlite_get_keymap(sqlite3* db, const std::string& serial_number, uint16_t sernbr, QMKKeymap& keymap);
+bool sqlite_store_keymap(sqlite3* db, const std::string& serial_number, uint16_t sernbr, const QMKKeymap& keymap);
+
+// host actions for key, layer and button events, see qmkaction.h
+bool sqlite_create_actionrules(sqlite3* db);
+bool sqlite_get_actionrules(sqlite3* db, std::vector<QMKActionRule>& rules);
+bool sqlite_add_update_actionrules(sqlite3* db, std::vector<QMKActionRule>& rules);
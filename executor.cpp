@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <vector>
+#include "executor.h"
+#include "log.h"
+
+typedef struct _ExecutorWorker {
+    std::mutex lock;
+    std::deque<ExecutorTask> tasks; // the owner takes the back, thieves the front
+    std::jthread thread;
+} ExecutorWorker;
+
+static struct {
+    std::vector<std::unique_ptr<ExecutorWorker>> workers;
+    std::atomic<bool> running;
+    std::atomic<uint32_t> next;     // round robin for submits from outside
+    std::atomic<int64_t> pending;   // queued on any worker
+    std::atomic<uint32_t> sleepers;
+    std::mutex sleepLock;
+    std::condition_variable_any wake;
+
+    std::mutex uiLock;
+    std::vector<ExecutorTask> uiTasks;
+    std::atomic<bool> uiSignaled;   // a wakeup is on its way to the UI thread
+    void (*uiWake)(void* context);
+    void* uiContext;
+
+    std::atomic<uint64_t> submitted;
+    std::atomic<uint64_t> executed;
+    std::atomic<uint64_t> stolen;
+    std::atomic<uint64_t> inlined;
+    std::atomic<uint64_t> uiPosted;
+    std::atomic<uint64_t> uiRuns;
+} _executor;
+
+static thread_local int _workerIndex = -1;
+
+static void executor_run(ExecutorTask& task) {
+    try {
+        task();
+    }
+    catch (const std::exception& e) {
+        QLOG_ERROR("EXEC", "Task failed: {}\n", e.what());
+    }
+}
+
+static bool executor_take(size_t index, ExecutorTask& task) {
+    ExecutorWorker& own = *_executor.workers[index];
+    {
+        std::lock_guard guard(own.lock);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    size_t count = _executor.workers.size();
+    for (size_t i = 1; i < count; i++) {
+        ExecutorWorker& victim = *_executor.workers[(index + i) % count];
+        std::lock_guard guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            _executor.stolen.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void executor_worker_func(std::stop_token stop, size_t index) {
+    _workerIndex = static_cast<int>(index);
+    while (!stop.stop_requested()) {
+        ExecutorTask task;
+        if (executor_take(index, task)) {
+            _executor.pending.fetch_sub(1, std::memory_order_relaxed);
+            executor_run(task);
+            _executor.executed.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        std::unique_lock lock(_executor.sleepLock);
+        // seq_cst against executor_submit: either it sees a sleeper or we see its task
+        _executor.sleepers.fetch_add(1, std::memory_order_seq_cst);
+        _executor.wake.wait(lock, stop, [] { return _executor.pending.load(std::memory_order_seq_cst) > 0; });
+        _executor.sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+bool executor_start(uint32_t threads, void (*uiWake)(void* context), void* uiContext) {
+    if (_executor.running.load(std::memory_order_acquire))
+        return true;
+    if (threads == 0)
+        threads = std::max(2u, std::thread::hardware_concurrency());
+    threads = std::min<uint32_t>(threads, EXECUTOR_MAX_THREADS);
+    _executor.uiWake = uiWake;
+    _executor.uiContext = uiContext;
+    _executor.workers.clear();
+    for (uint32_t i = 0; i < threads; i++) {
+        _executor.workers.push_back(std::make_unique<ExecutorWorker>());
+    }
+    _executor.running.store(true, std::memory_order_release);
+    for (uint32_t i = 0; i < threads; i++) {
+        _executor.workers[i]->thread = std::jthread(executor_worker_func, i);
+    }
+    return true;
+}
+
+void executor_stop() {
+    if (!_executor.running.exchange(false, std::memory_order_acq_rel))
+        return;
+    for (auto& worker : _executor.workers) {
+        worker->thread.request_stop();
+    }
+    for (auto& worker : _executor.workers) {
+        worker->thread = {};
+    }
+    for (auto& worker : _executor.workers) {
+        for (auto& task : worker->tasks) {
+            executor_run(task);
+            _executor.inlined.fetch_add(1, std::memory_order_relaxed);
+        }
+        worker->tasks.clear();
+    }
+    _executor.pending.store(0, std::memory_order_relaxed);
+}
+
+void executor_submit(ExecutorTask task) {
+    _executor.submitted.fetch_add(1, std::memory_order_relaxed);
+    if (!_executor.running.load(std::memory_order_acquire)) {
+        _executor.inlined.fetch_add(1, std::memory_order_relaxed);
+        executor_run(task);
+        return;
+    }
+    size_t count = _executor.workers.size();
+    size_t index = (_workerIndex >= 0) ? static_cast<size_t>(_workerIndex)
+        : _executor.next.fetch_add(1, std::memory_order_relaxed) % count;
+    {
+        ExecutorWorker& worker = *_executor.workers[index];
+        std::lock_guard guard(worker.lock);
+        worker.tasks.push_back(std::move(task));
+    }
+    _executor.pending.fetch_add(1, std::memory_order_seq_cst);
+    if (_executor.sleepers.load(std::memory_order_seq_cst) > 0) {
+        { std::lock_guard guard(_executor.sleepLock); } // a sleeper between its check and its wait gets the notify
+        _executor.wake.notify_one();
+    }
+}
+
+void executor_post_ui(ExecutorTask task) {
+    {
+        std::lock_guard guard(_executor.uiLock);
+        _executor.uiTasks.push_back(std::move(task));
+    }
+    _executor.uiPosted.fetch_add(1, std::memory_order_relaxed);
+    if (!_executor.uiSignaled.exchange(true, std::memory_order_acq_rel) && _executor.uiWake)
+        _executor.uiWake(_executor.uiContext);
+}
+
+size_t executor_run_ui() {
+    static std::vector<ExecutorTask> tasks; // UI thread only
+    _executor.uiSignaled.store(false, std::memory_order_release);
+    {
+        std::lock_guard guard(_executor.uiLock);
+        tasks.swap(_executor.uiTasks);
+    }
+    for (auto& task : tasks) {
+        executor_run(task);
+    }
+    size_t count = tasks.size();
+    tasks.clear();
+    if (count)
+        _executor.uiRuns.fetch_add(1, std::memory_order_relaxed);
+    return count;
+}
+
+ExecutorStats executor_stats() {
+    ExecutorStats stats;
+    stats.submitted = _executor.submitted.load(std::memory_order_relaxed);
+    stats.executed = _executor.executed.load(std::memory_order_relaxed);
+    stats.stolen = _executor.stolen.load(std::memory_order_relaxed);
+    stats.inlined = _executor.inlined.load(std::memory_order_relaxed);
+    stats.uiPosted = _executor.uiPosted.load(std::memory_order_relaxed);
+    stats.uiRuns = _executor.uiRuns.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void executor_log_stats() {
+    ExecutorStats stats = executor_stats();
+    QLOG_INFO("EXEC", "{} submitted, {} executed, {} stolen, {} inline, {} UI tasks in {} runs\n",
+        stats.submitted, stats.executed, stats.stolen, stats.inlined, stats.uiPosted, stats.uiRuns);
+}
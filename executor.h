@@ -0,0 +1,43 @@
+#pragma once
+
+// Shared worker threads for short tasks off the read threads, and a queue of
+// tasks which must run on the UI thread.
+//
+// Every worker owns a deque: a task submitted from a worker goes to its own
+// deque and is taken from the back (newest first, still warm), other tasks
+// are spread round robin. A worker whose deque is empty steals the oldest
+// task of another one before it sleeps.
+//
+// UI tasks are collected in one list, the first one after a run calls the
+// wake function (PostMessage on Windows) and executor_run_ui runs them all
+// in the order they were posted.
+//
+// Before executor_start and after executor_stop a submitted task runs at once
+// on the calling thread.
+
+#include <stdint.h>
+#include <functional>
+
+#define EXECUTOR_MAX_THREADS 16
+
+typedef std::function<void()> ExecutorTask;
+
+typedef struct _ExecutorStats {
+    uint64_t submitted;
+    uint64_t executed; // on a worker
+    uint64_t stolen;   // taken from another worker's deque
+    uint64_t inlined;  // run by the caller, the pool wasn't running
+    uint64_t uiPosted;
+    uint64_t uiRuns;   // executor_run_ui calls with at least one task
+} ExecutorStats;
+
+// threads 0 picks one per core, up to EXECUTOR_MAX_THREADS
+bool executor_start(uint32_t threads, void (*uiWake)(void* context), void* uiContext);
+// runs what is still queued on the calling thread, then stops the workers
+void executor_stop();
+void executor_submit(ExecutorTask task);
+void executor_post_ui(ExecutorTask task);
+// UI thread, returns the number of tasks run
+size_t executor_run_ui();
+ExecutorStats executor_stats();
+void executor_log_stats();
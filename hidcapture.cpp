@@ -0,0 +1,225 @@
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include "hidex.h"
+#include "hidtransport.h"
+#include "hidcapture.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// The recorder appends through one buffered FILE, records of the reactor and
+// of writing threads are serialized by the lock. Without a capture running the
+// hot path is one relaxed load.
+typedef struct _HIDCapture {
+    std::atomic<bool> active;
+    std::mutex lock;
+    FILE* file;
+    std::chrono::steady_clock::time_point started;
+    std::map<std::string, uint16_t> devices; // by device path, stays the same across reconnects
+} HIDCapture;
+
+static HIDCapture _capture;
+
+bool hid_capture_start(const std::string& path) {
+    std::lock_guard guard(_capture.lock);
+    if (_capture.file)
+        return false;
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        QLOG_ERROR("HID", "Capture file {} can't be created\n", path);
+        return false;
+    }
+    HIDCaptureHeader header = {};
+    memcpy(header.magic, HID_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = HID_CAPTURE_VERSION;
+    header.started = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        return false;
+    }
+    _capture.file = file;
+    _capture.started = std::chrono::steady_clock::now();
+    _capture.devices.clear();
+    _capture.active = true;
+    return true;
+}
+
+void hid_capture_stop() {
+    std::lock_guard guard(_capture.lock);
+    _capture.active = false;
+    if (_capture.file) {
+        fclose(_capture.file);
+        _capture.file = nullptr;
+    }
+}
+
+static void hid_capture_write(uint64_t time, uint16_t device, HIDCaptureDirection direction,
+    const void* payload, uint32_t length, const void* extra = nullptr, uint32_t extraLength = 0) {
+    HIDCaptureRecord record = {};
+    record.time = time;
+    record.device = device;
+    record.direction = static_cast<uint8_t>(direction);
+    record.length = length + extraLength;
+    fwrite(&record, sizeof(record), 1, _capture.file);
+    fwrite(payload, 1, length, _capture.file);
+    if (extraLength)
+        fwrite(extra, 1, extraLength, _capture.file);
+}
+
+void hid_capture_record(HID& hid, HIDCaptureDirection direction, std::span<const uint8_t> data,
+    std::chrono::steady_clock::time_point timestamp) {
+    if (!_capture.active.load(std::memory_order_relaxed))
+        return;
+    std::lock_guard guard(_capture.lock);
+    if (!_capture.file)
+        return;
+    auto since = timestamp - _capture.started;
+    uint64_t time = since.count() > 0 ? std::chrono::duration_cast<std::chrono::microseconds>(since).count() : 0;
+
+    auto it = _capture.devices.find(hid.info.devname);
+    if (it == _capture.devices.end()) {
+        uint16_t id = static_cast<uint16_t>(_capture.devices.size());
+        it = _capture.devices.emplace(hid.info.devname, id).first;
+        HIDCaptureDevice device = { hid.info.vid, hid.info.pid, hid.info.sernr, hid.inEplength, hid.outEplength };
+        hid_capture_write(time, id, HID_CAPTURE_DEVICE, &device, sizeof(device),
+            hid.info.devname.data(), static_cast<uint32_t>(hid.info.devname.size()));
+    }
+    hid_capture_write(time, it->second, direction, data.data(), static_cast<uint32_t>(data.size()));
+}
+
+static std::shared_ptr<void> hid_replay_map(const std::string& path, const uint8_t*& data, size_t& size) {
+#ifdef _WIN32
+    HANDLE file = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return nullptr;
+    LARGE_INTEGER fileSize = {};
+    GetFileSizeEx(file, &fileSize);
+    HANDLE mapping = fileSize.QuadPart ? CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    CloseHandle(file);
+    if (!mapping)
+        return nullptr;
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view)
+        return nullptr;
+    data = static_cast<const uint8_t*>(view);
+    size = static_cast<size_t>(fileSize.QuadPart);
+    return std::shared_ptr<void>(view, [](void* view) { UnmapViewOfFile(view); });
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    struct stat st = {};
+    fstat(fd, &st);
+    void* view = st.st_size ? mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (view == MAP_FAILED)
+        return nullptr;
+    size_t length = static_cast<size_t>(st.st_size);
+    data = static_cast<const uint8_t*>(view);
+    size = length;
+    return std::shared_ptr<void>(view, [length](void* view) { munmap(view, length); });
+#endif
+}
+
+// walks the records, false at the end or on a truncated record
+static bool hid_replay_next(const HIDReplay& replay, size_t& offset, HIDCaptureRecord& record, const uint8_t*& payload) {
+    if (replay.size - offset < sizeof(record))
+        return false;
+    memcpy(&record, replay.data + offset, sizeof(record));
+    if (replay.size - offset - sizeof(record) < record.length)
+        return false;
+    payload = replay.data + offset + sizeof(record);
+    offset += sizeof(record) + record.length;
+    return true;
+}
+
+bool hid_replay_open(HIDReplay& replay, const std::string& path) {
+    replay = {};
+    replay.mapping = hid_replay_map(path, replay.data, replay.size);
+    if (!replay.mapping) {
+        QLOG_ERROR("HID", "Replay file {} can't be mapped\n", path);
+        return false;
+    }
+    HIDCaptureHeader header;
+    if (replay.size < sizeof(header)) {
+        hid_replay_close(replay);
+        return false;
+    }
+    memcpy(&header, replay.data, sizeof(header));
+    if (memcmp(header.magic, HID_CAPTURE_MAGIC, sizeof(header.magic)) != 0 || header.version != HID_CAPTURE_VERSION) {
+        QLOG_ERROR("HID", "{} is no capture file\n", path);
+        hid_replay_close(replay);
+        return false;
+    }
+
+    size_t offset = sizeof(header);
+    HIDCaptureRecord record;
+    const uint8_t* payload;
+    while (hid_replay_next(replay, offset, record, payload)) {
+        if (record.direction != HID_CAPTURE_DEVICE || record.length < sizeof(HIDCaptureDevice))
+            continue;
+        HIDCaptureDevice device;
+        memcpy(&device, payload, sizeof(device));
+        // never opened, the HID only describes the captured device
+        auto hid = std::make_shared<HID>();
+        hid->handle = HID_INVALID_HANDLE;
+        hid->inEplength = device.inEplength;
+        hid->outEplength = device.outEplength;
+        hid->info.vid = device.vid;
+        hid->info.pid = device.pid;
+        hid->info.sernr = device.sernr;
+        hid->info.devname.assign(reinterpret_cast<const char*>(payload) + sizeof(device), record.length - sizeof(device));
+        hid->port = hid->info.devname;
+        if (replay.devices.size() <= record.device)
+            replay.devices.resize(record.device + 1);
+        replay.devices[record.device] = hid;
+    }
+    return true;
+}
+
+HIDReplayStats hid_replay_run(HIDReplay& replay, HIDReadCallback callback, void* userData, bool realtime, std::stop_token stop) {
+    HIDReplayStats stats = {};
+    auto started = std::chrono::steady_clock::now();
+    size_t offset = sizeof(HIDCaptureHeader);
+    HIDCaptureRecord record;
+    const uint8_t* payload;
+    while (!stop.stop_requested() && hid_replay_next(replay, offset, record, payload)) {
+        if (record.direction == HID_CAPTURE_OUT)
+            stats.written++;
+        if (record.direction != HID_CAPTURE_IN)
+            continue;
+        if (record.device >= replay.devices.size() || !replay.devices[record.device])
+            continue;
+        auto due = started + std::chrono::microseconds(record.time);
+        if (realtime)
+            std::this_thread::sleep_until(due);
+        // lent from the mapping, hid_report_retain copies it like an exhausted pool
+        HIDReport report = {};
+        report.data = std::span<const uint8_t>(payload, record.length);
+        report.timestamp = realtime ? due : std::chrono::steady_clock::now();
+        void* deviceData = (record.device < replay.userData.size()) ? replay.userData[record.device] : userData;
+        callback(*replay.devices[record.device], report, deviceData);
+        stats.reports++;
+        stats.bytes += record.length;
+    }
+    stats.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+    return stats;
+}
+
+void hid_replay_close(HIDReplay& replay) {
+    replay.devices.clear();
+    replay.userData.clear();
+    replay.mapping.reset();
+    replay.data = nullptr;
+    replay.size = 0;
+}
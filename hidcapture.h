@@ -0,0 +1,80 @@
+#pragma once
+
+// Capture of the raw report stream into an append-only binary file and replay
+// of such a file through a read callback, without the devices.
+//
+// File layout, little endian:
+//   HIDCaptureHeader
+//   HIDCaptureRecord + length bytes, repeated
+// A device is announced by a HID_CAPTURE_DEVICE record (HIDCaptureDevice +
+// device path) before its first report, later records refer to it by id.
+
+#include <stdint.h>
+#include <chrono>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+#include <stop_token>
+#include "hidex.h"
+
+#define HID_CAPTURE_MAGIC "QHCAP1"
+#define HID_CAPTURE_VERSION 1
+
+typedef enum _HIDCaptureDirection {
+    HID_CAPTURE_IN = 0,     // report read from the device
+    HID_CAPTURE_OUT = 1,    // report written to the device
+    HID_CAPTURE_DEVICE = 2, // device announcement, HIDCaptureDevice + path
+} HIDCaptureDirection;
+
+#pragma pack(push, 1)
+typedef struct _HIDCaptureHeader {
+    char magic[6];    // HID_CAPTURE_MAGIC without the terminating 0
+    uint16_t version;
+    int64_t started;  // ms since the unix epoch, informational
+} HIDCaptureHeader;
+
+typedef struct _HIDCaptureRecord {
+    uint64_t time;     // us since the capture started
+    uint16_t device;   // id from the device's HID_CAPTURE_DEVICE record
+    uint8_t direction; // HIDCaptureDirection
+    uint8_t reserved;
+    uint32_t length;   // bytes following the record
+} HIDCaptureRecord;
+
+typedef struct _HIDCaptureDevice {
+    uint16_t vid;
+    uint16_t pid;
+    uint16_t sernr;
+    uint16_t inEplength;
+    uint16_t outEplength;
+} HIDCaptureDevice;
+#pragma pack(pop)
+
+bool hid_capture_start(const std::string& path);
+void hid_capture_stop();
+// called by the hid layer for every report, returns at once while no capture runs
+void hid_capture_record(HID& hid, HIDCaptureDirection direction, std::span<const uint8_t> data,
+    std::chrono::steady_clock::time_point timestamp);
+
+typedef struct _HIDReplayStats {
+    uint64_t reports;  // reports handed to the callback
+    uint64_t written;  // captured writes, skipped
+    uint64_t bytes;
+    std::chrono::microseconds elapsed;
+} HIDReplayStats;
+
+typedef struct _HIDReplay {
+    const uint8_t* data; // the mapped file
+    size_t size;
+    std::vector<std::shared_ptr<HID>> devices; // by device id, set up by hid_replay_open
+    std::vector<void*> userData;               // by device id, optional, replaces hid_replay_run's userData
+    std::shared_ptr<void> mapping;             // unmaps the file
+} HIDReplay;
+
+// maps the file and creates a HID for every device in it, without opening anything
+bool hid_replay_open(HIDReplay& replay, const std::string& path);
+// hands every captured read to the callback, in the original timing or as fast as possible
+HIDReplayStats hid_replay_run(HIDReplay& replay, HIDReadCallback callback, void* userData, bool realtime,
+    std::stop_token stop = {});
+void hid_replay_close(HIDReplay& replay);
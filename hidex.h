@@ -1,15 +1,32 @@
 #ifndef HIDHELPER_H
 #define HIDHELPER_H
 
+#ifdef _WIN32
 #include <windows.h>
 #include <setupapi.h>
 #include <hidsdi.h>
 #include <hidpi.h>
+#endif
+#include <stdint.h>
+#include <string>
 #include <vector>
 #include <iostream>
 #include <chrono>
 #include <optional>
 #include <thread>
+#include <memory>
+#include <span>
+#include <future>
+#include <functional>
+#include <stop_token>
+
+#ifdef _WIN32
+typedef HANDLE hid_handle_t;
+#define HID_INVALID_HANDLE INVALID_HANDLE_VALUE
+#else
+typedef int hid_handle_t; // file descriptor of /dev/hidrawN
+#define HID_INVALID_HANDLE (-1)
+#endif
 
 typedef struct _HIDATTRIBUTE {
     uint16_t vid;
@@ -18,14 +35,31 @@ typedef struct _HIDATTRIBUTE {
     std::string devname;
 } HIDATTRIBUTE;
 
+// number of reads kept posted on a device, reports arriving while the
+// callback runs land in one of the other buffers instead of the kernel queue
+#define HID_READ_RING_SIZE 8
+// report buffers per device on top of the ring, used for reports which are
+// on loan to the callback or kept with hid_report_retain (max 64 in total)
+#define HID_POOL_SPARES 8
+
+struct _HIDReadRing;
+struct _HIDTransport;
+struct _HIDBufferPool;
+struct _HIDWriter;
+
+// default time a write may take, including the time it waits behind other writes
+#define HID_WRITE_TIMEOUT_MS 1000
+
 typedef struct _HID {
-    HANDLE handle;
-    uint16_t inEplength;
-    uint16_t outEplength;
+    hid_handle_t handle;
+    uint16_t inEplength;  // including the report id byte
+    uint16_t outEplength; // including the report id byte
     HIDATTRIBUTE info;
     std::optional<std::string> port;
-    std::shared_ptr<std::jthread> readThread;
-    std::shared_ptr<HANDLE> stopReadEvent;
+    std::shared_ptr<struct _HIDReadRing> readRing; // read state owned by the transport, see hid_read
+    const struct _HIDTransport* transport; // backend which opened the device
+    std::shared_ptr<struct _HIDBufferPool> pool; // report buffers, created by the transport on open
+    std::shared_ptr<struct _HIDWriter> writer; // queue behind hid_write_async
 } HID;
 
 typedef struct _Support {
@@ -40,21 +74,88 @@ typedef struct _Support {
 	std::string serial_number; // serial number e.g. DE631822C78142210000000000000000
     std::string manufactor;
     std::string product;
-    std::string dev; // e.g. \\?\HID#VID_35EE&PID_1308&MI_01#a&55b843f&0&0000#{4d1e55b2-f16f-11cf-88cb-001111000030}
+    std::string dev; // e.g. \\?\HID#VID_35EE&PID_1308&MI_01#a&55b843f&0&0000#{4d1e55b2-f16f-11cf-88cb-001111000030} or /dev/hidraw3
     std::string timestamp; // format e.g. "2025-03-19 23:09:13"
 }DeviceSupport;
 
-typedef void (*HIDReadCallback)(HID& hid, const std::vector<BYTE>& data, void* userData);
+// A report on loan to the read callback. data points into a buffer of the
+// device's pool which goes back to the pool when the callback returns.
+typedef struct _HIDReport {
+    std::span<const uint8_t> data; // including the report id byte
+    struct _HIDBufferPool* pool;
+    uint32_t index;  // buffer in the pool
+    bool pooled;     // the read slot already got another buffer, this one can be handed out
+    bool retained;
+    std::chrono::steady_clock::time_point timestamp; // when the read completed, for latency measurements
+} HIDReport;
+
+// Keeps the bytes of a report after the callback, see hid_report_retain.
+class HIDReportBuffer {
+public:
+    HIDReportBuffer() = default;
+    HIDReportBuffer(HIDReportBuffer&& other) noexcept;
+    HIDReportBuffer& operator=(HIDReportBuffer&& other) noexcept;
+    ~HIDReportBuffer();
+
+    std::span<const uint8_t> data() const { return bytes; }
+    size_t size() const { return bytes.size(); }
+
+private:
+    friend HIDReportBuffer hid_report_retain(HIDReport& report);
+    std::shared_ptr<struct _HIDBufferPool> pool;
+    uint32_t index = 0;
+    std::unique_ptr<uint8_t[]> copy; // only if the pool had no buffer to spare
+    std::span<const uint8_t> bytes;
+};
+
+typedef struct _HIDPoolStats {
+    uint32_t buffers;
+    uint32_t free;
+    uint64_t heapCopies; // hid_report_retain calls which had to allocate
+} HIDPoolStats;
+
+typedef void (*HIDReadCallback)(HID& hid, HIDReport& report, void* userData);
+
+typedef enum _HIDWriteStatus {
+    HID_WRITE_OK = 0,
+    HID_WRITE_FAILED,
+    HID_WRITE_TIMEOUT,
+    HID_WRITE_CANCELLED,
+    HID_WRITE_DISCONNECTED, // the device was closed before the write could run
+} HIDWriteStatus;
+
+typedef struct _HIDWriteOptions {
+    std::chrono::milliseconds timeout = std::chrono::milliseconds(HID_WRITE_TIMEOUT_MS);
+    std::stop_token stop; // cancels the write while it is queued or running
+    std::function<void(HIDWriteStatus)> done; // optional, runs on the thread which wrote it, see hid_write_async
+} HIDWriteOptions;
+
+// Takes the buffer of a report out of the pool until the returned object is
+// destroyed. Only allocates if all spare buffers are retained already.
+HIDReportBuffer hid_report_retain(HIDReport& report);
+HIDPoolStats hid_pool_stats(HID& hid);
 
 const std::string hid_error(HID& hid);
 void hid_close(HID& hid);
-bool hid_connect(HID& hid, std::string devname, HIDReadCallback callback);
-bool hid_read(HID& hid, std::vector<BYTE>& data);
+// with a callback the device is read by the transport's reactor thread,
+// without one the caller pulls the reports with hid_read. userData comes
+// back with every report.
+bool hid_connect(HID& hid, std::string devname, HIDReadCallback callback, void* userData = nullptr);
+// hands a device opened without a callback to the reactor, e.g. once everything
+// the callback looks at is set up
+bool hid_attach(HID& hid, HIDReadCallback callback, void* userData = nullptr);
+// timestamp, if given, gets the time the read completed
+bool hid_read(HID& hid, std::vector<uint8_t>& data, std::chrono::steady_clock::time_point* timestamp = nullptr);
 bool hid_open_list(std::vector<DeviceSupport>& toopen, const std::vector<DeviceSupport>& supported);
 
-bool hid_write(HID& hid, const std::vector<BYTE>& data);
+// blocks the caller until the report is written or HID_WRITE_TIMEOUT_MS passed
+bool hid_write(HID& hid, const std::vector<uint8_t>& data);
+// Queues the report on the device's writer and returns at once. Writes of one
+// device run in submission order on the reactor thread, on Linux on a write
+// thread per device; any thread may submit. Needs a device connected with a
+// read callback.
+std::future<HIDWriteStatus> hid_write_async(HID& hid, std::span<const uint8_t> data, HIDWriteOptions options = {});
 void hid_caps(HID &hid);
 
 
 #endif // HIDHELPER_H
-
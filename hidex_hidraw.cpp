@@ -0,0 +1,574 @@
+#include <optional>
+#include <format> // For std::
+#include <thread>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
+#include "hidex.h"
+#include "hidtransport.h"
+#include "hidcapture.h"
+
+// Linux backend: /dev/hidrawN opened non-blocking, reads are dispatched by one
+// epoll reactor for all devices. hidraw writes are synchronous, so every
+// attached device writes its queue on a thread of its own. Report lengths come
+// from the report descriptor.
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/hidraw.h>
+
+// hidraw keeps its own report queue per open file, so reads go into a single
+// pool buffer which is swapped for a free one when a report is lent out.
+// Reports are handed out like on Windows: the first byte is the report id, 0
+// for devices which don't number their reports.
+typedef struct _HIDReadRing {
+    uint32_t buffer; // index in hid.pool
+    bool reportIds; // the device numbers its reports, read() already returns the id
+    int stopEvent = -1; // eventfd, wakes up a blocking hid_read
+    HID* hid;
+    HIDReadCallback callback;
+    void* userData;
+    std::shared_ptr<HIDWriter> writer;
+    int writeKick = -1; // eventfd, wakes up the write thread
+    int writeCancel = -1; // eventfd, wakes up the running write to look at its stop token
+    std::jthread writeThread; // runs the writer's queue, see hid_writer_func_thread
+    std::atomic<bool> closing;
+
+    ~_HIDReadRing() {
+        if (stopEvent >= 0)
+            ::close(stopEvent);
+        if (writeKick >= 0)
+            ::close(writeKick);
+        if (writeCancel >= 0)
+            ::close(writeCancel);
+    }
+} HIDReadRing;
+
+// All devices with a read callback share one epoll set and one dispatch thread,
+// which keeps the callbacks of one device in report order.
+typedef struct _HIDReactor {
+    int epfd = -1;
+    int wakeup = -1; // eventfd registered with a null pointer, interrupts epoll_wait
+    std::atomic<bool> quit;
+    std::atomic<uint64_t> epoch; // advanced after every dispatched batch
+    std::jthread thread;
+    std::once_flag started;
+
+    ~_HIDReactor() {
+        if (epfd >= 0) {
+            quit = true;
+            eventfd_write(wakeup, 1);
+            if (thread.joinable())
+                thread.join();
+            ::close(wakeup);
+            ::close(epfd);
+        }
+    }
+} HIDReactor;
+
+static HIDReactor _reactor;
+static thread_local bool _onReactor = false;
+// rings closed from a callback, the current batch may still point at them
+static std::vector<std::shared_ptr<HIDReadRing>> _closedInBatch;
+
+static std::string hidraw_error(HID& hid) {
+    (void)hid; // errno is per thread, the device has no error state of its own
+    return std::string(strerror(errno));
+}
+
+static std::string hidraw_sysfs_read(const std::string& path) {
+    std::ifstream file(path);
+    std::string value;
+    std::getline(file, value);
+    return value;
+}
+
+// Walks the short items of the report descriptor and adds up Report Size x
+// Report Count of the Input and Output main items per report id. Returns the
+// longest report of each direction in bytes, without the report id byte.
+static bool hidraw_descriptor_lengths(int fd, uint16_t& inBytes, uint16_t& outBytes, bool& reportIds) {
+    int size = 0;
+    if (ioctl(fd, HIDIOCGRDESCSIZE, &size) < 0)
+        return false;
+    hidraw_report_descriptor rpt = {};
+    rpt.size = static_cast<uint32_t>(size);
+    if (ioctl(fd, HIDIOCGRDESC, &rpt) < 0)
+        return false;
+
+    std::array<uint32_t, 256> inBits = {};
+    std::array<uint32_t, 256> outBits = {};
+    uint32_t reportSize = 0, reportCount = 0;
+    uint8_t reportId = 0;
+    reportIds = false;
+
+    for (uint32_t i = 0; i < rpt.size; ) {
+        uint8_t prefix = rpt.value[i];
+        if (prefix == 0xFE) { // long item, data size in the next byte
+            if (i + 1 >= rpt.size)
+                break;
+            i += 3 + rpt.value[i + 1];
+            continue;
+        }
+        uint32_t len = prefix & 0x03;
+        if (len == 3)
+            len = 4;
+        if (i + 1 + len > rpt.size)
+            break;
+        uint32_t value = 0;
+        for (uint32_t j = 0; j < len; j++) {
+            value |= static_cast<uint32_t>(rpt.value[i + 1 + j]) << (8 * j);
+        }
+        switch (prefix & 0xFC) {
+        case 0x74: reportSize = value; break;                                  // Report Size
+        case 0x94: reportCount = value; break;                                 // Report Count
+        case 0x84: reportId = static_cast<uint8_t>(value); reportIds = true; break; // Report ID
+        case 0x80: inBits[reportId] += reportSize * reportCount; break;         // Input
+        case 0x90: outBits[reportId] += reportSize * reportCount; break;        // Output
+        }
+        i += 1 + len;
+    }
+
+    uint32_t maxIn = 0, maxOut = 0;
+    for (size_t id = 0; id < inBits.size(); id++) {
+        maxIn = std::max(maxIn, inBits[id]);
+        maxOut = std::max(maxOut, outBits[id]);
+    }
+    inBytes = static_cast<uint16_t>((maxIn + 7) / 8);
+    outBytes = static_cast<uint16_t>((maxOut + 7) / 8);
+    return true;
+}
+
+static void hidraw_caps(HID& hid) {
+    uint16_t inBytes = 0, outBytes = 0;
+    bool reportIds = false;
+    if (!hidraw_descriptor_lengths(hid.handle, inBytes, outBytes, reportIds)) {
+        QLOG_ERROR("HID", "HIDIOCGRDESC failed with error: {}\n", hidraw_error(hid));
+        return;
+    }
+    // same as HIDP_CAPS on Windows: the lengths include the report id byte
+    hid.inEplength = inBytes + 1;
+    hid.outEplength = outBytes + 1;
+}
+
+static bool hidraw_owns(const std::string& devname) {
+    return devname.starts_with("/dev/hidraw");
+}
+
+static void hidraw_list(std::vector<DeviceSupport>& system, const std::vector<DeviceSupport>& supported) {
+    DIR* dir = opendir("/sys/class/hidraw");
+    if (!dir)
+        return;
+
+    QLOG_DEBUG("HID", "{} ...........................................  \n", __FUNCTION__);
+
+    while (dirent* entry = readdir(dir)) {
+        if (strncmp(entry->d_name, "hidraw", 6) != 0)
+            continue;
+        // device/ is the hid device, its parent the usb interface and above that the usb device
+        std::string sysdev = std::string("/sys/class/hidraw/") + entry->d_name + "/device/";
+
+        std::ifstream uevent(sysdev + "uevent");
+        std::string line, uniq;
+        unsigned int bus = 0, vid = 0, pid = 0;
+        while (std::getline(uevent, line)) {
+            if (line.starts_with("HID_ID="))
+                sscanf(line.c_str() + 7, "%x:%x:%x", &bus, &vid, &pid); // e.g. 0003:000035EE:00001308
+            else if (line.starts_with("HID_UNIQ="))
+                uniq = line.substr(9);
+        }
+
+        auto it = std::find_if(supported.begin(), supported.end(), [vid, pid](const DeviceSupport& supp) {
+            return vid == supp.vid && pid == supp.pid;
+            });
+        if (it == supported.end())
+            continue;
+
+        std::string ifnum = hidraw_sysfs_read(sysdev + "../bInterfaceNumber");
+        std::string mi = ifnum.empty() ? std::string() : "&MI_" + ifnum;
+        // every usb interface has a number on Linux, an empty iface accepts all of them
+        if (!it->iface.empty() && it->iface != mi)
+            continue;
+
+        DeviceSupport fSupport = *it;
+        fSupport.serial_number = uniq;
+        fSupport.manufactor = hidraw_sysfs_read(sysdev + "../../manufacturer");
+        fSupport.product = hidraw_sysfs_read(sysdev + "../../product");
+        fSupport.sernbr = static_cast<uint16_t>(strtoul(hidraw_sysfs_read(sysdev + "../../bcdDevice").c_str(), nullptr, 16));
+        fSupport.dev = std::string("/dev/") + entry->d_name;
+        system.push_back(fSupport);
+    }
+    closedir(dir);
+}
+
+static bool hidraw_ring_create(HID& hid) {
+    auto ring = std::make_shared<HIDReadRing>();
+    uint16_t inBytes = 0, outBytes = 0;
+    hidraw_descriptor_lengths(hid.handle, inBytes, outBytes, ring->reportIds);
+    hid.pool = hid_pool_create(hid.inEplength, 1 + HID_POOL_SPARES);
+    if (!hid.pool) {
+        return false;
+    }
+    ring->buffer = hid_pool_take(*hid.pool).value();
+    ring->hid = &hid;
+    ring->stopEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ring->writeKick = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ring->writeCancel = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring->stopEvent < 0 || ring->writeKick < 0 || ring->writeCancel < 0) {
+        QLOG_ERROR("HID", "eventfd failed with error: {}\n", hidraw_error(hid));
+        return false;
+    }
+    hid.readRing = ring;
+    return true;
+}
+
+static bool hidraw_open(HID& hid, const std::string& devname) {
+    int fd = ::open(devname.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        QLOG_ERROR("HID", "open {} failed with error: {}\n", devname, hidraw_error(hid));
+        return false;
+    }
+    hidraw_devinfo info = {};
+    if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0) {
+        ::close(fd);
+        return false;
+    }
+    hid.handle = fd;
+    hid.info.vid = static_cast<uint16_t>(info.vendor);
+    hid.info.pid = static_cast<uint16_t>(info.product);
+    std::string sysdev = "/sys/class/hidraw/" + devname.substr(5) + "/device/";
+    hid.info.sernr = static_cast<uint16_t>(strtoul(hidraw_sysfs_read(sysdev + "../../bcdDevice").c_str(), nullptr, 16));
+    hid.info.devname = devname;
+    char phys[256] = {};
+    if (ioctl(fd, HIDIOCGRAWPHYS(sizeof(phys)), phys) >= 0)
+        hid.port = std::string(phys); // e.g. usb-0000:00:14.0-1/input1
+    hidraw_caps(hid);
+    if (hidraw_ring_create(hid))
+        return true;
+    ::close(fd);
+    hid.handle = HID_INVALID_HANDLE;
+    return false;
+}
+
+// one report from the non-blocking fd into the ring's buffer, <0 with errno
+// EAGAIN if none is queued, 0 at the end of the stream. Returns the length
+// including the report id byte.
+static ssize_t hidraw_read_report(HIDReadRing& ring) {
+    HIDBufferPool& pool = *ring.hid->pool;
+    uint8_t* buffer = hid_pool_buffer(pool, ring.buffer);
+    size_t offset = ring.reportIds ? 0 : 1;
+    ssize_t bytesRead = ::read(ring.hid->handle, buffer + offset, pool.bufferSize - offset);
+    if (bytesRead <= 0)
+        return bytesRead;
+    if (!ring.reportIds)
+        buffer[0] = 0;
+    return bytesRead + static_cast<ssize_t>(offset);
+}
+
+// events: what epoll_wait reported for the device fd
+static void hid_reactor_dispatch(HIDReadRing& ring, uint32_t events) {
+    HID& hid = *ring.hid;
+    HIDBufferPool& pool = *hid.pool;
+    // drain everything the kernel queued, the fd is non-blocking
+    while (!ring.closing) {
+        ssize_t bytesRead = hidraw_read_report(ring);
+        if (bytesRead > 0) {
+            HIDReport report = {};
+            report.data = std::span<const uint8_t>(hid_pool_buffer(pool, ring.buffer), static_cast<size_t>(bytesRead));
+            report.pool = &pool;
+            report.index = ring.buffer;
+            report.timestamp = std::chrono::steady_clock::now();
+            // with a spare buffer the next read goes there, otherwise the report is lent from the ring
+            auto spare = hid_pool_take(pool);
+            if (spare) {
+                ring.buffer = *spare;
+                report.pooled = true;
+            }
+            hid_capture_record(hid, HID_CAPTURE_IN, report.data, report.timestamp);
+            ring.callback(hid, report, ring.userData);
+            if (spare && !report.retained)
+                hid_pool_give(pool, report.index);
+            continue;
+        }
+        bool failed = bytesRead < 0 && errno != EAGAIN;
+        if (!failed && bytesRead < 0 && !(events & (EPOLLERR | EPOLLHUP)))
+            break; // drained
+        // the device is usually going away, stop polling it and let hid_close clean up
+        if (failed)
+            QLOG_ERROR("HID", "Read failed with error:{}\n", hidraw_error(hid));
+        else
+            QLOG_INFO("HID", "End of stream on {}\n", hid.info.devname);
+        epoll_ctl(_reactor.epfd, EPOLL_CTL_DEL, hid.handle, nullptr);
+        break;
+    }
+}
+
+// hidraw writes return once the report went out, the write thread runs them
+// one after the other. Waiting for the device to take a report ends early on
+// writeCancel; a write() the kernel already started runs to its end.
+static void hid_writer_pump(HIDReadRing& ring) {
+    HIDWriter& writer = *ring.writer;
+    while (!ring.closing) {
+        HIDWriteOp* op = hid_writer_next(writer);
+        if (!op)
+            return;
+        int fd = ring.hid->handle;
+        HIDWriteStatus status = HID_WRITE_FAILED;
+        op->running = true;
+        while (true) {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(op->deadline - std::chrono::steady_clock::now()).count();
+            if (left <= 0) {
+                status = HID_WRITE_TIMEOUT;
+                break;
+            }
+            if (op->stop.stop_requested()) {
+                status = HID_WRITE_CANCELLED;
+                break;
+            }
+            if (ring.closing) {
+                status = HID_WRITE_DISCONNECTED;
+                break;
+            }
+            pollfd fds[] = { { fd, POLLOUT, 0 }, { ring.writeCancel, POLLIN, 0 } };
+            int ready = poll(fds, 2, static_cast<int>(left));
+            if (ready < 0 && errno != EINTR) {
+                break;
+            }
+            if (fds[1].revents & POLLIN) {
+                // maybe left over from a write which is done, the checks above decide
+                eventfd_t value;
+                eventfd_read(ring.writeCancel, &value);
+                continue;
+            }
+            if (ready <= 0 || !(fds[0].revents & POLLOUT)) {
+                if (fds[0].revents & (POLLERR | POLLHUP))
+                    break;
+                continue;
+            }
+            ssize_t bytesWritten = ::write(fd, op->data.data(), op->data.size());
+            if (bytesWritten < 0 && errno == EAGAIN)
+                continue;
+            if (bytesWritten < 0)
+                QLOG_ERROR("HID", "write failed with error: {}\n", strerror(errno));
+            else if (static_cast<size_t>(bytesWritten) == op->data.size())
+                status = HID_WRITE_OK;
+            break;
+        }
+        op->running = false;
+        hid_writer_complete(op, status);
+    }
+}
+
+// Waits for kicks and writes the queue, so a slow device never holds up the
+// reactor and the reads of the other devices. Keeps the ring alive until it
+// returns, hidraw_close may run on this thread from a done callback.
+static void hid_writer_func_thread(std::shared_ptr<HIDReadRing> ring) {
+    while (!ring->closing) {
+        pollfd fds[] = { { ring->writeKick, POLLIN, 0 } };
+        if (poll(fds, 1, -1) < 0 && errno != EINTR) {
+            QLOG_ERROR("HID", "poll failed with error: {}\n", strerror(errno));
+            break;
+        }
+        eventfd_t value;
+        eventfd_read(ring->writeKick, &value);
+        ring->writer->kicked = false; // pushes from here on post a new kick
+        hid_writer_pump(*ring);
+    }
+}
+
+static void hid_reactor_func_thread() {
+    std::array<epoll_event, 64> events;
+    _onReactor = true;
+
+    while (!_reactor.quit) {
+        int count = epoll_wait(_reactor.epfd, events.data(), static_cast<int>(events.size()), -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            QLOG_ERROR("HID", "epoll_wait failed with error: {}\n", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == nullptr) {
+                eventfd_t value;
+                eventfd_read(_reactor.wakeup, &value);
+                continue;
+            }
+            hid_reactor_dispatch(*static_cast<HIDReadRing*>(events[i].data.ptr), events[i].events);
+        }
+        _closedInBatch.clear();
+        _reactor.epoch.fetch_add(1);
+        _reactor.epoch.notify_all();
+    }
+    QLOG_DEBUG("HID", "Reactor thread exiting...\n");
+}
+
+static bool hidraw_attach(HID& hid, HIDReadCallback callback, void* userData) {
+    std::call_once(_reactor.started, [] {
+        _reactor.epfd = epoll_create1(EPOLL_CLOEXEC);
+        _reactor.wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (_reactor.epfd < 0 || _reactor.wakeup < 0) {
+            QLOG_ERROR("HID", "epoll_create1 failed with error: {}\n", strerror(errno));
+            return;
+        }
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        epoll_ctl(_reactor.epfd, EPOLL_CTL_ADD, _reactor.wakeup, &event);
+        _reactor.thread = std::jthread(hid_reactor_func_thread);
+        });
+    if (_reactor.epfd < 0 || _reactor.wakeup < 0)
+        return false;
+
+    HIDReadRing& ring = *hid.readRing;
+    ring.callback = callback;
+    ring.userData = userData;
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = &ring;
+    if (epoll_ctl(_reactor.epfd, EPOLL_CTL_ADD, hid.handle, &event) < 0) {
+        QLOG_ERROR("HID", "epoll_ctl failed with error: {}\n", hidraw_error(hid));
+        ring.callback = nullptr;
+        return false;
+    }
+    ring.writer = hid.writer;
+    if (ring.writer) {
+        ring.writeThread = std::jthread(hid_writer_func_thread, hid.readRing);
+        ring.writer->attached = true;
+    }
+    return true;
+}
+
+static void hidraw_write_kick(HID& hid) {
+    eventfd_write(hid.readRing->writeKick, 1);
+}
+
+static void hidraw_write_cancel(HID& hid, HIDWriteOp& op) {
+    // a queued write is skipped by the write thread, only a running one needs a wakeup;
+    // it can't complete and let the ring go while its stop callback runs
+    if (op.running)
+        eventfd_write(hid.readRing->writeCancel, 1);
+}
+
+static void hidraw_close(HID& hid) {
+    if (hid.readRing) {
+        HIDReadRing& ring = *hid.readRing;
+        ring.closing = true;
+        eventfd_write(ring.stopEvent, 1); // wake up a blocking hid_read
+        if (ring.writeThread.joinable()) {
+            // the running write stops, the rest of the queue is drained by hid_close
+            eventfd_write(ring.writeKick, 1);
+            eventfd_write(ring.writeCancel, 1);
+            if (ring.writeThread.get_id() == std::this_thread::get_id())
+                ring.writeThread.detach(); // closed from a done callback
+            else
+                ring.writeThread.join();
+        }
+        if (ring.callback) {
+            epoll_ctl(_reactor.epfd, EPOLL_CTL_DEL, hid.handle, nullptr);
+            if (_onReactor) {
+                // closed from a callback, the ring is released after the batch
+                _closedInBatch.push_back(std::move(hid.readRing));
+            }
+            else {
+                // wait until the batch which may still hold the ring is done
+                uint64_t epoch = _reactor.epoch.load();
+                eventfd_write(_reactor.wakeup, 1);
+                while (_reactor.epoch.load() == epoch) {
+                    _reactor.epoch.wait(epoch);
+                }
+            }
+        }
+        hid.readRing.reset();
+    }
+    if (hid.handle != HID_INVALID_HANDLE)
+        ::close(hid.handle);
+    hid.handle = HID_INVALID_HANDLE;
+}
+
+static bool hidraw_read(HID& hid, std::vector<uint8_t>& data, std::chrono::steady_clock::time_point* timestamp) {
+    if (hid.handle == HID_INVALID_HANDLE || !hid.readRing) {
+        return false;
+    }
+    HIDReadRing& ring = *hid.readRing;
+    if (ring.callback) {
+        return false; // served by the reactor
+    }
+
+    data.clear();
+    while (!ring.closing) {
+        ssize_t bytesRead = hidraw_read_report(ring);
+        if (bytesRead > 0) {
+            const uint8_t* buffer = hid_pool_buffer(*hid.pool, ring.buffer);
+            data.assign(buffer, buffer + bytesRead);
+            if (timestamp)
+                *timestamp = std::chrono::steady_clock::now();
+            return true;
+        }
+        if (bytesRead == 0 || errno != EAGAIN)
+            return false; // end of stream or the device is gone
+        pollfd fds[] = { { hid.handle, POLLIN, 0 }, { ring.stopEvent, POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            return false;
+        if (fds[1].revents & POLLIN)
+            return false; // stop event
+        if ((fds[0].revents & (POLLERR | POLLHUP)) && !(fds[0].revents & POLLIN))
+            return false; // hung up with nothing left to read
+    }
+    return false;
+}
+
+static bool hidraw_write(HID& hid, const std::vector<uint8_t>& data) {
+    // like WriteFile the first byte is the report id, the kernel drops a 0 id;
+    // the fd is non-blocking, so wait until the device takes the report
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(HID_WRITE_TIMEOUT_MS);
+    while (true) {
+        ssize_t bytesWritten = ::write(hid.handle, data.data(), data.size());
+        if (bytesWritten >= 0)
+            return static_cast<size_t>(bytesWritten) == data.size();
+        if (errno != EAGAIN && errno != EINTR) {
+            QLOG_ERROR("HID", "write failed with error: {}\n", hidraw_error(hid));
+            return false;
+        }
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0) {
+            QLOG_WARN("HID", "write timed out\n");
+            return false;
+        }
+        pollfd fds[] = { { hid.handle, POLLOUT, 0 } };
+        if (poll(fds, 1, static_cast<int>(left)) < 0 && errno != EINTR)
+            return false;
+        if (fds[0].revents & (POLLERR | POLLHUP))
+            return false;
+    }
+}
+
+const HIDTransport hid_transport_hidraw = {
+    "hidraw",
+    hidraw_owns,
+    hidraw_list,
+    hidraw_open,
+    hidraw_close,
+    hidraw_attach,
+    hidraw_read,
+    hidraw_write,
+    hidraw_write_kick,
+    hidraw_write_cancel,
+    hidraw_caps,
+    hidraw_error,
+};
+
+#endif // __linux__
@@ -0,0 +1,585 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <stop_token>
+#include "hidex.h"
+#include "hidtransport.h"
+#include "hidcapture.h"
+#include "hidsim.h"
+#include "msgpack.h"
+#include "qmkframe.h"
+#include "qmkkeymap.h"
+
+// Simulation backend: devices live in this process, reports are generated by
+// one thread. The per-device state is kept here by HID, hid.readRing belongs
+// to the platform backend and stays empty.
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
+
+#define HID_SIM_QUEUE_MAX 1024 // reports waiting for hid_read
+#define HID_SIM_CATCHUP_MS 1000 // a device further behind its rate skips ahead
+#define HID_SIM_KEYMAP_ROWS 5    // QMK: keymap of layers x rows x cols
+#define HID_SIM_KEYMAP_COLS 14
+
+typedef struct _HIDSimState {
+    HIDSimDevice config;
+    bool plugged;
+} HIDSimState;
+
+// an opened simulated device
+typedef struct _HIDSimPort {
+    std::shared_ptr<HIDSimState> device;
+    HID* hid;
+    HIDReadCallback callback;
+    void* userData;
+    std::shared_ptr<HIDBufferPool> pool;
+    std::shared_ptr<HIDWriter> writer;
+    std::deque<std::vector<uint8_t>> queue; // generated reports and replies not handed out yet
+    std::chrono::steady_clock::time_point nextReport;
+    uint8_t layer;
+    uint8_t leds;
+    msgpack_format_t format; // QMK: of the reports sent, QMV2 after the handshake
+    uint8_t frameId;         // QMK: message id of the next framed message
+    QMKFramer requests;      // QMK: reassembles requests larger than one report
+    uint32_t button; // StreamDeck: next button to toggle
+    bool closing;
+} HIDSimPort;
+
+typedef struct _HIDSim {
+    std::mutex lock;
+    std::condition_variable_any wake;     // simulation thread
+    std::condition_variable_any readable; // blocking hid_read
+    bool work;                            // something to do before the next deadline
+    std::vector<std::shared_ptr<HIDSimState>> devices;
+    std::map<HID*, std::shared_ptr<HIDSimPort>> ports;
+    std::deque<HIDSimStep> script;
+    std::chrono::steady_clock::time_point scriptStart;
+    std::function<void(const std::string&, bool)> hotplug;
+    uint64_t epoch; // advanced after every round of the simulation thread
+    std::atomic<uint64_t> reports;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> writes;
+    std::atomic<uint64_t> replies;
+    std::once_flag started;
+    std::jthread thread; // last, stopped before the rest goes away
+} HIDSim;
+
+static HIDSim _sim;
+
+static bool sim_on_thread() {
+    return std::this_thread::get_id() == _sim.thread.get_id();
+}
+
+static std::shared_ptr<HIDSimState> sim_find_device(const std::string& name) {
+    auto it = std::find_if(_sim.devices.begin(), _sim.devices.end(), [&name](const std::shared_ptr<HIDSimState>& device) {
+        return device->config.name == name;
+        });
+    return (it != _sim.devices.end()) ? *it : nullptr;
+}
+
+static std::shared_ptr<HIDSimPort> sim_find_port(HID& hid) {
+    auto it = _sim.ports.find(&hid);
+    return (it != _sim.ports.end()) ? it->second : nullptr;
+}
+
+static uint16_t sim_in_length(const HIDSimDevice& config) {
+    // report id byte included, like the Windows backend reports it
+    return (config.kind == HID_SIM_QMK) ? RAW_EPSIZE + 1 : static_cast<uint16_t>(4 + config.buttons);
+}
+
+static std::vector<uint8_t> sim_qmk_report(HIDSimPort& port, const msgpack_t& km) {
+    std::vector<uint8_t> report(port.hid->inEplength, 0);
+    msgpack_t copy = km;
+    make_msgpack(&copy, report, port.format);
+    return report;
+}
+
+// next unsolicited report of the device, lock held
+static std::vector<uint8_t> sim_generate(HIDSimPort& port) {
+    const HIDSimDevice& config = port.device->config;
+    if (config.kind == HID_SIM_QMK) {
+        port.layer = config.layers ? static_cast<uint8_t>((port.layer + 1) % config.layers) : 0;
+        msgpack_t km;
+        init_msgpack(&km);
+        add_msgpack_add(&km, MSGPACK_CHANGED_LAYER, port.layer);
+        return sim_qmk_report(port, km);
+    }
+    // StreamDeck: press the buttons one after the other, every second report releases
+    std::vector<uint8_t> report(port.hid->inEplength, 0);
+    report[0] = 1;
+    uint32_t buttons = std::max<uint32_t>(config.buttons, 1);
+    uint32_t index = (port.button / 2) % buttons;
+    if ((port.button & 1) == 0 && 4 + index < report.size())
+        report[4 + index] = 1;
+    port.button++;
+    return report;
+}
+
+// the same keymap every time, letters and digits walking through the layers
+static uint16_t sim_keycode(uint32_t index) {
+    return static_cast<uint16_t>(0x04 + index % 36); // KC_A..KC_0
+}
+
+// queues a keymap chunk as framed reports, lock held
+static void sim_keymap_chunk(HIDSimPort& port, uint16_t chunk) {
+    uint32_t keys = std::max<uint32_t>(port.device->config.layers, 1) * HID_SIM_KEYMAP_ROWS * HID_SIM_KEYMAP_COLS;
+    uint32_t first = static_cast<uint32_t>(chunk) * QMK_KEYMAP_CHUNK_KEYS;
+    if (first >= keys)
+        return;
+    uint32_t count = std::min<uint32_t>(QMK_KEYMAP_CHUNK_KEYS, keys - first);
+    std::vector<uint8_t> message = { QMK_FRAME_KEYMAP, static_cast<uint8_t>(chunk >> 8), static_cast<uint8_t>(chunk) };
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t keycode = sim_keycode(first + i);
+        message.push_back(static_cast<uint8_t>(keycode >> 8));
+        message.push_back(static_cast<uint8_t>(keycode));
+    }
+    std::vector<std::vector<uint8_t>> reports;
+    qmk_frame_split(port.frameId++, message, port.hid->inEplength, reports);
+    for (auto& report : reports) {
+        port.queue.push_back(std::move(report));
+    }
+}
+
+// answers a QMV1 or QMV2 request like the firmware, the sequence id is echoed; lock held
+static void sim_handle_write(HIDSimPort& port, std::span<const uint8_t> data) {
+    _sim.writes.fetch_add(1, std::memory_order_relaxed);
+    if (port.device->config.kind != HID_SIM_QMK)
+        return;
+    std::vector<uint8_t> message;
+    if (qmk_frame_is_fragment(data)) {
+        // the whole request once the last fragment is in, it is decoded like a report
+        if (qmk_frame_feed(port.requests, data, std::chrono::steady_clock::now(), message) != QMK_FRAME_COMPLETE)
+            return;
+        data = message;
+    }
+    msgpack_t request;
+    if (!read_msgpack(&request, data))
+        return;
+    msgpack_t reply;
+    init_msgpack(&reply);
+    bool qmv2 = false;
+    for (uint8_t i = 0; i < request.count; i++) {
+        const msgpack_pair_t& pair = request.pairs[i];
+        switch (pair.key) {
+        case MSGPACK_CURRENT_LAYER:
+            add_msgpack_add(&reply, MSGPACK_CURRENT_LAYER, port.layer);
+            break;
+        case MSGPACK_CURRENT_LEDSTATE:
+            add_msgpack_add(&reply, MSGPACK_CURRENT_LEDSTATE, port.leds);
+            break;
+        case MSGPACK_SET_LAYER:
+            port.layer = static_cast<uint8_t>(pair.value);
+            add_msgpack_add(&reply, MSGPACK_CHANGED_LAYER, port.layer);
+            break;
+        case MSGPACK_SEQUENCE_ID:
+            add_msgpack_add(&reply, MSGPACK_SEQUENCE_ID, pair.value);
+            break;
+        case MSGPACK_CAPABILITIES:
+            qmv2 = port.device->config.qmv2 && (pair.value & QMK_CAP_QMV2);
+            add_msgpack_add(&reply, MSGPACK_CAPABILITIES, port.device->config.qmv2 ? QMK_CAP_QMV2 : 0);
+            break;
+        case MSGPACK_KEYMAP_LAYERS:
+            add_msgpack_add(&reply, MSGPACK_KEYMAP_LAYERS, std::max<uint8_t>(port.device->config.layers, 1));
+            break;
+        case MSGPACK_KEYMAP_ROWS:
+            add_msgpack_add(&reply, MSGPACK_KEYMAP_ROWS, HID_SIM_KEYMAP_ROWS);
+            break;
+        case MSGPACK_KEYMAP_COLS:
+            add_msgpack_add(&reply, MSGPACK_KEYMAP_COLS, HID_SIM_KEYMAP_COLS);
+            break;
+        case MSGPACK_KEYMAP_CHUNK:
+            // the data goes ahead of the reply
+            sim_keymap_chunk(port, static_cast<uint16_t>(pair.value));
+            add_msgpack_add(&reply, MSGPACK_KEYMAP_CHUNK, pair.value);
+            break;
+        }
+    }
+    if (reply.count == 0)
+        return;
+    if (port.queue.size() >= HID_SIM_QUEUE_MAX) {
+        port.queue.pop_front();
+        _sim.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    port.queue.push_back(sim_qmk_report(port, reply));
+    // the handshake reply still goes out in the old format
+    if (qmv2)
+        port.format = MSGPACK_QMV2;
+    _sim.replies.fetch_add(1, std::memory_order_relaxed);
+    _sim.work = true;
+    _sim.wake.notify_one();
+    _sim.readable.notify_all();
+}
+
+// reports due by now, lock held
+static void sim_generate_due(HIDSimPort& port, std::chrono::steady_clock::time_point now) {
+    uint32_t rate = port.device->config.reportsPerSecond;
+    if (rate == 0)
+        return;
+    auto period = std::chrono::nanoseconds(1000000000ll / rate);
+    if (now - port.nextReport > std::chrono::milliseconds(HID_SIM_CATCHUP_MS))
+        port.nextReport = now;
+    while (port.nextReport <= now) {
+        if (port.queue.size() >= HID_SIM_QUEUE_MAX) {
+            port.queue.pop_front();
+            _sim.dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        port.queue.push_back(sim_generate(port));
+        port.nextReport += period;
+    }
+}
+
+static void sim_run_writes(HIDSimPort& port) {
+    HIDWriter& writer = *port.writer;
+    writer.kicked = false; // pushes from here on notify again
+    while (HIDWriteOp* op = hid_writer_next(writer)) {
+        HIDWriteStatus status = HID_WRITE_OK;
+        {
+            std::lock_guard guard(_sim.lock);
+            if (port.closing)
+                status = HID_WRITE_DISCONNECTED;
+            else if (!port.device->plugged)
+                status = HID_WRITE_FAILED;
+            else
+                sim_handle_write(port, op->data);
+        }
+        hid_writer_complete(op, status);
+    }
+}
+
+// hands the queued reports of a device with a callback out, lock not held
+static void sim_deliver(HIDSimPort& port, std::deque<std::vector<uint8_t>>& reports) {
+    HIDBufferPool& pool = *port.pool;
+    for (auto& bytes : reports) {
+        if (port.closing)
+            break;
+        auto index = hid_pool_take(pool);
+        if (!index) {
+            _sim.dropped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        uint8_t* buffer = hid_pool_buffer(pool, *index);
+        size_t length = std::min(bytes.size(), pool.bufferSize);
+        std::copy(bytes.begin(), bytes.begin() + length, buffer);
+        HIDReport report = {};
+        report.data = std::span<const uint8_t>(buffer, length);
+        report.pool = &pool;
+        report.index = *index;
+        report.pooled = true;
+        report.timestamp = std::chrono::steady_clock::now();
+        hid_capture_record(*port.hid, HID_CAPTURE_IN, report.data, report.timestamp);
+        port.callback(*port.hid, report, port.userData);
+        if (!report.retained)
+            hid_pool_give(pool, report.index);
+        _sim.reports.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+static void sim_thread_func(std::stop_token stop) {
+    std::unique_lock guard(_sim.lock);
+    while (!stop.stop_requested()) {
+        auto now = std::chrono::steady_clock::now();
+        _sim.work = false;
+
+        std::vector<std::pair<std::string, bool>> hotplugs;
+        while (!_sim.script.empty() && _sim.scriptStart + _sim.script.front().at <= now) {
+            HIDSimStep step = _sim.script.front();
+            _sim.script.pop_front();
+            if (auto device = sim_find_device(step.name)) {
+                if (device->plugged != step.plug) {
+                    device->plugged = step.plug;
+                    hotplugs.push_back({ HID_SIM_PREFIX + step.name, step.plug });
+                }
+            }
+        }
+
+        std::vector<std::pair<std::shared_ptr<HIDSimPort>, std::deque<std::vector<uint8_t>>>> deliveries;
+        std::vector<std::shared_ptr<HIDSimPort>> writers;
+        for (auto& [hid, port] : _sim.ports) {
+            if (port->closing || !port->device->plugged)
+                continue;
+            sim_generate_due(*port, now);
+            if (port->callback) {
+                if (!port->queue.empty())
+                    deliveries.push_back({ port, std::move(port->queue) });
+                port->queue.clear();
+                if (port->writer && port->writer->kicked)
+                    writers.push_back(port);
+            }
+        }
+        _sim.readable.notify_all();
+
+        guard.unlock();
+        auto hotplug = _sim.hotplug;
+        for (auto& [devname, arrived] : hotplugs) {
+            if (hotplug)
+                hotplug(devname, arrived);
+        }
+        for (auto& port : writers) {
+            sim_run_writes(*port);
+        }
+        for (auto& [port, reports] : deliveries) {
+            sim_deliver(*port, reports);
+        }
+        guard.lock();
+
+        _sim.epoch++;
+        _sim.wake.notify_all();
+        if (_sim.work)
+            continue;
+        // sleep until the next report or script step is due
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        for (auto& [hid, port] : _sim.ports) {
+            if (!port->closing && port->device->plugged && port->device->config.reportsPerSecond)
+                deadline = std::min(deadline, port->nextReport);
+        }
+        if (!_sim.script.empty())
+            deadline = std::min(deadline, _sim.scriptStart + _sim.script.front().at);
+        _sim.wake.wait_until(guard, stop, deadline, [] { return _sim.work; });
+    }
+}
+
+static void sim_start() {
+    std::call_once(_sim.started, [] {
+        _sim.thread = std::jthread(sim_thread_func);
+        });
+}
+
+void hid_sim_add(const HIDSimDevice& device, bool plugged) {
+    std::lock_guard guard(_sim.lock);
+    auto state = std::make_shared<HIDSimState>();
+    state->config = device;
+    state->plugged = plugged;
+    _sim.devices.push_back(state);
+}
+
+void hid_sim_plug(const std::string& name, bool plugged) {
+    std::function<void(const std::string&, bool)> hotplug;
+    {
+        std::lock_guard guard(_sim.lock);
+        auto device = sim_find_device(name);
+        if (!device || device->plugged == plugged)
+            return;
+        device->plugged = plugged;
+        hotplug = _sim.hotplug;
+        _sim.work = true;
+        _sim.wake.notify_all();
+        _sim.readable.notify_all();
+    }
+    if (hotplug)
+        hotplug(HID_SIM_PREFIX + name, plugged);
+}
+
+void hid_sim_script(std::vector<HIDSimStep> steps) {
+    std::sort(steps.begin(), steps.end(), [](const HIDSimStep& a, const HIDSimStep& b) { return a.at < b.at; });
+    sim_start();
+    std::lock_guard guard(_sim.lock);
+    _sim.script.assign(steps.begin(), steps.end());
+    _sim.scriptStart = std::chrono::steady_clock::now();
+    _sim.work = true;
+    _sim.wake.notify_all();
+}
+
+void hid_sim_set_hotplug(std::function<void(const std::string& devname, bool arrived)> hotplug) {
+    std::lock_guard guard(_sim.lock);
+    _sim.hotplug = std::move(hotplug);
+}
+
+HIDSimStats hid_sim_stats() {
+    HIDSimStats stats = {};
+    stats.reports = _sim.reports.load(std::memory_order_relaxed);
+    stats.dropped = _sim.dropped.load(std::memory_order_relaxed);
+    stats.writes = _sim.writes.load(std::memory_order_relaxed);
+    stats.replies = _sim.replies.load(std::memory_order_relaxed);
+    return stats;
+}
+
+static std::string sim_error(HID& hid) {
+    std::lock_guard guard(_sim.lock);
+    auto port = sim_find_port(hid);
+    if (port && !port->device->plugged)
+        return "The simulated device is unplugged";
+    return std::string();
+}
+
+static void sim_caps(HID& hid) {
+    std::lock_guard guard(_sim.lock);
+    auto device = sim_find_device(hid.info.devname.substr(sizeof(HID_SIM_PREFIX) - 1));
+    if (device) {
+        hid.inEplength = sim_in_length(device->config);
+        hid.outEplength = RAW_EPSIZE + 1;
+    }
+}
+
+static bool sim_owns(const std::string& devname) {
+    return devname.starts_with(HID_SIM_PREFIX);
+}
+
+static void sim_list(std::vector<DeviceSupport>& system, const std::vector<DeviceSupport>& supported) {
+    std::lock_guard guard(_sim.lock);
+    for (auto& device : _sim.devices) {
+        if (!device->plugged)
+            continue;
+        const HIDSimDevice& config = device->config;
+        auto it = std::find_if(supported.begin(), supported.end(), [&config](const DeviceSupport& supp) {
+            return config.vid == supp.vid && config.pid == supp.pid && (supp.iface.empty() || supp.iface == config.iface);
+            });
+        if (it == supported.end())
+            continue;
+        DeviceSupport fSupport = *it;
+        fSupport.serial_number = config.name;
+        fSupport.manufactor = "Simulation";
+        fSupport.product = config.name;
+        fSupport.dev = HID_SIM_PREFIX + config.name;
+        system.push_back(fSupport);
+    }
+}
+
+static bool sim_open(HID& hid, const std::string& devname) {
+    std::lock_guard guard(_sim.lock);
+    auto device = sim_find_device(devname.substr(sizeof(HID_SIM_PREFIX) - 1));
+    if (!device || !device->plugged)
+        return false;
+    // a real handle, so the front end sees an open device
+#ifdef _WIN32
+    hid.handle = CreateEvent(NULL, TRUE, FALSE, NULL);
+#else
+    hid.handle = eventfd(0, EFD_CLOEXEC);
+#endif
+#ifdef _WIN32
+    if (hid.handle == NULL) {
+#else
+    if (hid.handle < 0) {
+#endif
+        hid.handle = HID_INVALID_HANDLE;
+        return false;
+    }
+    const HIDSimDevice& config = device->config;
+    hid.info.vid = config.vid;
+    hid.info.pid = config.pid;
+    hid.info.sernr = 0;
+    hid.info.devname = devname;
+    hid.port = devname;
+    hid.inEplength = sim_in_length(config);
+    hid.outEplength = RAW_EPSIZE + 1;
+    hid.pool = hid_pool_create(hid.inEplength, 1 + HID_POOL_SPARES);
+
+    auto port = std::make_shared<HIDSimPort>();
+    port->device = device;
+    port->hid = &hid;
+    port->callback = nullptr;
+    port->userData = nullptr;
+    port->pool = hid.pool;
+    port->nextReport = std::chrono::steady_clock::now();
+    port->layer = 0;
+    port->leds = 0;
+    port->format = MSGPACK_QMV1;
+    port->frameId = 0;
+    port->button = 0;
+    port->closing = false;
+    _sim.ports[&hid] = port;
+    _sim.work = true;
+    _sim.wake.notify_all();
+    return true;
+}
+
+static void sim_close(HID& hid) {
+    {
+        std::unique_lock guard(_sim.lock);
+        auto port = sim_find_port(hid);
+        if (port) {
+            port->closing = true;
+            _sim.ports.erase(&hid);
+            _sim.readable.notify_all();
+            if (!sim_on_thread() && _sim.thread.joinable()) {
+                // the round which may still use the device has to end first
+                uint64_t epoch = _sim.epoch;
+                _sim.work = true;
+                _sim.wake.notify_all();
+                _sim.wake.wait(guard, [epoch] { return _sim.epoch != epoch; });
+            }
+        }
+    }
+    if (hid.handle != HID_INVALID_HANDLE) {
+#ifdef _WIN32
+        CloseHandle(hid.handle);
+#else
+        ::close(hid.handle);
+#endif
+    }
+    hid.handle = HID_INVALID_HANDLE;
+}
+
+static bool sim_attach(HID& hid, HIDReadCallback callback, void* userData) {
+    sim_start();
+    std::lock_guard guard(_sim.lock);
+    auto port = sim_find_port(hid);
+    if (!port)
+        return false;
+    port->callback = callback;
+    port->userData = userData;
+    port->writer = hid.writer;
+    if (port->writer)
+        port->writer->attached = true;
+    return true;
+}
+
+static bool sim_read(HID& hid, std::vector<uint8_t>& data, std::chrono::steady_clock::time_point* timestamp) {
+    sim_start();
+    std::unique_lock guard(_sim.lock);
+    auto port = sim_find_port(hid);
+    if (!port || port->callback)
+        return false;
+    _sim.readable.wait(guard, [&port] { return port->closing || !port->device->plugged || !port->queue.empty(); });
+    if (port->closing || port->queue.empty())
+        return false;
+    data = std::move(port->queue.front());
+    port->queue.pop_front();
+    if (timestamp)
+        *timestamp = std::chrono::steady_clock::now();
+    _sim.reports.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+static bool sim_write(HID& hid, const std::vector<uint8_t>& data) {
+    std::lock_guard guard(_sim.lock);
+    auto port = sim_find_port(hid);
+    if (!port || !port->device->plugged)
+        return false;
+    sim_handle_write(*port, data);
+    return true;
+}
+
+static void sim_write_kick(HID& hid) {
+    (void)hid; // one simulation thread serves every port
+    std::lock_guard guard(_sim.lock);
+    _sim.work = true;
+    _sim.wake.notify_all();
+}
+
+static void sim_write_cancel(HID& hid, HIDWriteOp& op) {
+    // writes complete at once on the simulation thread, a queued one is skipped there
+    (void)hid;
+    (void)op;
+}
+
+const HIDTransport hid_transport_sim = {
+    "sim",
+    sim_owns,
+    sim_list,
+    sim_open,
+    sim_close,
+    sim_attach,
+    sim_read,
+    sim_write,
+    sim_write_kick,
+    sim_write_cancel,
+    sim_caps,
+    sim_error,
+};
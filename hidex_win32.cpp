@@ -0,0 +1,639 @@
+#include <optional>
+#include <format> // For std::
+#include <thread>
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <locale>
+#include <codecvt>
+#include <condition_variable>
+#include "hidex.h"
+#include "hidtransport.h"
+#include "hidcapture.h"
+
+// Win32 backend: SetupAPI/hid.dll device access with overlapped I/O, reads are
+// dispatched by one completion port reactor for all devices.
+
+#ifdef _WIN32
+
+#include "DeviceNameWindow.h"
+#include "hidapi/hidapi.h"
+
+#pragma comment(lib, "setupapi.lib")
+#pragma comment(lib, "hid.lib")
+
+static void win32_caps(HID& hid);
+
+static std::string wstringToString(const std::wstring& wstr) {
+    if (wstr.empty()) {
+        return std::string();
+    }
+    int size_needed = WideCharToMultiByte(CP_UTF8, 0, &wstr[0], (int)wstr.size(), NULL, 0, NULL, NULL);
+    std::string strTo(size_needed, 0);
+    WideCharToMultiByte(CP_UTF8, 0, &wstr[0], (int)wstr.size(), &strTo[0], size_needed, NULL, NULL);
+    return strTo;
+}
+
+static std::string GetLastErrorAsString() {
+    DWORD error = GetLastError();
+    if (error == 0) {
+        return std::string(); // No error message has been recorded
+    }
+
+    LPVOID lpMsgBuf;
+    DWORD bufLen = FormatMessage(
+        FORMAT_MESSAGE_ALLOCATE_BUFFER |
+        FORMAT_MESSAGE_FROM_SYSTEM |
+        FORMAT_MESSAGE_IGNORE_INSERTS,
+        NULL,
+        error,
+        MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+        (LPTSTR)&lpMsgBuf,
+        0, NULL);
+    if (bufLen) {
+        LPCSTR lpMsgStr = (LPCSTR)lpMsgBuf;
+        std::string result(lpMsgStr, lpMsgStr + bufLen);
+        LocalFree(lpMsgBuf);
+        return result;
+    }
+    return std::string();
+}
+
+static std::string win32_error(HID& hid) {
+    return GetLastErrorAsString();
+}
+
+static void win32_caps(HID& hid) {
+    PHIDP_PREPARSED_DATA preparsedData;
+
+    if (HidD_GetPreparsedData(hid.handle, &preparsedData)) {
+        HIDP_CAPS caps;
+        if (HidP_GetCaps(preparsedData, &caps) == HIDP_STATUS_SUCCESS) {
+            hid.inEplength = static_cast<uint16_t>(caps.InputReportByteLength);
+            hid.outEplength = static_cast<uint16_t>(caps.OutputReportByteLength);
+#ifdef _xDEBUG
+            QLOG_DEBUG("HID", "------------------------------------------------\n");
+            QLOG_DEBUG("HID", "VID: 0x{:04X}, PID: 0x{:04X}, SerialNr: 0x{:04X}\n", hid.info.vid, hid.info.pid, hid.info.sernr);
+            QLOG_DEBUG("HID", "Usage Page: {}\n", caps.UsagePage);
+            QLOG_DEBUG("HID", "Usage: {}\n", caps.Usage);
+            QLOG_DEBUG("HID", "Input Report Byte Length: {}\n", caps.InputReportByteLength);
+            QLOG_DEBUG("HID", "Output Report Byte Length: {}\n", caps.OutputReportByteLength);
+            QLOG_DEBUG("HID", "Feature Report Byte Length: {}\n", caps.FeatureReportByteLength);
+            QLOG_DEBUG("HID", "Number of Link Collection Nodes: {}\n", caps.NumberLinkCollectionNodes);
+            QLOG_DEBUG("HID", "Number of Input Button Caps: {}\n", caps.NumberInputButtonCaps);
+            QLOG_DEBUG("HID", "Number of Input Value Caps: {}\n", caps.NumberInputValueCaps);
+            QLOG_DEBUG("HID", "Number of Input Data Indices: {}\n", caps.NumberInputDataIndices);
+            QLOG_DEBUG("HID", "Number of Output Button Caps: {}\n", caps.NumberOutputButtonCaps);
+            QLOG_DEBUG("HID", "Number of Output Value Caps: {}\n", caps.NumberOutputValueCaps);
+            QLOG_DEBUG("HID", "Number of Output Data Indices: {}\n", caps.NumberOutputDataIndices);
+            QLOG_DEBUG("HID", "Number of Feature Button Caps: {}\n", caps.NumberFeatureButtonCaps);
+            QLOG_DEBUG("HID", "Number of Feature Value Caps: {}\n", caps.NumberFeatureValueCaps);
+            QLOG_DEBUG("HID", "Number of Feature Data Indices: {}\n", caps.NumberFeatureDataIndices);
+#endif
+        }
+        else {
+            QLOG_ERROR("HID", "HidP_GetCaps failed with error: {}\n", win32_error(hid));
+        }
+        HidD_FreePreparsedData(preparsedData);
+    }
+    else {
+        QLOG_ERROR("HID", "HidD_GetPreparsedData failed with error: {}\n", win32_error(hid));
+    }
+}
+
+static void hid_device_info_log(const hid_device_info* dev) {
+    if (dev == nullptr) {
+        return;
+    }
+    QLOG_DEBUG("HID", "Device Info:\n");
+    QLOG_DEBUG("HID", "  Path: {}\n", dev->path ? dev->path : "N/A");
+    QLOG_DEBUG("HID", "  Vendor ID: 0x{:04X}\n", dev->vendor_id);
+    QLOG_DEBUG("HID", "  Product ID: 0x{:04X}\n", dev->product_id);
+    QLOG_DEBUG("HID", "  Serial Number: {}\n", dev->serial_number ? wstringToString(dev->serial_number) : "N/A");
+    QLOG_DEBUG("HID", "  Release Number: 0x{:04X}\n", dev->release_number);
+    QLOG_DEBUG("HID", "  Manufacturer String: {}\n", dev->manufacturer_string ? wstringToString(dev->manufacturer_string) : "N/A");
+    QLOG_DEBUG("HID", "  Product String: {}\n", dev->product_string ? wstringToString(dev->product_string) : "N/A");
+    QLOG_DEBUG("HID", "  Usage Page: 0x{:04X}\n", dev->usage_page);
+    QLOG_DEBUG("HID", "  Usage: 0x{:04X}\n", dev->usage);
+    QLOG_DEBUG("HID", "  Interface Number: {}\n", dev->interface_number);
+}
+
+static void win32_list(std::vector<DeviceSupport>& system, const std::vector<DeviceSupport>& supported){
+
+    hid_init();
+
+    hid_device_info * devs = hid_enumerate(0, 0);
+    struct hid_device_info* d = devs;
+
+    QLOG_DEBUG("HID", "{} ...........................................  \n", __FUNCTION__);
+
+    while (d) {
+
+		DevicePath path;
+		if (parseDevicePath(d->path, path)) {
+			auto it = std::find_if(supported.begin(), supported.end(), [&path](const DeviceSupport& supp) {
+				return path.vid.value() == supp.vid && path.pid.value() == supp.pid;
+				});
+			if (it != supported.end()) {
+			    DeviceSupport fSupport = *it;
+                fSupport.serial_number = wstringToString(d->serial_number);
+                fSupport.manufactor = wstringToString(d->manufacturer_string);
+                fSupport.product = wstringToString(d->product_string);
+                fSupport.sernbr = d->release_number; // bcdDevice, the firmware version
+                fSupport.dev = d->path;
+                if (path.mi[0] && fSupport.iface == path.mi) {
+                    system.push_back(fSupport);
+                    //QLOG_DEBUG("HID", "Relevant Device: {} \n", d->path);
+                    hid_device_info_log(d);
+                }else
+				if (!path.mi[0] && fSupport.iface == "") {
+                    system.push_back(fSupport);
+                    //QLOG_DEBUG("HID", "Relevant Device: {} \n", d->path);
+                    hid_device_info_log(d);
+                }
+			}
+		}
+		d = d->next;
+    }
+    hid_free_enumeration(devs);
+    hid_exit();
+}
+
+// One posted read: the OVERLAPPED and its event live as long as the device is
+// open and are reused every time the slot is reposted. The report buffer comes
+// from the device's pool and is swapped for a free one when a report is lent out.
+typedef struct _HIDReadSlot {
+    OVERLAPPED overlapped;
+    uint32_t buffer; // index in hid.pool
+    bool pending;
+} HIDReadSlot;
+
+// Reads on a handle complete in the order they were posted, so the ring is
+// consumed strictly from head and every consumed slot is reposted at once.
+// Devices with a read callback are served by the reactor, the others are
+// pulled with hid_read. The reactor also runs the device's write queue.
+typedef struct _HIDReadRing {
+    std::array<HIDReadSlot, HID_READ_RING_SIZE> slots;
+    size_t head;
+    bool posted; // reads are posted on attach or with the first hid_read
+    HANDLE stopEvent; // wakes up a blocking hid_read
+    HID* hid;
+    HIDReadCallback callback;
+    void* userData;
+    std::shared_ptr<HIDBufferPool> pool; // the slots' buffers, kept until the last read drained
+    std::shared_ptr<HIDWriter> writer;
+    OVERLAPPED writeKick;       // posted by hid_write_async, never handed to the driver
+    OVERLAPPED writeOverlapped; // the running write
+    std::atomic<bool> closing;
+    std::atomic<uint32_t> outstanding; // posted reads, kicks and writes plus a running callback
+
+    ~_HIDReadRing() {
+        for (auto& slot : slots) {
+            if (slot.overlapped.hEvent)
+                CloseHandle(slot.overlapped.hEvent);
+        }
+        if (stopEvent)
+            CloseHandle(stopEvent);
+    }
+} HIDReadRing;
+
+// All devices with a read callback share one completion port and one dispatch
+// thread instead of a thread per device. A single thread also keeps the
+// callbacks of one device in report order.
+typedef struct _HIDReactor {
+    HANDLE port = NULL;
+    std::jthread thread;
+    std::once_flag started;
+
+    ~_HIDReactor() {
+        if (port) {
+            PostQueuedCompletionStatus(port, 0, 0, NULL); // quit packet
+            if (thread.joinable())
+                thread.join();
+            CloseHandle(port);
+        }
+    }
+} HIDReactor;
+
+static HIDReactor _reactor;
+// rings closed on the reactor thread itself, it can't wait for its own completions
+// so they are freed once the cancelled I/O drained
+static thread_local std::vector<std::shared_ptr<HIDReadRing>> _retired;
+// rings with a write handed to the driver, reactor only
+static std::vector<HIDReadRing*> _writing;
+
+static bool hid_on_reactor() {
+    return std::this_thread::get_id() == _reactor.thread.get_id();
+}
+
+static void hid_ring_release(HIDReadRing& ring) {
+    ring.outstanding.fetch_sub(1);
+    ring.outstanding.notify_all();
+}
+
+static bool hid_ring_post(HIDReadRing& ring, HIDReadSlot& slot) {
+    HID& hid = *ring.hid;
+    HANDLE hEvent = slot.overlapped.hEvent;
+    slot.overlapped = { 0 };
+    slot.overlapped.hEvent = hEvent;
+    ResetEvent(hEvent);
+
+    ring.outstanding.fetch_add(1);
+    if (ReadFile(hid.handle, hid_pool_buffer(*ring.pool, slot.buffer), static_cast<DWORD>(ring.pool->bufferSize), NULL, &slot.overlapped) ||
+        GetLastError() == ERROR_IO_PENDING) {
+        slot.pending = true;
+        // hid_close may have cancelled the other reads while this one was being posted
+        if (ring.closing)
+            CancelIoEx(hid.handle, &slot.overlapped);
+        return true;
+    }
+    QLOG_ERROR("HID", "ReadFile failed with error:{}\n", win32_error(hid));
+    slot.pending = false;
+    hid_ring_release(ring);
+    return false;
+}
+
+static bool hid_ring_create(HID& hid) {
+    auto ring = std::make_shared<HIDReadRing>();
+    ring->head = 0;
+    ring->posted = false;
+    ring->hid = &hid;
+    ring->writeKick = { 0 };
+    ring->writeOverlapped = { 0 };
+    ring->stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!ring->stopEvent) {
+        QLOG_ERROR("HID", "CreateEvent failed with error: {}\n", GetLastErrorAsString());
+        return false;
+    }
+    hid.pool = hid_pool_create(hid.inEplength, HID_READ_RING_SIZE + HID_POOL_SPARES);
+    if (!hid.pool) {
+        return false;
+    }
+    ring->pool = hid.pool;
+    for (auto& slot : ring->slots) {
+        slot.overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        slot.buffer = hid_pool_take(*hid.pool).value();
+        slot.pending = false;
+        if (!slot.overlapped.hEvent) {
+            QLOG_ERROR("HID", "CreateEvent failed with error: {}\n", GetLastErrorAsString());
+            return false;
+        }
+    }
+    hid.readRing = ring;
+    return true;
+}
+
+static void hid_ring_post_all(HIDReadRing& ring) {
+    for (auto& slot : ring.slots) {
+        hid_ring_post(ring, slot);
+    }
+    ring.posted = true;
+}
+
+static void hid_ring_destroy(HID& hid) {
+    if (!hid.readRing)
+        return;
+    HIDReadRing& ring = *hid.readRing;
+    // cancel what is still posted and wait for it, the kernel owns the buffers until then
+    ring.closing = true;
+    CancelIoEx(hid.handle, NULL);
+    if (ring.callback) {
+        // the reactor drains the cancelled reads and writes
+        if (hid_on_reactor()) {
+            _retired.push_back(std::move(hid.readRing));
+            return;
+        }
+        for (uint32_t n = ring.outstanding.load(); n > 0; n = ring.outstanding.load()) {
+            ring.outstanding.wait(n);
+        }
+    }
+    else {
+        for (auto& slot : ring.slots) {
+            if (slot.pending) {
+                DWORD bytesRead;
+                GetOverlappedResult(hid.handle, &slot.overlapped, &bytesRead, TRUE);
+                slot.pending = false;
+            }
+        }
+    }
+    hid.readRing.reset();
+}
+
+static void hid_reactor_dispatch(HIDReadRing& ring, HIDReadSlot& slot, std::chrono::steady_clock::time_point completed) {
+    HIDBufferPool& pool = *ring.pool;
+    DWORD bytesRead = 0;
+    slot.pending = false;
+
+    // once closing, the HID may be gone already
+    if (!ring.closing) {
+        HID& hid = *ring.hid;
+        if (GetOverlappedResult(hid.handle, &slot.overlapped, &bytesRead, FALSE) && bytesRead > 0) {
+            HIDReport report = {};
+            report.data = std::span<const uint8_t>(hid_pool_buffer(pool, slot.buffer), bytesRead);
+            report.pool = &pool;
+            report.index = slot.buffer;
+            report.timestamp = completed;
+            // with a spare buffer the slot goes back to the driver before the callback runs,
+            // otherwise the report is lent from the slot and it is reposted afterwards
+            auto spare = hid_pool_take(pool);
+            if (spare) {
+                slot.buffer = *spare;
+                report.pooled = true;
+                hid_ring_post(ring, slot);
+            }
+            hid_capture_record(hid, HID_CAPTURE_IN, report.data, report.timestamp);
+            ring.callback(hid, report, ring.userData);
+            if (!spare) {
+                if (!ring.closing)
+                    hid_ring_post(ring, slot);
+            }
+            else if (!report.retained) {
+                hid_pool_give(pool, report.index);
+            }
+        }
+        else {
+            // don't repost, the device is usually going away and hid_close cleans up
+            QLOG_ERROR("HID", "Read failed with error:{}\n", win32_error(hid));
+        }
+    }
+    hid_ring_release(ring);
+}
+
+// starts the next queued write unless one is running, reactor only
+static void hid_writer_pump(HIDReadRing& ring) {
+    HIDWriter& writer = *ring.writer;
+    while (!writer.current && !ring.closing) {
+        HIDWriteOp* op = hid_writer_next(writer);
+        if (!op)
+            return;
+        HANDLE handle = ring.hid->handle;
+        writer.current = op;
+        op->running = true;
+        ring.writeOverlapped = { 0 };
+        ring.outstanding.fetch_add(1);
+        if (WriteFile(handle, op->data.data(), static_cast<DWORD>(op->data.size()), NULL, &ring.writeOverlapped) ||
+            GetLastError() == ERROR_IO_PENDING) {
+            _writing.push_back(&ring);
+            if (ring.closing)
+                CancelIoEx(handle, &ring.writeOverlapped);
+            return;
+        }
+        QLOG_ERROR("HID", "WriteFile failed with error: {}\n", GetLastErrorAsString());
+        writer.current = nullptr;
+        op->running = false;
+        hid_ring_release(ring);
+        hid_writer_complete(op, HID_WRITE_FAILED);
+    }
+}
+
+static void hid_writer_dispatch(HIDReadRing& ring, const OVERLAPPED_ENTRY& entry) {
+    HIDWriter& writer = *ring.writer;
+    HIDWriteOp* op = writer.current;
+    writer.current = nullptr;
+    op->running = false;
+    std::erase(_writing, &ring);
+
+    // the status is in the entry, the handle may be closed already
+    HIDWriteStatus status = HID_WRITE_FAILED;
+    if (entry.lpOverlapped->Internal == 0 && entry.dwNumberOfBytesTransferred == op->data.size())
+        status = HID_WRITE_OK;
+    else if (op->abort != HID_WRITE_OK)
+        status = op->abort;
+    else if (ring.closing)
+        status = HID_WRITE_DISCONNECTED;
+    hid_writer_complete(op, status);
+    hid_writer_pump(ring);
+    hid_ring_release(ring);
+}
+
+// aborts running writes past their deadline and returns how long the reactor may sleep
+static DWORD hid_writer_expire() {
+    DWORD timeout = INFINITE;
+    auto now = std::chrono::steady_clock::now();
+    for (HIDReadRing* ring : _writing) {
+        HIDWriteOp* op = ring->writer->current;
+        if (ring->closing || op->abort != HID_WRITE_OK)
+            continue; // cancelled already, the completion is on its way
+        if (op->deadline <= now) {
+            HIDWriteStatus expected = HID_WRITE_OK;
+            if (op->abort.compare_exchange_strong(expected, HID_WRITE_TIMEOUT))
+                CancelIoEx(ring->hid->handle, &ring->writeOverlapped);
+            continue;
+        }
+        auto wait = std::chrono::ceil<std::chrono::milliseconds>(op->deadline - now).count();
+        timeout = std::min(timeout, static_cast<DWORD>(wait));
+    }
+    return timeout;
+}
+
+static void hid_reactor_func_thread(HANDLE port) {
+    std::array<OVERLAPPED_ENTRY, 64> entries;
+
+    while (true) {
+        ULONG count = 0;
+        if (!GetQueuedCompletionStatusEx(port, entries.data(), static_cast<ULONG>(entries.size()), &count, hid_writer_expire(), FALSE)) {
+            if (GetLastError() == WAIT_TIMEOUT)
+                continue;
+            QLOG_ERROR("HID", "GetQueuedCompletionStatusEx failed with error: {}\n", GetLastErrorAsString());
+            break;
+        }
+        // one timestamp for the batch, the reports completed before it was dequeued
+        auto completed = std::chrono::steady_clock::now();
+        for (ULONG i = 0; i < count; i++) {
+            if (entries[i].lpOverlapped == NULL) {
+                QLOG_DEBUG("HID", "Reactor thread exiting...\n");
+                return;
+            }
+            auto& ring = *reinterpret_cast<HIDReadRing*>(entries[i].lpCompletionKey);
+            if (entries[i].lpOverlapped == &ring.writeKick) {
+                ring.writer->kicked = false; // pushes from here on post a new kick
+                hid_writer_pump(ring);
+                hid_ring_release(ring);
+            }
+            else if (entries[i].lpOverlapped == &ring.writeOverlapped) {
+                hid_writer_dispatch(ring, entries[i]);
+            }
+            else {
+                auto& slot = *CONTAINING_RECORD(entries[i].lpOverlapped, HIDReadSlot, overlapped);
+                hid_reactor_dispatch(ring, slot, completed);
+            }
+        }
+        std::erase_if(_retired, [](const auto& ring) { return ring->outstanding == 0; });
+    }
+}
+
+static bool win32_attach(HID& hid, HIDReadCallback callback, void* userData) {
+    std::call_once(_reactor.started, [] {
+        _reactor.port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+        if (_reactor.port)
+            _reactor.thread = std::jthread(hid_reactor_func_thread, _reactor.port);
+        else
+            QLOG_ERROR("HID", "CreateIoCompletionPort failed with error: {}\n", GetLastErrorAsString());
+        });
+    if (!_reactor.port)
+        return false;
+
+    HIDReadRing& ring = *hid.readRing;
+    ring.callback = callback;
+    ring.userData = userData;
+    // the ring is the completion key, it stays alive until all its reads are drained
+    if (!CreateIoCompletionPort(hid.handle, _reactor.port, reinterpret_cast<ULONG_PTR>(&ring), 0)) {
+        QLOG_ERROR("HID", "CreateIoCompletionPort failed with error: {}\n", GetLastErrorAsString());
+        ring.callback = nullptr;
+        return false;
+    }
+    ring.writer = hid.writer;
+    if (ring.writer)
+        ring.writer->attached = true;
+    hid_ring_post_all(ring);
+    return true;
+}
+
+static void win32_write_kick(HID& hid) {
+    HIDReadRing& ring = *hid.readRing;
+    ring.outstanding.fetch_add(1);
+    if (!PostQueuedCompletionStatus(_reactor.port, 0, reinterpret_cast<ULONG_PTR>(&ring), &ring.writeKick)) {
+        QLOG_ERROR("HID", "PostQueuedCompletionStatus failed with error: {}\n", GetLastErrorAsString());
+        ring.writer->kicked = false;
+        hid_ring_release(ring);
+    }
+}
+
+static void win32_write_cancel(HID& hid, HIDWriteOp& op) {
+    // a queued write is skipped by the reactor, only a running one needs the driver;
+    // it can't complete before this returns, completing waits for the stop callback
+    if (!op.running)
+        return;
+    HIDWriteStatus expected = HID_WRITE_OK;
+    if (op.abort.compare_exchange_strong(expected, HID_WRITE_CANCELLED))
+        CancelIoEx(hid.handle, &hid.readRing->writeOverlapped);
+}
+
+static bool win32_owns(const std::string& devname) {
+    return devname.starts_with("\\\\?\\") || devname.starts_with("\\\\.\\");
+}
+
+static bool win32_open(HID &hid, const std::string& devName) {
+
+    hid.handle = CreateFile(devName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+
+	if (hid.handle != INVALID_HANDLE_VALUE) {
+        DeviceNameParser devNameParse(devName);
+		HIDD_ATTRIBUTES attributes;
+		if (HidD_GetAttributes(hid.handle, &attributes)) {
+            hid.info.vid = attributes.VendorID;
+            hid.info.pid = attributes.ProductID;
+            hid.info.sernr = attributes.VersionNumber;
+            hid.info.devname = devName;
+            hid.port = devNameParse.getPort();
+            win32_caps(hid);
+            if (hid_ring_create(hid))
+			    return true;
+		}
+		CloseHandle(hid.handle);
+        hid.handle = INVALID_HANDLE_VALUE;
+	}
+    return false;
+}
+
+static void win32_close(HID& hid) {
+    if (hid.readRing) {
+        SetEvent(hid.readRing->stopEvent); // wake up a blocking hid_read
+    }
+    hid_ring_destroy(hid);
+    if(hid.handle != INVALID_HANDLE_VALUE)
+        CloseHandle(hid.handle);
+	hid.handle = INVALID_HANDLE_VALUE;
+}
+
+static bool win32_read(HID& hid, std::vector<uint8_t>& data, std::chrono::steady_clock::time_point* timestamp) {
+    if (hid.handle == INVALID_HANDLE_VALUE || !hid.readRing) {
+        return false;
+    }
+
+    HIDReadRing& ring = *hid.readRing;
+    if (ring.callback) {
+        return false; // served by the reactor
+    }
+    if (!ring.posted) {
+        hid_ring_post_all(ring);
+    }
+    HIDReadSlot& slot = ring.slots[ring.head];
+
+    // the slot could not be posted the last time, e.g. the device is going away
+    if (!slot.pending && !hid_ring_post(ring, slot)) {
+        data.clear();
+        return false;
+    }
+
+    bool readSuccess = false;
+    HANDLE events[] = { slot.overlapped.hEvent,  ring.stopEvent };
+    DWORD waitResult = WaitForMultipleObjects(ARRAYSIZE(events), events, FALSE, INFINITE); // Wait for either event
+    if (waitResult == WAIT_OBJECT_0) {
+        DWORD bytesRead = 0;
+        slot.pending = false;
+        hid_ring_release(ring);
+        if (GetOverlappedResult(hid.handle, &slot.overlapped, &bytesRead, FALSE) && bytesRead > 0) {
+            const uint8_t* buffer = hid_pool_buffer(*hid.pool, slot.buffer);
+            data.assign(buffer, buffer + bytesRead);
+            if (timestamp)
+                *timestamp = std::chrono::steady_clock::now();
+            readSuccess = true;
+        }
+        // hand the buffer back to the driver before the caller works on the report
+        hid_ring_post(ring, slot);
+        ring.head = (ring.head + 1) % ring.slots.size();
+    }
+    // else: the stop event was signaled, the slot stays posted until hid_close
+
+    if (!readSuccess)
+        data.clear();
+    return readSuccess;
+}
+
+
+static bool win32_write(HID& hid, const std::vector<uint8_t>& data) {
+    DWORD bytesWritten;
+    OVERLAPPED overlapped = { 0 };
+    HANDLE hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    // the low bit keeps the completion off the reactor's port if the handle is attached
+    overlapped.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(hEvent) | 1);
+
+    if (WriteFile(hid.handle, data.data(), (DWORD)data.size(), &bytesWritten, &overlapped) ||
+        GetLastError() == ERROR_IO_PENDING) {
+        if (WaitForSingleObject(hEvent, HID_WRITE_TIMEOUT_MS) != WAIT_OBJECT_0) {
+            QLOG_WARN("HID", "WriteFile timed out\n");
+            // the driver owns the buffer until the cancelled write completed
+            CancelIoEx(hid.handle, &overlapped);
+            WaitForSingleObject(hEvent, INFINITE);
+        }
+        if (GetOverlappedResult(hid.handle, &overlapped, &bytesWritten, FALSE)) {
+            CloseHandle(hEvent);
+            return bytesWritten == data.size();
+        }
+    }
+    else {
+        QLOG_ERROR("HID", "WriteFile failed with error: {}", GetLastErrorAsString());
+    }
+    CloseHandle(hEvent);
+    return false;
+}
+
+const HIDTransport hid_transport_win32 = {
+    "win32",
+    win32_owns,
+    win32_list,
+    win32_open,
+    win32_close,
+    win32_attach,
+    win32_read,
+    win32_write,
+    win32_write_kick,
+    win32_write_cancel,
+    win32_caps,
+    win32_error,
+};
+
+#endif // _WIN32
@@ -0,0 +1,90 @@
+#include <bit>
+#include <memory>
+#include <optional>
+#include "hidex.h"
+#include "hidtransport.h"
+
+std::shared_ptr<HIDBufferPool> hid_pool_create(size_t bufferSize, uint32_t count) {
+    if (count == 0 || count > 64)
+        return nullptr;
+    auto pool = std::make_shared<HIDBufferPool>();
+    pool->memory = std::make_unique<uint8_t[]>(bufferSize * count);
+    pool->bufferSize = bufferSize;
+    pool->count = count;
+    pool->freeMask = (count == 64) ? ~0ull : ((1ull << count) - 1);
+    pool->heapCopies = 0;
+    return pool;
+}
+
+std::optional<uint32_t> hid_pool_take(HIDBufferPool& pool) {
+    uint64_t mask = pool.freeMask.load(std::memory_order_relaxed);
+    while (mask) {
+        uint32_t index = static_cast<uint32_t>(std::countr_zero(mask));
+        if (pool.freeMask.compare_exchange_weak(mask, mask & ~(1ull << index), std::memory_order_acquire))
+            return index;
+    }
+    return std::nullopt;
+}
+
+void hid_pool_give(HIDBufferPool& pool, uint32_t index) {
+    pool.freeMask.fetch_or(1ull << index, std::memory_order_release);
+}
+
+uint8_t* hid_pool_buffer(HIDBufferPool& pool, uint32_t index) {
+    return pool.memory.get() + index * pool.bufferSize;
+}
+
+HIDReportBuffer hid_report_retain(HIDReport& report) {
+    HIDReportBuffer buffer;
+    if (report.retained)
+        return buffer;
+    if (report.pooled) {
+        // the read slot has moved on to another buffer, this one just changes hands
+        buffer.pool = report.pool->shared_from_this();
+        buffer.index = report.index;
+        buffer.bytes = report.data;
+        report.retained = true;
+    }
+    else {
+        // the buffer goes back into the read ring after the callback, keep a copy
+        if (report.pool) // no pool for replayed reports
+            report.pool->heapCopies.fetch_add(1, std::memory_order_relaxed);
+        buffer.copy = std::make_unique<uint8_t[]>(report.data.size());
+        std::copy(report.data.begin(), report.data.end(), buffer.copy.get());
+        buffer.bytes = std::span<const uint8_t>(buffer.copy.get(), report.data.size());
+    }
+    return buffer;
+}
+
+HIDReportBuffer::HIDReportBuffer(HIDReportBuffer&& other) noexcept
+    : pool(std::move(other.pool)), index(other.index), copy(std::move(other.copy)), bytes(other.bytes) {
+    other.bytes = {};
+}
+
+HIDReportBuffer& HIDReportBuffer::operator=(HIDReportBuffer&& other) noexcept {
+    if (this != &other) {
+        if (pool)
+            hid_pool_give(*pool, index);
+        pool = std::move(other.pool);
+        index = other.index;
+        copy = std::move(other.copy);
+        bytes = other.bytes;
+        other.bytes = {};
+    }
+    return *this;
+}
+
+HIDReportBuffer::~HIDReportBuffer() {
+    if (pool)
+        hid_pool_give(*pool, index);
+}
+
+HIDPoolStats hid_pool_stats(HID& hid) {
+    HIDPoolStats stats = {};
+    if (hid.pool) {
+        stats.buffers = hid.pool->count;
+        stats.free = static_cast<uint32_t>(std::popcount(hid.pool->freeMask.load()));
+        stats.heapCopies = hid.pool->heapCopies.load();
+    }
+    return stats;
+}
@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <iterator>
+#include "hidregistry.h"
+
+typedef struct _HIDRetired {
+    uint64_t epoch; // the epoch before the entry was unpublished
+    std::function<void()> destroy;
+} HIDRetired;
+
+static struct {
+    std::atomic<uint64_t> epoch{ 1 }; // 0 marks an idle reader
+    HIDEpochReader readers[HID_EPOCH_READERS];
+    std::atomic<uint32_t> overflow;   // readers without a slot, nothing is freed while there are any
+    std::mutex lock; // retired
+    std::vector<HIDRetired> retired;
+} _epoch;
+
+// the thread's reader slot, given back when the thread ends
+typedef struct _HIDEpochThread {
+    HIDEpochReader* reader = nullptr;
+    uint32_t depth = 0;
+    ~_HIDEpochThread() {
+        if (reader)
+            reader->used.store(false, std::memory_order_release);
+    }
+} HIDEpochThread;
+
+static thread_local HIDEpochThread _epochThread;
+
+static HIDEpochReader* hid_epoch_reader() {
+    if (_epochThread.reader)
+        return _epochThread.reader;
+    for (auto& reader : _epoch.readers) {
+        bool used = false;
+        if (reader.used.compare_exchange_strong(used, true, std::memory_order_acquire)) {
+            _epochThread.reader = &reader;
+            return &reader;
+        }
+    }
+    return nullptr;
+}
+
+_HIDEpochGuard::_HIDEpochGuard() {
+    reader = hid_epoch_reader();
+    outer = _epochThread.depth++ == 0;
+    if (!outer)
+        return;
+    // seq_cst, the following slot loads must not move above it
+    if (reader)
+        reader->active.store(_epoch.epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+    else
+        _epoch.overflow.fetch_add(1, std::memory_order_seq_cst);
+}
+
+_HIDEpochGuard::~_HIDEpochGuard() {
+    _epochThread.depth--;
+    if (!outer)
+        return;
+    if (reader)
+        reader->active.store(0, std::memory_order_release);
+    else
+        _epoch.overflow.fetch_sub(1, std::memory_order_release);
+}
+
+void hid_epoch_retire(std::function<void()> destroy) {
+    // readers entering from now on see the slot already empty
+    uint64_t epoch = _epoch.epoch.fetch_add(1, std::memory_order_seq_cst);
+    std::lock_guard guard(_epoch.lock);
+    _epoch.retired.push_back({ epoch, std::move(destroy) });
+}
+
+size_t hid_epoch_reclaim() {
+    uint64_t oldest = _epoch.overflow.load(std::memory_order_seq_cst) ? 0 : UINT64_MAX; // the oldest epoch a reader is still in
+    for (auto& reader : _epoch.readers) {
+        uint64_t active = reader.active.load(std::memory_order_seq_cst);
+        if (active)
+            oldest = std::min(oldest, active);
+    }
+    std::vector<HIDRetired> ready;
+    size_t waiting;
+    {
+        std::lock_guard guard(_epoch.lock);
+        auto keep = std::partition(_epoch.retired.begin(), _epoch.retired.end(),
+            [oldest](const HIDRetired& retired) { return retired.epoch >= oldest; });
+        std::move(keep, _epoch.retired.end(), std::back_inserter(ready));
+        _epoch.retired.erase(keep, _epoch.retired.end());
+        waiting = _epoch.retired.size();
+    }
+    for (auto& retired : ready) {
+        retired.destroy();
+    }
+    return waiting;
+}
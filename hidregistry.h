@@ -0,0 +1,145 @@
+#pragma once
+
+// Registry of the open devices for lookups from the read threads.
+//
+// A device gets a small id when it is added, the id goes to hid_connect as
+// userData and comes back with every report. Lookup is an index into a fixed
+// slot table, a reused slot gets a new generation so an old id never finds
+// the next device. Adding and removing is for one thread at a time (the UI
+// thread), lookups may run on any thread inside a HIDEpochGuard.
+//
+// A removed entry is freed once no reader which could have seen it is left:
+// a reader publishes the epoch it entered in, removal advances the epoch and
+// the entry is freed when every reader is idle or entered later.
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#define HID_REGISTRY_SLOTS   1024 // devices registered at once, a power of two
+#define HID_REGISTRY_INVALID 0
+#define HID_EPOCH_READERS    64   // reader threads with a slot, more are served but hold off reclaim
+
+typedef struct _HIDEpochReader {
+    std::atomic<uint64_t> active; // epoch at enter, 0 while outside of a guard
+    std::atomic<bool> used;       // owned by a thread
+} HIDEpochReader;
+
+// enters the epoch for the lifetime of the guard, may be nested
+typedef struct _HIDEpochGuard {
+    _HIDEpochGuard();
+    ~_HIDEpochGuard();
+    _HIDEpochGuard(const _HIDEpochGuard&) = delete;
+    _HIDEpochGuard& operator=(const _HIDEpochGuard&) = delete;
+    HIDEpochReader* reader;
+    bool outer;
+} HIDEpochGuard;
+
+// destroy runs once no reader can see the entry anymore, on the thread of a later reclaim
+void hid_epoch_retire(std::function<void()> destroy);
+// frees what can be freed, returns how many entries are still waiting
+size_t hid_epoch_reclaim();
+
+template <typename T>
+struct HIDRegistry {
+    std::mutex lock; // writers
+    std::atomic<T*> slots[HID_REGISTRY_SLOTS] = {};
+    uint16_t generation[HID_REGISTRY_SLOTS] = {};
+    std::vector<uint16_t> freeSlots;
+    std::vector<uint32_t> order; // ids in the order they were added, for the writer thread
+    uint16_t used = 0;           // slots handed out at least once
+    std::atomic<uint32_t> count = 0; // registered devices, for any thread
+};
+
+inline uint32_t hid_registry_slot(uint32_t id) {
+    return id & (HID_REGISTRY_SLOTS - 1);
+}
+
+inline void* hid_registry_userdata(uint32_t id) {
+    return reinterpret_cast<void*>(static_cast<uintptr_t>(id));
+}
+
+inline uint32_t hid_registry_id(void* userData) {
+    return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(userData));
+}
+
+// T needs a uint32_t id member, set here. HID_REGISTRY_INVALID if the table is full.
+template <typename T>
+uint32_t hid_registry_add(HIDRegistry<T>& registry, std::unique_ptr<T> entry) {
+    std::lock_guard guard(registry.lock);
+    uint32_t slot;
+    if (!registry.freeSlots.empty()) {
+        slot = registry.freeSlots.back();
+        registry.freeSlots.pop_back();
+    }
+    else if (registry.used < HID_REGISTRY_SLOTS) {
+        slot = registry.used++;
+    }
+    else {
+        return HID_REGISTRY_INVALID;
+    }
+    uint16_t generation = ++registry.generation[slot];
+    if (generation == 0)
+        generation = registry.generation[slot] = 1; // id 0 stays invalid
+    entry->id = (static_cast<uint32_t>(generation) << 16) | slot;
+    uint32_t id = entry->id;
+    registry.slots[slot].store(entry.release(), std::memory_order_release);
+    registry.order.push_back(id);
+    registry.count.fetch_add(1, std::memory_order_relaxed);
+    return id;
+}
+
+// inside a HIDEpochGuard, or on the writer thread; nullptr for a removed device
+template <typename T>
+T* hid_registry_get(HIDRegistry<T>& registry, uint32_t id) {
+    // seq_cst pairs with the reader's epoch store, see hid_registry_remove
+    T* entry = registry.slots[hid_registry_slot(id)].load(std::memory_order_seq_cst);
+    return (entry && entry->id == id) ? entry : nullptr;
+}
+
+template <typename T>
+bool hid_registry_remove(HIDRegistry<T>& registry, uint32_t id) {
+    T* entry;
+    {
+        std::lock_guard guard(registry.lock);
+        uint32_t slot = hid_registry_slot(id);
+        entry = registry.slots[slot].load(std::memory_order_relaxed);
+        if (!entry || entry->id != id)
+            return false;
+        registry.slots[slot].store(nullptr, std::memory_order_seq_cst);
+        registry.freeSlots.push_back(static_cast<uint16_t>(slot));
+        std::erase(registry.order, id);
+        registry.count.fetch_sub(1, std::memory_order_relaxed);
+    }
+    hid_epoch_retire([entry] { delete entry; });
+    hid_epoch_reclaim();
+    return true;
+}
+
+// the first device still registered, for the writer thread
+template <typename T>
+T* hid_registry_first(HIDRegistry<T>& registry) {
+    return registry.order.empty() ? nullptr : hid_registry_get(registry, registry.order.front());
+}
+
+// calls fn for each device in the order they were added, for the writer thread
+template <typename T, typename Fn>
+void hid_registry_for_each(HIDRegistry<T>& registry, Fn fn) {
+    std::vector<uint32_t> ids = registry.order; // fn may remove
+    for (uint32_t id : ids) {
+        if (T* entry = hid_registry_get(registry, id))
+            fn(*entry);
+    }
+}
+
+// removes every device, for shutdown
+template <typename T>
+void hid_registry_clear(HIDRegistry<T>& registry) {
+    std::vector<uint32_t> ids = registry.order;
+    for (uint32_t id : ids) {
+        hid_registry_remove(registry, id);
+    }
+}
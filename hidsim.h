@@ -0,0 +1,55 @@
+#pragma once
+
+// Simulated devices behind the hid_* functions, for load tests without
+// hardware. A device is opened like any other through its path "sim:<name>".
+// QMK boards answer QMV1 or QMV2 queries and report layer changes,
+// StreamDecks send StreamDeckHIDIn button reports. One simulation thread
+// generates the reports of all devices and runs their write queues.
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define HID_SIM_PREFIX "sim:"
+
+typedef enum _HIDSimKind {
+    HID_SIM_QMK = 0,
+    HID_SIM_STREAMDECK,
+} HIDSimKind;
+
+typedef struct _HIDSimDevice {
+    std::string name;          // the device path is HID_SIM_PREFIX + name
+    HIDSimKind kind;
+    uint16_t vid;
+    uint16_t pid;
+    std::string iface;         // matched against DeviceSupport.iface, e.g. "&MI_01"
+    uint32_t reportsPerSecond; // unsolicited layer changes or button presses, 0 for none
+    uint8_t layers;            // QMK: layers the board cycles through
+    uint8_t buttons;           // StreamDeck: 15, or 32 for the XL
+    bool qmv2;                 // QMK: agrees to QMV2 in the MSGPACK_CAPABILITIES handshake
+} HIDSimDevice;
+
+// one step of a hotplug script, relative to hid_sim_script
+typedef struct _HIDSimStep {
+    std::chrono::milliseconds at;
+    std::string name;
+    bool plug; // false unplugs
+} HIDSimStep;
+
+typedef struct _HIDSimStats {
+    uint64_t reports;  // delivered to a callback or queued for hid_read
+    uint64_t dropped;  // no free buffer or the hid_read queue was full
+    uint64_t writes;
+    uint64_t replies;
+} HIDSimStats;
+
+void hid_sim_add(const HIDSimDevice& device, bool plugged = true);
+// plugs a device in or out now, the hotplug callback runs on the calling thread
+void hid_sim_plug(const std::string& name, bool plugged);
+// replaces a running script, the steps run on the simulation thread
+void hid_sim_script(std::vector<HIDSimStep> steps);
+// devname is the full path, arrived false for an unplug
+void hid_sim_set_hotplug(std::function<void(const std::string& devname, bool arrived)> hotplug);
+HIDSimStats hid_sim_stats();
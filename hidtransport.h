@@ -0,0 +1,94 @@
+#pragma once
+
+// Backend interface below the hid_* functions in hidex.h. hidex.cpp picks the
+// backend which owns a device path and forwards to it, the backends only know
+// their own platform API.
+
+#include <string>
+#include <vector>
+#include <format>
+#include <cstdio>
+#include <atomic>
+#include <optional>
+#include <future>
+#include <functional>
+#include <stop_token>
+#include "hidex.h"
+#include "log.h"
+
+typedef struct _HIDTransport {
+    const char* name;
+    bool (*owns)(const std::string& devname); // is the device path one of ours
+    void (*list)(std::vector<DeviceSupport>& system, const std::vector<DeviceSupport>& supported);
+    bool (*open)(HID& hid, const std::string& devname);
+    void (*close)(HID& hid);
+    bool (*attach)(HID& hid, HIDReadCallback callback, void* userData); // deliver reads through the reactor
+    bool (*read)(HID& hid, std::vector<uint8_t>& data, std::chrono::steady_clock::time_point* timestamp);
+    bool (*write)(HID& hid, const std::vector<uint8_t>& data);
+    void (*write_kick)(HID& hid); // wake the thread which runs the writer's queue
+    void (*write_cancel)(HID& hid, struct _HIDWriteOp& op); // stop a running write, any thread
+    void (*caps)(HID& hid);
+    std::string (*error)(HID& hid);
+} HIDTransport;
+
+// Fixed set of equally sized report buffers in one allocation. Free buffers are
+// bits in a mask, so taking and returning one is a single atomic operation and
+// works from the reactor and from whichever thread drops a HIDReportBuffer.
+typedef struct _HIDBufferPool : std::enable_shared_from_this<_HIDBufferPool> {
+    std::unique_ptr<uint8_t[]> memory;
+    size_t bufferSize;
+    uint32_t count;
+    std::atomic<uint64_t> freeMask;
+    std::atomic<uint64_t> heapCopies;
+} HIDBufferPool;
+
+std::shared_ptr<HIDBufferPool> hid_pool_create(size_t bufferSize, uint32_t count);
+std::optional<uint32_t> hid_pool_take(HIDBufferPool& pool);
+void hid_pool_give(HIDBufferPool& pool, uint32_t index);
+uint8_t* hid_pool_buffer(HIDBufferPool& pool, uint32_t index);
+
+typedef struct _HIDWriteNode {
+    std::atomic<struct _HIDWriteNode*> next;
+} HIDWriteNode;
+
+typedef struct _HIDWriteOp : HIDWriteNode {
+    std::vector<uint8_t> data;
+    std::chrono::steady_clock::time_point deadline;
+    std::stop_token stop;
+    std::unique_ptr<std::stop_callback<std::function<void()>>> onStop;
+    std::promise<HIDWriteStatus> promise;
+    std::function<void(HIDWriteStatus)> done;
+    std::atomic<bool> running;         // handed to the OS, write_cancel may abort it
+    std::atomic<HIDWriteStatus> abort; // why the reactor aborted the running write
+} HIDWriteOp;
+
+// Write queue of one device: intrusive multi producer / single consumer list
+// (Vyukov). Any thread pushes without locks, only the thread serving the device
+// pops (the reactor, or the write thread on Linux), except in hid_close after
+// it let go of the device. One write runs at a time.
+typedef struct _HIDWriter {
+    std::atomic<HIDWriteNode*> head; // last pushed
+    HIDWriteNode* tail;              // next to pop
+    HIDWriteNode stub;
+    bool attached;                   // served by a reactor, set by the transport
+    std::atomic<bool> closing;
+    std::atomic<uint32_t> submitters; // hid_write_async calls between the closing check and the push
+    std::atomic<bool> kicked;         // a wakeup is already on its way to the reactor
+    HIDWriteOp* current;              // running write, reactor only
+} HIDWriter;
+
+std::shared_ptr<HIDWriter> hid_writer_create();
+// next write to start: queued writes which were cancelled or expired meanwhile are completed on the way
+HIDWriteOp* hid_writer_next(HIDWriter& writer);
+// resolves the future, runs the done callback and frees the write
+void hid_writer_complete(HIDWriteOp* op, HIDWriteStatus status);
+// completes everything still queued, in order
+void hid_writer_drain(HIDWriter& writer, HIDWriteStatus status);
+
+#ifdef _WIN32
+extern const HIDTransport hid_transport_win32;
+#endif
+#ifdef __linux__
+extern const HIDTransport hid_transport_hidraw;
+#endif
+extern const HIDTransport hid_transport_sim; // "sim:" paths, see hidsim.h
@@ -0,0 +1,113 @@
+#include <chrono>
+#include <memory>
+#include <span>
+#include "hidex.h"
+#include "hidtransport.h"
+#include "hidcapture.h"
+
+std::shared_ptr<HIDWriter> hid_writer_create() {
+    auto writer = std::make_shared<HIDWriter>();
+    writer->stub.next = nullptr;
+    writer->head = &writer->stub;
+    writer->tail = &writer->stub;
+    writer->attached = false;
+    writer->closing = false;
+    writer->submitters = 0;
+    writer->kicked = false;
+    writer->current = nullptr;
+    return writer;
+}
+
+static void hid_writer_push(HIDWriter& writer, HIDWriteNode* node) {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    HIDWriteNode* prev = writer.head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+}
+
+static HIDWriteOp* hid_writer_pop(HIDWriter& writer) {
+    HIDWriteNode* tail = writer.tail;
+    HIDWriteNode* next = tail->next.load(std::memory_order_acquire);
+    if (tail == &writer.stub) {
+        if (!next)
+            return nullptr;
+        writer.tail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+        writer.tail = next;
+        return static_cast<HIDWriteOp*>(tail);
+    }
+    if (tail != writer.head.load(std::memory_order_acquire))
+        return nullptr; // a producer is between its exchange and its link, picked up with its kick
+    hid_writer_push(writer, &writer.stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+        writer.tail = next;
+        return static_cast<HIDWriteOp*>(tail);
+    }
+    return nullptr;
+}
+
+void hid_writer_complete(HIDWriteOp* op, HIDWriteStatus status) {
+    op->onStop.reset(); // waits for a stop callback running on another thread
+    op->promise.set_value(status);
+    if (op->done)
+        op->done(status);
+    delete op;
+}
+
+HIDWriteOp* hid_writer_next(HIDWriter& writer) {
+    while (HIDWriteOp* op = hid_writer_pop(writer)) {
+        if (op->stop.stop_requested())
+            hid_writer_complete(op, HID_WRITE_CANCELLED);
+        else if (std::chrono::steady_clock::now() >= op->deadline)
+            hid_writer_complete(op, HID_WRITE_TIMEOUT);
+        else
+            return op;
+    }
+    return nullptr;
+}
+
+void hid_writer_drain(HIDWriter& writer, HIDWriteStatus status) {
+    while (HIDWriteOp* op = hid_writer_pop(writer)) {
+        hid_writer_complete(op, status);
+    }
+}
+
+std::future<HIDWriteStatus> hid_write_async(HID& hid, std::span<const uint8_t> data, HIDWriteOptions options) {
+    auto op = new HIDWriteOp();
+    op->data.assign(data.begin(), data.end());
+    op->deadline = std::chrono::steady_clock::now() + options.timeout;
+    op->stop = options.stop;
+    op->done = std::move(options.done);
+    op->running = false;
+    op->abort = HID_WRITE_OK;
+    auto future = op->promise.get_future();
+
+    HIDWriter* writer = hid.writer.get();
+    if (!writer || !writer->attached || !hid.transport) {
+        hid_writer_complete(op, writer ? HID_WRITE_FAILED : HID_WRITE_DISCONNECTED);
+        return future;
+    }
+    // hid_close sets closing first and then waits for the submitters, so a write
+    // is either refused here or pushed before the close drains the queue
+    writer->submitters.fetch_add(1);
+    if (writer->closing) {
+        writer->submitters.fetch_sub(1);
+        writer->submitters.notify_all();
+        hid_writer_complete(op, HID_WRITE_DISCONNECTED);
+        return future;
+    }
+    if (op->stop.stop_possible()) {
+        op->onStop = std::make_unique<std::stop_callback<std::function<void()>>>(op->stop,
+            std::function<void()>([&hid, op] { hid.transport->write_cancel(hid, *op); }));
+    }
+    hid_capture_record(hid, HID_CAPTURE_OUT, data, std::chrono::steady_clock::now());
+    hid_writer_push(*writer, op);
+    if (!writer->kicked.exchange(true))
+        hid.transport->write_kick(hid);
+    writer->submitters.fetch_sub(1);
+    writer->submitters.notify_all();
+    return future;
+}
@@ -0,0 +1,494 @@
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include <stop_token>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "log.h"
+
+std::atomic<int> _logLevel = QLOG_LEVEL_DEBUG;
+std::atomic<bool> _logDeferred = false;
+
+static const char* _levelNames[] = { "trace", "debug", "info", "warn", "error", "off" };
+
+#pragma pack(push, 1)
+typedef struct _LogRingRecord {
+    uint16_t size; // with this header
+    uint16_t reserved;
+    uint32_t site;
+    int64_t time;  // steady clock, ns
+} LogRingRecord;
+#pragma pack(pop)
+
+// single producer, the owning thread; single consumer, whoever holds drainLock
+typedef struct _LogRing {
+    std::atomic<uint64_t> head;    // bytes written
+    std::atomic<uint64_t> tail;    // bytes consumed
+    std::atomic<uint64_t> dropped; // records which didn't fit
+    std::atomic<bool> retired;     // the thread has ended
+    uint16_t thread;
+    uint8_t data[QLOG_RING_SIZE];
+} LogRing;
+
+typedef struct _LogRingHolder {
+    std::shared_ptr<LogRing> ring;
+    ~_LogRingHolder() {
+        if (ring)
+            ring->retired.store(true, std::memory_order_release);
+    }
+} LogRingHolder;
+
+typedef struct _LogEntry {
+    int64_t time;
+    uint32_t site;
+    uint16_t thread;
+    size_t offset; // of the argument bytes in the drain buffer
+    size_t size;
+} LogEntry;
+
+static struct {
+    std::mutex siteLock;
+    std::vector<LogSite*> sites; // by id - 1
+
+    std::mutex ringLock;
+    std::vector<std::shared_ptr<LogRing>> rings;
+    uint16_t threads;
+
+    std::mutex drainLock;
+    std::vector<uint8_t> buffer; // argument bytes of the records being drained
+    std::vector<LogEntry> entries;
+    LogSink sink;
+    std::string path;
+    FILE* file;
+    size_t fileSize;
+    int64_t fileOrigin;          // steady clock ns at the file's time 0
+    std::vector<bool> described; // sites with a QLOG_RECORD_SITE in the current file
+
+    std::mutex wakeLock;
+    std::condition_variable_any wake;
+    std::atomic<bool> signaled; // a wakeup is on its way to the log thread
+    std::jthread thread; // last, stopped before the rest goes away
+} _logger;
+
+static thread_local LogRingHolder _logRing;
+
+static int64_t log_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void log_set_level(int level) {
+    _logLevel.store(level, std::memory_order_relaxed);
+}
+
+bool log_set_level(const std::string& name) {
+    for (int level = QLOG_LEVEL_TRACE; level <= QLOG_LEVEL_OFF; level++) {
+        if (name == _levelNames[level]) {
+            log_set_level(level);
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::string log_line(int level, const char* tag, const std::string& message) {
+    std::string line = std::string(tag) + ": ";
+    if (level >= QLOG_LEVEL_WARN)
+        line += (level == QLOG_LEVEL_WARN) ? "warning: " : "error: ";
+    line += message;
+    return line;
+}
+
+static void log_output(LogSink sink, const std::string& line) {
+#ifdef _WIN32
+    if (sink == QLOG_SINK_DEBUGGER) {
+        OutputDebugString(line.c_str());
+        return;
+    }
+#endif
+    (void)sink;
+    fputs(line.c_str(), stderr);
+}
+
+void log_write(int level, const char* tag, const std::string& message) {
+    log_output(QLOG_SINK_DEBUGGER, log_line(level, tag, message));
+}
+
+static uint32_t log_site_register(LogSite& site, const char* format) {
+    std::lock_guard guard(_logger.siteLock);
+    uint32_t id = site.id.load(std::memory_order_relaxed);
+    if (id == 0) {
+        site.format = format;
+        _logger.sites.push_back(&site);
+        id = static_cast<uint32_t>(_logger.sites.size());
+        site.id.store(id, std::memory_order_release);
+    }
+    return id;
+}
+
+static const LogSite* log_site(uint32_t id) {
+    std::lock_guard guard(_logger.siteLock);
+    return (id && id <= _logger.sites.size()) ? _logger.sites[id - 1] : nullptr;
+}
+
+static LogRing& log_ring() {
+    if (!_logRing.ring) {
+        auto ring = std::make_shared<LogRing>();
+        ring->head = 0;
+        ring->tail = 0;
+        ring->dropped = 0;
+        ring->retired = false;
+        std::lock_guard guard(_logger.ringLock);
+        ring->thread = _logger.threads++;
+        _logger.rings.push_back(ring);
+        _logRing.ring = std::move(ring);
+    }
+    return *_logRing.ring;
+}
+
+static void log_ring_copy(LogRing& ring, uint64_t position, const void* data, size_t size) {
+    size_t offset = position & (QLOG_RING_SIZE - 1);
+    size_t first = std::min<size_t>(size, QLOG_RING_SIZE - offset);
+    memcpy(ring.data + offset, data, first);
+    memcpy(ring.data, static_cast<const uint8_t*>(data) + first, size - first);
+}
+
+static void log_ring_read(const LogRing& ring, uint64_t position, void* data, size_t size) {
+    size_t offset = position & (QLOG_RING_SIZE - 1);
+    size_t first = std::min<size_t>(size, QLOG_RING_SIZE - offset);
+    memcpy(data, ring.data + offset, first);
+    memcpy(static_cast<uint8_t*>(data) + first, ring.data, size - first);
+}
+
+// one wakeup per drain, the log thread clears the flag before it drains
+static void log_wake() {
+    if (_logger.signaled.exchange(true, std::memory_order_acq_rel))
+        return;
+    std::lock_guard guard(_logger.wakeLock);
+    _logger.wake.notify_one();
+}
+
+void log_push(LogSite& site, const char* format, const LogArgs& args) {
+    uint32_t id = site.id.load(std::memory_order_acquire);
+    if (id == 0)
+        id = log_site_register(site, format);
+    if (!_logDeferred.load(std::memory_order_acquire)) {
+        log_write(site.level, site.tag, log_render(format, std::span<const uint8_t>(args.data, args.size)));
+        return;
+    }
+
+    LogRing& ring = log_ring();
+    LogRingRecord record;
+    record.size = static_cast<uint16_t>(sizeof(record) + args.size);
+    record.reserved = 0;
+    record.site = id;
+    record.time = log_now();
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    uint64_t tail = ring.tail.load(std::memory_order_acquire);
+    if (QLOG_RING_SIZE - (head - tail) < record.size) {
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    log_ring_copy(ring, head, &record, sizeof(record));
+    log_ring_copy(ring, head + sizeof(record), args.data, args.size);
+    ring.head.store(head + record.size, std::memory_order_release);
+    // the first record since the last drain, or the ring is half full; the fence
+    // pairs with the one in log_pending, either the log thread sees this record
+    // or we see the tail of its drain
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail == head || head + record.size - tail >= QLOG_RING_SIZE / 2)
+        log_wake();
+}
+
+static bool log_render_arg(std::string& out, const std::string& spec, std::span<const uint8_t> args, size_t& pos) {
+    if (pos >= args.size())
+        return false;
+    uint8_t type = args[pos++];
+    auto take = [&](void* value, size_t size) {
+        if (pos + size > args.size())
+            return false;
+        memcpy(value, &args[pos], size);
+        pos += size;
+        return true;
+        };
+    try {
+        switch (type) {
+        case QLOG_ARG_INT: {
+            int64_t value;
+            if (!take(&value, sizeof(value)))
+                return false;
+            out += std::vformat(spec, std::make_format_args(value));
+            return true;
+        }
+        case QLOG_ARG_UINT: {
+            uint64_t value;
+            if (!take(&value, sizeof(value)))
+                return false;
+            out += std::vformat(spec, std::make_format_args(value));
+            return true;
+        }
+        case QLOG_ARG_DOUBLE: {
+            double value;
+            if (!take(&value, sizeof(value)))
+                return false;
+            out += std::vformat(spec, std::make_format_args(value));
+            return true;
+        }
+        case QLOG_ARG_CHAR: {
+            char value;
+            if (!take(&value, sizeof(value)))
+                return false;
+            out += std::vformat(spec, std::make_format_args(value));
+            return true;
+        }
+        case QLOG_ARG_BOOL: {
+            uint8_t raw;
+            if (!take(&raw, sizeof(raw)))
+                return false;
+            bool value = raw != 0;
+            out += std::vformat(spec, std::make_format_args(value));
+            return true;
+        }
+        case QLOG_ARG_STRING: {
+            uint16_t length;
+            if (!take(&length, sizeof(length)) || pos + length > args.size())
+                return false;
+            std::string_view value(reinterpret_cast<const char*>(&args[pos]), length);
+            pos += length;
+            out += std::vformat(spec, std::make_format_args(value));
+            return true;
+        }
+        }
+    }
+    catch (const std::format_error&) {
+        out += spec; // a spec which doesn't suit the type, shown as is
+        return true;
+    }
+    pos = args.size(); // unknown type, the rest can't be decoded
+    return false;
+}
+
+std::string log_render(const char* format, std::span<const uint8_t> args) {
+    std::string out;
+    size_t pos = 0;
+    for (const char* p = format; *p; p++) {
+        if ((p[0] == '{' && p[1] == '{') || (p[0] == '}' && p[1] == '}')) {
+            out += *p++;
+            continue;
+        }
+        if (*p != '{') {
+            out += *p;
+            continue;
+        }
+        const char* end = strchr(p, '}');
+        if (!end) {
+            out += p;
+            break;
+        }
+        std::string spec(p, end + 1);
+        if (!log_render_arg(out, spec, args, pos))
+            out += "{?}";
+        p = end;
+    }
+    return out;
+}
+
+static void log_file_write(const LogFileRecord& record, const void* data, size_t size) {
+    fwrite(&record, sizeof(record), 1, _logger.file);
+    if (size)
+        fwrite(data, size, 1, _logger.file);
+    _logger.fileSize += sizeof(record) + size;
+}
+
+static bool log_file_open() {
+    _logger.file = fopen(_logger.path.c_str(), "wb");
+    if (!_logger.file)
+        return false;
+    LogFileHeader header;
+    memcpy(header.magic, QLOG_FILE_MAGIC, sizeof(header.magic));
+    header.version = QLOG_FILE_VERSION;
+    header.started = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    fwrite(&header, sizeof(header), 1, _logger.file);
+    _logger.fileSize = sizeof(header);
+    _logger.fileOrigin = log_now();
+    _logger.described.clear();
+    return true;
+}
+
+// path becomes path.1, path.1 becomes path.2 and so on, the oldest goes away
+static void log_file_rotate() {
+    fclose(_logger.file);
+    _logger.file = nullptr;
+    std::error_code ec;
+    for (int i = QLOG_FILE_COUNT - 1; i > 0; i--) {
+        std::string from = (i == 1) ? _logger.path : _logger.path + "." + std::to_string(i - 1);
+        std::filesystem::rename(from, _logger.path + "." + std::to_string(i), ec);
+    }
+    if (!log_file_open())
+        log_output(QLOG_SINK_STDERR, log_line(QLOG_LEVEL_ERROR, "LOG", "Can't reopen " + _logger.path + "\n"));
+}
+
+static void log_file_event(const LogEntry& entry, const LogSite& site) {
+    if (!_logger.file)
+        return;
+    LogFileRecord record = {};
+    record.time = entry.time > _logger.fileOrigin ? (entry.time - _logger.fileOrigin) / 1000 : 0;
+    record.site = entry.site;
+    record.thread = entry.thread;
+    if (_logger.described.size() <= entry.site)
+        _logger.described.resize(entry.site + 1);
+    if (!_logger.described[entry.site]) {
+        LogFileSite info;
+        info.level = static_cast<uint8_t>(site.level);
+        info.tagLength = static_cast<uint16_t>(strlen(site.tag));
+        info.formatLength = static_cast<uint16_t>(strlen(site.format));
+        std::vector<uint8_t> data(sizeof(info) + info.tagLength + info.formatLength);
+        memcpy(data.data(), &info, sizeof(info));
+        memcpy(data.data() + sizeof(info), site.tag, info.tagLength);
+        memcpy(data.data() + sizeof(info) + info.tagLength, site.format, info.formatLength);
+        record.type = QLOG_RECORD_SITE;
+        record.length = static_cast<uint32_t>(data.size());
+        log_file_write(record, data.data(), data.size());
+        _logger.described[entry.site] = true;
+    }
+    record.type = QLOG_RECORD_EVENT;
+    record.length = static_cast<uint32_t>(entry.size);
+    log_file_write(record, _logger.buffer.data() + entry.offset, entry.size);
+}
+
+static void log_dropped(const LogRing& ring, uint64_t dropped) {
+    if (_logger.sink == QLOG_SINK_FILE) {
+        if (!_logger.file)
+            return;
+        LogFileRecord record = {};
+        record.time = (log_now() - _logger.fileOrigin) / 1000;
+        record.thread = ring.thread;
+        record.type = QLOG_RECORD_DROPPED;
+        record.length = sizeof(dropped);
+        log_file_write(record, &dropped, sizeof(dropped));
+    }
+    else {
+        log_output(_logger.sink, log_line(QLOG_LEVEL_WARN, "LOG",
+            std::format("{} records of thread {} dropped, the ring was full\n", dropped, ring.thread)));
+    }
+}
+
+// moves the records of all rings to the sink, oldest first
+static void log_drain() {
+    std::lock_guard guard(_logger.drainLock);
+    std::vector<std::shared_ptr<LogRing>> rings;
+    {
+        std::lock_guard ringGuard(_logger.ringLock);
+        rings = _logger.rings;
+    }
+    _logger.buffer.clear();
+    _logger.entries.clear();
+    for (auto& ring : rings) {
+        uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped)
+            log_dropped(*ring, dropped);
+        bool retired = ring->retired.load(std::memory_order_acquire);
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        while (tail < head) {
+            LogRingRecord record;
+            log_ring_read(*ring, tail, &record, sizeof(record));
+            LogEntry entry;
+            entry.time = record.time;
+            entry.site = record.site;
+            entry.thread = ring->thread;
+            entry.offset = _logger.buffer.size();
+            entry.size = record.size - sizeof(record);
+            _logger.buffer.resize(entry.offset + entry.size);
+            log_ring_read(*ring, tail + sizeof(record), _logger.buffer.data() + entry.offset, entry.size);
+            _logger.entries.push_back(entry);
+            tail += record.size;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+        if (retired) {
+            std::lock_guard ringGuard(_logger.ringLock);
+            std::erase(_logger.rings, ring);
+        }
+    }
+
+    std::stable_sort(_logger.entries.begin(), _logger.entries.end(),
+        [](const LogEntry& a, const LogEntry& b) { return a.time < b.time; });
+    for (const LogEntry& entry : _logger.entries) {
+        const LogSite* site = log_site(entry.site);
+        if (!site)
+            continue;
+        if (_logger.sink == QLOG_SINK_FILE) {
+            log_file_event(entry, *site);
+        }
+        else {
+            std::span<const uint8_t> args(_logger.buffer.data() + entry.offset, entry.size);
+            log_output(_logger.sink, log_line(site->level, site->tag, log_render(site->format, args)));
+        }
+    }
+    if (_logger.file) {
+        fflush(_logger.file);
+        if (_logger.fileSize >= QLOG_FILE_SIZE)
+            log_file_rotate();
+    }
+}
+
+// a record pushed while a drain ran may not have woken us, see log_push
+static bool log_pending() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::lock_guard guard(_logger.ringLock);
+    return std::any_of(_logger.rings.begin(), _logger.rings.end(), [](const std::shared_ptr<LogRing>& ring) {
+        return ring->head.load(std::memory_order_acquire) != ring->tail.load(std::memory_order_relaxed)
+            || ring->dropped.load(std::memory_order_relaxed);
+        });
+}
+
+static void log_thread_func(std::stop_token stop) {
+    while (!stop.stop_requested()) {
+        _logger.signaled.store(false, std::memory_order_release);
+        log_drain();
+        std::unique_lock lock(_logger.wakeLock);
+        _logger.wake.wait(lock, stop, [] { return _logger.signaled.load(std::memory_order_acquire) || log_pending(); });
+    }
+}
+
+bool log_start(LogSink sink, const std::string& path) {
+    if (_logDeferred.load(std::memory_order_acquire))
+        return true;
+    {
+        std::lock_guard guard(_logger.drainLock);
+        _logger.sink = sink;
+        _logger.path = path;
+        if (sink == QLOG_SINK_FILE && !log_file_open()) {
+            log_write(QLOG_LEVEL_ERROR, "LOG", "Log file " + path + " can't be created\n");
+            return false;
+        }
+    }
+    _logger.thread = std::jthread(log_thread_func);
+    _logDeferred.store(true, std::memory_order_release);
+    return true;
+}
+
+void log_flush() {
+    if (_logDeferred.load(std::memory_order_acquire))
+        log_drain();
+}
+
+void log_stop() {
+    if (!_logDeferred.exchange(false, std::memory_order_acq_rel))
+        return;
+    _logger.thread.request_stop();
+    _logger.thread = {};
+    log_drain();
+    std::lock_guard guard(_logger.drainLock);
+    if (_logger.file) {
+        fclose(_logger.file);
+        _logger.file = nullptr;
+    }
+}
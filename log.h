@@ -0,0 +1,213 @@
+#pragma once
+
+// Logging for all modules. A statement below QLOG_LEVEL is removed at compile
+// time, one below the runtime level costs a relaxed load. Either way its
+// arguments are neither evaluated nor formatted.
+//
+//   QLOG_DEBUG("HID", "Opened {}\n", path);
+//
+// Once log_start has run, an enabled statement only copies its site id and
+// the raw argument bytes into a ring owned by the calling thread. The log
+// thread sleeps until a ring gets its first record or fills up, then formats
+// the records and hands them to the sink, or writes them unformatted into a
+// binary file which tools/qmklogdump.cpp decodes.
+// Before log_start, and after log_stop, statements are formatted and
+// written at once.
+//
+// Binary file layout, little endian:
+//   LogFileHeader
+//   LogFileRecord + length bytes, repeated
+// A site is described by a QLOG_RECORD_SITE record (LogFileSite + tag +
+// format) before its first event in the file, each rotated file on its own.
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#define QLOG_LEVEL_TRACE 0 // per report
+#define QLOG_LEVEL_DEBUG 1
+#define QLOG_LEVEL_INFO  2
+#define QLOG_LEVEL_WARN  3
+#define QLOG_LEVEL_ERROR 4
+#define QLOG_LEVEL_OFF   5
+
+// compile-time floor, e.g. /DQLOG_LEVEL=QLOG_LEVEL_WARN for a quiet build
+#ifndef QLOG_LEVEL
+#ifdef _DEBUG
+#define QLOG_LEVEL QLOG_LEVEL_TRACE
+#else
+#define QLOG_LEVEL QLOG_LEVEL_INFO
+#endif
+#endif
+
+#define QLOG_ARGS_MAX   512         // argument bytes of one record, longer strings are cut
+#define QLOG_RING_SIZE  (64 * 1024) // per thread, a power of two
+#define QLOG_FILE_SIZE  (4 * 1024 * 1024)
+#define QLOG_FILE_COUNT 3           // the file and its rotated copies .1 .. .2
+
+#define QLOG_FILE_MAGIC "QLOG1"
+#define QLOG_FILE_VERSION 1
+
+typedef enum _LogSink {
+    QLOG_SINK_DEBUGGER = 0, // OutputDebugString, stderr outside of Windows
+    QLOG_SINK_STDERR = 1,
+    QLOG_SINK_FILE = 2,     // binary, rotated at QLOG_FILE_SIZE
+} LogSink;
+
+// argument type tags in a record
+typedef enum _LogArgType {
+    QLOG_ARG_INT = 'i',    // int64_t
+    QLOG_ARG_UINT = 'u',   // uint64_t
+    QLOG_ARG_DOUBLE = 'd',
+    QLOG_ARG_CHAR = 'c',
+    QLOG_ARG_BOOL = 'b',
+    QLOG_ARG_STRING = 's', // uint16_t length + bytes
+} LogArgType;
+
+typedef enum _LogRecordType {
+    QLOG_RECORD_SITE = 1,    // LogFileSite + tag + format
+    QLOG_RECORD_EVENT = 2,   // the argument bytes
+    QLOG_RECORD_DROPPED = 3, // uint64_t, records lost since the last one
+} LogRecordType;
+
+#pragma pack(push, 1)
+typedef struct _LogFileHeader {
+    char magic[5];    // QLOG_FILE_MAGIC without the terminating 0
+    uint16_t version;
+    int64_t started;  // ms since the unix epoch at time 0
+} LogFileHeader;
+
+typedef struct _LogFileRecord {
+    uint64_t time;   // us since the file's time 0
+    uint32_t site;
+    uint16_t thread; // in order of the threads' first statement
+    uint8_t type;    // LogRecordType
+    uint8_t reserved;
+    uint32_t length; // bytes following the record
+} LogFileRecord;
+
+typedef struct _LogFileSite {
+    uint8_t level;
+    uint16_t tagLength;
+    uint16_t formatLength;
+} LogFileSite;
+#pragma pack(pop)
+
+// one per statement, id assigned on its first record
+typedef struct _LogSite {
+    int level;
+    const char* tag;
+    const char* format;
+    std::atomic<uint32_t> id;
+} LogSite;
+
+typedef struct _LogArgs {
+    uint8_t data[QLOG_ARGS_MAX];
+    size_t size;
+    bool full; // an argument didn't fit, the rest are left out and render as {?}
+} LogArgs;
+
+extern std::atomic<int> _logLevel;     // runtime floor, QLOG_LEVEL_DEBUG until log_set_level
+extern std::atomic<bool> _logDeferred; // between log_start and log_stop
+
+void log_set_level(int level);
+// "trace" .. "off", false for an unknown name
+bool log_set_level(const std::string& name);
+// the text sink, OutputDebugString on Windows and stderr elsewhere
+void log_write(int level, const char* tag, const std::string& message);
+
+// starts the log thread, path is the binary file for QLOG_SINK_FILE
+bool log_start(LogSink sink, const std::string& path = {});
+// waits until everything logged so far went to the sink
+void log_flush();
+void log_stop();
+
+// queues a record, or writes it at once while no log thread runs
+void log_push(LogSite& site, const char* format, const LogArgs& args);
+// formats the argument bytes of a record, as the log thread and qmklogdump do
+std::string log_render(const char* format, std::span<const uint8_t> args);
+
+inline bool log_enabled(int level) {
+    return level >= QLOG_LEVEL && level >= _logLevel.load(std::memory_order_relaxed);
+}
+
+inline void log_put(LogArgs& args, const void* data, size_t size) {
+    memcpy(args.data + args.size, data, size);
+    args.size += size;
+}
+
+inline void log_put_string(LogArgs& args, std::string_view text) {
+    if (args.full || args.size + 3 > QLOG_ARGS_MAX) {
+        args.full = true;
+        return;
+    }
+    uint16_t length = static_cast<uint16_t>(std::min(text.size(), QLOG_ARGS_MAX - args.size - 3));
+    args.data[args.size++] = QLOG_ARG_STRING;
+    log_put(args, &length, sizeof(length));
+    log_put(args, text.data(), length);
+}
+
+template <typename T>
+void log_put_value(LogArgs& args, LogArgType type, T value) {
+    if (args.full || args.size + 1 + sizeof(value) > QLOG_ARGS_MAX) {
+        args.full = true;
+        return;
+    }
+    args.data[args.size++] = static_cast<uint8_t>(type);
+    log_put(args, &value, sizeof(value));
+}
+
+// the raw bytes of one argument, types without a tag are formatted here
+template <typename T>
+void log_arg(LogArgs& args, const T& value) {
+    using U = std::remove_cvref_t<T>;
+    if constexpr (std::is_same_v<U, bool>)
+        log_put_value(args, QLOG_ARG_BOOL, static_cast<uint8_t>(value));
+    else if constexpr (std::is_same_v<U, char>)
+        log_put_value(args, QLOG_ARG_CHAR, value);
+    else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>)
+        log_put_value(args, QLOG_ARG_INT, static_cast<int64_t>(value));
+    else if constexpr (std::is_integral_v<U>)
+        log_put_value(args, QLOG_ARG_UINT, static_cast<uint64_t>(value));
+    else if constexpr (std::is_floating_point_v<U>)
+        log_put_value(args, QLOG_ARG_DOUBLE, static_cast<double>(value));
+    else if constexpr (std::is_same_v<U, const char*> || std::is_same_v<U, char*>)
+        log_put_string(args, value ? value : "(null)");
+    else if constexpr (std::is_convertible_v<const U&, std::string_view>)
+        log_put_string(args, std::string_view(value));
+    else
+        log_put_string(args, std::format("{}", value));
+}
+
+template <typename... Args>
+void log_record(LogSite& site, const char* format, const Args&... values) {
+    LogArgs args;
+    args.size = 0;
+    args.full = false;
+    (log_arg(args, values), ...);
+    log_push(site, format, args);
+}
+
+// the site is static, so its id survives between calls
+#define QLOG(level, tag, ...) \
+    do { \
+        if constexpr ((level) >= QLOG_LEVEL) { \
+            if (log_enabled(level)) { \
+                static LogSite _logSite = { (level), (tag), nullptr, 0 }; \
+                log_record(_logSite, __VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+#define QLOG_TRACE(tag, ...) QLOG(QLOG_LEVEL_TRACE, tag, __VA_ARGS__)
+#define QLOG_DEBUG(tag, ...) QLOG(QLOG_LEVEL_DEBUG, tag, __VA_ARGS__)
+#define QLOG_INFO(tag, ...)  QLOG(QLOG_LEVEL_INFO, tag, __VA_ARGS__)
+#define QLOG_WARN(tag, ...)  QLOG(QLOG_LEVEL_WARN, tag, __VA_ARGS__)
+#define QLOG_ERROR(tag, ...) QLOG(QLOG_LEVEL_ERROR, tag, __VA_ARGS__)
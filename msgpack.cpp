@@ -1,138 +1,343 @@
 
 #include <format> // For std::format
-#include <mpack.h>
+#include <array>
+#include <cstring>
+#include <type_traits>
 #include "msgpack.h"
 #include "hidex.h"
+#include "log.h"
 
-typedef struct {
-    uint8_t key;
-    const char *name;
-} msgpack_key_t;
+#define MSGPACK_FIELD(KEY, TYPE, NAME) names[KEY] = NAME;
+static constexpr std::array<const char*, MSGPACK_KEY_LIMIT> msgpack_names = [] {
+    std::array<const char*, MSGPACK_KEY_LIMIT> names = {};
+    names.fill("unknown");
+    MSGPACK_SCHEMA(MSGPACK_FIELD)
+    return names;
+}();
+#undef MSGPACK_FIELD
 
-static msgpack_key_t msgpack_keys[] = {
-	{MSGPACK_UNKNOWN, "unknown"},
-	{MSGPACK_CURRENT_KEYCODE, "keycode"},
-	{MSGPACK_CURRENT_LAYER, "currentlayer"},
-	{MSGPACK_CHANGED_LAYER, "changedlayer"},
-    {MSGPACK_SET_LAYER, "setlayer"},
-    {MSGPACK_CURRENT_LEDSTATE, "ledstate"}
-};
+// QMV1 is a fixed shape of msgpack: the string "QMV1" followed by a map of
+// uint8 keys to int16 values. It is encoded and decoded here directly, the
+// decoder accepts every integer encoding msgpack allows for those ranges.
+#define QMV1_MAGIC      "QMV1"
+#define QMV1_MAGIC_SIZE 4
+#define MP_FIXSTR       0xa0
+#define MP_STR8         0xd9
+#define MP_FIXMAP       0x80
+#define MP_MAP16        0xde
+#define MP_UINT8        0xcc
+#define MP_UINT16       0xcd
+#define MP_UINT32       0xce
+#define MP_UINT64       0xcf
+#define MP_INT8         0xd0
+#define MP_INT16        0xd1
+#define MP_INT32        0xd2
+#define MP_INT64        0xd3
 
-void mpack_assert_fail(const char* message) {
-    printf("MessagePack assertion failed: %s\n", message);
-    while(1) {} // Halt on assertion failure
-}
+static_assert(std::is_trivially_copyable_v<msgpack_t>, "msgpack_t is copied and cleared as plain memory");
 
 // Implementation
 void init_msgpack(msgpack_t * km) {
     km->count = 0;
     // Initialize all pairs to 0
     memset(km->pairs, 0, sizeof(msgpack_pair_t) * MSGPACK_PAIR_ARRAY_SIZE);
+    km->present = 0;
+    memset(km->values, 0, sizeof(km->values));
 }
 
-// Helper function to add a pair
-bool add_msgpack_add(msgpack_t * km, uint8_t key, uint16_t value) {
-    if (km->count >= 10) return false;  // Array full
+// for the decoders, the pairs past count are never read
+static void msgpack_clear(msgpack_t* km) {
+    km->count = 0;
+    km->present = 0;
+    memset(km->values, 0, sizeof(km->values));
+}
 
+// keeps the pair in wire order and fills the key's slot, a repeated key overwrites the slot
+static void msgpack_put_pair(msgpack_t* km, uint8_t key, int16_t value) {
     km->pairs[km->count].key = key;
     km->pairs[km->count].value = value;
     km->count++;
+    if (key < MSGPACK_KEY_LIMIT) {
+        km->present |= 1u << key;
+        km->values[key] = value;
+    }
+}
+
+// Helper function to add a pair
+bool add_msgpack_add(msgpack_t * km, uint8_t key, uint16_t value) {
+    if (km->count >= MSGPACK_PAIR_ARRAY_SIZE) return false;  // Array full
+
+    msgpack_put_pair(km, key, static_cast<int16_t>(value));
     return true;
 }
 
-bool make_msgpack(msgpack_t* km, std::vector<uint8_t>& data) {
-    mpack_writer_t writer;
+bool msgpack_set(msgpack_t* km, uint8_t key, uint16_t value) {
+    for (uint8_t i = 0; i < km->count; i++) {
+        if (km->pairs[i].key == key) {
+            km->pairs[i].value = static_cast<int16_t>(value);
+            if (key < MSGPACK_KEY_LIMIT)
+                km->values[key] = static_cast<int16_t>(value);
+            return true;
+        }
+    }
+    return add_msgpack_add(km, key, value);
+}
+
+// smallest encoding, the same mpack_write_int picks
+static uint8_t* msgpack_put_int(uint8_t* out, int16_t value) {
+    if (value >= 0 && value <= 0x7f) {
+        *out++ = static_cast<uint8_t>(value);
+    }
+    else if (value >= -32 && value < 0) {
+        *out++ = static_cast<uint8_t>(value); // negative fixint 0xe0..0xff
+    }
+    else if (value > 0 && value <= 0xff) {
+        *out++ = MP_UINT8;
+        *out++ = static_cast<uint8_t>(value);
+    }
+    else if (value > 0) {
+        *out++ = MP_UINT16;
+        *out++ = static_cast<uint8_t>(value >> 8);
+        *out++ = static_cast<uint8_t>(value);
+    }
+    else if (value >= -128) {
+        *out++ = MP_INT8;
+        *out++ = static_cast<uint8_t>(value);
+    }
+    else {
+        *out++ = MP_INT16;
+        *out++ = static_cast<uint8_t>(static_cast<uint16_t>(value) >> 8);
+        *out++ = static_cast<uint8_t>(value);
+    }
+    return out;
+}
 
-    mpack_writer_init(&writer, (char *)data.data()+1, data.size()-1);
+static size_t make_qmv1(const msgpack_t* km, std::vector<uint8_t>& data) {
+    // worst case: magic, map header, every pair with a uint8 key and an int16 value
+    if (km->count > QMV1_MAX_PAIRS || data.size() < static_cast<size_t>(1 + 1 + QMV1_MAGIC_SIZE + 1 + km->count * (2 + 3)))
+        return 0;
+    uint8_t* out = data.data() + 1;
+    *out++ = MP_FIXSTR | QMV1_MAGIC_SIZE;
+    memcpy(out, QMV1_MAGIC, QMV1_MAGIC_SIZE);
+    out += QMV1_MAGIC_SIZE;
+    *out++ = static_cast<uint8_t>(MP_FIXMAP | km->count);
+    for (uint8_t i = 0; i < km->count; i++) {
+        uint8_t key = km->pairs[i].key;
+        if (key > 0x7f)
+            *out++ = MP_UINT8;
+        *out++ = key;
+        out = msgpack_put_int(out, km->pairs[i].value);
+    }
+    return out - data.data();
+}
 
-    // Write format identifier string "MPACK"
-    mpack_write_cstr(&writer, "QMV1");
+static uint8_t* qmv2_put_varint(uint8_t* out, uint32_t value) {
+    while (value > 0x7f) {
+        *out++ = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<uint8_t>(value);
+    return out;
+}
 
-    // Start writing map with number of pairs
-    mpack_start_map(&writer, km->count);
-    // Loop through all pairs
-    for (size_t i = 0; i < km->count; i++) {
-        mpack_write_uint(&writer, km->pairs[i].key);
-        mpack_write_int(&writer, km->pairs[i].value);
+static size_t make_qmv2(const msgpack_t* km, std::vector<uint8_t>& data) {
+    if (data.size() < 2)
+        return 0;
+    uint8_t* out = data.data() + 1;
+    uint8_t* end = data.data() + data.size();
+    *out++ = QMV2_HEADER;
+    for (uint8_t i = 0; i < km->count; i++) {
+        const msgpack_pair_t& pair = km->pairs[i];
+        // a value of 0 is left out, except for key 0 whose lone 0 byte would end the pairs
+        bool hasValue = pair.value != 0 || pair.key == MSGPACK_UNKNOWN;
+        uint8_t buffer[5]; // 2 bytes key, 3 bytes int16
+        uint8_t* next = qmv2_put_varint(buffer, (static_cast<uint32_t>(pair.key) << 1) | hasValue);
+        if (hasValue) {
+            uint16_t zigzag = static_cast<uint16_t>((static_cast<uint16_t>(pair.value) << 1) ^ static_cast<uint16_t>(pair.value >> 15));
+            next = qmv2_put_varint(next, zigzag);
+        }
+        if (next - buffer > end - out)
+            return 0;
+        memcpy(out, buffer, next - buffer);
+        out += next - buffer;
     }
+    size_t size = out - data.data();
+    if (out < end)
+        *out = 0; // the terminator is not counted, the rest of a report is 0 anyway
+    return size;
+}
 
-    mpack_finish_map(&writer);
+// encodes into data[1..], data[0] is the report id
+size_t make_msgpack(msgpack_t* km, std::vector<uint8_t>& data, msgpack_format_t format) {
+    return format == MSGPACK_QMV2 ? make_qmv2(km, data) : make_qmv1(km, data);
+}
 
-    if (mpack_writer_destroy(&writer) == mpack_ok) {
-        return true;
+uint8_t msgpack_max_pairs(msgpack_format_t format) {
+    return format == MSGPACK_QMV2 ? MSGPACK_PAIR_ARRAY_SIZE : QMV1_MAX_PAIRS;
+}
+
+// one msgpack integer in [min, max], false if it is no integer, out of range or cut off
+static bool msgpack_get_int(const uint8_t*& in, const uint8_t* end, int64_t min, int64_t max, int64_t& value) {
+    if (in >= end)
+        return false;
+    uint8_t type = *in++;
+    size_t size = 0;
+    bool sign = false;
+    if (type <= 0x7f) {
+        value = type;
+    }
+    else if (type >= 0xe0) {
+        value = static_cast<int8_t>(type);
+    }
+    else {
+        switch (type) {
+        case MP_UINT8:  size = 1; break;
+        case MP_UINT16: size = 2; break;
+        case MP_UINT32: size = 4; break;
+        case MP_UINT64: size = 8; break;
+        case MP_INT8:   size = 1; sign = true; break;
+        case MP_INT16:  size = 2; sign = true; break;
+        case MP_INT32:  size = 4; sign = true; break;
+        case MP_INT64:  size = 8; sign = true; break;
+        default: return false;
+        }
+        if (static_cast<size_t>(end - in) < size)
+            return false;
+        uint64_t raw = 0;
+        for (size_t i = 0; i < size; i++) {
+            raw = (raw << 8) | *in++;
+        }
+        if (sign) {
+            uint64_t signBit = 1ull << (size * 8 - 1);
+            value = static_cast<int64_t>((raw ^ signBit) - signBit);
+        }
+        else {
+            if (raw > static_cast<uint64_t>(INT64_MAX))
+                return false;
+            value = static_cast<int64_t>(raw);
+        }
+    }
+    return value >= min && value <= max;
+}
+
+// varint of at most limit, false if it is longer or cut off
+static bool qmv2_get_varint(const uint8_t*& in, const uint8_t* end, uint32_t limit, uint32_t& value) {
+    value = 0;
+    for (uint32_t shift = 0; in < end && shift < 21; shift += 7) {
+        uint8_t byte = *in++;
+        value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return value <= limit;
     }
     return false;
 }
 
-bool read_msgpack(msgpack_t * km, std::vector<uint8_t>& data) {
-    mpack_reader_t reader;
-    bool success = false;
+static bool read_qmv2(msgpack_t* km, const uint8_t* in, const uint8_t* end) {
+    msgpack_clear(km);
+    while (in < end && *in != 0) {
+        uint32_t key, zigzag = 0;
+        if (!qmv2_get_varint(in, end, (UINT8_MAX << 1) | 1, key))
+            return false;
+        if ((key & 1) && !qmv2_get_varint(in, end, UINT16_MAX, zigzag))
+            return false;
+        if (km->count >= MSGPACK_PAIR_ARRAY_SIZE)
+            return false;
+        int16_t value = static_cast<int16_t>((zigzag >> 1) ^ (0u - (zigzag & 1)));
+        msgpack_put_pair(km, static_cast<uint8_t>(key >> 1), value);
+    }
+    return true;
+}
 
+// single pass over the report, data[0] is the report id
+bool read_msgpack(msgpack_t * km, std::span<const uint8_t> data) {
     // Read raw HID data
     if (data.size() < RAW_EPSIZE) return false;
-
-    mpack_reader_init_data(&reader, (char*)data.data()+1, data.size()-1);
+    const uint8_t* in = data.data() + 1;
+    const uint8_t* end = data.data() + data.size();
+    if (*in == QMV2_HEADER)
+        return read_qmv2(km, in + 1, end);
 
     // Check format identifier
-    char format[5];
-    mpack_expect_cstr(&reader, format, sizeof(format));
-    if (strcmp(format, "QMV1") != 0) {
-        printf("Invalid format identifier\n");
-        mpack_reader_destroy(&reader);
+    size_t length;
+    if ((*in & 0xe0) == MP_FIXSTR) {
+        length = *in++ & 0x1f;
+    }
+    else if (*in == MP_STR8) {
+        in++;
+        length = *in++;
+    }
+    else {
         return false;
     }
+    if (length != QMV1_MAGIC_SIZE || memcmp(in, QMV1_MAGIC, QMV1_MAGIC_SIZE) != 0)
+        return false;
+    in += QMV1_MAGIC_SIZE;
 
     // Read map
-    uint32_t count = mpack_expect_map(&reader);
-    if (count > MSGPACK_PAIR_ARRAY_SIZE) {
-        printf("Too many pairs for the given buffer received: %lu\n", count);
-        mpack_reader_destroy(&reader);
+    size_t count;
+    if ((*in & 0xf0) == MP_FIXMAP) {
+        count = *in++ & 0x0f;
+    }
+    else if (*in == MP_MAP16 && end - in >= 3) {
+        count = (static_cast<size_t>(in[1]) << 8) | in[2];
+        in += 3;
+    }
+    else {
         return false;
     }
-
-    // Initialize msgpack structure
-    init_msgpack(km);
+    if (count > QMV1_MAX_PAIRS)
+        return false;
 
     // Read all key-value pairs
-    for (uint32_t i = 0; i < count; i++) {
-        uint8_t key = mpack_expect_uint(&reader);
-        int16_t value= mpack_expect_int(&reader);
-        add_msgpack_add(km, key, value);
+    msgpack_clear(km);
+    for (size_t i = 0; i < count; i++) {
+        int64_t key, value;
+        if (!msgpack_get_int(in, end, 0, UINT8_MAX, key) || !msgpack_get_int(in, end, INT16_MIN, INT16_MAX, value))
+            return false;
+        msgpack_put_pair(km, static_cast<uint8_t>(key), static_cast<int16_t>(value));
     }
-    
-    mpack_done_map(&reader);
-    printf("Received %d key-value pairs\n", km->count);
-    mpack_reader_destroy(&reader);
-
     return true;
 }
 
-bool msgpack_haskey(msgpack_t* km, uint8_t key) {
-	for (uint8_t i = 0; i < km->count; i++) {
-		if (km->pairs[i].key == key) {
-			return true;
-		}
-	}
-	return false;
+bool msgpack_haskey(const msgpack_t* km, uint8_t key) {
+    if (key < MSGPACK_KEY_LIMIT)
+        return (km->present >> key) & 1;
+    for (uint8_t i = 0; i < km->count; i++) {
+        if (km->pairs[i].key == key) {
+            return true;
+        }
+    }
+    return false;
 }
 
 
-std::optional<uint16_t> msgpack_getValue(msgpack_t* km, uint8_t key) {
-    for (uint8_t i = 0; i < km->count; i++) {
+std::optional<uint16_t> msgpack_getValue(const msgpack_t* km, uint8_t key) {
+    if (!msgpack_haskey(km, key))
+        return std::nullopt; // Return std::nullopt if key is not found
+    if (key < MSGPACK_KEY_LIMIT)
+        return km->values[key];
+    // last one wins, like the slots
+    for (uint8_t i = km->count; i-- > 0;) {
         if (km->pairs[i].key == key) {
             return km->pairs[i].value;
         }
     }
-    return std::nullopt; // Return std::nullopt if key is not found
+    return std::nullopt;
+}
+
+const char* msgpack_keyname(uint8_t key) {
+    return key < MSGPACK_KEY_LIMIT ? msgpack_names[key] : msgpack_names[MSGPACK_UNKNOWN];
 }
 
-bool msgpack_log(msgpack_t* km) {
+bool msgpack_log(const msgpack_t* km) {
+    if (!log_enabled(QLOG_LEVEL_TRACE))
+        return true;
     std::string outmsg;
 
     for (uint32_t i = 0; i < km->count; i++) {
-        outmsg += std::format("Key: {}, Value: {}\n", msgpack_keys[km->pairs[i].key].name, km->pairs[i].value);
+        outmsg += std::format("Key: {}, Value: {}\n", msgpack_keyname(km->pairs[i].key), km->pairs[i].value);
     }
-    OutputDebugString(outmsg.c_str());
+    QLOG_TRACE("MSGPACK", "{}", outmsg);
 
     return true;
 }
@@ -20,6 +20,7 @@
 #include <vector>
 #include <string>
 #include <optional>
+#include <span>
 
 #define MSGPACK_UNKNOWN             0
 #define MSGPACK_CURRENT_KEYCODE     1
@@ -27,27 +28,100 @@
 #define MSGPACK_CHANGED_LAYER       3 // keyboard has changed the layer
 #define MSGPACK_SET_LAYER           4 // want to set the layer
 #define MSGPACK_CURRENT_LEDSTATE    5
+#define MSGPACK_SEQUENCE_ID         6 // request id, the firmware echoes it in the reply
+#define MSGPACK_CAPABILITIES        7 // handshake, the host sends its QMK_CAP_* bits and the firmware answers with its own
+#define MSGPACK_KEYMAP_LAYERS       8 // keymap dimensions, queried together, see qmkkeymap.h
+#define MSGPACK_KEYMAP_ROWS         9
+#define MSGPACK_KEYMAP_COLS         10
+#define MSGPACK_KEYMAP_CHUNK        11 // chunk index of the keymap download
 
+#define QMK_CAP_QMV2                0x0001 // understands and sends QMV2 reports
 
-#define MSGPACK_PAIR_ARRAY_SIZE 10
+// The message schema: every known key with the type of its value and its name.
+// A new key is one line here, it gets a presence bit, a value slot, a typed
+// getter and its name in the log. Keys must stay below MSGPACK_KEY_LIMIT.
+#define MSGPACK_SCHEMA(X) \
+    X(MSGPACK_CURRENT_KEYCODE,  uint16_t, "keycode") \
+    X(MSGPACK_CURRENT_LAYER,    uint8_t,  "currentlayer") \
+    X(MSGPACK_CHANGED_LAYER,    uint8_t,  "changedlayer") \
+    X(MSGPACK_SET_LAYER,        uint8_t,  "setlayer") \
+    X(MSGPACK_CURRENT_LEDSTATE, uint8_t,  "ledstate") \
+    X(MSGPACK_SEQUENCE_ID,      uint16_t, "seqid") \
+    X(MSGPACK_CAPABILITIES,     uint16_t, "capabilities") \
+    X(MSGPACK_KEYMAP_LAYERS,    uint8_t,  "keymaplayers") \
+    X(MSGPACK_KEYMAP_ROWS,      uint8_t,  "keymaprows") \
+    X(MSGPACK_KEYMAP_COLS,      uint8_t,  "keymapcols") \
+    X(MSGPACK_KEYMAP_CHUNK,     uint16_t, "keymapchunk")
+
+#define MSGPACK_PAIR_ARRAY_SIZE 32 // QMV2, QMV1 carries at most QMV1_MAX_PAIRS
+#define QMV1_MAX_PAIRS 10
 #define RAW_EPSIZE 64
 
+// Wire formats. QMV1 is the string "QMV1" and a msgpack map of the pairs.
+// QMV2 is negotiated with MSGPACK_CAPABILITIES: the header byte QMV2_HEADER,
+// then per pair varint(key << 1 | has value) and, unless the value is 0, the
+// zigzag varint of the value. A 0 byte or the end of the report ends the pairs.
+// read_msgpack takes either format.
+typedef enum _msgpack_format_t {
+    MSGPACK_QMV1 = 1,
+    MSGPACK_QMV2 = 2,
+} msgpack_format_t;
+
+#define QMV2_HEADER 0xf2
+
 // Define data structure
 typedef struct {
     uint8_t key;
     int16_t value;
-    std::string name;
 } msgpack_pair_t;
 
+#define MSGPACK_KEY_LIMIT 32
+
 typedef struct {
     uint8_t count;
-    msgpack_pair_t pairs[MSGPACK_PAIR_ARRAY_SIZE];
+    msgpack_pair_t pairs[MSGPACK_PAIR_ARRAY_SIZE]; // in wire order, unknown keys too
+    uint32_t present;                              // bit per key below MSGPACK_KEY_LIMIT
+    int16_t values[MSGPACK_KEY_LIMIT];             // by key, 0 where present is clear
 } msgpack_t;
 
-bool msgpack_haskey(msgpack_t* km, uint8_t key);
-std::optional<uint16_t> msgpack_getValue(msgpack_t* km, uint8_t key);
+template <uint8_t KEY> struct msgpack_field; // only schema keys are defined
+
+#define MSGPACK_FIELD(KEY, TYPE, NAME) \
+    static_assert((KEY) > MSGPACK_UNKNOWN && (KEY) < MSGPACK_KEY_LIMIT, "schema key out of range"); \
+    template <> struct msgpack_field<KEY> { using type = TYPE; static constexpr const char* name = NAME; };
+MSGPACK_SCHEMA(MSGPACK_FIELD)
+#undef MSGPACK_FIELD
+
+// compile errors for a key missing from MSGPACK_SCHEMA
+template <uint8_t KEY>
+inline bool msgpack_has(const msgpack_t& km) {
+    static_assert(msgpack_field<KEY>::name != nullptr);
+    return (km.present >> KEY) & 1;
+}
+
+// the slot is 0 while the key is absent, no branch needed where 0 is fine
+template <uint8_t KEY>
+inline typename msgpack_field<KEY>::type msgpack_value(const msgpack_t& km) {
+    return static_cast<typename msgpack_field<KEY>::type>(km.values[KEY]);
+}
+
+template <uint8_t KEY>
+inline std::optional<typename msgpack_field<KEY>::type> msgpack_get(const msgpack_t& km) {
+    if (!msgpack_has<KEY>(km))
+        return std::nullopt;
+    return msgpack_value<KEY>(km);
+}
+
+bool msgpack_haskey(const msgpack_t* km, uint8_t key);
+std::optional<uint16_t> msgpack_getValue(const msgpack_t* km, uint8_t key);
+const char* msgpack_keyname(uint8_t key);
 bool add_msgpack_add(msgpack_t *msgpack, uint8_t key, uint16_t value);
+// replaces the value of a key already there, adds it otherwise
+bool msgpack_set(msgpack_t* km, uint8_t key, uint16_t value);
 void init_msgpack(msgpack_t *msgpack);
-bool read_msgpack(msgpack_t* km, std::vector<uint8_t>& data);
-bool msgpack_log(msgpack_t* km);
-bool make_msgpack(msgpack_t* km, std::vector<uint8_t>& data);
\ No newline at end of file
+bool read_msgpack(msgpack_t* km, std::span<const uint8_t> data);
+bool msgpack_log(const msgpack_t* km);
+// the bytes used from data[0] on, 0 if the pairs don't fit into data
+size_t make_msgpack(msgpack_t* km, std::vector<uint8_t>& data, msgpack_format_t format = MSGPACK_QMV1);
+// pairs one report of the format holds at most
+uint8_t msgpack_max_pairs(msgpack_format_t format);
\ No newline at end of file
@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <bit>
+#include "qmkaction.h"
+#include "hidregistry.h"
+#include "log.h"
+
+#define QMK_ACTION_SEED_TRIES 4096 // per bucket, then the table doubles
+#define QMK_ACTION_MAX_GROWS  6
+
+// the probes of qmk_action_find in order, bit i of QMKActionTable::wildcards
+static const struct {
+    bool anyDevice;
+    bool anyLayer;
+} _probes[] = { { false, false }, { false, true }, { true, false }, { true, true } };
+
+uint64_t qmk_action_key(uint32_t device, uint8_t layer, uint8_t trigger, uint16_t code, uint8_t edge) {
+    return (static_cast<uint64_t>(device) << 32) | (static_cast<uint64_t>(layer) << 24)
+        | (static_cast<uint64_t>(trigger & 0x0F) << 20) | (static_cast<uint64_t>(edge & 0x0F) << 16) | code;
+}
+
+// splitmix64 finalizer
+static uint64_t qmk_action_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t qmk_action_slot(uint64_t key, uint32_t seed, uint64_t mask) {
+    return qmk_action_mix(key ^ (seed * 0x9e3779b97f4a7c15ULL)) & mask;
+}
+
+// hash and displace: the biggest buckets first, each gets the first seed
+// which puts all its keys into free slots
+static bool qmk_action_place(QMKActionTable& table, const std::vector<uint64_t>& keys, size_t slots) {
+    size_t buckets = std::bit_ceil(std::max<size_t>(1, keys.size() / 2));
+    table.slotMask = slots - 1;
+    table.bucketMask = buckets - 1;
+    table.seeds.assign(buckets, 0);
+    table.keys.assign(slots, QMK_ACTION_NO_KEY);
+    table.index.assign(slots, 0);
+
+    std::vector<std::vector<uint32_t>> members(buckets); // rule indexes
+    for (uint32_t i = 0; i < keys.size(); i++) {
+        members[qmk_action_mix(keys[i]) & table.bucketMask].push_back(i);
+    }
+    std::vector<uint32_t> order(buckets);
+    for (uint32_t i = 0; i < buckets; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&members](uint32_t a, uint32_t b) {
+        return members[a].size() > members[b].size();
+        });
+
+    std::vector<uint64_t> taken;
+    for (uint32_t bucket : order) {
+        const std::vector<uint32_t>& rules = members[bucket];
+        if (rules.empty())
+            break;
+        uint32_t seed = 1;
+        for (; seed <= QMK_ACTION_SEED_TRIES; seed++) {
+            taken.clear();
+            bool fits = true;
+            for (uint32_t rule : rules) {
+                uint64_t slot = qmk_action_slot(keys[rule], seed, table.slotMask);
+                if (table.keys[slot] != QMK_ACTION_NO_KEY || std::find(taken.begin(), taken.end(), slot) != taken.end()) {
+                    fits = false;
+                    break;
+                }
+                taken.push_back(slot);
+            }
+            if (fits)
+                break;
+        }
+        if (seed > QMK_ACTION_SEED_TRIES)
+            return false;
+        table.seeds[bucket] = seed;
+        for (size_t i = 0; i < rules.size(); i++) {
+            table.keys[taken[i]] = keys[rules[i]];
+            table.index[taken[i]] = rules[i];
+        }
+    }
+    return true;
+}
+
+bool qmk_action_compile(const std::vector<QMKActionRule>& rules, uint8_t profile, QMKActionTable& table) {
+    table.profile = profile;
+    table.wildcards = 0;
+    table.rules.clear();
+    std::vector<QMKActionRule> sorted;
+    for (const QMKActionRule& rule : rules) {
+        if (rule.active && rule.profile == profile)
+            sorted.push_back(rule);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](const QMKActionRule& a, const QMKActionRule& b) {
+        return a.seqnr < b.seqnr;
+        });
+
+    std::vector<uint64_t> keys;
+    for (QMKActionRule& rule : sorted) {
+        uint64_t key = qmk_action_key(rule.device, rule.layer, rule.trigger, rule.code, rule.edge);
+        if (std::find(keys.begin(), keys.end(), key) != keys.end()) {
+            QLOG_WARN("ACTION", "Rule {} has the key of an earlier rule, ignored\n", rule.seqnr);
+            continue;
+        }
+        keys.push_back(key);
+        for (uint8_t i = 0; i < std::size(_probes); i++) {
+            if (_probes[i].anyDevice == (rule.device == QMK_ACTION_ANY_DEVICE)
+                && _probes[i].anyLayer == (rule.layer == QMK_ACTION_ANY_LAYER))
+                table.wildcards |= 1 << i;
+        }
+        table.rules.push_back(std::move(rule));
+    }
+
+    size_t slots = std::bit_ceil(keys.size() + keys.size() / 4 + 1);
+    for (int grow = 0; grow <= QMK_ACTION_MAX_GROWS; grow++, slots *= 2) {
+        if (qmk_action_place(table, keys, slots))
+            return true;
+    }
+    QLOG_ERROR("ACTION", "No perfect hash for {} rules of profile {}\n", keys.size(), profile);
+    return false;
+}
+
+const QMKActionRule* qmk_action_find(const QMKActionTable& table, uint32_t device, uint8_t layer,
+    uint8_t trigger, uint16_t code, uint8_t edge, uint32_t& probes) {
+    for (uint8_t i = 0; i < std::size(_probes); i++) {
+        if (!(table.wildcards & (1 << i)))
+            continue;
+        uint64_t key = qmk_action_key(_probes[i].anyDevice ? QMK_ACTION_ANY_DEVICE : device,
+            _probes[i].anyLayer ? QMK_ACTION_ANY_LAYER : layer, trigger, code, edge);
+        uint64_t slot = qmk_action_slot(key, table.seeds[qmk_action_mix(key) & table.bucketMask], table.slotMask);
+        probes++;
+        if (table.keys[slot] == key)
+            return &table.rules[table.index[slot]];
+    }
+    return nullptr;
+}
+
+// lock held
+static bool qmk_action_publish(QMKActions& actions, uint8_t profile) {
+    auto table = std::make_unique<QMKActionTable>();
+    if (!qmk_action_compile(actions.rules, profile, *table))
+        return false;
+    actions.compiles++;
+    QLOG_INFO("ACTION", "Profile {}: {} rules in {} slots\n", profile, table->rules.size(), table->keys.size());
+    QMKActionTable* old = actions.table.exchange(table.release(), std::memory_order_acq_rel);
+    if (old) {
+        hid_epoch_retire([old] { delete old; });
+        hid_epoch_reclaim();
+    }
+    return true;
+}
+
+bool qmk_action_load(QMKActions& actions, std::vector<QMKActionRule> rules, uint8_t profile) {
+    std::lock_guard guard(actions.lock);
+    actions.rules = std::move(rules);
+    return qmk_action_publish(actions, profile);
+}
+
+bool qmk_action_select(QMKActions& actions, uint8_t profile) {
+    std::lock_guard guard(actions.lock);
+    return qmk_action_publish(actions, profile);
+}
+
+const QMKActionRule* qmk_action_dispatch(QMKActions& actions, uint32_t device, uint8_t layer,
+    uint8_t trigger, uint16_t code, uint8_t edge) {
+    actions.dispatched.fetch_add(1, std::memory_order_relaxed);
+    // seq_cst like hid_registry_get, the epoch of the guard is published before
+    const QMKActionTable* table = actions.table.load(std::memory_order_seq_cst);
+    if (!table || table->rules.empty())
+        return nullptr;
+    uint32_t probes = 0;
+    const QMKActionRule* rule = qmk_action_find(*table, device, layer, trigger, code, edge, probes);
+    actions.probes.fetch_add(probes, std::memory_order_relaxed);
+    if (rule)
+        actions.matched.fetch_add(1, std::memory_order_relaxed);
+    return rule;
+}
+
+QMKActionStats qmk_action_stats(QMKActions& actions) {
+    QMKActionStats stats;
+    stats.dispatched = actions.dispatched.load(std::memory_order_relaxed);
+    stats.matched = actions.matched.load(std::memory_order_relaxed);
+    stats.probes = actions.probes.load(std::memory_order_relaxed);
+    std::lock_guard guard(actions.lock);
+    stats.compiles = actions.compiles;
+    return stats;
+}
+
+void qmk_action_log_stats(QMKActions& actions) {
+    QMKActionStats stats = qmk_action_stats(actions);
+    QLOG_INFO("ACTION", "{} dispatched, {} matched, {} probes, {} compiles\n",
+        stats.dispatched, stats.matched, stats.probes, stats.compiles);
+}
+
+void qmk_action_close(QMKActions& actions) {
+    std::lock_guard guard(actions.lock);
+    delete actions.table.exchange(nullptr, std::memory_order_acq_rel);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+// Host actions triggered by layer changes, keycodes and StreamDeck buttons.
+//
+// A rule is keyed by (device, layer, trigger, code, edge). The rules of the
+// active profile are compiled into a minimal perfect hash when they are
+// loaded: the key picks a bucket, the bucket's seed picks the slot, so a
+// dispatch costs two table reads and one compare per probe. Rules may leave
+// the device (QMK_ACTION_ANY_DEVICE) or the layer (QMK_ACTION_ANY_LAYER) open,
+// the exact rule wins over the layer wildcard, over the device wildcard, over
+// both; probes only run for wildcard kinds the table actually has.
+//
+// Dispatch runs on the read threads inside a HIDEpochGuard, loading a new
+// table publishes it with one store and retires the old one via the epoch
+// (hidregistry.h). Running the action is up to the caller, it gets a copy.
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define QMK_ACTION_ANY_DEVICE 0    // DeviceSupport.seqnr of the rule
+#define QMK_ACTION_ANY_LAYER  0xFF
+#define QMK_ACTION_NO_KEY     UINT64_MAX // empty slot, never a packed key
+
+typedef enum _QMKActionTrigger {
+    QMK_TRIGGER_LAYER = 0, // code: the layer switched to
+    QMK_TRIGGER_KEYCODE,   // code: QMK keycode
+    QMK_TRIGGER_BUTTON,    // code: StreamDeck button index
+} QMKActionTrigger;
+
+typedef enum _QMKActionEdge {
+    QMK_EDGE_PRESS = 0,    // a layer change and a keycode are presses
+    QMK_EDGE_RELEASE,
+    QMK_EDGE_LONG_PRESS,
+    QMK_EDGE_DOUBLE_PRESS,
+} QMKActionEdge;
+
+typedef enum _QMKActionType {
+    QMK_ACTION_LAUNCH = 0, // argument: command line
+    QMK_ACTION_KEYS,       // argument: text typed on the host
+    QMK_ACTION_PROFILE,    // argument: profile number to switch to
+} QMKActionType;
+
+typedef struct _QMKActionRule {
+    uint32_t seqnr; // primary key
+    bool active;
+    uint8_t profile;
+    uint32_t device; // DeviceSupport.seqnr or QMK_ACTION_ANY_DEVICE
+    uint8_t layer;   // or QMK_ACTION_ANY_LAYER, a StreamDeck is always on layer 0
+    uint8_t trigger; // QMKActionTrigger
+    uint16_t code;
+    uint8_t edge;    // QMKActionEdge
+    uint8_t action;  // QMKActionType
+    std::string argument;
+    std::string timestamp;
+} QMKActionRule;
+
+// the compiled rules of one profile, read only once published
+typedef struct _QMKActionTable {
+    uint8_t profile;
+    uint64_t slotMask;
+    uint64_t bucketMask;
+    uint8_t wildcards;            // bit per probe, see qmk_action_find
+    std::vector<uint32_t> seeds;  // per bucket
+    std::vector<uint64_t> keys;   // per slot, QMK_ACTION_NO_KEY if empty
+    std::vector<uint32_t> index;  // per slot, into rules
+    std::vector<QMKActionRule> rules;
+} QMKActionTable;
+
+typedef struct _QMKActionStats {
+    uint64_t dispatched;
+    uint64_t matched;
+    uint64_t probes;
+    uint64_t compiles;
+} QMKActionStats;
+
+typedef struct _QMKActions {
+    std::mutex lock;                   // rules and loading
+    std::vector<QMKActionRule> rules;  // as stored, all profiles
+    std::atomic<QMKActionTable*> table = nullptr;
+    std::atomic<uint64_t> dispatched = 0;
+    std::atomic<uint64_t> matched = 0;
+    std::atomic<uint64_t> probes = 0;
+    uint64_t compiles = 0;             // under lock
+} QMKActions;
+
+uint64_t qmk_action_key(uint32_t device, uint8_t layer, uint8_t trigger, uint16_t code, uint8_t edge);
+// false if the rules can't be placed, duplicates keep the lower seqnr
+bool qmk_action_compile(const std::vector<QMKActionRule>& rules, uint8_t profile, QMKActionTable& table);
+// the matching rule of the table or nullptr, probes counts the lookups
+const QMKActionRule* qmk_action_find(const QMKActionTable& table, uint32_t device, uint8_t layer,
+    uint8_t trigger, uint16_t code, uint8_t edge, uint32_t& probes);
+
+// compiles the profile of the rules and publishes it, any thread
+bool qmk_action_load(QMKActions& actions, std::vector<QMKActionRule> rules, uint8_t profile);
+// the same rules with another profile
+bool qmk_action_select(QMKActions& actions, uint8_t profile);
+// read threads inside a HIDEpochGuard, the rule stays valid until the guard ends
+const QMKActionRule* qmk_action_dispatch(QMKActions& actions, uint32_t device, uint8_t layer,
+    uint8_t trigger, uint16_t code, uint8_t edge);
+QMKActionStats qmk_action_stats(QMKActions& actions);
+void qmk_action_log_stats(QMKActions& actions);
+// frees the published table, no reader may be left
+void qmk_action_close(QMKActions& actions);
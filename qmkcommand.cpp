@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <format>
+#include <queue>
+#include <thread>
+#include <condition_variable>
+#include <stop_token>
+#include "qmkcommand.h"
+#include "log.h"
+
+// One timer thread for the deadlines of all devices. Entries are not removed
+// when a request is answered, a stale entry finds its sequence id gone or its
+// deadline moved and is dropped.
+typedef struct _QMKCommandDeadline {
+    std::chrono::steady_clock::time_point deadline;
+    std::weak_ptr<QMKCommander> cmd;
+    uint16_t seq;
+
+    bool operator>(const _QMKCommandDeadline& other) const { return deadline > other.deadline; }
+} QMKCommandDeadline;
+
+typedef struct _QMKCommandTimer {
+    std::mutex lock;
+    std::condition_variable_any wake;
+    std::priority_queue<QMKCommandDeadline, std::vector<QMKCommandDeadline>, std::greater<>> queue;
+    std::once_flag started;
+    std::jthread thread; // last, stopped and joined before the queue goes away
+} QMKCommandTimer;
+
+static QMKCommandTimer _timer;
+
+// timer entry of the batch, requests never get sequence id 0
+#define QMK_COMMAND_SEQ_BATCH 0
+
+static void qmk_command_expire(QMKCommander& cmd, uint16_t seq);
+
+static void qmk_command_timer_thread(std::stop_token stop) {
+    std::unique_lock guard(_timer.lock);
+    while (!stop.stop_requested()) {
+        if (_timer.queue.empty()) {
+            _timer.wake.wait(guard, stop, [] { return !_timer.queue.empty(); });
+            continue;
+        }
+        auto deadline = _timer.queue.top().deadline;
+        if (deadline > std::chrono::steady_clock::now()) {
+            // an earlier deadline may come in meanwhile
+            _timer.wake.wait_until(guard, stop, deadline, [deadline] { return _timer.queue.top().deadline < deadline; });
+            continue;
+        }
+        QMKCommandDeadline entry = _timer.queue.top();
+        _timer.queue.pop();
+        guard.unlock();
+        if (auto cmd = entry.cmd.lock())
+            qmk_command_expire(*cmd, entry.seq);
+        guard.lock();
+    }
+}
+
+static void qmk_command_timer_add(QMKCommander& cmd, uint16_t seq, std::chrono::steady_clock::time_point deadline) {
+    std::call_once(_timer.started, [] {
+        _timer.thread = std::jthread(qmk_command_timer_thread);
+        });
+    std::lock_guard guard(_timer.lock);
+    _timer.queue.push({ deadline, cmd.weak_from_this(), seq });
+    _timer.wake.notify_one();
+}
+
+static void qmk_command_resolve(QMKPendingCommand& pc, QMKCommandStatus status, const msgpack_t* reply, std::chrono::microseconds rtt) {
+    QMKCommandResult result = {};
+    result.status = status;
+    if (reply)
+        result.reply = *reply;
+    else
+        init_msgpack(&result.reply);
+    result.rtt = rtt;
+    result.attempts = pc.attempts;
+    pc.promise.set_value(result);
+    if (pc.done)
+        pc.done(result);
+}
+
+static std::future<QMKCommandResult> qmk_command_reject(QMKCommandOptions& options, QMKCommandStatus status) {
+    QMKPendingCommand pc = {};
+    pc.done = std::move(options.done);
+    auto future = pc.promise.get_future();
+    qmk_command_resolve(pc, status, nullptr, std::chrono::microseconds(0));
+    return future;
+}
+
+// a failed write ends the request at once, waiting for its timeout gains nothing
+static void qmk_command_fail(QMKCommander& cmd, uint16_t seq, uint8_t attempt) {
+    std::unique_lock guard(cmd.lock);
+    auto it = cmd.pending.find(seq);
+    if (it == cmd.pending.end() || it->second.attempts != attempt)
+        return;
+    QMKPendingCommand pc = std::move(it->second);
+    cmd.pending.erase(it);
+    guard.unlock();
+    qmk_command_resolve(pc, QMK_COMMAND_FAILED, nullptr, std::chrono::microseconds(0));
+}
+
+static void qmk_command_write(QMKCommander& cmd, uint16_t seq, uint8_t attempt, const std::vector<uint8_t>& report, bool framed, std::chrono::milliseconds timeout) {
+    HIDWriteOptions options;
+    options.timeout = timeout;
+    options.done = [weak = cmd.weak_from_this(), seq, attempt](HIDWriteStatus status) {
+        if (status == HID_WRITE_OK)
+            return;
+        if (auto cmd = weak.lock())
+            qmk_command_fail(*cmd, seq, attempt);
+        };
+    if (!framed)
+        hid_write_async(*cmd.hid, report, options);
+    else if (!qmk_frame_send(*cmd.framer, *cmd.hid, report, options))
+        qmk_command_fail(cmd, seq, attempt);
+}
+
+// one report, or with a framer the fragments of a larger QMV2 one. QMV1 is
+// never framed, its QMV1_MAX_PAIRS always fit into one report.
+static bool qmk_command_encode(QMKCommander& cmd, msgpack_t& request, QMKPendingCommand& pc) {
+    pc.framed = false;
+    pc.report.assign(cmd.hid->outEplength, 0);
+    if (make_msgpack(&request, pc.report, cmd.format))
+        return true;
+    if (!cmd.framer || cmd.format != MSGPACK_QMV2)
+        return false;
+    pc.report.assign(QMK_COMMAND_FRAMED_MAX, 0);
+    size_t size = make_msgpack(&request, pc.report, cmd.format);
+    if (!size)
+        return false;
+    // only the encoded bytes are framed, longer than a report so the board decodes it as one
+    pc.report.resize(size);
+    pc.framed = true;
+    return true;
+}
+
+static void qmk_command_expire(QMKCommander& cmd, uint16_t seq) {
+    auto now = std::chrono::steady_clock::now();
+    if (seq == QMK_COMMAND_SEQ_BATCH) {
+        std::unique_lock guard(cmd.lock);
+        bool due = !cmd.batch.commands.empty() && cmd.batch.deadline <= now;
+        guard.unlock();
+        if (due)
+            qmk_command_flush(cmd);
+        return;
+    }
+    std::unique_lock guard(cmd.lock);
+    auto it = cmd.pending.find(seq);
+    if (it == cmd.pending.end() || it->second.deadline > now)
+        return; // answered, or retried with a later deadline
+    QMKPendingCommand& pc = it->second;
+    if (pc.attempts <= pc.retries) {
+        // resend with the same sequence id, a late reply to the earlier attempt still counts
+        pc.attempts++;
+        pc.sent = now;
+        pc.deadline = now + pc.timeout;
+        for (uint8_t key : pc.keys)
+            cmd.stats[key].retries++;
+        std::vector<uint8_t> report = pc.report;
+        bool framed = pc.framed;
+        uint8_t attempt = pc.attempts;
+        auto deadline = pc.deadline;
+        auto timeout = pc.timeout;
+        guard.unlock();
+        qmk_command_timer_add(cmd, seq, deadline);
+        qmk_command_write(cmd, seq, attempt, report, framed, timeout);
+        return;
+    }
+    for (uint8_t key : pc.keys)
+        cmd.stats[key].timeouts++;
+    QMKPendingCommand expired = std::move(pc);
+    cmd.pending.erase(it);
+    guard.unlock();
+    QLOG_WARN("CMD", "Command {} of {} keys (seq {}) timed out after {} attempts\n",
+        msgpack_keyname(expired.keys[0]), expired.keys.size(), seq, expired.attempts);
+    qmk_command_resolve(expired, QMK_COMMAND_TIMEOUT, nullptr, std::chrono::microseconds(0));
+}
+
+std::shared_ptr<QMKCommander> qmk_command_create(std::shared_ptr<HID> hid) {
+    auto cmd = std::make_shared<QMKCommander>();
+    cmd->hid = std::move(hid);
+    cmd->nextSeq = 1;
+    cmd->sendCount = 0;
+    cmd->seqEcho = false;
+    cmd->closed = false;
+    cmd->format = MSGPACK_QMV1;
+    for (auto& stats : cmd->stats) {
+        stats = {};
+    }
+    init_msgpack(&cmd->batch.request);
+    return cmd;
+}
+
+std::future<QMKCommandResult> qmk_command_send(QMKCommander& cmd, const msgpack_t& request, QMKCommandOptions options) {
+    std::unique_lock guard(cmd.lock);
+    if (cmd.closed || !cmd.hid) {
+        guard.unlock();
+        return qmk_command_reject(options, QMK_COMMAND_CLOSED);
+    }
+    if (cmd.pending.size() >= QMK_COMMAND_MAX_INFLIGHT) {
+        guard.unlock();
+        return qmk_command_reject(options, QMK_COMMAND_BUSY);
+    }
+    // next id which isn't waiting for its reply, at most MAX_INFLIGHT are taken
+    uint16_t seq = cmd.nextSeq;
+    while (cmd.pending.contains(seq)) {
+        seq = (seq >= QMK_COMMAND_SEQ_MAX) ? 1 : seq + 1;
+    }
+    cmd.nextSeq = (seq >= QMK_COMMAND_SEQ_MAX) ? 1 : seq + 1;
+
+    msgpack_t tagged = request;
+    QMKPendingCommand pc = {};
+    if (!add_msgpack_add(&tagged, MSGPACK_SEQUENCE_ID, seq) || !qmk_command_encode(cmd, tagged, pc)) {
+        guard.unlock();
+        QLOG_INFO("CMD", "Command does not fit into a report\n");
+        return qmk_command_reject(options, QMK_COMMAND_FAILED);
+    }
+    for (uint8_t i = 0; i < request.count; i++)
+        pc.keys.push_back(request.pairs[i].key);
+    if (pc.keys.empty())
+        pc.keys.push_back(MSGPACK_UNKNOWN);
+    pc.order = cmd.sendCount++;
+    pc.sent = std::chrono::steady_clock::now();
+    pc.timeout = options.timeout;
+    pc.deadline = pc.sent + pc.timeout;
+    pc.attempts = 1;
+    pc.retries = options.retries;
+    pc.done = std::move(options.done);
+    auto future = pc.promise.get_future();
+    std::vector<uint8_t> report = pc.report;
+    bool framed = pc.framed;
+    auto deadline = pc.deadline;
+    cmd.pending.emplace(seq, std::move(pc));
+    guard.unlock();
+
+    qmk_command_timer_add(cmd, seq, deadline);
+    qmk_command_write(cmd, seq, 1, report, framed, options.timeout);
+    return future;
+}
+
+std::future<QMKCommandResult> qmk_command_query(QMKCommander& cmd, uint8_t key, QMKCommandOptions options) {
+    msgpack_t request;
+    init_msgpack(&request);
+    add_msgpack_add(&request, key, 0);
+    return qmk_command_send(cmd, request, std::move(options));
+}
+
+// takes the queued commands out under the lock, qmk_command_batch_send sends them without it
+static QMKCommandBatch qmk_command_batch_take(QMKCommander& cmd) {
+    QMKCommandBatch taken = {};
+    taken.request = cmd.batch.request;
+    taken.commands = std::move(cmd.batch.commands);
+    taken.timeout = cmd.batch.timeout;
+    taken.retries = cmd.batch.retries;
+    if (!taken.commands.empty()) {
+        cmd.batch.batched += taken.commands.size();
+        cmd.batch.reports++;
+    }
+    init_msgpack(&cmd.batch.request);
+    cmd.batch.commands.clear();
+    cmd.batch.timeout = std::chrono::milliseconds(0);
+    cmd.batch.retries = 0;
+    return taken;
+}
+
+static void qmk_command_batch_send(QMKCommander& cmd, QMKCommandBatch& batch) {
+    if (batch.commands.empty())
+        return;
+    auto commands = std::make_shared<std::vector<QMKBatchedCommand>>(std::move(batch.commands));
+    QMKCommandOptions options;
+    options.timeout = batch.timeout;
+    options.retries = batch.retries;
+    options.done = [commands](const QMKCommandResult& result) {
+        for (auto& command : *commands) {
+            command.promise.set_value(result);
+            if (command.done)
+                command.done(result);
+        }
+        };
+    qmk_command_send(cmd, batch.request, std::move(options));
+}
+
+// true if the command still fits into the report, with room for the sequence id
+static bool qmk_command_batch_fits(QMKCommander& cmd, uint8_t key, uint16_t value) {
+    thread_local std::vector<uint8_t> report;
+    report.assign(cmd.hid->outEplength, 0);
+    msgpack_t request = cmd.batch.request;
+    return msgpack_set(&request, key, value) && add_msgpack_add(&request, MSGPACK_SEQUENCE_ID, QMK_COMMAND_SEQ_MAX) &&
+        make_msgpack(&request, report, cmd.format);
+}
+
+std::future<QMKCommandResult> qmk_command_batch(QMKCommander& cmd, uint8_t key, uint16_t value, QMKCommandOptions options) {
+    std::unique_lock guard(cmd.lock);
+    if (cmd.closed || !cmd.hid) {
+        guard.unlock();
+        return qmk_command_reject(options, QMK_COMMAND_CLOSED);
+    }
+    QMKCommandBatch full = {};
+    if (!qmk_command_batch_fits(cmd, key, value))
+        full = qmk_command_batch_take(cmd);
+    bool first = cmd.batch.commands.empty();
+    msgpack_set(&cmd.batch.request, key, value);
+    QMKBatchedCommand command = {};
+    command.key = key;
+    command.done = std::move(options.done);
+    auto future = command.promise.get_future();
+    cmd.batch.commands.push_back(std::move(command));
+    cmd.batch.timeout = std::max(cmd.batch.timeout, options.timeout);
+    cmd.batch.retries = std::max(cmd.batch.retries, options.retries);
+    if (first)
+        cmd.batch.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(QMK_COMMAND_BATCH_DELAY_MS);
+    auto deadline = cmd.batch.deadline;
+    // no further key fits next to the sequence id, don't wait for the timer
+    QMKCommandBatch ready = {};
+    if (cmd.batch.request.count >= msgpack_max_pairs(cmd.format) - 1)
+        ready = qmk_command_batch_take(cmd);
+    bool scheduled = first && ready.commands.empty();
+    guard.unlock();
+
+    qmk_command_batch_send(cmd, full);
+    qmk_command_batch_send(cmd, ready);
+    if (scheduled)
+        qmk_command_timer_add(cmd, QMK_COMMAND_SEQ_BATCH, deadline);
+    return future;
+}
+
+void qmk_command_flush(QMKCommander& cmd) {
+    std::unique_lock guard(cmd.lock);
+    QMKCommandBatch batch = qmk_command_batch_take(cmd);
+    guard.unlock();
+    qmk_command_batch_send(cmd, batch);
+}
+
+void qmk_command_handshake(QMKCommander& cmd) {
+    msgpack_t request;
+    init_msgpack(&request);
+    add_msgpack_add(&request, MSGPACK_CAPABILITIES, QMK_CAP_QMV2);
+    QMKCommandOptions options;
+    options.retries = 0; // older firmware never answers, once is enough
+    options.done = [weak = cmd.weak_from_this()](const QMKCommandResult& result) {
+        auto cmd = weak.lock();
+        if (!cmd || result.status != QMK_COMMAND_OK)
+            return;
+        if (msgpack_value<MSGPACK_CAPABILITIES>(result.reply) & QMK_CAP_QMV2) {
+            std::lock_guard guard(cmd->lock);
+            cmd->format = MSGPACK_QMV2;
+            QLOG_INFO("CMD", "Firmware speaks QMV2\n");
+        }
+        };
+    qmk_command_send(cmd, request, std::move(options));
+}
+
+bool qmk_command_dispatch(QMKCommander& cmd, const msgpack_t& reply) {
+    auto now = std::chrono::steady_clock::now();
+    auto seq = msgpack_get<MSGPACK_SEQUENCE_ID>(reply);
+    std::unique_lock guard(cmd.lock);
+    auto it = cmd.pending.end();
+    if (seq) {
+        cmd.seqEcho = true;
+        it = cmd.pending.find(*seq);
+    }
+    else if (!cmd.seqEcho) {
+        // firmware without sequence ids answers in order, take the oldest request for one of the keys
+        for (auto pit = cmd.pending.begin(); pit != cmd.pending.end(); ++pit) {
+            bool answers = std::ranges::any_of(pit->second.keys, [&reply](uint8_t key) { return msgpack_haskey(&reply, key); });
+            if (answers && (it == cmd.pending.end() || pit->second.order < it->second.order))
+                it = pit;
+        }
+    }
+    // else: the keyboard reported something on its own, e.g. MSGPACK_CHANGED_LAYER
+    if (it == cmd.pending.end())
+        return false;
+
+    QMKPendingCommand pc = std::move(it->second);
+    cmd.pending.erase(it);
+    auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(now - pc.sent);
+    for (uint8_t key : pc.keys) {
+        QMKCommandStats& stats = cmd.stats[key];
+        stats.rttMin = stats.count ? std::min(stats.rttMin, rtt) : rtt;
+        stats.rttMax = std::max(stats.rttMax, rtt);
+        stats.rttSum += rtt;
+        stats.count++;
+    }
+    guard.unlock();
+
+    qmk_command_resolve(pc, QMK_COMMAND_OK, &reply, rtt);
+    return true;
+}
+
+void qmk_command_close(QMKCommander& cmd) {
+    std::unique_lock guard(cmd.lock);
+    cmd.closed = true;
+    std::map<uint16_t, QMKPendingCommand> pending = std::move(cmd.pending);
+    cmd.pending.clear();
+    std::vector<QMKBatchedCommand> batched = std::move(cmd.batch.commands);
+    cmd.batch.commands.clear();
+    init_msgpack(&cmd.batch.request);
+    guard.unlock();
+    for (auto& command : batched) {
+        QMKPendingCommand pc = {};
+        pc.promise = std::move(command.promise);
+        pc.done = std::move(command.done);
+        qmk_command_resolve(pc, QMK_COMMAND_CLOSED, nullptr, std::chrono::microseconds(0));
+    }
+    for (auto& [seq, pc] : pending) {
+        qmk_command_resolve(pc, QMK_COMMAND_CLOSED, nullptr, std::chrono::microseconds(0));
+    }
+}
+
+QMKCommandStats qmk_command_stats(QMKCommander& cmd, uint8_t key) {
+    std::lock_guard guard(cmd.lock);
+    return cmd.stats[key];
+}
+
+void qmk_command_log_stats(QMKCommander& cmd) {
+    std::lock_guard guard(cmd.lock);
+    for (size_t key = 0; key < cmd.stats.size(); key++) {
+        const QMKCommandStats& stats = cmd.stats[key];
+        if (stats.count == 0 && stats.timeouts == 0)
+            continue;
+        auto avg = stats.count ? stats.rttSum.count() / static_cast<int64_t>(stats.count) : 0;
+        QLOG_INFO("CMD", "{}: {} replies, rtt min/avg/max {}/{}/{} us, {} retries, {} timeouts\n",
+            msgpack_keyname(static_cast<uint8_t>(key)), stats.count, stats.rttMin.count(), avg, stats.rttMax.count(),
+            stats.retries, stats.timeouts);
+    }
+    if (cmd.batch.reports)
+        QLOG_INFO("CMD", "{} batched commands in {} reports\n", cmd.batch.batched, cmd.batch.reports);
+}
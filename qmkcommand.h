@@ -0,0 +1,127 @@
+#pragma once
+
+// Request/response layer on top of hid_write_async and the QMV1 msgpack
+// reports. Every request carries a MSGPACK_SEQUENCE_ID which the firmware
+// echoes in its reply, so several requests can be in flight per device and
+// each reply resolves the future of its own request. A QMV2 request which
+// doesn't fit into one report goes out in fragments (qmkframe.h) if the
+// commander has a framer, QMV1 requests always fit.
+
+#include <stdint.h>
+#include <array>
+#include <chrono>
+#include <future>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "hidex.h"
+#include "msgpack.h"
+#include "qmkframe.h"
+
+#define QMK_COMMAND_TIMEOUT_MS  250 // per attempt
+#define QMK_COMMAND_RETRIES     2   // resends after the first attempt timed out
+#define QMK_COMMAND_MAX_INFLIGHT 8
+#define QMK_COMMAND_SEQ_MAX     0x7FFF // sequence ids are msgpack values, 1..0x7FFF
+#define QMK_COMMAND_FRAMED_MAX  512 // bytes of a QMV2 request sent in fragments
+#define QMK_COMMAND_BATCH_DELAY_MS 2 // a batch waits this long for more commands before it is sent
+
+typedef enum _QMKCommandStatus {
+    QMK_COMMAND_OK = 0,
+    QMK_COMMAND_TIMEOUT,  // no reply after all retries
+    QMK_COMMAND_FAILED,   // the report could not be written
+    QMK_COMMAND_BUSY,     // QMK_COMMAND_MAX_INFLIGHT requests are waiting already
+    QMK_COMMAND_CLOSED,   // the device went away
+} QMKCommandStatus;
+
+typedef struct _QMKCommandResult {
+    QMKCommandStatus status;
+    msgpack_t reply;                // valid with QMK_COMMAND_OK
+    std::chrono::microseconds rtt;  // last send to reply
+    uint8_t attempts;
+} QMKCommandResult;
+
+typedef struct _QMKCommandOptions {
+    std::chrono::milliseconds timeout = std::chrono::milliseconds(QMK_COMMAND_TIMEOUT_MS);
+    uint8_t retries = QMK_COMMAND_RETRIES;
+    std::function<void(const QMKCommandResult&)> done; // optional, runs on the thread which resolved it
+} QMKCommandOptions;
+
+// round trip statistics of one command key, a batch counts for each of its keys
+typedef struct _QMKCommandStats {
+    uint64_t count;    // answered requests
+    uint64_t retries;
+    uint64_t timeouts;
+    std::chrono::microseconds rttMin;
+    std::chrono::microseconds rttMax;
+    std::chrono::microseconds rttSum;
+} QMKCommandStats;
+
+typedef struct _QMKPendingCommand {
+    std::vector<uint8_t> keys; // of the request without the sequence id, for the stats and the fallback match
+    uint64_t order; // send order, sequence ids wrap
+    std::vector<uint8_t> report; // if framed only the encoded bytes, more than one report
+    bool framed;
+    std::chrono::steady_clock::time_point sent;
+    std::chrono::steady_clock::time_point deadline;
+    std::chrono::milliseconds timeout;
+    uint8_t attempts;
+    uint8_t retries;
+    std::promise<QMKCommandResult> promise;
+    std::function<void(const QMKCommandResult&)> done;
+} QMKPendingCommand;
+
+// a command waiting in the batch, it is resolved with the reply to the whole batch
+typedef struct _QMKBatchedCommand {
+    uint8_t key;
+    std::promise<QMKCommandResult> promise;
+    std::function<void(const QMKCommandResult&)> done;
+} QMKBatchedCommand;
+
+// Commands queued by qmk_command_batch, sent as one request when the report is
+// full or QMK_COMMAND_BATCH_DELAY_MS after the first one.
+typedef struct _QMKCommandBatch {
+    msgpack_t request;  // one pair per key, a later command for the same key replaces the value
+    std::vector<QMKBatchedCommand> commands;
+    std::chrono::milliseconds timeout; // longest of the commands
+    uint8_t retries;                   // most of the commands
+    std::chrono::steady_clock::time_point deadline; // the timer flushes it then
+    uint64_t batched;   // commands sent in batches
+    uint64_t reports;   // batches sent
+} QMKCommandBatch;
+
+typedef struct _QMKCommander : std::enable_shared_from_this<_QMKCommander> {
+    std::shared_ptr<HID> hid;
+    std::shared_ptr<QMKFramer> framer; // optional, set before the first request
+    std::mutex lock;
+    uint16_t nextSeq;
+    uint64_t sendCount;
+    bool seqEcho;   // the firmware echoed a sequence id at least once
+    bool closed;
+    msgpack_format_t format; // of the requests, QMV2 once the handshake agreed on it
+    std::map<uint16_t, QMKPendingCommand> pending; // by sequence id
+    std::array<QMKCommandStats, 256> stats;        // by command key
+    QMKCommandBatch batch;
+} QMKCommander;
+
+std::shared_ptr<QMKCommander> qmk_command_create(std::shared_ptr<HID> hid);
+// sends the request with a fresh sequence id, the future resolves with the reply, a timeout or a failure
+std::future<QMKCommandResult> qmk_command_send(QMKCommander& cmd, const msgpack_t& request, QMKCommandOptions options = {});
+// shortcut for a query of a single key, e.g. MSGPACK_CURRENT_LAYER
+std::future<QMKCommandResult> qmk_command_query(QMKCommander& cmd, uint8_t key, QMKCommandOptions options = {});
+// queues a command for the next batch, e.g. a query (value 0) or MSGPACK_SET_LAYER.
+// Commands of one batch share a report and a sequence id, each future resolves with the whole reply.
+std::future<QMKCommandResult> qmk_command_batch(QMKCommander& cmd, uint8_t key, uint16_t value, QMKCommandOptions options = {});
+// sends the batch now instead of after QMK_COMMAND_BATCH_DELAY_MS
+void qmk_command_flush(QMKCommander& cmd);
+// offers QMV2 to the firmware, the requests switch to it when the reply has QMK_CAP_QMV2.
+// Firmware without the handshake doesn't answer and the device stays on QMV1.
+void qmk_command_handshake(QMKCommander& cmd);
+// feeds a decoded report from the read callback, true if it answered a pending request.
+// Replies without a sequence id (older firmware) answer the oldest request for one of their keys.
+bool qmk_command_dispatch(QMKCommander& cmd, const msgpack_t& reply);
+// fails everything pending with QMK_COMMAND_CLOSED, call before hid_close
+void qmk_command_close(QMKCommander& cmd);
+QMKCommandStats qmk_command_stats(QMKCommander& cmd, uint8_t key);
+void qmk_command_log_stats(QMKCommander& cmd);
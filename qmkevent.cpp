@@ -0,0 +1,118 @@
+#include <algorithm>
+#include "qmkevent.h"
+#include "log.h"
+
+void qmk_event_init(QMKEventQueue& queue, void (*wake)(void* context), void* context) {
+    for (uint64_t i = 0; i < QMK_EVENT_QUEUE_SIZE; i++) {
+        queue.cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    queue.enqueue.store(0, std::memory_order_relaxed);
+    queue.dequeue = 0;
+    queue.signaled.store(false, std::memory_order_relaxed);
+    queue.wake = wake;
+    queue.context = context;
+    queue.pushed = 0;
+    queue.dropped = 0;
+    queue.wakeups = 0;
+    queue.coalesced = 0;
+    queue.batches = 0;
+    queue.maxDepth = 0;
+}
+
+bool qmk_event_push(QMKEventQueue& queue, const QMKEvent& event) {
+    uint64_t position = queue.enqueue.load(std::memory_order_relaxed);
+    QMKEventCell* cell;
+    for (;;) {
+        cell = &queue.cells[position & (QMK_EVENT_QUEUE_SIZE - 1)];
+        uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+        int64_t diff = static_cast<int64_t>(sequence - position);
+        if (diff == 0) {
+            if (queue.enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {
+            queue.dropped.fetch_add(1, std::memory_order_relaxed);
+            return false; // full, the consumer hasn't freed this cell yet
+        }
+        else {
+            position = queue.enqueue.load(std::memory_order_relaxed);
+        }
+    }
+    cell->event = event;
+    cell->sequence.store(position + 1, std::memory_order_release);
+    queue.pushed.fetch_add(1, std::memory_order_relaxed);
+
+    // one wakeup per batch, the consumer clears the flag before it drains
+    if (!queue.signaled.exchange(true, std::memory_order_acq_rel) && queue.wake) {
+        queue.wakeups.fetch_add(1, std::memory_order_relaxed);
+        queue.wake(queue.context);
+    }
+    return true;
+}
+
+static bool qmk_event_is_state(uint8_t type) {
+    return type == QMK_EVENT_LAYER || type == QMK_EVENT_LEDSTATE || type == QMK_EVENT_DECODE_ERROR;
+}
+
+size_t qmk_event_drain(QMKEventQueue& queue, std::vector<QMKEvent>& events) {
+    events.clear();
+    // acquire pairs with the push which set it, its event is visible below
+    queue.signaled.exchange(false, std::memory_order_acq_rel);
+    for (;;) {
+        QMKEventCell& cell = queue.cells[queue.dequeue & (QMK_EVENT_QUEUE_SIZE - 1)];
+        if (cell.sequence.load(std::memory_order_acquire) != queue.dequeue + 1)
+            break; // empty, or the next producer hasn't finished; its push signals again
+        events.push_back(cell.event);
+        cell.sequence.store(queue.dequeue + QMK_EVENT_QUEUE_SIZE, std::memory_order_release);
+        queue.dequeue++;
+    }
+    if (events.empty())
+        return 0;
+    queue.batches++;
+    queue.maxDepth = std::max<uint64_t>(queue.maxDepth, events.size());
+
+    // a state event is dropped if a later one of the same device and type follows,
+    // a changed layer stays a change even if a plain query answer came after it
+    std::vector<size_t> latest; // newest state event per device and type, few devices
+    for (size_t i = events.size(); i-- > 0;) {
+        QMKEvent& event = events[i];
+        if (!qmk_event_is_state(event.type))
+            continue;
+        auto it = std::find_if(latest.begin(), latest.end(), [&](size_t index) {
+            return events[index].type == event.type && events[index].device == event.device;
+            });
+        if (it == latest.end()) {
+            latest.push_back(i);
+            continue;
+        }
+        QMKEvent& newer = events[*it];
+        if (event.type == QMK_EVENT_LAYER)
+            newer.detail = std::max(newer.detail, event.detail);
+        event.type = QMK_EVENT_TYPES; // removed below
+        queue.coalesced++;
+    }
+    size_t kept = 0;
+    for (const QMKEvent& event : events) {
+        if (event.type != QMK_EVENT_TYPES)
+            events[kept++] = event;
+    }
+    events.resize(kept);
+    return kept;
+}
+
+QMKEventStats qmk_event_stats(const QMKEventQueue& queue) {
+    QMKEventStats stats;
+    stats.pushed = queue.pushed.load(std::memory_order_relaxed);
+    stats.dropped = queue.dropped.load(std::memory_order_relaxed);
+    stats.wakeups = queue.wakeups.load(std::memory_order_relaxed);
+    stats.coalesced = queue.coalesced;
+    stats.batches = queue.batches;
+    stats.maxDepth = queue.maxDepth;
+    return stats;
+}
+
+void qmk_event_log_stats(const QMKEventQueue& queue) {
+    QMKEventStats stats = qmk_event_stats(queue);
+    QLOG_INFO("QMK", "Events: {} pushed, {} dropped, {} coalesced, {} batches, {} wakeups, max depth {}\n",
+        stats.pushed, stats.dropped, stats.coalesced, stats.batches, stats.wakeups, stats.maxDepth);
+}
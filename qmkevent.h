@@ -0,0 +1,74 @@
+#pragma once
+
+// Decoded device events from the read threads to the UI thread.
+//
+// The read callbacks push into a bounded multi producer / single consumer
+// ring (Vyukov) without locks and never touch UI state themselves. The first
+// push after a drain calls the wake function, the UI thread posts nothing
+// back and takes everything queued so far in one go. State events (layer,
+// LED state) of the same device are coalesced on the way out, only the
+// latest one is applied; decode errors of a device are coalesced the same
+// way. Keycodes and button edges are all delivered.
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#define QMK_EVENT_QUEUE_SIZE 1024 // a power of two, a full queue drops new events
+
+typedef enum _QMKEventType {
+    QMK_EVENT_LAYER = 0, // value: layer, detail: MSGPACK_CHANGED_LAYER or MSGPACK_CURRENT_LAYER
+    QMK_EVENT_KEYCODE,   // value: keycode
+    QMK_EVENT_LEDSTATE,  // value: LED bits
+    QMK_EVENT_BUTTON,    // value: button index, detail: 1 pressed, 0 released
+    QMK_EVENT_LONG_PRESS,  // value: button index, see streamdeck.h
+    QMK_EVENT_MULTI_PRESS, // value: button index, detail: presses so far
+    QMK_EVENT_DECODE_ERROR, // value: report size, the UI thread shows a notification
+    QMK_EVENT_TYPES
+} QMKEventType;
+
+typedef struct _QMKEvent {
+    uint32_t device; // registry id, see hidregistry.h
+    uint16_t value;
+    uint8_t type;    // QMKEventType
+    uint8_t detail;
+    std::chrono::steady_clock::time_point received; // read completion of the report
+} QMKEvent;
+
+typedef struct _QMKEventCell {
+    std::atomic<uint64_t> sequence;
+    QMKEvent event;
+} QMKEventCell;
+
+typedef struct _QMKEventStats {
+    uint64_t pushed;
+    uint64_t dropped;   // the queue was full
+    uint64_t coalesced; // replaced by a later state event of the same device
+    uint64_t batches;   // drains with at least one event
+    uint64_t wakeups;   // calls of the wake function
+    uint64_t maxDepth;  // most events taken in one drain
+} QMKEventStats;
+
+typedef struct _QMKEventQueue {
+    QMKEventCell cells[QMK_EVENT_QUEUE_SIZE];
+    alignas(64) std::atomic<uint64_t> enqueue;
+    alignas(64) uint64_t dequeue;         // consumer only
+    std::atomic<bool> signaled;           // a wakeup is on its way to the consumer
+    void (*wake)(void* context);          // called by the pushing thread, e.g. PostMessage
+    void* context;
+    std::atomic<uint64_t> pushed;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> wakeups;
+    uint64_t coalesced;                   // consumer only
+    uint64_t batches;
+    uint64_t maxDepth;
+} QMKEventQueue;
+
+void qmk_event_init(QMKEventQueue& queue, void (*wake)(void* context), void* context);
+// any thread, false if the queue was full and the event was dropped
+bool qmk_event_push(QMKEventQueue& queue, const QMKEvent& event);
+// consumer thread, takes everything queued in push order with state events coalesced
+size_t qmk_event_drain(QMKEventQueue& queue, std::vector<QMKEvent>& events);
+QMKEventStats qmk_event_stats(const QMKEventQueue& queue);
+void qmk_event_log_stats(const QMKEventQueue& queue);
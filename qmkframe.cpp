@@ -0,0 +1,165 @@
+#include <format>
+#include <cstring>
+#include "qmkframe.h"
+#include "log.h"
+
+static uint16_t frame_get16(const uint8_t* in) {
+    return static_cast<uint16_t>((in[0] << 8) | in[1]);
+}
+
+static void frame_put16(uint8_t* out, uint16_t value) {
+    out[0] = static_cast<uint8_t>(value >> 8);
+    out[1] = static_cast<uint8_t>(value);
+}
+
+static size_t frame_count(size_t total, size_t chunk) {
+    return total ? (total + chunk - 1) / chunk : 1; // an empty message still takes one fragment
+}
+
+void qmk_frame_expire(QMKFramer& framer, std::chrono::steady_clock::time_point now) {
+    for (auto it = framer.partial.begin(); it != framer.partial.end();) {
+        if (it->second.deadline <= now) {
+            framer.stats.expired++;
+            it = framer.partial.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+QMKFrameResult qmk_frame_feed(QMKFramer& framer, std::span<const uint8_t> report,
+    std::chrono::steady_clock::time_point now, std::vector<uint8_t>& message) {
+    if (!qmk_frame_is_fragment(report))
+        return QMK_FRAME_NONE;
+    qmk_frame_expire(framer, now);
+
+    uint8_t id = report[2];
+    uint16_t index = frame_get16(&report[3]);
+    uint16_t total = frame_get16(&report[5]);
+    size_t chunk = report.size() - QMK_FRAME_HEADER_SIZE;
+    size_t count = frame_count(total, chunk);
+
+    auto it = framer.partial.find(id);
+    if (it != framer.partial.end() && it->second.data.size() != total) {
+        // the id was reused before the old message completed, start over
+        framer.stats.dropped++;
+        framer.partial.erase(it);
+        it = framer.partial.end();
+    }
+    if (index >= count) {
+        framer.stats.invalid++;
+        if (it != framer.partial.end())
+            framer.partial.erase(it);
+        return QMK_FRAME_INVALID;
+    }
+    if (it == framer.partial.end()) {
+        if (framer.partial.size() >= QMK_FRAME_MAX_PARTIAL) {
+            auto oldest = framer.partial.begin();
+            for (auto pit = framer.partial.begin(); pit != framer.partial.end(); ++pit) {
+                if (pit->second.order < oldest->second.order)
+                    oldest = pit;
+            }
+            framer.stats.dropped++;
+            framer.partial.erase(oldest);
+        }
+        QMKFramePartial partial;
+        partial.data.resize(total);
+        partial.received.resize(count);
+        partial.missing = static_cast<uint16_t>(count);
+        partial.order = framer.order++;
+        it = framer.partial.emplace(id, std::move(partial)).first;
+    }
+
+    QMKFramePartial& partial = it->second;
+    partial.deadline = now + framer.timeout;
+    if (!partial.received[index]) {
+        size_t offset = index * chunk;
+        size_t length = std::min(chunk, total - offset);
+        if (length)
+            memcpy(partial.data.data() + offset, report.data() + QMK_FRAME_HEADER_SIZE, length);
+        partial.received[index] = true;
+        partial.missing--;
+    }
+    if (partial.missing)
+        return QMK_FRAME_PENDING;
+
+    message = std::move(partial.data);
+    framer.partial.erase(it);
+    framer.stats.completed++;
+    return QMK_FRAME_COMPLETE;
+}
+
+bool qmk_frame_split(uint8_t messageId, std::span<const uint8_t> payload, size_t reportSize,
+    std::vector<std::vector<uint8_t>>& reports) {
+    reports.clear();
+    if (reportSize <= QMK_FRAME_HEADER_SIZE || payload.size() > QMK_FRAME_MAX_PAYLOAD)
+        return false;
+    size_t chunk = reportSize - QMK_FRAME_HEADER_SIZE;
+    size_t count = frame_count(payload.size(), chunk);
+    reports.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        std::vector<uint8_t>& report = reports[i];
+        report.resize(reportSize);
+        report[1] = QMK_FRAME_MARKER;
+        report[2] = messageId;
+        frame_put16(&report[3], static_cast<uint16_t>(i));
+        frame_put16(&report[5], static_cast<uint16_t>(payload.size()));
+        size_t offset = i * chunk;
+        size_t length = std::min(chunk, payload.size() - offset);
+        if (length)
+            memcpy(report.data() + QMK_FRAME_HEADER_SIZE, payload.data() + offset, length);
+    }
+    return true;
+}
+
+// the fragments of one message complete in order on the writer, so the first
+// failure is seen before the last fragment reports
+typedef struct _QMKFrameSend {
+    uint8_t id;
+    size_t count;
+    size_t failedAt;
+    HIDWriteStatus status;
+    std::function<void(HIDWriteStatus)> done;
+} QMKFrameSend;
+
+bool qmk_frame_send(QMKFramer& framer, HID& hid, std::span<const uint8_t> payload, HIDWriteOptions options) {
+    std::vector<std::vector<uint8_t>> reports;
+    uint8_t id = framer.nextMessage.fetch_add(1, std::memory_order_relaxed);
+    if (!qmk_frame_split(id, payload, hid.outEplength, reports)) {
+        QLOG_ERROR("FRAME", "{} bytes can't be framed into reports of {} bytes\n", payload.size(), hid.outEplength);
+        return false;
+    }
+    auto send = std::make_shared<QMKFrameSend>();
+    send->id = id;
+    send->count = reports.size();
+    send->failedAt = 0;
+    send->status = HID_WRITE_OK;
+    send->done = std::move(options.done);
+    for (size_t i = 0; i < reports.size(); i++) {
+        HIDWriteOptions fragment;
+        fragment.timeout = options.timeout;
+        fragment.stop = options.stop;
+        fragment.done = [send, i](HIDWriteStatus status) {
+            if (status != HID_WRITE_OK && send->status == HID_WRITE_OK) {
+                send->status = status;
+                send->failedAt = i;
+            }
+            if (i + 1 < send->count)
+                return;
+            if (send->status != HID_WRITE_OK)
+                QLOG_ERROR("FRAME", "Message {} failed at fragment {} of {}\n", send->id, send->failedAt, send->count);
+            if (send->done)
+                send->done(send->status);
+            };
+        hid_write_async(hid, reports[i], std::move(fragment));
+    }
+    framer.sent.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void qmk_frame_log_stats(const QMKFramer& framer, const std::string& devname) {
+    QLOG_INFO("FRAME", "{}: {} sent, {} received, {} expired, {} dropped, {} invalid\n", devname,
+        framer.sent.load(std::memory_order_relaxed), framer.stats.completed, framer.stats.expired,
+        framer.stats.dropped, framer.stats.invalid);
+}
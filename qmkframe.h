@@ -0,0 +1,82 @@
+#pragma once
+
+// Framing for payloads which don't fit into one QMV1 report, e.g. keymaps,
+// macros and status blobs. The payload is split over consecutive reports:
+//
+//   byte 0    report id
+//   byte 1    QMK_FRAME_MARKER, 0xc1 is never used by msgpack so a fragment
+//             can't be mistaken for a QMV1 report
+//   byte 2    message id, fragments of different messages may interleave
+//   byte 3-4  fragment index, big endian like msgpack
+//   byte 5-6  total payload length, big endian
+//   byte 7-   payload, the last fragment is padded with 0
+//
+// The receiving side keeps one QMKFramer per device and feeds it every report
+// from the read callback.
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <span>
+#include <string>
+#include <vector>
+#include "hidex.h"
+
+#define QMK_FRAME_MARKER        0xc1
+#define QMK_FRAME_HEADER_SIZE   7    // including the report id
+#define QMK_FRAME_MAX_PAYLOAD   0xFFFF
+#define QMK_FRAME_MAX_PARTIAL   4    // messages reassembled at the same time, the oldest is dropped
+#define QMK_FRAME_TIMEOUT_MS    500  // from one fragment to the next
+
+typedef enum _QMKFrameResult {
+    QMK_FRAME_NONE = 0,  // no fragment, decode it as a QMV1 report
+    QMK_FRAME_PENDING,   // fragment taken, the message is incomplete
+    QMK_FRAME_COMPLETE,  // the message is complete
+    QMK_FRAME_INVALID,   // broken fragment, dropped with its message
+} QMKFrameResult;
+
+typedef struct _QMKFramePartial {
+    std::vector<uint8_t> data;  // total length, filled as fragments arrive
+    std::vector<bool> received; // by fragment index
+    uint16_t missing;           // fragments still to come
+    uint64_t order;             // first fragment, for dropping the oldest
+    std::chrono::steady_clock::time_point deadline;
+} QMKFramePartial;
+
+typedef struct _QMKFrameStats {
+    uint64_t completed;
+    uint64_t expired;   // no fragment for QMK_FRAME_TIMEOUT_MS
+    uint64_t dropped;   // pushed out by newer messages
+    uint64_t invalid;
+} QMKFrameStats;
+
+typedef struct _QMKFramer {
+    // receiving side, only touched by the read callback of the device
+    std::map<uint8_t, QMKFramePartial> partial; // by message id
+    uint64_t order;
+    std::chrono::milliseconds timeout = std::chrono::milliseconds(QMK_FRAME_TIMEOUT_MS);
+    QMKFrameStats stats;
+    // sending side, any thread
+    std::atomic<uint8_t> nextMessage;
+    std::atomic<uint64_t> sent; // messages queued
+} QMKFramer;
+
+inline bool qmk_frame_is_fragment(std::span<const uint8_t> report) {
+    return report.size() > QMK_FRAME_HEADER_SIZE && report[1] == QMK_FRAME_MARKER;
+}
+
+// takes a report from the read callback, the message is set with QMK_FRAME_COMPLETE
+QMKFrameResult qmk_frame_feed(QMKFramer& framer, std::span<const uint8_t> report,
+    std::chrono::steady_clock::time_point now, std::vector<uint8_t>& message);
+// drops the messages whose next fragment is overdue, qmk_frame_feed calls it as well
+void qmk_frame_expire(QMKFramer& framer, std::chrono::steady_clock::time_point now);
+// splits the payload into reports of reportSize bytes
+bool qmk_frame_split(uint8_t messageId, std::span<const uint8_t> payload, size_t reportSize,
+    std::vector<std::vector<uint8_t>>& reports);
+// queues the payload with a fresh message id as consecutive reports on the
+// device's writer (hid_write_async), false if it can't be framed. The timeout
+// and stop apply to each fragment, done runs once after the last one with the
+// status of the first fragment which failed.
+bool qmk_frame_send(QMKFramer& framer, HID& hid, std::span<const uint8_t> payload, HIDWriteOptions options = {});
+void qmk_frame_log_stats(const QMKFramer& framer, const std::string& devname);
@@ -0,0 +1,166 @@
+#include <format>
+#include "keycode_lookup.h"
+#include "qmkkeymap.h"
+#include "log.h"
+
+static void qmk_keymap_finish(QMKKeymapDownload& download, bool ok) {
+    std::unique_lock guard(download.lock);
+    if (download.finished)
+        return;
+    download.finished = true;
+    auto done = std::move(download.done);
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - download.started);
+    size_t keys = download.keymap.keycodes.size();
+    guard.unlock();
+    if (ok)
+        QLOG_INFO("KEYMAP", "{} keycodes in {} ms\n", keys, elapsed.count());
+    else
+        QLOG_ERROR("KEYMAP", "Download failed after {} ms\n", elapsed.count());
+    if (done)
+        done(ok);
+}
+
+static void qmk_keymap_request(QMKKeymapDownload& download, uint32_t chunk);
+
+// the reply to a chunk request, its data came before it
+static void qmk_keymap_answered(QMKKeymapDownload& download, uint32_t chunk, const QMKCommandResult& result) {
+    if (result.status != QMK_COMMAND_OK) {
+        qmk_keymap_finish(download, false);
+        return;
+    }
+    std::unique_lock guard(download.lock);
+    if (download.finished)
+        return;
+    int64_t next = -1;
+    if (!download.received[chunk]) {
+        // answered without the data, a fragment got lost
+        if (download.attempts[chunk] > QMK_KEYMAP_RETRIES) {
+            guard.unlock();
+            qmk_keymap_finish(download, false);
+            return;
+        }
+        next = chunk;
+    }
+    else if (download.nextChunk < download.received.size()) {
+        next = download.nextChunk++;
+    }
+    bool complete = download.missing == 0;
+    guard.unlock();
+    if (complete)
+        qmk_keymap_finish(download, true);
+    else if (next >= 0)
+        qmk_keymap_request(download, static_cast<uint32_t>(next));
+}
+
+static void qmk_keymap_request(QMKKeymapDownload& download, uint32_t chunk) {
+    {
+        std::lock_guard guard(download.lock);
+        download.attempts[chunk]++;
+    }
+    msgpack_t request;
+    init_msgpack(&request);
+    add_msgpack_add(&request, MSGPACK_KEYMAP_CHUNK, static_cast<uint16_t>(chunk));
+    QMKCommandOptions options;
+    options.done = [self = download.shared_from_this(), chunk](const QMKCommandResult& result) {
+        qmk_keymap_answered(*self, chunk, result);
+        };
+    qmk_command_send(*download.cmd, request, std::move(options));
+}
+
+// the dimensions are known, the chunk requests start
+static void qmk_keymap_start(QMKKeymapDownload& download, const QMKCommandResult& result) {
+    if (result.status != QMK_COMMAND_OK) {
+        qmk_keymap_finish(download, false);
+        return;
+    }
+    uint8_t layers = msgpack_value<MSGPACK_KEYMAP_LAYERS>(result.reply);
+    uint8_t rows = msgpack_value<MSGPACK_KEYMAP_ROWS>(result.reply);
+    uint8_t cols = msgpack_value<MSGPACK_KEYMAP_COLS>(result.reply);
+    size_t keys = static_cast<size_t>(layers) * rows * cols;
+    if (keys == 0 || keys > QMK_KEYMAP_MAX_KEYS) {
+        QLOG_ERROR("KEYMAP", "Keymap of {} x {} x {} keys not supported\n", layers, rows, cols);
+        qmk_keymap_finish(download, false);
+        return;
+    }
+    std::unique_lock guard(download.lock);
+    download.keymap.layers = layers;
+    download.keymap.rows = rows;
+    download.keymap.cols = cols;
+    download.keymap.keycodes.assign(keys, 0);
+    uint32_t chunks = static_cast<uint32_t>((keys + QMK_KEYMAP_CHUNK_KEYS - 1) / QMK_KEYMAP_CHUNK_KEYS);
+    download.received.assign(chunks, false);
+    download.attempts.assign(chunks, 0);
+    download.missing = chunks;
+    download.nextChunk = std::min<uint32_t>(QMK_KEYMAP_PIPELINE, chunks);
+    uint32_t first = download.nextChunk;
+    guard.unlock();
+    for (uint32_t chunk = 0; chunk < first; chunk++) {
+        qmk_keymap_request(download, chunk);
+    }
+}
+
+std::shared_ptr<QMKKeymapDownload> qmk_keymap_download(std::shared_ptr<QMKCommander> cmd, std::function<void(bool ok)> done) {
+    auto download = qmk_keymap_download_create(std::move(cmd), std::move(done));
+    qmk_keymap_download_begin(*download);
+    return download;
+}
+
+std::shared_ptr<QMKKeymapDownload> qmk_keymap_download_create(std::shared_ptr<QMKCommander> cmd, std::function<void(bool ok)> done) {
+    auto download = std::make_shared<QMKKeymapDownload>();
+    download->cmd = std::move(cmd);
+    download->keymap = {};
+    download->nextChunk = 0;
+    download->missing = 0;
+    download->finished = false;
+    download->started = std::chrono::steady_clock::now();
+    download->done = std::move(done);
+    return download;
+}
+
+void qmk_keymap_download_begin(QMKKeymapDownload& download) {
+    msgpack_t request;
+    init_msgpack(&request);
+    add_msgpack_add(&request, MSGPACK_KEYMAP_LAYERS, 0);
+    add_msgpack_add(&request, MSGPACK_KEYMAP_ROWS, 0);
+    add_msgpack_add(&request, MSGPACK_KEYMAP_COLS, 0);
+    QMKCommandOptions options;
+    options.done = [download = download.shared_from_this()](const QMKCommandResult& result) {
+        qmk_keymap_start(*download, result);
+        };
+    qmk_command_send(*download.cmd, request, std::move(options));
+}
+
+bool qmk_keymap_feed(QMKKeymapDownload& download, std::span<const uint8_t> message) {
+    if (message.size() < 3 || message[0] != QMK_FRAME_KEYMAP)
+        return false;
+    uint32_t chunk = (static_cast<uint32_t>(message[1]) << 8) | message[2];
+    std::lock_guard guard(download.lock);
+    if (download.finished || chunk >= download.received.size())
+        return true; // late, or not asked for
+    std::vector<uint16_t>& keycodes = download.keymap.keycodes;
+    size_t first = static_cast<size_t>(chunk) * QMK_KEYMAP_CHUNK_KEYS;
+    size_t count = std::min<size_t>(QMK_KEYMAP_CHUNK_KEYS, keycodes.size() - first);
+    if (message.size() < 3 + count * 2)
+        return true; // cut short, the chunk is requested again
+    for (size_t i = 0; i < count; i++) {
+        keycodes[first + i] = static_cast<uint16_t>((message[3 + i * 2] << 8) | message[4 + i * 2]);
+    }
+    if (!download.received[chunk]) {
+        download.received[chunk] = true;
+        download.missing--;
+    }
+    return true;
+}
+
+std::string qmk_keymap_layer_text(const QMKKeymap& keymap, uint8_t layer) {
+    std::string text;
+    for (uint8_t row = 0; row < keymap.rows; row++) {
+        for (uint8_t col = 0; col < keymap.cols; col++) {
+            if (col)
+                text += ' ';
+            text += get_keycode_name(qmk_keymap_get(keymap, layer, row, col));
+        }
+        text += '\n';
+    }
+    return text;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+// Bulk download of a board's keymap, cached per device in the database.
+//
+// Protocol, on top of qmkcommand.h and qmkframe.h:
+//   1. request {KEYMAP_LAYERS, KEYMAP_ROWS, KEYMAP_COLS}, the reply carries
+//      the dimensions
+//   2. request {KEYMAP_CHUNK: n} for every chunk. The firmware first sends a
+//      framed message: QMK_FRAME_KEYMAP, n as uint16, then up to
+//      QMK_KEYMAP_CHUNK_KEYS keycodes as uint16, all big endian. After it comes
+//      the reply {KEYMAP_CHUNK: n, seqid}, which resolves the request.
+// Up to QMK_KEYMAP_PIPELINE chunk requests are in flight at a time.
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+#include "qmkcommand.h"
+
+#define QMK_FRAME_KEYMAP        1    // first byte of a framed keymap chunk
+#define QMK_KEYMAP_CHUNK_KEYS   64
+#define QMK_KEYMAP_PIPELINE     4
+#define QMK_KEYMAP_MAX_KEYS     8192 // layers * rows * cols
+#define QMK_KEYMAP_RETRIES      2    // resends of a chunk which was answered without its data
+
+typedef struct _QMKKeymap {
+    uint8_t layers;
+    uint8_t rows;
+    uint8_t cols;
+    std::vector<uint16_t> keycodes; // by layer, row, col
+} QMKKeymap;
+
+typedef struct _QMKKeymapDownload : std::enable_shared_from_this<_QMKKeymapDownload> {
+    std::shared_ptr<QMKCommander> cmd;
+    std::mutex lock;
+    QMKKeymap keymap;
+    std::vector<bool> received; // by chunk
+    std::vector<uint8_t> attempts; // by chunk
+    uint32_t nextChunk;         // next one to request
+    uint32_t missing;           // chunks not received yet
+    bool finished;
+    std::chrono::steady_clock::time_point started;
+    std::function<void(bool ok)> done; // once, on the thread which completed or failed it
+} QMKKeymapDownload;
+
+// KC_NO outside of the keymap
+inline uint16_t qmk_keymap_get(const QMKKeymap& keymap, uint8_t layer, uint8_t row, uint8_t col) {
+    if (layer >= keymap.layers || row >= keymap.rows || col >= keymap.cols)
+        return 0;
+    return keymap.keycodes[(static_cast<size_t>(layer) * keymap.rows + row) * keymap.cols + col];
+}
+
+// starts the download, keymap is valid once done is called with true
+std::shared_ptr<QMKKeymapDownload> qmk_keymap_download(std::shared_ptr<QMKCommander> cmd, std::function<void(bool ok)> done);
+// the same in two steps, so the download can be published to the read callback
+// before the first request goes out
+std::shared_ptr<QMKKeymapDownload> qmk_keymap_download_create(std::shared_ptr<QMKCommander> cmd, std::function<void(bool ok)> done);
+void qmk_keymap_download_begin(QMKKeymapDownload& download);
+// takes a framed message from the read callback, false if it is no keymap chunk
+bool qmk_keymap_feed(QMKKeymapDownload& download, std::span<const uint8_t> message);
+// the keycode names of one layer, a line per row
+std::string qmk_keymap_layer_text(const QMKKeymap& keymap, uint8_t layer);
@@ -0,0 +1,94 @@
+#include <bit>
+#include <format>
+#include <string>
+#include "hidex.h"
+#include "qmklatency.h"
+#include "log.h"
+
+static QMKLatencyHistogram _histograms[QMK_LATENCY_STAGES];
+
+static const char* _stageNames[QMK_LATENCY_STAGES] = {
+    "callback",
+    "layer window",
+    "tray icon",
+};
+
+static uint32_t latency_bucket(uint64_t us) {
+    constexpr uint64_t sub = 1ull << QMK_LATENCY_SUB_BITS;
+    if (us < sub)
+        return static_cast<uint32_t>(us);
+    uint32_t exponent = static_cast<uint32_t>(std::bit_width(us)) - 1;
+    uint32_t bucket = ((exponent - QMK_LATENCY_SUB_BITS + 1) << QMK_LATENCY_SUB_BITS) +
+        static_cast<uint32_t>((us >> (exponent - QMK_LATENCY_SUB_BITS)) & (sub - 1));
+    return std::min<uint32_t>(bucket, QMK_LATENCY_BUCKETS - 1);
+}
+
+// largest value which still falls into the bucket
+static uint64_t latency_bucket_limit(uint32_t bucket) {
+    constexpr uint64_t sub = 1ull << QMK_LATENCY_SUB_BITS;
+    if (bucket < sub)
+        return bucket;
+    uint32_t exponent = (bucket >> QMK_LATENCY_SUB_BITS) + QMK_LATENCY_SUB_BITS - 1;
+    uint64_t mantissa = sub + (bucket & (sub - 1));
+    return ((mantissa + 1) << (exponent - QMK_LATENCY_SUB_BITS)) - 1;
+}
+
+void qmk_latency_record_us(QMKLatencyStage stage, uint64_t us) {
+    QMKLatencyHistogram& histogram = _histograms[stage];
+    histogram.buckets[latency_bucket(us)].fetch_add(1, std::memory_order_relaxed);
+    histogram.count.fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = histogram.max.load(std::memory_order_relaxed);
+    while (us > max && !histogram.max.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+    }
+}
+
+void qmk_latency_record(QMKLatencyStage stage, std::chrono::steady_clock::time_point start) {
+    if (start.time_since_epoch().count() == 0)
+        return; // no timestamp, e.g. the layer came from a query at startup
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    qmk_latency_record_us(stage, elapsed > 0 ? static_cast<uint64_t>(elapsed) : 0);
+}
+
+uint64_t qmk_latency_count(QMKLatencyStage stage) {
+    return _histograms[stage].count.load(std::memory_order_relaxed);
+}
+
+uint64_t qmk_latency_percentile(QMKLatencyStage stage, double q) {
+    QMKLatencyHistogram& histogram = _histograms[stage];
+    // the buckets are read one by one while others record, the sum is taken from them
+    std::array<uint64_t, QMK_LATENCY_BUCKETS> counts;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < QMK_LATENCY_BUCKETS; i++) {
+        counts[i] = histogram.buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < QMK_LATENCY_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank)
+            return std::min(latency_bucket_limit(i), histogram.max.load(std::memory_order_relaxed));
+    }
+    return histogram.max.load(std::memory_order_relaxed);
+}
+
+void qmk_latency_log() {
+    for (int stage = 0; stage < QMK_LATENCY_STAGES; stage++) {
+        auto s = static_cast<QMKLatencyStage>(stage);
+        QLOG_INFO("LAT", "{}: {} samples, p50 {} us, p99 {} us, p999 {} us, max {} us\n", _stageNames[stage],
+            qmk_latency_count(s), qmk_latency_percentile(s, 0.5), qmk_latency_percentile(s, 0.99),
+            qmk_latency_percentile(s, 0.999), _histograms[stage].max.load(std::memory_order_relaxed));
+    }
+}
+
+void qmk_latency_reset() {
+    for (auto& histogram : _histograms) {
+        for (auto& bucket : histogram.buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        histogram.count.store(0, std::memory_order_relaxed);
+        histogram.max.store(0, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+// Per-stage latency histograms from the completion of a report read to the
+// places that show its effect. Recording is a relaxed atomic increment, so the
+// reactor, the callback threads and the UI thread record without locks.
+
+#include <stdint.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+
+typedef enum _QMKLatencyStage {
+    QMK_LATENCY_CALLBACK = 0, // read completion to the decoded report in readCallback
+    QMK_LATENCY_LAYER_WINDOW, // read completion to the shown layer window
+    QMK_LATENCY_TRAY_ICON,    // read completion to the updated tray icon
+    QMK_LATENCY_STAGES
+} QMKLatencyStage;
+
+// log-linear buckets in microseconds: 16 linear sub-buckets per power of two,
+// so every bucket is at most 1/16 wide relative to its value, up to ~71 minutes
+#define QMK_LATENCY_SUB_BITS 4
+#define QMK_LATENCY_BUCKETS ((33 - QMK_LATENCY_SUB_BITS) << QMK_LATENCY_SUB_BITS)
+
+typedef struct _QMKLatencyHistogram {
+    std::array<std::atomic<uint64_t>, QMK_LATENCY_BUCKETS> buckets;
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> max; // us
+} QMKLatencyHistogram;
+
+void qmk_latency_record(QMKLatencyStage stage, std::chrono::steady_clock::time_point start);
+void qmk_latency_record_us(QMKLatencyStage stage, uint64_t us);
+// upper bound of the bucket holding the q-quantile (0..1) in us, 0 without samples
+uint64_t qmk_latency_percentile(QMKLatencyStage stage, double q);
+uint64_t qmk_latency_count(QMKLatencyStage stage);
+// p50/p99/p999 and max of every stage to the debug output
+void qmk_latency_log();
+void qmk_latency_reset();
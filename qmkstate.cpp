@@ -0,0 +1,29 @@
+#include "qmkstate.h"
+#include "log.h"
+
+QMKDeviceState qmk_state_read(const QMKStateBlock& block) {
+    uint64_t words[QMK_STATE_WORDS];
+    for (;;) {
+        uint32_t before = block.sequence.load(std::memory_order_acquire);
+        if (!(before & 1)) {
+            for (size_t i = 0; i < QMK_STATE_WORDS; i++) {
+                words[i] = block.words[i].load(std::memory_order_relaxed);
+            }
+            // the copy is done before the sequence is checked again
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (block.sequence.load(std::memory_order_relaxed) == before)
+                break;
+        }
+        block.retries.fetch_add(1, std::memory_order_relaxed);
+    }
+    QMKDeviceState state;
+    memcpy(&state, words, sizeof(state));
+    return state;
+}
+
+void qmk_state_log(const QMKStateBlock& block, const std::string& devname) {
+    QMKDeviceState state = qmk_state_read(block);
+    QLOG_INFO("QMK", "State {}: layer {}, {} reports, {} layer changes, {} keycodes, {} presses, {} reader retries\n",
+        devname, state.layer, state.reports, state.layerChanges, state.keycodes, state.presses,
+        block.retries.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+// Per-device state for readers on any thread, published through a seqlock.
+//
+// The read callback of a device updates its block after every report, the
+// UI thread, the tray icon and the action rules take snapshots. A writer
+// makes the sequence odd, stores the state and makes it even again; a reader
+// copies the state between two loads of the sequence and retries if it was
+// odd or changed. Readers never block writers and take no lock, writers only
+// wait for another writer of the same block, e.g. the UI thread marking the
+// device disconnected.
+//
+// The state is kept in relaxed atomic words, so the copy a reader throws
+// away is not a data race.
+
+#include <stdint.h>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+typedef enum _QMKConnection {
+    QMK_CONNECTION_CLOSED = 0,
+    QMK_CONNECTION_OPEN,
+    QMK_CONNECTION_ERROR, // the last read failed
+} QMKConnection;
+
+typedef struct _QMKDeviceState {
+    uint8_t layer;
+    uint8_t ledState;
+    uint8_t connection;   // QMKConnection
+    uint16_t keycode;     // last key pressed
+    uint32_t buttons;     // StreamDeck buttons held, bit per button
+    uint64_t reports;
+    uint64_t layerChanges;
+    uint64_t keycodes;
+    uint64_t presses;     // StreamDeck
+    int64_t lastReport;   // steady_clock ticks of the last report's read completion
+} QMKDeviceState;
+
+#define QMK_STATE_WORDS ((sizeof(QMKDeviceState) + sizeof(uint64_t) - 1) / sizeof(uint64_t))
+
+typedef struct _QMKStateBlock {
+    std::atomic<uint32_t> sequence = 0; // odd while written
+    std::atomic<uint64_t> words[QMK_STATE_WORDS] = {};
+    mutable std::atomic<uint64_t> retries = 0; // reader copies thrown away
+} QMKStateBlock;
+
+static_assert(std::is_trivially_copyable_v<QMKDeviceState>);
+
+// any thread, a consistent copy
+QMKDeviceState qmk_state_read(const QMKStateBlock& block);
+void qmk_state_log(const QMKStateBlock& block, const std::string& devname);
+
+// writer side, update gets the current state to change in place
+template <typename Fn>
+void qmk_state_update(QMKStateBlock& block, Fn update) {
+    uint32_t sequence = block.sequence.load(std::memory_order_relaxed);
+    // another writer holds the block, it's a few stores; acquire sees what the last writer stored
+    while ((sequence & 1) || !block.sequence.compare_exchange_weak(sequence, sequence + 1,
+        std::memory_order_acquire, std::memory_order_relaxed)) {
+        sequence = block.sequence.load(std::memory_order_relaxed);
+    }
+    // the odd sequence is visible before any of the stores below
+    std::atomic_thread_fence(std::memory_order_release);
+
+    uint64_t words[QMK_STATE_WORDS];
+    for (size_t i = 0; i < QMK_STATE_WORDS; i++) {
+        words[i] = block.words[i].load(std::memory_order_relaxed);
+    }
+    QMKDeviceState state;
+    memcpy(&state, words, sizeof(state));
+    update(state);
+    memcpy(words, &state, sizeof(state));
+    for (size_t i = 0; i < QMK_STATE_WORDS; i++) {
+        block.words[i].store(words[i], std::memory_order_relaxed);
+    }
+    block.sequence.store(sequence + 2, std::memory_order_release);
+}
@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <bit>
+#include <string>
+#include "streamdeck.h"
+#include "log.h"
+
+uint32_t streamdeck_pack(std::span<const uint8_t> report, uint8_t& count) {
+    count = 0;
+    if (report.size() <= STREAMDECK_HEADER_SIZE)
+        return 0;
+    count = static_cast<uint8_t>(std::min<size_t>(report.size() - STREAMDECK_HEADER_SIZE, STREAMDECK_MAX_BUTTONS));
+    const uint8_t* states = report.data() + STREAMDECK_HEADER_SIZE;
+    uint32_t mask = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        mask |= static_cast<uint32_t>(states[i] != 0) << i;
+    }
+    return mask;
+}
+
+size_t streamdeck_decode(StreamDeckButtons& buttons, std::span<const uint8_t> report,
+    std::chrono::steady_clock::time_point now, std::span<StreamDeckEdge, STREAMDECK_MAX_EDGES> edges) {
+    uint8_t count;
+    uint32_t state = streamdeck_pack(report, count);
+    if (count < buttons.count) // another layout, e.g. after a firmware update
+        buttons.state &= (count < 32) ? ((1u << count) - 1) : ~0u;
+    buttons.count = count;
+    buttons.stats.reports++;
+
+    size_t written = 0;
+    // held buttons which crossed the long press time since the last report
+    for (uint32_t held = buttons.state & state & ~buttons.longFired; held; held &= held - 1) {
+        uint8_t i = static_cast<uint8_t>(std::countr_zero(held));
+        if (now - buttons.pressed[i] >= buttons.longPress) {
+            buttons.longFired |= 1u << i;
+            buttons.presses[i] = 0;
+            buttons.stats.longPresses++;
+            edges[written++] = { i, STREAMDECK_LONG_PRESS, 0, now };
+        }
+    }
+
+    uint32_t changed = state ^ buttons.state;
+    if (!changed && !written)
+        buttons.stats.unchanged++;
+    for (; changed; changed &= changed - 1) {
+        uint8_t i = static_cast<uint8_t>(std::countr_zero(changed));
+        uint32_t bit = 1u << i;
+        if (state & bit) {
+            buttons.presses[i] = (buttons.presses[i] && now - buttons.released[i] <= buttons.multiPress)
+                ? static_cast<uint8_t>(std::min(buttons.presses[i] + 1, 255)) : 1;
+            buttons.pressed[i] = now;
+            buttons.stats.presses++;
+            edges[written++] = { i, STREAMDECK_PRESSED, buttons.presses[i], now };
+            if (buttons.presses[i] > 1) {
+                buttons.stats.multiPresses++;
+                edges[written++] = { i, STREAMDECK_MULTI_PRESS, buttons.presses[i], now };
+            }
+        }
+        else {
+            if (!(buttons.longFired & bit) && now - buttons.pressed[i] >= buttons.longPress) {
+                buttons.presses[i] = 0;
+                buttons.stats.longPresses++;
+                edges[written++] = { i, STREAMDECK_LONG_PRESS, 0, now };
+            }
+            buttons.longFired &= ~bit;
+            buttons.released[i] = now;
+            edges[written++] = { i, STREAMDECK_RELEASED, 0, now };
+        }
+    }
+    buttons.state = state;
+    return written;
+}
+
+void streamdeck_log_stats(const StreamDeckButtons& buttons, const std::string& devname) {
+    const StreamDeckStats& stats = buttons.stats;
+    QLOG_INFO("QMK", "StreamDeck {}: {} reports, {} unchanged, {} presses, {} long, {} multi\n",
+        devname, stats.reports, stats.unchanged, stats.presses, stats.longPresses, stats.multiPresses);
+}
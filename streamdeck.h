@@ -0,0 +1,70 @@
+#pragma once
+
+// StreamDeck button reports to press and release edges.
+//
+// A report carries one byte per button after a 4 byte header, 15 buttons on
+// the original StreamDeck and 32 on the XL; the button count follows from the
+// report size. The bytes are packed into a bit mask, XOR against the previous
+// mask of the device gives the changed buttons. Besides the plain edges the
+// decoder recognizes
+//
+//   long press   held for longPress, reported with the next report of the
+//                device or at the release at the latest (the StreamDeck only
+//                reports changes)
+//   multi press  pressed again within multiPress of its release, reported
+//                with the press and the number of presses so far
+//
+// The state belongs to the read callback of the device, decoding allocates
+// nothing: the edges go into a caller supplied array.
+
+#include <stdint.h>
+#include <chrono>
+#include <span>
+#include <string>
+
+#define STREAMDECK_HEADER_SIZE    4
+#define STREAMDECK_MAX_BUTTONS    32 // XL
+#define STREAMDECK_MAX_EDGES      (2 * STREAMDECK_MAX_BUTTONS) // per report: press + multi or long + release
+#define STREAMDECK_LONG_PRESS_MS  500
+#define STREAMDECK_MULTI_PRESS_MS 300
+
+typedef enum _StreamDeckEdgeType {
+    STREAMDECK_RELEASED = 0,
+    STREAMDECK_PRESSED,
+    STREAMDECK_LONG_PRESS,  // still held, or released with this report
+    STREAMDECK_MULTI_PRESS, // presses: 2 for a double press, ...
+} StreamDeckEdgeType;
+
+typedef struct _StreamDeckEdge {
+    uint8_t button;
+    uint8_t type;    // StreamDeckEdgeType
+    uint8_t presses; // of the running multi press, STREAMDECK_PRESSED and STREAMDECK_MULTI_PRESS
+    std::chrono::steady_clock::time_point time;
+} StreamDeckEdge;
+
+typedef struct _StreamDeckStats {
+    uint64_t reports;
+    uint64_t unchanged; // reports without an edge
+    uint64_t presses;
+    uint64_t longPresses;
+    uint64_t multiPresses;
+} StreamDeckStats;
+
+typedef struct _StreamDeckButtons {
+    uint32_t state = 0;     // bit per button, 1 held
+    uint32_t longFired = 0; // held buttons whose long press was reported
+    uint8_t count = 0;      // buttons of the last report
+    uint8_t presses[STREAMDECK_MAX_BUTTONS] = {}; // in the running multi press
+    std::chrono::steady_clock::time_point pressed[STREAMDECK_MAX_BUTTONS];
+    std::chrono::steady_clock::time_point released[STREAMDECK_MAX_BUTTONS];
+    std::chrono::milliseconds longPress = std::chrono::milliseconds(STREAMDECK_LONG_PRESS_MS);
+    std::chrono::milliseconds multiPress = std::chrono::milliseconds(STREAMDECK_MULTI_PRESS_MS);
+    StreamDeckStats stats = {};
+} StreamDeckButtons;
+
+// bit i set if button i is down, at most STREAMDECK_MAX_BUTTONS
+uint32_t streamdeck_pack(std::span<const uint8_t> report, uint8_t& count);
+// edges of the report in button order, returns how many were written to edges
+size_t streamdeck_decode(StreamDeckButtons& buttons, std::span<const uint8_t> report,
+    std::chrono::steady_clock::time_point now, std::span<StreamDeckEdge, STREAMDECK_MAX_EDGES> edges);
+void streamdeck_log_stats(const StreamDeckButtons& buttons, const std::string& devname);
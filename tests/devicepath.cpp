@@ -0,0 +1,187 @@
+// Checks parseDevicePath and DeviceNameParser against a table of device paths:
+// USB with and without an interface number, BLE and Bluetooth, paths without
+// ids, malformed ids and empty or trailing '#' segments. Every row is also run
+// through the regex parser DeviceNameWindow.h had before, the USB fields must
+// come out the same. Then times both.
+//
+//   devicepath [<iterations>]
+//
+// Exit code 0 if every row matches. Build from the repository root, e.g. on
+// Linux (StringEx.h uses the Windows localtime_s)
+//   g++ -std=c++20 -O2 -I. '-Dlocaltime_s(a,b)=localtime_r(b,a)' tests/devicepath.cpp log.cpp -lpthread
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <regex>
+#include <sstream>
+#include <vector>
+#include "DeviceNameWindow.h"
+
+#define TEST_ITERATIONS 20000
+#define TEST_NONE       -1
+
+typedef struct _TestPath {
+    const char* path;
+    int vid;          // TEST_NONE if not found
+    int pid;
+    const char* mi;   // nullptr if not found
+    const char* port; // upper case, nullptr without a third segment
+    bool ble;
+    uint16_t bleVid;
+    uint16_t blePid;
+} TestPath;
+
+static const TestPath _paths[] = {
+    // USB, interface number in lower and upper case
+    { R"(\\?\hid#vid_35ee&pid_1308&mi_01#7&1a2b3c4d&0&0000#{4d1e55b2-f16f-11cf-88cb-001111000030})",
+        0x35EE, 0x1308, "&MI_01", "7&1A2B3C4D&0&0000", false, 0, 0 },
+    { R"(\\?\HID#VID_35EE&PID_1308&MI_01#7&1A2B3C4D&0&0000#{4D1E55B2-F16F-11CF-88CB-001111000030})",
+        0x35EE, 0x1308, "&MI_01", "7&1A2B3C4D&0&0000", false, 0, 0 },
+    { R"(\\?\hid#vid_046d&pid_c52b&mi_02&col01#8&2b2a1f0c&0&0000#{4d1e55b2-f16f-11cf-88cb-001111000030})",
+        0x046D, 0xC52B, "&MI_02", "8&2B2A1F0C&0&0000", false, 0, 0 },
+    { R"(\\?\hid#vid_046d&pid_c52b&mi_02&col03#8&2b2a1f0c&0&0002#{4d1e55b2-f16f-11cf-88cb-001111000030})",
+        0x046D, 0xC52B, "&MI_02", "8&2B2A1F0C&0&0002", false, 0, 0 },
+    { R"(\\?\hid#vid_4653&pid_0001&mi_01#8&3a1b2c&0&0000#{4d1e55b2-f16f-11cf-88cb-001111000030})",
+        0x4653, 0x0001, "&MI_01", "8&3A1B2C&0&0000", false, 0, 0 },
+    // USB without an interface number
+    { R"(\\?\hid#vid_0fd9&pid_0080#6&2b1f3c8a&0&0000#{4d1e55b2-f16f-11cf-88cb-001111000030})",
+        0x0FD9, 0x0080, nullptr, "6&2B1F3C8A&0&0000", false, 0, 0 },
+    { R"(\\?\USB#VID_35EE&PID_1308#6&1234&0&1)", 0x35EE, 0x1308, nullptr, "6&1234&0&1", false, 0, 0 },
+    { R"(\\.\hid#vid_1234&pid_abcd#port)", 0x1234, 0xABCD, nullptr, "PORT", false, 0, 0 },
+    { "vid_1234&pid_5678", 0x1234, 0x5678, nullptr, nullptr, false, 0, 0 },
+    // BLE with a two digit vendor id source, Bluetooth with four
+    { R"(\\?\HID#{00001812-0000-1000-8000-00805F9B34FB}_DEV_VID&02046D_PID&B013_REV&0007_C4C4C279C660&COL03#B&2C603A6D&0&0002#{4D1E55B2-F16F-11CF-88CB-001111000030})",
+        TEST_NONE, TEST_NONE, nullptr, nullptr, true, 0x046D, 0xB013 },
+    { R"(\\?\hid#{00001124-0000-1000-8000-00805f9b34fb}_vid&0002046d_pid&b342&col01#9&1c0b4d3&0&0000#{4d1e55b2-f16f-11cf-88cb-001111000030})",
+        TEST_NONE, TEST_NONE, nullptr, nullptr, true, 0x046D, 0xB342 },
+    // no ids
+    { R"(\\?\hid#intc816&col01#3&36a7043c&0&0000#{4d1e55b2-f16f-11cf-88cb-001111000030})",
+        TEST_NONE, TEST_NONE, nullptr, "3&36A7043C&0&0000", false, 0, 0 },
+    { R"(\\?\hid#hid_device_system_control#2&1f3a3b2f&0&0000#{4d1e55b2-f16f-11cf-88cb-001111000030})",
+        TEST_NONE, TEST_NONE, nullptr, "2&1F3A3B2F&0&0000", false, 0, 0 },
+    { "sim:qmk", TEST_NONE, TEST_NONE, nullptr, nullptr, false, 0, 0 },
+    // malformed ids, the first valid one in a segment and the last segment with one win
+    { "x#vid_12g4&vid_1234#", 0x1234, TEST_NONE, nullptr, nullptr, false, 0, 0 },
+    { R"(\\?\hid#vid_35ee&pid_1308&mi_0g&mi_01#7&1a2b3c4d&0&0000#vid_aaaa)",
+        0xAAAA, 0x1308, "&MI_01", "7&1A2B3C4D&0&0000", false, 0, 0 },
+    // empty and trailing '#'
+    { "", TEST_NONE, TEST_NONE, nullptr, nullptr, false, 0, 0 },
+    { "#", TEST_NONE, TEST_NONE, nullptr, nullptr, false, 0, 0 },
+    { "a##b", TEST_NONE, TEST_NONE, nullptr, "B", false, 0, 0 },
+    { "x#y#", TEST_NONE, TEST_NONE, nullptr, nullptr, false, 0, 0 },
+    { "x#y##", TEST_NONE, TEST_NONE, nullptr, "", false, 0, 0 },
+};
+
+typedef struct _TestRegexPath {
+    std::optional<uint16_t> vid;
+    std::optional<uint16_t> pid;
+    std::optional<std::string> mi;
+    std::optional<std::string> port;
+} TestRegexPath;
+
+// the parser before parseDevicePath, a regex per id and segment
+static TestRegexPath test_regex_parse(const std::string& deviceName) {
+    TestRegexPath parsed;
+    std::string devname = stringex::toUpper(deviceName);
+    std::vector<std::string> pieces;
+    std::stringstream ss(devname);
+    for (std::string item; std::getline(ss, item, '#');)
+        pieces.push_back(item);
+
+    std::smatch match;
+    std::regex uuidRegex(R"(\{[0-9a-fA-F]{8}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{12}\})");
+    if (pieces.size() > 1 && std::regex_search(pieces[1], match, uuidRegex))
+        return parsed;
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        const auto& part = pieces[i];
+        std::regex vidRegex(R"(VID_([0-9a-fA-F]{4}))");
+        if (std::regex_search(part, match, vidRegex))
+            parsed.vid = static_cast<uint16_t>(std::stoi(match.str(1), nullptr, 16));
+        std::regex pidRegex(R"(PID_([0-9a-fA-F]{4}))");
+        if (std::regex_search(part, match, pidRegex))
+            parsed.pid = static_cast<uint16_t>(std::stoi(match.str(1), nullptr, 16));
+        std::regex miRegex(R"(&MI_([0-9a-fA-F]{2}))");
+        if (std::regex_search(part, match, miRegex))
+            parsed.mi = "&MI_" + match.str(1);
+        if (i == 2)
+            parsed.port = part;
+    }
+    return parsed;
+}
+
+static std::optional<uint16_t> test_id(int value) {
+    return value == TEST_NONE ? std::nullopt : std::optional<uint16_t>(static_cast<uint16_t>(value));
+}
+
+static std::optional<std::string> test_text(const char* value) {
+    return value ? std::optional<std::string>(value) : std::nullopt;
+}
+
+static bool test_row(const TestPath& row) {
+    std::string path = row.path;
+    DevicePath parsed;
+    bool usb = parseDevicePath(path, parsed);
+    DeviceNameParser parser(path);
+    TestRegexPath regex = test_regex_parse(path);
+    bool expectUsb = row.vid != TEST_NONE && row.pid != TEST_NONE;
+
+    const char* failed = nullptr;
+    if (usb != expectUsb || parser.isRegularHidDevice() != expectUsb)
+        failed = "usb";
+    else if (parsed.vid != test_id(row.vid) || parsed.pid != test_id(row.pid))
+        failed = "vid/pid";
+    else if (parser.getMI() != test_text(row.mi))
+        failed = "mi";
+    else if (parser.getPort() != test_text(row.port))
+        failed = "port";
+    else if (parsed.ble != row.ble || parsed.bleVid != row.bleVid || parsed.blePid != row.blePid)
+        failed = "ble";
+    else if (regex.vid != parser.getVID() || regex.pid != parser.getPID() || regex.mi != parser.getMI()
+        || regex.port != parser.getPort())
+        failed = "regex";
+    if (failed)
+        printf("FAIL %s: %s\n", failed, row.path);
+    return !failed;
+}
+
+static volatile uint32_t _sink;
+
+template <typename Parse>
+static double test_time(uint32_t iterations, Parse parse) {
+    std::vector<std::string> paths;
+    for (const TestPath& row : _paths)
+        paths.emplace_back(row.path);
+    uint32_t check = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < iterations; i++)
+        check += parse(paths[i % paths.size()]);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+    _sink = check; // keeps the loop
+    return ns;
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t iterations = argc > 1 ? static_cast<uint32_t>(strtoul(argv[1], nullptr, 10)) : TEST_ITERATIONS;
+    size_t failed = 0;
+    for (const TestPath& row : _paths) {
+        if (!test_row(row))
+            failed++;
+    }
+    printf("%zu paths, %zu failed\n", std::size(_paths), failed);
+
+    double regex = test_time(iterations, [](const std::string& path) {
+        return test_regex_parse(path).vid.value_or(0);
+    });
+    double direct = test_time(iterations * 50, [](const std::string& path) {
+        DevicePath parsed;
+        parseDevicePath(path, parsed);
+        return parsed.vid.value_or(0);
+    });
+    double wrapped = test_time(iterations * 50, [](const std::string& path) {
+        return DeviceNameParser(path).getVID().value_or(0);
+    });
+    printf("per path: regex %.0f ns, parseDevicePath %.0f ns, DeviceNameParser %.0f ns\n", regex, direct, wrapped);
+    printf("%s\n", failed ? "FAIL" : "ok");
+    return failed ? 1 : 0;
+}
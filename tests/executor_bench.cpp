@@ -0,0 +1,115 @@
+// Cost of running a short handler off the read thread: a thread spawned per
+// event and joined later, against executor_submit to a fixed pool of workers.
+// A flood of events gives the time per event until all handlers ran, with one
+// submitting thread like the reactor and with several. Events paced like
+// reports give the time from the submit to the start of the handler. Then
+// checks that every task ran exactly once.
+//
+//   executor_bench [<events>]
+//
+// Exit code 0 if no task was lost or ran twice. Build from the repository
+// root, e.g. on Linux
+//   g++ -std=c++20 -O2 -I. tests/executor_bench.cpp executor.cpp log.cpp -lpthread
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "executor.h"
+
+#define BENCH_EVENTS     20000
+#define BENCH_PACED      2000 // events of the latency run
+#define BENCH_GAP_US     250  // between paced events, a busy board
+#define BENCH_WORKERS    4
+#define BENCH_SUBMITTERS 4
+#define BENCH_WORK       200  // iterations of the handler's busy loop
+
+using namespace std::chrono;
+
+typedef enum _BenchMode {
+    BENCH_SPAWN = 0, // std::jthread per event, joined at the end of the run
+    BENCH_EXECUTOR,
+} BenchMode;
+
+static std::atomic<uint64_t> _ran;
+static std::atomic<uint64_t> _sink; // keeps the busy loop
+
+// one event, latency gets the time from its submit to the start of the handler
+static void bench_handler(steady_clock::time_point submitted, double* latency) {
+    *latency = duration<double, std::micro>(steady_clock::now() - submitted).count();
+    uint64_t value = 0;
+    for (int i = 0; i < BENCH_WORK; i++)
+        value += static_cast<uint64_t>(i) * i;
+    _sink.store(value, std::memory_order_relaxed);
+    _ran.fetch_add(1, std::memory_order_release);
+}
+
+// the submitters share the events, gapUs 0 submits them as fast as possible;
+// returns the time per event until the last handler finished
+static double bench_run(BenchMode mode, uint32_t events, uint32_t submitters, uint32_t gapUs, std::vector<double>& latencies) {
+    latencies.assign(events, 0.0);
+    _ran = 0;
+    auto start = steady_clock::now();
+    std::vector<std::jthread> threads;
+    for (uint32_t s = 0; s < submitters; s++) {
+        threads.emplace_back([&latencies, mode, events, submitters, gapUs, s] {
+            std::vector<std::jthread> spawned;
+            auto next = steady_clock::now();
+            for (uint32_t i = s; i < events; i += submitters) {
+                if (gapUs) {
+                    next += microseconds(gapUs);
+                    while (steady_clock::now() < next)
+                        std::this_thread::yield();
+                }
+                double* latency = &latencies[i];
+                auto submitted = steady_clock::now();
+                if (mode == BENCH_SPAWN)
+                    spawned.emplace_back(bench_handler, submitted, latency);
+                else
+                    executor_submit([submitted, latency] { bench_handler(submitted, latency); });
+            }
+            });
+    }
+    threads.clear();
+    while (_ran.load(std::memory_order_acquire) < events)
+        std::this_thread::yield();
+    return duration<double, std::micro>(steady_clock::now() - start).count() / events;
+}
+
+static void bench_print(const char* name, BenchMode mode, uint32_t events) {
+    std::vector<double> latencies;
+    double flood = bench_run(mode, events, 1, 0, latencies);
+    double many = bench_run(mode, events, BENCH_SUBMITTERS, 0, latencies);
+    bench_run(mode, BENCH_PACED, 1, BENCH_GAP_US, latencies);
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-17s %6.2f us per event, %6.2f with %d submitters; paced: submit to start p50 %5.1f us, p99 %6.1f us\n",
+        name, flood, many, BENCH_SUBMITTERS, latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100]);
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t events = argc > 1 ? static_cast<uint32_t>(strtoul(argv[1], nullptr, 10)) : BENCH_EVENTS;
+    if (events == 0)
+        events = BENCH_EVENTS;
+    printf("%u events, %d paced %d us apart, %d workers, handler of %d iterations\n",
+        events, BENCH_PACED, BENCH_GAP_US, BENCH_WORKERS, BENCH_WORK);
+
+    bench_print("thread per event", BENCH_SPAWN, events);
+    executor_start(BENCH_WORKERS, nullptr, nullptr);
+    std::vector<double> latencies;
+    bench_run(BENCH_EXECUTOR, events, 1, 0, latencies); // warm-up, the deques grow once
+    ExecutorStats before = executor_stats();
+    bench_print("executor", BENCH_EXECUTOR, events);
+    ExecutorStats stats = executor_stats();
+    executor_stop();
+
+    uint64_t submitted = stats.submitted - before.submitted;
+    uint64_t executed = stats.executed - before.executed;
+    printf("%llu submitted, %llu executed, %llu stolen\n", static_cast<unsigned long long>(submitted),
+        static_cast<unsigned long long>(executed), static_cast<unsigned long long>(stats.stolen - before.stolen));
+    bool ok = submitted == 2ull * events + BENCH_PACED && executed == submitted && stats.inlined == 0;
+    printf("%s\n", ok ? "ok" : "FAIL");
+    return ok ? 0 : 1;
+}
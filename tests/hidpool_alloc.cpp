@@ -0,0 +1,150 @@
+// Reads a simulated QMK board and StreamDeck through the callback path and
+// checks that the steady state allocates nothing: the reports come out of the
+// device's buffer pool, hid_report_retain only changes their owner and no
+// retained report falls back to a heap copy.
+//
+//   hidpool_alloc [<reports per device>]
+//
+// Exit code 0 if no allocation was seen after the warm-up. Build from the
+// repository root, e.g. on Linux
+//   g++ -std=c++20 -O2 -I. tests/hidpool_alloc.cpp hidex.cpp hidex_hidraw.cpp hidex_sim.cpp hidpool.cpp
+//       hidwriter.cpp hidcapture.cpp msgpack.cpp qmkframe.cpp log.cpp -lpthread
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include "hidex.h"
+#include "hidsim.h"
+#include "msgpack.h"
+
+#define TEST_WARMUP   2000 // reports per device before counting starts
+#define TEST_REPORTS  50000
+#define TEST_RATE     20000 // reports/s per simulated device
+#define TEST_KEPT     4     // reports held back per device, fewer than HID_POOL_SPARES
+
+// only allocations made inside the read callback are counted, the simulated
+// devices build their reports on the same thread
+static thread_local bool _counting = false;
+static std::atomic<uint64_t> _allocations = 0;
+
+void* operator new(size_t size) {
+    if (_counting)
+        _allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+typedef struct _TestDevice {
+    HID hid;
+    HIDReportBuffer kept[TEST_KEPT]; // the oldest goes back to the pool when a report comes in
+    uint32_t next;
+    std::atomic<uint64_t> reports;
+    uint64_t decoded;
+} TestDevice;
+
+static void test_callback(HID& hid, HIDReport& report, void* userData) {
+    (void)hid;
+    _counting = true;
+    TestDevice& device = *static_cast<TestDevice*>(userData);
+    msgpack_t km;
+    if (read_msgpack(&km, report.data))
+        device.decoded++;
+    device.kept[device.next++ % TEST_KEPT] = hid_report_retain(report);
+    device.reports.fetch_add(1, std::memory_order_release);
+    _counting = false;
+}
+
+static DeviceSupport test_support(const char* name, uint8_t type, uint16_t vid, uint16_t pid, const char* iface) {
+    DeviceSupport support{};
+    support.active = true;
+    support.name = name;
+    support.type = type;
+    support.vid = vid;
+    support.pid = pid;
+    support.iface = iface;
+    return support;
+}
+
+static void test_wait(TestDevice* devices, size_t count, uint64_t reports) {
+    for (size_t i = 0; i < count; i++) {
+        while (devices[i].reports.load(std::memory_order_acquire) < reports)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t reports = argc > 1 ? strtoull(argv[1], nullptr, 10) : TEST_REPORTS;
+    hid_sim_add({ "qmk", HID_SIM_QMK, 0x35EE, 0x1308, "&MI_01", TEST_RATE, 4, 0, false });
+    hid_sim_add({ "streamdeck", HID_SIM_STREAMDECK, 0x0fd9, 0x0080, "", TEST_RATE, 0, 15, false });
+    std::vector<DeviceSupport> supported = {
+        test_support("QMK", 2, 0x35EE, 0x1308, "&MI_01"),
+        test_support("StreamDeck", 1, 0x0fd9, 0x0080, ""),
+    };
+    std::vector<DeviceSupport> system;
+    hid_open_list(system, supported);
+
+    static TestDevice devices[2];
+    size_t count = 0;
+    for (auto& support : system) {
+        if (!support.dev.starts_with(HID_SIM_PREFIX) || count == std::size(devices))
+            continue;
+        if (!hid_connect(devices[count].hid, support.dev, test_callback, &devices[count])) {
+            printf("FAIL: %s does not open\n", support.dev.c_str());
+            return 1;
+        }
+        count++;
+    }
+    if (count != std::size(devices)) {
+        printf("FAIL: %zu of %zu simulated devices\n", count, std::size(devices));
+        return 1;
+    }
+
+    test_wait(devices, count, TEST_WARMUP);
+    uint64_t warmup = _allocations.exchange(0);
+    uint64_t heapCopies[2];
+    for (size_t i = 0; i < count; i++)
+        heapCopies[i] = hid_pool_stats(devices[i].hid).heapCopies;
+    auto start = std::chrono::steady_clock::now();
+    test_wait(devices, count, TEST_WARMUP + reports);
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    uint64_t allocations = _allocations.load();
+
+    bool ok = allocations == 0;
+    for (size_t i = 0; i < count; i++) {
+        HIDPoolStats stats = hid_pool_stats(devices[i].hid);
+        printf("%s: %llu reports, %llu decoded, %u buffers, %llu heap copies after the warm-up\n",
+            devices[i].hid.info.devname.c_str(), static_cast<unsigned long long>(devices[i].reports.load()),
+            static_cast<unsigned long long>(devices[i].decoded), stats.buffers,
+            static_cast<unsigned long long>(stats.heapCopies - heapCopies[i]));
+        ok = ok && stats.heapCopies == heapCopies[i];
+    }
+    HIDSimStats sim = hid_sim_stats();
+    printf("%llu allocations in the callback during the warm-up, %llu after it (%lld ms), %llu reports dropped\n",
+        static_cast<unsigned long long>(warmup), static_cast<unsigned long long>(allocations),
+        static_cast<long long>(elapsed.count()), static_cast<unsigned long long>(sim.dropped));
+
+    for (size_t i = 0; i < count; i++) {
+        hid_close(devices[i].hid);
+        for (auto& kept : devices[i].kept)
+            kept = HIDReportBuffer();
+        HIDPoolStats stats = hid_pool_stats(devices[i].hid);
+        if (stats.free != stats.buffers) {
+            printf("FAIL: %u of %u buffers back in the pool\n", stats.free, stats.buffers);
+            ok = false;
+        }
+    }
+    printf("%s\n", ok ? "ok" : "FAIL");
+    return ok ? 0 : 1;
+}
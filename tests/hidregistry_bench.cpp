@@ -0,0 +1,136 @@
+// Cost of finding the device of a report at 16 to 1000 open devices. Compares
+// the find_if over the device vector readCallback did before with a guarded
+// hid_registry_get, then measures the lookup from several read threads while
+// the writer keeps removing and adding devices.
+//
+//   hidregistry_bench [<lookups>]
+//
+// Exit code 0 if every lookup of a registered device found it. Build from the
+// repository root, e.g. on Linux
+//   g++ -std=c++20 -O2 -I. tests/hidregistry_bench.cpp hidregistry.cpp -lpthread
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "hidregistry.h"
+
+#define BENCH_LOOKUPS 10000000
+#define BENCH_READERS 4
+#define BENCH_CHURN   20000 // removes and adds while the readers run
+
+// what readCallback needs from a HIDData: the id and the device it belongs to
+typedef struct _BenchDevice {
+    uint32_t id;
+    void* hid;
+    uint64_t reports;
+} BenchDevice;
+
+static const size_t _sizes[] = { 16, 128, 256, 1000 };
+
+// the report of device i, spread so neither the scan nor the slots stay in one place
+static size_t bench_pick(uint64_t i, size_t devices) {
+    return static_cast<size_t>((i * 37) % devices);
+}
+
+static double bench_ns(std::chrono::steady_clock::time_point start, uint64_t lookups) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / lookups;
+}
+
+static bool bench_single(size_t devices, uint64_t lookups) {
+    std::vector<BenchDevice> vector(devices);
+    std::vector<void*> handles(devices);
+    auto registry = std::make_unique<HIDRegistry<BenchDevice>>();
+    std::vector<uint32_t> ids(devices);
+    for (size_t i = 0; i < devices; i++) {
+        handles[i] = &vector[i]; // any distinct pointer does as the HID
+        vector[i].hid = handles[i];
+        auto device = std::make_unique<BenchDevice>();
+        device->hid = handles[i];
+        ids[i] = hid_registry_add(*registry, std::move(device));
+    }
+
+    uint64_t missed = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < lookups; i++) {
+        void* hid = handles[bench_pick(i, devices)];
+        auto it = std::ranges::find_if(vector, [hid](const BenchDevice& device) { return device.hid == hid; });
+        if (it == vector.end())
+            missed++;
+        else
+            it->reports++;
+    }
+    double scan = bench_ns(start, lookups);
+
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < lookups; i++) {
+        HIDEpochGuard guard;
+        BenchDevice* device = hid_registry_get(*registry, ids[bench_pick(i, devices)]);
+        if (!device)
+            missed++;
+        else
+            device->reports++;
+    }
+    double lookup = bench_ns(start, lookups);
+    printf("%4zu devices: find_if %7.1f ns  registry %5.1f ns  (%.0fx)\n", devices, scan, lookup, scan / lookup);
+    hid_registry_clear(*registry);
+    hid_epoch_reclaim();
+    return missed == 0;
+}
+
+// readers look up the devices which are never removed, the writer churns the rest
+static bool bench_churn(size_t devices, uint64_t lookups) {
+    auto registry = std::make_unique<HIDRegistry<BenchDevice>>();
+    std::vector<uint32_t> stable(devices / 2);
+    for (auto& id : stable)
+        id = hid_registry_add(*registry, std::make_unique<BenchDevice>());
+    std::vector<uint32_t> churned(devices - stable.size());
+    for (auto& id : churned)
+        id = hid_registry_add(*registry, std::make_unique<BenchDevice>());
+
+    std::atomic<uint64_t> missed = 0;
+    uint64_t perReader = lookups / BENCH_READERS;
+    std::vector<std::thread> readers;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < BENCH_READERS; r++) {
+        readers.emplace_back([&, r] {
+            uint64_t misses = 0;
+            for (uint64_t i = 0; i < perReader; i++) {
+                HIDEpochGuard guard;
+                if (!hid_registry_get(*registry, stable[bench_pick(i + r, stable.size())]))
+                    misses++;
+            }
+            missed.fetch_add(misses);
+        });
+    }
+    uint64_t churns = 0;
+    for (; churns < BENCH_CHURN; churns++) {
+        size_t k = bench_pick(churns, churned.size());
+        hid_registry_remove(*registry, churned[k]);
+        churned[k] = hid_registry_add(*registry, std::make_unique<BenchDevice>());
+    }
+    for (auto& reader : readers)
+        reader.join();
+    double ns = bench_ns(start, perReader);
+    hid_registry_clear(*registry);
+    size_t waiting = hid_epoch_reclaim();
+    printf("%4zu devices, %d readers and %llu removes: %5.1f ns per lookup and reader, %llu missed, %zu unreclaimed\n",
+        devices, BENCH_READERS, static_cast<unsigned long long>(churns), ns,
+        static_cast<unsigned long long>(missed.load()), waiting);
+    return missed == 0 && waiting == 0;
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t lookups = argc > 1 ? strtoull(argv[1], nullptr, 10) : BENCH_LOOKUPS;
+    printf("%llu lookups per run\n", static_cast<unsigned long long>(lookups));
+    bool ok = true;
+    for (size_t devices : _sizes)
+        ok = bench_single(devices, lookups) && ok;
+    ok = bench_churn(128, lookups) && ok;
+    printf("%s\n", ok ? "ok" : "FAIL");
+    return ok ? 0 : 1;
+}
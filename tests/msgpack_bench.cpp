@@ -0,0 +1,122 @@
+// Encode and decode cost of a typical report: a layer change with its keycode
+// and sequence id. Compares the QMV1 codec of msgpack.cpp and QMV2 with the
+// mpack based codec it replaced, the latter only where mpack.h is found (the
+// Windows tree has it next to the repository, see QmkHid.vcxproj).
+//
+//   msgpack_bench [<iterations>]
+//
+// Build from the repository root, e.g. on Linux
+//   g++ -std=c++20 -O2 -I. tests/msgpack_bench.cpp msgpack.cpp log.cpp -lpthread
+// and with mpack
+//   g++ -std=c++20 -O2 -I. -I../mpack/src/mpack tests/msgpack_bench.cpp msgpack.cpp log.cpp ../mpack/src/mpack/*.c -lpthread
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "msgpack.h"
+
+#define BENCH_ITERATIONS 10000000
+
+#if __has_include(<mpack.h>)
+#include <mpack.h>
+#define BENCH_MPACK 1
+
+// the codec before the direct one, without the printf read_msgpack did per report
+static size_t bench_mpack_make(msgpack_t* km, std::vector<uint8_t>& data) {
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, (char*)data.data() + 1, data.size() - 1);
+    mpack_write_cstr(&writer, "QMV1");
+    mpack_start_map(&writer, km->count);
+    for (size_t i = 0; i < km->count; i++) {
+        mpack_write_uint(&writer, km->pairs[i].key);
+        mpack_write_int(&writer, km->pairs[i].value);
+    }
+    mpack_finish_map(&writer);
+    size_t used = mpack_writer_buffer_used(&writer);
+    return mpack_writer_destroy(&writer) == mpack_ok ? 1 + used : 0;
+}
+
+static bool bench_mpack_read(msgpack_t* km, std::span<const uint8_t> data) {
+    if (data.size() < RAW_EPSIZE)
+        return false;
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, (const char*)data.data() + 1, data.size() - 1);
+    char format[5];
+    mpack_expect_cstr(&reader, format, sizeof(format));
+    if (strcmp(format, "QMV1") != 0) {
+        mpack_reader_destroy(&reader);
+        return false;
+    }
+    uint32_t count = mpack_expect_map(&reader);
+    if (count > QMV1_MAX_PAIRS) {
+        mpack_reader_destroy(&reader);
+        return false;
+    }
+    init_msgpack(km);
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t key = mpack_expect_uint(&reader);
+        int16_t value = mpack_expect_int(&reader);
+        add_msgpack_add(km, key, value);
+    }
+    mpack_done_map(&reader);
+    return mpack_reader_destroy(&reader) == mpack_ok;
+}
+#endif
+
+typedef struct _BenchResult {
+    double encodeNs;
+    double decodeNs;
+    uint64_t check; // encoded bytes and decoded values, keeps the compiler from dropping the loops
+} BenchResult;
+
+template <typename Encode, typename Decode>
+static BenchResult bench_run(const char* name, uint32_t iterations, Encode encode, Decode decode) {
+    msgpack_t request;
+    init_msgpack(&request);
+    add_msgpack_add(&request, MSGPACK_CHANGED_LAYER, 2);
+    add_msgpack_add(&request, MSGPACK_CURRENT_KEYCODE, 0x5C12);
+    add_msgpack_add(&request, MSGPACK_SEQUENCE_ID, 300);
+    std::vector<uint8_t> report(RAW_EPSIZE + 1, 0);
+
+    BenchResult result = {};
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < iterations; i++) {
+        request.pairs[0].value = static_cast<int16_t>(i & 7);
+        result.check += encode(&request, report);
+    }
+    auto encoded = std::chrono::steady_clock::now();
+    // the codecs are in another translation unit, neither loop can be folded away
+    for (uint32_t i = 0; i < iterations; i++) {
+        msgpack_t km;
+        if (decode(&km, report))
+            result.check += km.count + km.pairs[0].value;
+    }
+    auto decoded = std::chrono::steady_clock::now();
+    result.encodeNs = std::chrono::duration<double, std::nano>(encoded - start).count() / iterations;
+    result.decodeNs = std::chrono::duration<double, std::nano>(decoded - encoded).count() / iterations;
+    printf("%-6s encode %6.1f ns  decode %6.1f ns  (check %llu)\n", name, result.encodeNs, result.decodeNs,
+        static_cast<unsigned long long>(result.check));
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t iterations = argc > 1 ? static_cast<uint32_t>(strtoul(argv[1], nullptr, 10)) : BENCH_ITERATIONS;
+    printf("%u iterations per codec\n", iterations);
+    BenchResult qmv1 = bench_run("qmv1", iterations,
+        [](msgpack_t* km, std::vector<uint8_t>& data) { return make_msgpack(km, data, MSGPACK_QMV1); },
+        [](msgpack_t* km, std::span<const uint8_t> data) { return read_msgpack(km, data); });
+    bench_run("qmv2", iterations,
+        [](msgpack_t* km, std::vector<uint8_t>& data) { return make_msgpack(km, data, MSGPACK_QMV2); },
+        [](msgpack_t* km, std::span<const uint8_t> data) { return read_msgpack(km, data); });
+#ifdef BENCH_MPACK
+    BenchResult mpack = bench_run("mpack", iterations, bench_mpack_make, bench_mpack_read);
+    printf("qmv1 against mpack: encode %.1fx, decode %.1fx faster\n",
+        mpack.encodeNs / qmv1.encodeNs, mpack.decodeNs / qmv1.decodeNs);
+#else
+    (void)qmv1;
+    printf("mpack.h not found, no comparison with the mpack codec\n");
+#endif
+    return 0;
+}
@@ -0,0 +1,304 @@
+// Decoder fuzz and round trip for the QMV1 and QMV2 report formats.
+//
+//   msgpack_fuzz [<mutations per seed>] [<seed>]
+//
+// 1. the seed corpus below decodes as expected
+// 2. every value encoding survives make_msgpack and read_msgpack, the bytes
+//    make_msgpack counts are all the decoder needs
+// 3. random mutations of the seeds never read past the report, and whatever
+//    decodes encodes again to the same pairs
+// 4. requests and mutated reports written to a simulated QMK board, which
+//    decodes them with read_msgpack and answers with make_msgpack; a QMV2
+//    request too large for a report goes out in fragments
+//
+// Exit code 0 if all checks pass. Build from the repository root, e.g. on Linux
+//   g++ -std=c++20 -O1 -g -fsanitize=address,undefined -I. tests/msgpack_fuzz.cpp hidex.cpp hidex_hidraw.cpp
+//       hidex_sim.cpp hidpool.cpp hidwriter.cpp hidcapture.cpp msgpack.cpp qmkframe.cpp log.cpp -lpthread
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <set>
+#include <vector>
+#include "hidex.h"
+#include "hidsim.h"
+#include "msgpack.h"
+#include "qmkframe.h"
+
+#define FUZZ_MUTATIONS 200000 // per seed
+#define FUZZ_FRAMED_MAX 512 // QMK_COMMAND_FRAMED_MAX
+#define FUZZ_SIM_REPORTS 2000
+#define FUZZ_SIM_TIMEOUT_MS 1000
+
+typedef struct _FuzzSeed {
+    const char* name;
+    std::vector<uint8_t> payload; // after the report id, padded with 0 to the report size
+    bool valid;
+    std::vector<msgpack_pair_t> pairs;
+    size_t size = RAW_EPSIZE + 1;
+} FuzzSeed;
+
+#define QMV1 0xa4, 'Q', 'M', 'V', '1'
+
+static const FuzzSeed _seeds[] = {
+    { "qmv1 fixint", { QMV1, 0x81, 0x02, 0x05 }, true, { { 2, 5 } } },
+    { "qmv1 uint8 and uint16", { QMV1, 0x82, 0x02, 0xcc, 0xc8, 0x01, 0xcd, 0x01, 0x2c }, true, { { 2, 200 }, { 1, 300 } } },
+    { "qmv1 negative", { QMV1, 0x82, 0x02, 0xff, 0x03, 0xd1, 0x80, 0x00 }, true, { { 2, -1 }, { 3, -32768 } } },
+    { "qmv1 uint8 key", { QMV1, 0x81, 0xcc, 0xc8, 0x01 }, true, { { 200, 1 } } },
+    { "qmv1 str8 magic", { 0xd9, 0x04, 'Q', 'M', 'V', '1', 0x80 }, true, {} },
+    { "qmv1 map16", { QMV1, 0xde, 0x00, 0x01, 0x05, 0x06 }, true, { { 5, 6 } } },
+    { "qmv1 int64 in range", { QMV1, 0x81, 0x02, 0xd3, 0, 0, 0, 0, 0, 0, 0x01, 0x00 }, true, { { 2, 256 } } },
+    { "qmv1 padding is a pair", { QMV1, 0x82, 0x02, 0x05 }, true, { { 2, 5 }, { 0, 0 } } },
+    { "wrong magic", { 0xa4, 'Q', 'M', 'V', '2', 0x80 }, false, {} },
+    { "magic too long", { 0xa5, 'Q', 'M', 'V', '1', 'X', 0x80 }, false, {} },
+    { "no map", { QMV1, 0x90 }, false, {} },
+    { "too many pairs", { QMV1, 0x8b }, false, {} },
+    { "value above int16", { QMV1, 0x81, 0x02, 0xcd, 0x80, 0x00 }, false, {} },
+    { "value below int16", { QMV1, 0x81, 0x02, 0xd2, 0xff, 0xff, 0x7f, 0xff }, false, {} },
+    { "negative key", { QMV1, 0x81, 0xff, 0x01 }, false, {} },
+    { "key above uint8", { QMV1, 0x81, 0xcd, 0x01, 0x00, 0x01 }, false, {} },
+    { "float value", { QMV1, 0x81, 0x02, 0xca, 0x3f, 0x80, 0x00, 0x00 }, false, {} },
+    { "short report", { QMV1, 0x81, 0x02, 0x05 }, false, {}, 16 },
+    { "qmv2 pair", { QMV2_HEADER, 0x05, 0x0a }, true, { { 2, 5 } } },
+    { "qmv2 zero value", { QMV2_HEADER, 0x06 }, true, { { 3, 0 } } },
+    { "qmv2 negative", { QMV2_HEADER, 0x05, 0x01, 0x07, 0xff, 0xff, 0x03 }, true, { { 2, -1 }, { 3, -32768 } } },
+    { "qmv2 overlong varint", { QMV2_HEADER, 0x85, 0x00, 0x0a }, true, { { 2, 5 } } },
+    { "qmv2 varint too long", { QMV2_HEADER, 0xff, 0xff, 0xff, 0x7f }, false, {} },
+    { "qmv2 value above uint16", { QMV2_HEADER, 0x05, 0x80, 0x80, 0x04 }, false, {} },
+};
+
+static std::vector<uint8_t> fuzz_report(const FuzzSeed& seed) {
+    std::vector<uint8_t> report(seed.size, 0);
+    for (size_t i = 0; i < seed.payload.size() && i + 1 < report.size(); i++)
+        report[i + 1] = seed.payload[i];
+    return report;
+}
+
+static bool fuzz_same(const msgpack_t& a, const msgpack_t& b) {
+    if (a.count != b.count || a.present != b.present)
+        return false;
+    for (uint8_t i = 0; i < a.count; i++) {
+        if (a.pairs[i].key != b.pairs[i].key || a.pairs[i].value != b.pairs[i].value)
+            return false;
+    }
+    return true;
+}
+
+static bool fuzz_seeds() {
+    bool ok = true;
+    for (const FuzzSeed& seed : _seeds) {
+        msgpack_t km;
+        bool decoded = read_msgpack(&km, fuzz_report(seed));
+        bool match = decoded == seed.valid;
+        if (match && decoded) {
+            match = km.count == seed.pairs.size();
+            for (size_t i = 0; match && i < seed.pairs.size(); i++)
+                match = km.pairs[i].key == seed.pairs[i].key && km.pairs[i].value == seed.pairs[i].value;
+        }
+        if (!match) {
+            printf("FAIL: seed '%s' decoded %d, expected %d\n", seed.name, decoded, seed.valid);
+            ok = false;
+        }
+    }
+    printf("%zu seeds\n", std::size(_seeds));
+    return ok;
+}
+
+static bool fuzz_values() {
+    static const int16_t values[] = { 0, 1, 127, 128, 255, 256, 32767, -1, -32, -33, -128, -129, -32768 };
+    static const uint8_t keys[] = { 0, 2, 127, 128, 255 };
+    uint32_t checked = 0;
+    for (msgpack_format_t format : { MSGPACK_QMV1, MSGPACK_QMV2 }) {
+        for (uint8_t key : keys) {
+            for (int16_t value : values) {
+                msgpack_t km, back;
+                init_msgpack(&km);
+                add_msgpack_add(&km, key, static_cast<uint16_t>(value));
+                add_msgpack_add(&km, MSGPACK_CURRENT_LAYER, static_cast<uint16_t>(value));
+                // garbage behind the encoded bytes, only the counted ones are copied
+                std::vector<uint8_t> report(RAW_EPSIZE + 1, 0xAA);
+                size_t size = make_msgpack(&km, report, format);
+                std::vector<uint8_t> used(report.begin(), report.begin() + size);
+                used.resize(report.size(), 0);
+                if (!size || !read_msgpack(&back, used) || !fuzz_same(km, back)) {
+                    printf("FAIL: format %d key %u value %d does not round trip\n", format, key, value);
+                    return false;
+                }
+                checked++;
+            }
+        }
+    }
+    printf("%u value round trips\n", checked);
+    return true;
+}
+
+static bool fuzz_mutations(uint32_t mutations, uint32_t seedValue) {
+    std::mt19937 random(seedValue);
+    uint64_t decoded = 0, total = 0;
+    for (const FuzzSeed& seed : _seeds) {
+        std::vector<uint8_t> base = fuzz_report(seed);
+        for (uint32_t n = 0; n < mutations; n++) {
+            // a heap copy of the exact size, so the sanitizers see every read past the end
+            std::vector<uint8_t> report = base;
+            uint32_t flips = 1 + random() % 4;
+            for (uint32_t i = 0; i < flips; i++) {
+                size_t at = 1 + random() % (report.size() - 1);
+                switch (random() % 3) {
+                case 0: report[at] ^= static_cast<uint8_t>(1 << (random() % 8)); break;
+                case 1: report[at] = static_cast<uint8_t>(random()); break;
+                case 2: report[at] = static_cast<uint8_t>(0xc0 + random() % 0x20); break; // msgpack type bytes
+                }
+            }
+            if (random() % 8 == 0)
+                report.resize(1 + random() % report.size());
+            total++;
+            msgpack_t km;
+            if (!read_msgpack(&km, report))
+                continue;
+            decoded++;
+            if (km.count > MSGPACK_PAIR_ARRAY_SIZE) {
+                printf("FAIL: %u pairs from a mutation of '%s'\n", km.count, seed.name);
+                return false;
+            }
+            msgpack_format_t format = report[1] == QMV2_HEADER ? MSGPACK_QMV2 : MSGPACK_QMV1;
+            std::vector<uint8_t> again(report.size(), 0);
+            msgpack_t back;
+            if (!make_msgpack(&km, again, format) || !read_msgpack(&back, again) || !fuzz_same(km, back)) {
+                printf("FAIL: a mutation of '%s' decodes but does not encode to the same pairs\n", seed.name);
+                return false;
+            }
+        }
+    }
+    printf("%llu mutations, %llu decoded and encoded again\n",
+        static_cast<unsigned long long>(total), static_cast<unsigned long long>(decoded));
+    return true;
+}
+
+typedef struct _FuzzReplies {
+    std::mutex lock;
+    std::condition_variable arrived;
+    std::multiset<int16_t> sequenceIds;
+} FuzzReplies;
+
+static void fuzz_callback(HID& hid, HIDReport& report, void* userData) {
+    (void)hid;
+    FuzzReplies& replies = *static_cast<FuzzReplies*>(userData);
+    msgpack_t km;
+    if (!read_msgpack(&km, report.data) || !msgpack_has<MSGPACK_SEQUENCE_ID>(km))
+        return;
+    std::lock_guard guard(replies.lock);
+    replies.sequenceIds.insert(static_cast<int16_t>(msgpack_value<MSGPACK_SEQUENCE_ID>(km)));
+    replies.arrived.notify_all();
+}
+
+static bool fuzz_answered(FuzzReplies& replies, int16_t seq) {
+    std::unique_lock guard(replies.lock);
+    return replies.arrived.wait_for(guard, std::chrono::milliseconds(FUZZ_SIM_TIMEOUT_MS), [&replies, seq] {
+        auto it = replies.sequenceIds.find(seq);
+        if (it == replies.sequenceIds.end())
+            return false;
+        replies.sequenceIds.erase(it);
+        return true;
+        });
+}
+
+static bool fuzz_request(HID& hid, FuzzReplies& replies, int16_t seq) {
+    msgpack_t request;
+    init_msgpack(&request);
+    add_msgpack_add(&request, MSGPACK_SEQUENCE_ID, static_cast<uint16_t>(seq));
+    add_msgpack_add(&request, MSGPACK_CURRENT_LAYER, 0);
+    std::vector<uint8_t> report(hid.outEplength, 0);
+    if (!make_msgpack(&request, report) || hid_write_async(hid, report).get() != HID_WRITE_OK)
+        return false;
+    return fuzz_answered(replies, seq);
+}
+
+// all pairs with the largest key and value encodings need several reports,
+// the encoded bytes are framed like qmk_command_encode does
+static bool fuzz_framed_request(HID& hid, FuzzReplies& replies, int16_t seq) {
+    msgpack_t request;
+    init_msgpack(&request);
+    add_msgpack_add(&request, MSGPACK_SEQUENCE_ID, static_cast<uint16_t>(seq));
+    for (uint8_t key = 0xE0; request.count < MSGPACK_PAIR_ARRAY_SIZE; key++)
+        add_msgpack_add(&request, key, 0x7FFF);
+    std::vector<uint8_t> report(hid.outEplength, 0);
+    if (make_msgpack(&request, report, MSGPACK_QMV2)) {
+        printf("FAIL: %u pairs fit into one report\n", request.count);
+        return false;
+    }
+    report.assign(FUZZ_FRAMED_MAX, 0);
+    size_t size = make_msgpack(&request, report, MSGPACK_QMV2);
+    static QMKFramer framer;
+    if (!size || !qmk_frame_send(framer, hid, std::span<const uint8_t>(report).first(size)))
+        return false;
+    return fuzz_answered(replies, seq);
+}
+
+static bool fuzz_sim(uint32_t seedValue) {
+    hid_sim_add({ "fuzz", HID_SIM_QMK, 0x35EE, 0x1308, "&MI_01", 0, 4, 0, false });
+    DeviceSupport qmk{};
+    qmk.active = true;
+    qmk.name = "QMK";
+    qmk.type = 2;
+    qmk.vid = 0x35EE;
+    qmk.pid = 0x1308;
+    qmk.iface = "&MI_01";
+    std::vector<DeviceSupport> supported = { qmk };
+    std::vector<DeviceSupport> system;
+    hid_open_list(system, supported);
+    std::erase_if(system, [](const DeviceSupport& device) { return !device.dev.starts_with(HID_SIM_PREFIX); });
+    static FuzzReplies replies;
+    HID hid = {};
+    if (system.empty() || !hid_connect(hid, system[0].dev, fuzz_callback, &replies)) {
+        printf("FAIL: the simulated board does not open\n");
+        return false;
+    }
+
+    // the sequence id is echoed, so it comes back through make_msgpack on the board
+    bool ok = true;
+    static const int16_t sequenceIds[] = { 1, 127, 128, 255, 256, 0x7FFF, -1, -32, -33, -32768 };
+    for (int16_t seq : sequenceIds) {
+        if (!fuzz_request(hid, replies, seq)) {
+            printf("FAIL: sequence id %d is not echoed\n", seq);
+            ok = false;
+        }
+    }
+
+    if (!fuzz_framed_request(hid, replies, 0x2345)) {
+        printf("FAIL: the framed request is not answered\n");
+        ok = false;
+    }
+
+    std::mt19937 random(seedValue);
+    for (uint32_t n = 0; n < FUZZ_SIM_REPORTS; n++) {
+        std::vector<uint8_t> report = fuzz_report(_seeds[random() % std::size(_seeds)]);
+        report.resize(hid.outEplength);
+        for (uint32_t i = 0; i < 4; i++)
+            report[1 + random() % (report.size() - 1)] = static_cast<uint8_t>(random());
+        hid_write_async(hid, report);
+    }
+    // still answering after the garbage
+    if (!fuzz_request(hid, replies, 0x1234)) {
+        printf("FAIL: the board stopped answering after %u mutated reports\n", FUZZ_SIM_REPORTS);
+        ok = false;
+    }
+    HIDSimStats stats = hid_sim_stats();
+    printf("sim: %llu writes, %llu replies\n", static_cast<unsigned long long>(stats.writes),
+        static_cast<unsigned long long>(stats.replies));
+    hid_close(hid);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t mutations = argc > 1 ? static_cast<uint32_t>(strtoul(argv[1], nullptr, 10)) : FUZZ_MUTATIONS;
+    uint32_t seedValue = argc > 2 ? static_cast<uint32_t>(strtoul(argv[2], nullptr, 10)) : 1;
+    bool ok = fuzz_seeds();
+    ok = fuzz_values() && ok;
+    ok = fuzz_mutations(mutations, seedValue) && ok;
+    ok = fuzz_sim(seedValue) && ok;
+    printf("%s\n", ok ? "ok" : "FAIL");
+    return ok ? 0 : 1;
+}
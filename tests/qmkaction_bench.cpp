@@ -0,0 +1,200 @@
+// Cost of finding the action of a keycode at 16 to 1000 rules. Compares a
+// scan over the rules of the profile, which has to look at every rule to
+// honour the wildcard order, with qmk_action_dispatch on the compiled table,
+// then dispatches from several read threads while the rules are loaded again
+// and again.
+//
+//   qmkaction_bench [<dispatches>]
+//
+// Exit code 0 if the table and the scan agree on every dispatch and no reader
+// missed a rule during the reloads. Build from the repository root, e.g. on
+// Linux
+//   g++ -std=c++20 -O2 -I. tests/qmkaction_bench.cpp qmkaction.cpp hidregistry.cpp log.cpp -lpthread
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "qmkaction.h"
+#include "hidregistry.h"
+#include "log.h"
+
+#define BENCH_DISPATCHES 1000000
+#define BENCH_READERS    3
+#define BENCH_RELOADS    2000 // loads while the readers run
+#define BENCH_DEVICE     1
+#define BENCH_LAYERS     4
+
+typedef struct _BenchEvent {
+    uint32_t device;
+    uint8_t layer;
+    uint16_t code;
+} BenchEvent;
+
+static const size_t _sizes[] = { 16, 128, 1000 };
+
+// keycodes 0 .. count-1 on BENCH_DEVICE, every fourth rule on any layer and
+// every sixteenth on any device, so all probes of the table run
+static std::vector<QMKActionRule> bench_rules(size_t count, uint32_t firstSeqnr) {
+    std::vector<QMKActionRule> rules(count);
+    for (size_t i = 0; i < count; i++) {
+        QMKActionRule& rule = rules[i];
+        rule.seqnr = firstSeqnr + static_cast<uint32_t>(i);
+        rule.active = true;
+        rule.profile = 0;
+        rule.device = i % 16 == 3 ? QMK_ACTION_ANY_DEVICE : BENCH_DEVICE;
+        rule.layer = i % 4 == 1 ? QMK_ACTION_ANY_LAYER : static_cast<uint8_t>(i % BENCH_LAYERS);
+        rule.trigger = QMK_TRIGGER_KEYCODE;
+        rule.code = static_cast<uint16_t>(i);
+        rule.edge = QMK_EDGE_PRESS;
+        rule.action = QMK_ACTION_KEYS;
+        rule.argument = "text";
+    }
+    return rules;
+}
+
+// half of the events have a rule, spread so neither the scan nor the slots stay in one place
+static std::vector<BenchEvent> bench_events(size_t rules) {
+    std::vector<BenchEvent> events(4096);
+    for (size_t i = 0; i < events.size(); i++) {
+        uint16_t code = static_cast<uint16_t>((i * 37) % (2 * rules));
+        events[i] = { BENCH_DEVICE, static_cast<uint8_t>(code % BENCH_LAYERS), code };
+    }
+    return events;
+}
+
+// the rule readCallback would take without the table: exact over any layer,
+// over any device, over both, so a miss or a wildcard match reads all rules
+static const QMKActionRule* bench_scan(const std::vector<QMKActionRule>& rules, const BenchEvent& event) {
+    const QMKActionRule* best = nullptr;
+    int bestRank = 4;
+    for (const QMKActionRule& rule : rules) {
+        if (rule.trigger != QMK_TRIGGER_KEYCODE || rule.code != event.code || rule.edge != QMK_EDGE_PRESS)
+            continue;
+        bool anyDevice = rule.device == QMK_ACTION_ANY_DEVICE;
+        bool anyLayer = rule.layer == QMK_ACTION_ANY_LAYER;
+        if ((!anyDevice && rule.device != event.device) || (!anyLayer && rule.layer != event.layer))
+            continue;
+        int rank = (anyDevice ? 2 : 0) + (anyLayer ? 1 : 0);
+        if (rank < bestRank) {
+            best = &rule;
+            bestRank = rank;
+            if (rank == 0)
+                break;
+        }
+    }
+    return best;
+}
+
+static double bench_ns(std::chrono::steady_clock::time_point start, uint64_t dispatches) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / dispatches;
+}
+
+static bool bench_single(size_t count, uint64_t dispatches) {
+    std::vector<QMKActionRule> rules = bench_rules(count, 1);
+    std::vector<BenchEvent> events = bench_events(count);
+    QMKActions actions;
+    if (!qmk_action_load(actions, rules, 0)) {
+        printf("FAIL: %zu rules do not compile\n", count);
+        return false;
+    }
+
+    uint64_t differ = 0;
+    for (const BenchEvent& event : events) {
+        HIDEpochGuard guard;
+        const QMKActionRule* found = qmk_action_dispatch(actions, event.device, event.layer,
+            QMK_TRIGGER_KEYCODE, event.code, QMK_EDGE_PRESS);
+        const QMKActionRule* scanned = bench_scan(rules, event);
+        if ((found == nullptr) != (scanned == nullptr) || (found && found->seqnr != scanned->seqnr))
+            differ++;
+    }
+
+    uint64_t matched = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < dispatches; i++) {
+        if (bench_scan(rules, events[i % events.size()]))
+            matched++;
+    }
+    double scan = bench_ns(start, dispatches);
+
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < dispatches; i++) {
+        const BenchEvent& event = events[i % events.size()];
+        HIDEpochGuard guard;
+        if (qmk_action_dispatch(actions, event.device, event.layer, QMK_TRIGGER_KEYCODE, event.code, QMK_EDGE_PRESS))
+            matched--;
+    }
+    double table = bench_ns(start, dispatches);
+
+    QMKActionStats stats = qmk_action_stats(actions);
+    printf("%4zu rules: scan %8.1f ns  dispatch %5.1f ns  (%.1fx), %.2f probes per dispatch, %zu/%zu events match\n",
+        count, scan, table, scan / table, static_cast<double>(stats.probes) / stats.dispatched,
+        static_cast<size_t>(stats.matched * events.size() / stats.dispatched), events.size());
+    if (differ)
+        printf("FAIL: table and scan differ on %llu of %zu events\n", static_cast<unsigned long long>(differ), events.size());
+    qmk_action_close(actions);
+    hid_epoch_reclaim();
+    return differ == 0 && matched == 0;
+}
+
+// the readers dispatch keycodes every load has, the writer loads one of two
+// rule sets with the same keys; a reader must always get a rule of its code
+static bool bench_reload(size_t count, uint64_t dispatches) {
+    std::vector<QMKActionRule> sets[2] = { bench_rules(count, 1), bench_rules(count, 100001) };
+    QMKActions actions;
+    qmk_action_load(actions, sets[0], 0);
+
+    std::atomic<uint64_t> missed = 0;
+    std::atomic<uint64_t> done = 0;
+    uint64_t perReader = dispatches / BENCH_READERS;
+    std::vector<std::thread> readers;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < BENCH_READERS; r++) {
+        readers.emplace_back([&, r] {
+            uint64_t misses = 0;
+            for (uint64_t i = 0; i < perReader; i++) {
+                uint16_t code = static_cast<uint16_t>(((i + r) * 37) % count);
+                uint8_t layer = static_cast<uint8_t>(code % BENCH_LAYERS);
+                HIDEpochGuard guard;
+                const QMKActionRule* rule = qmk_action_dispatch(actions, BENCH_DEVICE, layer,
+                    QMK_TRIGGER_KEYCODE, code, QMK_EDGE_PRESS);
+                if (!rule || rule->code != code || rule->argument != "text")
+                    misses++;
+            }
+            missed.fetch_add(misses);
+            done.fetch_add(1);
+        });
+    }
+    uint64_t reloads = 0;
+    for (; reloads < BENCH_RELOADS || done.load() < BENCH_READERS; reloads++) {
+        if (!qmk_action_load(actions, sets[reloads % 2], 0))
+            missed++;
+        if (reloads >= BENCH_RELOADS)
+            std::this_thread::yield();
+    }
+    for (auto& reader : readers)
+        reader.join();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    qmk_action_close(actions);
+    size_t waiting = hid_epoch_reclaim();
+    printf("%4zu rules, %d readers of %llu dispatches and %llu reloads in %.0f ms, %llu missed, %zu unreclaimed\n",
+        count, BENCH_READERS, static_cast<unsigned long long>(perReader), static_cast<unsigned long long>(reloads), ms,
+        static_cast<unsigned long long>(missed.load()), waiting);
+    return missed == 0 && waiting == 0;
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t dispatches = argc > 1 ? strtoull(argv[1], nullptr, 10) : BENCH_DISPATCHES;
+    if (dispatches == 0)
+        dispatches = BENCH_DISPATCHES;
+    log_set_level(QLOG_LEVEL_WARN); // one info line per load otherwise
+    printf("%llu dispatches per run\n", static_cast<unsigned long long>(dispatches));
+    bool ok = true;
+    for (size_t count : _sizes)
+        ok = bench_single(count, dispatches) && ok;
+    ok = bench_reload(1000, dispatches) && ok;
+    printf("%s\n", ok ? "ok" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+// A model of the UI loop of WinMain before and after it waited for messages.
+// The Windows message queue is stood in for by a mutex, a condition variable
+// and a posted message counter, so the numbers show the shape of the change,
+// not what Windows does. A producer thread pushes layer changes into a
+// QMKEventQueue like readCallback does, its wake function posts the message.
+//
+//   poll: the old loop, look for a message, Sleep(10) if there is none
+//   wait: MsgWaitForMultipleObjectsEx, block until a message is posted
+//
+// Reports the loop iterations per second while idle, and the time from the
+// push to the UI thread applying the event. The real numbers come from
+// QmkHid itself: it logs the wakeups/s of its loop (loopStats) on exit, and
+// "Log latency" in the tray menu logs report to tray icon and layer window.
+// Build it once as is and once with /DQMK_POLL_LOOP for the old loop.
+//
+//   uiloop_bench [<seconds per run>]
+//
+// Build from the repository root, e.g. on Linux
+//   g++ -std=c++20 -O2 -I. tests/uiloop_bench.cpp qmkevent.cpp log.cpp -lpthread
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include "qmkevent.h"
+
+#define BENCH_SECONDS  3
+#define BENCH_POLL_MS  10 // the Sleep of the old loop
+#define BENCH_EVENT_MS 50 // mean time between layer changes, randomized
+
+using namespace std::chrono;
+
+typedef struct _BenchQueue {
+    std::mutex lock;
+    std::condition_variable posted;
+    uint32_t messages; // posted and not yet taken
+    bool quit;
+} BenchQueue;
+
+static BenchQueue _messages;
+static QMKEventQueue _events;
+
+// PostMessage(hTrayWnd, WM_DEVICE_EVENTS)
+static void bench_wake(void*) {
+    std::lock_guard guard(_messages.lock);
+    _messages.messages++;
+    _messages.posted.notify_one();
+}
+
+// PeekMessage with PM_REMOVE, waits for a message first if wait is set;
+// -1 on quit, else whether a message was taken
+static int bench_take(bool wait) {
+    std::unique_lock guard(_messages.lock);
+    if (wait)
+        _messages.posted.wait(guard, [] { return _messages.messages || _messages.quit; });
+    if (_messages.quit)
+        return -1;
+    bool taken = _messages.messages != 0;
+    _messages.messages = 0;
+    return taken;
+}
+
+typedef struct _BenchRun {
+    double idleWakeups;  // loop iterations per second without events
+    double wakeups;      // with events
+    double latencyP50Us;
+    double latencyP99Us;
+    double latencyMaxUs;
+} BenchRun;
+
+static uint64_t bench_loop(bool wait, std::vector<double>& latencies) {
+    std::vector<QMKEvent> events;
+    uint64_t iterations = 0;
+    for (int taken; (taken = bench_take(wait)) >= 0;) {
+        iterations++;
+        if (taken) {
+            qmk_event_drain(_events, events);
+            auto now = steady_clock::now();
+            for (const QMKEvent& event : events)
+                latencies.push_back(duration<double, std::micro>(now - event.received).count());
+        }
+        if (!wait)
+            std::this_thread::sleep_for(milliseconds(BENCH_POLL_MS));
+    }
+    return iterations;
+}
+
+static BenchRun bench_run(bool wait, uint32_t seconds) {
+    BenchRun run = {};
+    for (int phase = 0; phase < 2; phase++) {
+        bool produce = phase == 1;
+        qmk_event_init(_events, bench_wake, nullptr);
+        _messages.messages = 0;
+        _messages.quit = false;
+        std::vector<double> latencies;
+        uint64_t iterations = 0;
+        std::thread ui([&] { iterations = bench_loop(wait, latencies); });
+
+        auto start = steady_clock::now();
+        std::mt19937 random(7);
+        std::exponential_distribution<double> gap(1.0 / BENCH_EVENT_MS);
+        uint16_t layer = 0;
+        while (steady_clock::now() - start < seconds * 1s) {
+            if (!produce) {
+                std::this_thread::sleep_for(10ms);
+                continue;
+            }
+            std::this_thread::sleep_for(duration<double, std::milli>(gap(random)));
+            QMKEvent event = { 1, static_cast<uint16_t>(++layer & 3), QMK_EVENT_LAYER, 0, steady_clock::now() };
+            qmk_event_push(_events, event);
+        }
+        double elapsed = duration<double>(steady_clock::now() - start).count();
+        {
+            std::lock_guard guard(_messages.lock);
+            _messages.quit = true;
+            _messages.posted.notify_one();
+        }
+        ui.join();
+
+        if (!produce) {
+            run.idleWakeups = iterations / elapsed;
+            continue;
+        }
+        run.wakeups = iterations / elapsed;
+        std::sort(latencies.begin(), latencies.end());
+        if (!latencies.empty()) {
+            run.latencyP50Us = latencies[latencies.size() / 2];
+            run.latencyP99Us = latencies[latencies.size() * 99 / 100];
+            run.latencyMaxUs = latencies.back();
+        }
+        printf("%s: %zu events applied, ", wait ? "wait" : "poll", latencies.size());
+    }
+    printf("%.1f wakeups/s idle, %.1f with events, push to apply p50 %.0f us, p99 %.0f us, max %.0f us\n",
+        run.idleWakeups, run.wakeups, run.latencyP50Us, run.latencyP99Us, run.latencyMaxUs);
+    return run;
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t seconds = argc > 1 ? static_cast<uint32_t>(strtoul(argv[1], nullptr, 10)) : BENCH_SECONDS;
+    printf("%u s idle and %u s with a layer change every %d ms on average per loop\n", seconds, seconds, BENCH_EVENT_MS);
+    BenchRun poll = bench_run(false, seconds);
+    BenchRun wait = bench_run(true, seconds);
+    printf("wait against poll: idle %.1f instead of %.1f wakeups/s, p50 latency %.0fx lower\n",
+        wait.idleWakeups, poll.idleWakeups, wait.latencyP50Us > 0 ? poll.latencyP50Us / wait.latencyP50Us : 0.0);
+    return 0;
+}
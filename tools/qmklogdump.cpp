@@ -0,0 +1,102 @@
+// Prints a binary log written by QmkHid --log-file <path> as text.
+//
+//   qmklogdump <file> [<file> ...]
+//
+// Each rotated file (path, path.1, ...) is self-contained. Build from the
+// repository root together with log.cpp, e.g.
+//   cl /std:c++20 /EHsc /I. tools\qmklogdump.cpp log.cpp
+
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+#include "log.h"
+
+static const char* _levelTags[] = { "T", "D", "I", "W", "E", "-" };
+
+typedef struct _DumpSite {
+    int level;
+    std::string tag;
+    std::string format;
+} DumpSite;
+
+static bool dump_file(const char* path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        fprintf(stderr, "%s can't be opened\n", path);
+        return false;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    LogFileHeader header;
+    if (data.size() < sizeof(header)) {
+        fprintf(stderr, "%s is no log file\n", path);
+        return false;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, QLOG_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != QLOG_FILE_VERSION) {
+        fprintf(stderr, "%s is no log file of version %d\n", path, QLOG_FILE_VERSION);
+        return false;
+    }
+    time_t started = static_cast<time_t>(header.started / 1000);
+    char when[64];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&started));
+    printf("# %s, started %s.%03d\n", path, when, static_cast<int>(header.started % 1000));
+
+    std::map<uint32_t, DumpSite> sites;
+    size_t pos = sizeof(header);
+    while (pos + sizeof(LogFileRecord) <= data.size()) {
+        LogFileRecord record;
+        memcpy(&record, &data[pos], sizeof(record));
+        pos += sizeof(record);
+        if (pos + record.length > data.size()) {
+            fprintf(stderr, "%s is cut short\n", path);
+            return false;
+        }
+        const uint8_t* body = &data[pos];
+        pos += record.length;
+
+        if (record.type == QLOG_RECORD_SITE && record.length >= sizeof(LogFileSite)) {
+            LogFileSite info;
+            memcpy(&info, body, sizeof(info));
+            if (sizeof(info) + info.tagLength + info.formatLength > record.length)
+                continue;
+            DumpSite& site = sites[record.site];
+            site.level = info.level <= QLOG_LEVEL_OFF ? info.level : QLOG_LEVEL_OFF;
+            site.tag.assign(reinterpret_cast<const char*>(body + sizeof(info)), info.tagLength);
+            site.format.assign(reinterpret_cast<const char*>(body + sizeof(info) + info.tagLength), info.formatLength);
+        }
+        else if (record.type == QLOG_RECORD_EVENT) {
+            auto it = sites.find(record.site);
+            std::string text = (it == sites.end()) ? std::string("<unknown site>\n")
+                : log_render(it->second.format.c_str(), std::span<const uint8_t>(body, record.length));
+            if (text.empty() || text.back() != '\n')
+                text += '\n';
+            printf("%10.3f %2u %s %s: %s", record.time / 1000.0, record.thread,
+                it == sites.end() ? "?" : _levelTags[it->second.level],
+                it == sites.end() ? "?" : it->second.tag.c_str(), text.c_str());
+        }
+        else if (record.type == QLOG_RECORD_DROPPED && record.length == sizeof(uint64_t)) {
+            uint64_t dropped;
+            memcpy(&dropped, body, sizeof(dropped));
+            printf("%10.3f %2u W LOG: %llu records dropped\n", record.time / 1000.0, record.thread,
+                static_cast<unsigned long long>(dropped));
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: qmklogdump <file> [<file> ...]\n");
+        return 2;
+    }
+    int result = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!dump_file(argv[i]))
+            result = 1;
+    }
+    return result;
+}